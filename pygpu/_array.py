@@ -233,8 +233,6 @@ Since these functions are untested (thus probably wrong), we disable them.
               '(a[i] < %(min)s ? %(min)s : a[i])' % dict(min=a_min, max=a_max))
         return elemwise1(self, '', oper=oper, out=out)
 
-    def fill(self, value):
-        self[...] = value
 """
     # reductions
     def all(self, axis=None, out=None):
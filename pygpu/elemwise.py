@@ -282,13 +282,37 @@ class ElemwiseKernel(object):
                                                    name="elem_contig",
                                                    arguments=self.arguments,
                                                    expression=self.operation)
-        self.contig_k = gpuarray.GpuKernel(self.contig_src, "elem_contig",
-                                           self.argspec_contig(),
-                                           context=self.context, cluda=True,
-                                           **self.flags)
+        # Compiled in the background, see contig_k
+        self._contig_f = gpuarray.GpuKernelFuture(self.contig_src,
+                                                  "elem_contig",
+                                                  self.argspec_contig(),
+                                                  context=self.context,
+                                                  cluda=True, **self.flags)
+        self._contig_k = None
+        self._pending = {}
         self._speckey = None
         self._dims = None
 
+    @property
+    def contig_k(self):
+        if self._contig_k is None:
+            self._contig_k = self._contig_f.result()
+            self._contig_f = None
+        return self._contig_k
+
+    def precompile(self, nds):
+        """
+        Start compiling the kernels for non-contiguous arguments with
+        the given numbers of dimensions in the background.
+        """
+        for nd in nds:
+            if nd not in self._pending:
+                name = "elem_" + str(nd)
+                self._pending[nd] = gpuarray.GpuKernelFuture(
+                    self.render_basic(nd, name=name), name,
+                    self.argspec_basic(nd), context=self.context,
+                    cluda=True, **self.flags)
+
     def __hash__(self):
         return (hash(self.arguments) ^ hash(self.operation) ^
                 hash(self.context) ^ hash(self.preamble))
@@ -332,6 +356,9 @@ class ElemwiseKernel(object):
 
     @lru_cache()
     def _make_basic(self, nd):
+        f = self._pending.pop(nd, None)
+        if f is not None:
+            return f.result()
         name = "elem_" + str(nd)
         src = self.render_basic(nd, name=name)
         return gpuarray.GpuKernel(src, name, self.argspec_basic(nd),
@@ -73,6 +73,7 @@ cdef extern from "gpuarray/buffer.h":
         void buffer_deinit(void *ctx)
         char *ctx_error(void *ctx)
         int property(void *c, gpudata *b, gpukernel *k, int prop_id, void *res)
+        int buffer_reset_peak(void *ctx)
 
     int GA_CTX_PROP_DEVNAME
     int GA_CTX_PROP_MAXLSIZE
@@ -80,16 +81,26 @@ cdef extern from "gpuarray/buffer.h":
     int GA_CTX_PROP_NUMPROCS
     int GA_CTX_PROP_MAXGSIZE
     int GA_CTX_PROP_BIN_ID
+    int GA_CTX_PROP_CACHED_BYTES
+    int GA_CTX_PROP_INUSE_BYTES
+    int GA_CTX_PROP_PEAK_BYTES
+    int GA_CTX_PROP_NUM_BUFFERS
+    int GA_CTX_PROP_NUM_ALLOCS
+    int GA_CTX_PROP_KERNEL_CACHE_HITS
+    int GA_CTX_PROP_KERNEL_CACHE_MISSES
     int GA_BUFFER_PROP_CTX
     int GA_KERNEL_PROP_CTX
     int GA_KERNEL_PROP_MAXLSIZE
     int GA_KERNEL_PROP_PREFLSIZE
     int GA_KERNEL_PROP_NUMARGS
     int GA_KERNEL_PROP_TYPES
+    int GA_EVENT_TIMING
 
     cdef enum ga_usefl:
         GA_USE_CLUDA, GA_USE_SMALL, GA_USE_DOUBLE, GA_USE_COMPLEX, GA_USE_HALF,
-        GA_USE_BINARY, GA_USE_PTX, GA_USE_CUDA, GA_USE_OPENCL
+        GA_USE_BINARY, GA_USE_PTX, GA_USE_CUDA, GA_USE_OPENCL,
+        GA_USE_FAST_MATH, GA_USE_MAD
+    int GA_OPT_LEVEL(int n)
 
     char *Gpu_error(const gpuarray_buffer_ops *o, void *ctx, int err)
     const gpuarray_buffer_ops *gpuarray_get_ops(const char *) nogil
@@ -103,6 +114,7 @@ cdef extern from "gpuarray/kernel.h":
                        unsigned int count, const char **strs,
                        const size_t *lens, const char *name,
                        unsigned int argcount, const int *types, int flags, char **err_str)
+    char *GpuKernel_defines(unsigned int ndefs, const char **defines)
     void GpuKernel_clear(_GpuKernel *k)
     void *GpuKernel_context(_GpuKernel *k)
     int GpuKernel_sched(_GpuKernel *k, size_t n, size_t *ls, size_t *gs)
@@ -110,6 +122,74 @@ cdef extern from "gpuarray/kernel.h":
                        const size_t *ls, const size_t *gs,
                        size_t shared, void **args)
     int GpuKernel_binary(_GpuKernel *, size_t *, void **)
+    int GpuKernel_init_module(_GpuKernel *ks, const gpuarray_buffer_ops *ops,
+                              void *ctx, unsigned int count,
+                              const char **strs, const size_t *lens,
+                              unsigned int n, const char **names,
+                              const unsigned int *argcounts,
+                              const int **types, int flags, char **err_str)
+
+    ctypedef struct _GpuKernelFuture "GpuKernelFuture"
+
+    _GpuKernelFuture *GpuKernel_init_async(const gpuarray_buffer_ops *ops,
+                                           void *ctx, unsigned int count,
+                                           const char **strs,
+                                           const size_t *lens,
+                                           const char *name,
+                                           unsigned int argcount,
+                                           const int *types, int flags,
+                                           int *ret)
+    int GpuKernelFuture_ready(_GpuKernelFuture *f)
+    int GpuKernelFuture_error(_GpuKernelFuture *f, char **err_str) nogil
+    int GpuKernelFuture_wait(_GpuKernelFuture *f, _GpuKernel *k,
+                             char **err_str) nogil
+    void GpuKernelFuture_free(_GpuKernelFuture *f) nogil
+
+    ctypedef struct _GpuKernelManifest "GpuKernelManifest"
+
+    _GpuKernelManifest *GpuKernelManifest_new()
+    _GpuKernelManifest *GpuKernelManifest_load(const char *path, int *ret)
+    int GpuKernelManifest_save(const _GpuKernelManifest *m, const char *path)
+    void GpuKernelManifest_free(_GpuKernelManifest *m)
+    size_t GpuKernelManifest_size(const _GpuKernelManifest *m)
+    void GpuKernelManifest_record(_GpuKernelManifest *m)
+    int GpuKernelManifest_replay(_GpuKernelManifest *m,
+                                 const gpuarray_buffer_ops *ops, void *ctx,
+                                 size_t *nbin, char **err_str) nogil
+
+cdef extern from "gpuarray/stream.h":
+    ctypedef struct gpustream:
+        pass
+    ctypedef struct _GpuStream "GpuStream":
+        gpustream *s
+        const gpuarray_buffer_ops *ops
+        void *ctx
+
+    int GpuStream_init(_GpuStream *s, const gpuarray_buffer_ops *ops,
+                       void *ctx)
+    void GpuStream_default(_GpuStream *s, const gpuarray_buffer_ops *ops,
+                           void *ctx)
+    void GpuStream_clear(_GpuStream *s)
+    int GpuStream_use(const _GpuStream *s)
+    int GpuStream_sync(const _GpuStream *s) nogil
+    int GpuStream_wait(const _GpuStream *s, const _GpuStream *other)
+
+cdef extern from "gpuarray/event.h":
+    ctypedef struct gpuevent:
+        pass
+    ctypedef struct _GpuEvent "GpuEvent":
+        gpuevent *ev
+        const gpuarray_buffer_ops *ops
+
+    int GpuEvent_init(_GpuEvent *e, const gpuarray_buffer_ops *ops,
+                      void *ctx, int flags)
+    int GpuEvent_record(_GpuEvent *e, const _GpuStream *s)
+    int GpuEvent_wait(const _GpuEvent *e, const _GpuStream *s)
+    int GpuEvent_elapsed(const _GpuEvent *start, const _GpuEvent *end,
+                         double *ms) nogil
+    int GpuEvent_query(const _GpuEvent *e)
+    int GpuEvent_sync(const _GpuEvent *e) nogil
+    void GpuEvent_clear(_GpuEvent *e)
 
 cdef extern from "gpuarray/array.h":
     ctypedef struct _GpuArray "GpuArray":
@@ -151,6 +231,8 @@ cdef extern from "gpuarray/array.h":
     int GpuArray_index(_GpuArray *r, _GpuArray *a, const ssize_t *starts,
                        const ssize_t *stops, const ssize_t *steps)
     int GpuArray_setarray(_GpuArray *v, _GpuArray *a)
+    int GpuArray_reshape_inplace(_GpuArray *a, unsigned int nd,
+                                 const size_t *newdims, ga_order ord)
     int GpuArray_reshape(_GpuArray *res, _GpuArray *a, unsigned int nd,
                          const size_t *newdims, ga_order ord, int nocopy)
     int GpuArray_transpose(_GpuArray *res, _GpuArray *a,
@@ -164,7 +246,12 @@ cdef extern from "gpuarray/array.h":
     int GpuArray_move(_GpuArray *dst, _GpuArray *src)
     int GpuArray_write(_GpuArray *dst, void *src, size_t src_sz)
     int GpuArray_read(void *dst, size_t dst_sz, _GpuArray *src)
+    int GpuArray_write_async(_GpuArray *dst, void *src, size_t src_sz,
+                             _GpuEvent *ev)
+    int GpuArray_read_async(void *dst, size_t dst_sz, _GpuArray *src,
+                            _GpuEvent *ev)
     int GpuArray_memset(_GpuArray *a, int data)
+    int GpuArray_fill(_GpuArray *a, const void *value)
     int GpuArray_copy(_GpuArray *res, _GpuArray *a, ga_order order)
 
     int GpuArray_transfer(_GpuArray *res, const _GpuArray *a, void *new_ctx,
@@ -225,6 +312,7 @@ cdef int array_move(GpuArray a, GpuArray src) except -1
 cdef int array_write(GpuArray a, void *src, size_t sz) except -1
 cdef int array_read(void *dst, size_t sz, GpuArray src) except -1
 cdef int array_memset(GpuArray a, int data) except -1
+cdef int array_fill(GpuArray a, const void *value) except -1
 cdef int array_copy(GpuArray res, GpuArray a, ga_order order) except -1
 cdef int array_transfer(GpuArray res, GpuArray a, void *new_ctx,
                         const gpuarray_buffer_ops *ops,
@@ -243,6 +331,7 @@ cdef int kernel_call(GpuKernel k, unsigned int n,
                      size_t shared, void **args) except -1
 cdef int kernel_binary(GpuKernel k, size_t *, void **) except -1
 cdef int kernel_property(GpuKernel k, int prop_id, void *res) except -1
+cdef int kernel_wait(GpuKernel k, GpuKernelFuture f) except -1
 
 cdef int ctx_property(GpuContext c, int prop_id, void *res) except -1
 cdef const gpuarray_buffer_ops *get_ops(kind) except NULL
@@ -300,6 +389,7 @@ cdef api GpuArray pygpu_concatenate(const _GpuArray **a, size_t n,
 cdef api class GpuContext [type PyGpuContextType, object PyGpuContextObject]:
     cdef const gpuarray_buffer_ops *ops
     cdef void* ctx
+    cdef list manifests
 
 cdef GpuArray new_GpuArray(type cls, GpuContext ctx, object base)
 
@@ -311,6 +401,7 @@ cdef api class GpuArray [type PyGpuArrayType, object PyGpuArrayObject]:
 
     cdef __index_helper(self, key, unsigned int i, ssize_t *start,
                         ssize_t *stop, ssize_t *step)
+    cdef __check_host(self, np.ndarray h)
 
 cdef api class GpuKernel [type PyGpuKernelType, object PyGpuKernelObject]:
     cdef _GpuKernel k
@@ -320,3 +411,22 @@ cdef api class GpuKernel [type PyGpuKernelType, object PyGpuKernelObject]:
 
     cdef do_call(self, py_n, py_ls, py_gs, py_args, size_t shared)
     cdef _setarg(self, unsigned int index, int typecode, object o)
+
+cdef api class GpuKernelFuture [type PyGpuKernelFutureType, object PyGpuKernelFutureObject]:
+    cdef _GpuKernelFuture *f
+    cdef readonly GpuContext context
+    cdef object source
+    cdef object name
+    cdef object types
+
+cdef api class KernelManifest [type PyKernelManifestType, object PyKernelManifestObject]:
+    cdef _GpuKernelManifest *m
+
+cdef api class GpuStream [type PyGpuStreamType, object PyGpuStreamObject]:
+    cdef _GpuStream s
+    cdef readonly GpuContext context
+
+cdef api class GpuEvent [type PyGpuEventType, object PyGpuEventObject]:
+    cdef _GpuEvent ev
+    cdef readonly GpuContext context
+    cdef object keep
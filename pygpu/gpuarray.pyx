@@ -404,6 +404,12 @@ cdef int array_memset(GpuArray a, int data) except -1:
     if err != GA_NO_ERROR:
         raise get_exc(err), GpuArray_error(&a.ga, err)
 
+cdef int array_fill(GpuArray a, const void *value) except -1:
+    cdef int err
+    err = GpuArray_fill(&a.ga, value)
+    if err != GA_NO_ERROR:
+        raise get_exc(err), GpuArray_error(&a.ga, err)
+
 cdef int array_copy(GpuArray res, GpuArray a, ga_order order) except -1:
     cdef int err
     err = GpuArray_copy(&res.ga, &a.ga, order)
@@ -487,6 +493,87 @@ cdef int kernel_property(GpuKernel k, int prop_id, void *res) except -1:
     if err != GA_NO_ERROR:
         raise get_exc(err), kernel_error(k, err)
 
+cdef int kernel_wait(GpuKernel k, GpuKernelFuture f) except -1:
+    cdef int err
+    cdef char *err_str = NULL
+    with nogil:
+        err = GpuKernelFuture_wait(f.f, &k.k, &err_str)
+    if err != GA_NO_ERROR:
+        if err_str != NULL:
+            try:
+                py_err_str = err_str.decode('UTF-8')
+            finally:
+                free(err_str)
+            raise get_exc(err), py_err_str
+        raise get_exc(err), Gpu_error(f.context.ops, f.context.ctx, err)
+
+cdef int kernel_flags(cluda, have_double, have_small, have_complex, have_half,
+                      binary, ptx, cuda, opencl):
+    cdef int flags = 0
+    if cluda:
+        flags |= GA_USE_CLUDA
+    if have_double:
+        flags |= GA_USE_DOUBLE
+    if have_small:
+        flags |= GA_USE_SMALL
+    if have_complex:
+        flags |= GA_USE_COMPLEX
+    if have_half:
+        flags |= GA_USE_HALF
+    if binary:
+        flags |= GA_USE_BINARY
+    if ptx:
+        flags |= GA_USE_PTX
+    if cuda:
+        flags |= GA_USE_CUDA
+    if opencl:
+        flags |= GA_USE_OPENCL
+    return flags
+
+cdef int kernel_options(fast_math, mad, opt_level) except -1:
+    cdef int flags = 0
+    if fast_math:
+        flags |= GA_USE_FAST_MATH
+    if mad:
+        flags |= GA_USE_MAD
+    if opt_level is not None:
+        if not 0 <= opt_level <= 3:
+            raise ValueError, "opt_level must be between 0 and 3"
+        flags |= GA_OPT_LEVEL(opt_level)
+    return flags
+
+cdef kernel_defines(source, defines):
+    cdef const char **_defs
+    cdef char *res
+    cdef unsigned int n
+    cdef unsigned int i
+
+    if not defines:
+        return source
+    n = <unsigned int>len(defines)
+    _defs = <const char **>calloc(n, sizeof(char *))
+    if _defs == NULL:
+        raise MemoryError
+    try:
+        for i in range(n):
+            if not isinstance(defines[i], (str, unicode)):
+                raise TypeError, "Expected strings for the defines"
+            _defs[i] = defines[i]
+        res = GpuKernel_defines(n, _defs)
+        if res == NULL:
+            raise MemoryError
+        try:
+            return res + source
+        finally:
+            free(res)
+    finally:
+        free(_defs)
+
+cdef int kernel_typecode(t) except -1:
+    if t == GpuArray:
+        return GA_BUFFER
+    return dtype_to_typecode(t)
+
 cdef GpuContext pygpu_default_context():
     return default_context
 
@@ -510,6 +597,8 @@ cdef ops_kind(const gpuarray_buffer_ops *ops):
         return "opencl"
     if ops == gpuarray_get_ops("cuda"):
         return "cuda"
+    if ops == gpuarray_get_ops("host"):
+        return "host"
     raise RuntimeError, "Unknown ops vector"
 
 def set_default_context(GpuContext ctx):
@@ -571,18 +660,26 @@ cdef GpuContext pygpu_init(dev):
             raise ValueError, "OpenCL name incorrect. Should be opencl<int>:<int> instead got: " + dev
         else:
             devnum = int(devspec[0]) << 16 | int(devspec[1])
+    elif dev.startswith('host'):
+        kind = "host"
+        if dev[4:] == '':
+            devnum = 0
+        else:
+            devnum = int(dev[4:])
     else:
         raise ValueError, "Unknown device format:" + dev
     return GpuContext(kind, devnum)
 
-def init(dev):
+def init(dev, manifest=None):
     """
-    init(dev)
+    init(dev, manifest=None)
 
     Creates a context from a device specifier.
 
     :param dev: device specifier
     :type dev: string
+    :param manifest: kernels to build in the new context
+    :type manifest: KernelManifest or path of a saved one
     :rtype: GpuContext
 
     Device specifiers are composed of the type string and the device
@@ -590,6 +687,7 @@ def init(dev):
 
         "cuda0"
         "opencl0:1"
+        "host"
 
     For cuda the device id is the numeric identifier.  You can see
     what devices are available by running nvidia-smi on the machine.
@@ -601,8 +699,20 @@ def init(dev):
     list available platforms and devices.  You can experiement with
     the values, unavaiable ones will just raise an error, and there
     are no gaps in the valid numbers.
+
+    For host there is only one device which runs on the CPU cores of
+    the machine, so the id can be omitted.
+
+    If `manifest` is given, its kernels are built before returning (see
+    :meth:`GpuContext.load_kernels`).
     """
-    return pygpu_init(dev)
+    cdef GpuContext res
+    res = pygpu_init(dev)
+    if manifest is not None:
+        if not isinstance(manifest, KernelManifest):
+            manifest = KernelManifest(manifest)
+        res.load_kernels(manifest)
+    return res
 
 def zeros(shape, dtype=GA_DOUBLE, order='C', GpuContext context=None,
           cls=None):
@@ -960,7 +1070,7 @@ cdef class GpuContext:
     :type devno: int
 
     The currently implemented modules (for the `kind` parameter) are
-    "cuda" and "opencl".  Which are available depends on the build
+    "cuda", "opencl" and "host".  Which are available depends on the build
     options for libgpuarray.
 
     If you want an alternative interface check :meth:`~pygpu.gpuarray.init`.
@@ -1038,6 +1148,99 @@ cdef class GpuContext:
             ctx_property(self, GA_CTX_PROP_BIN_ID, &res)
             return res;
 
+    property inuse_bytes:
+        "Memory, in bytes, used by the buffers allocated in this context"
+        def __get__(self):
+            cdef size_t res
+            ctx_property(self, GA_CTX_PROP_INUSE_BYTES, &res)
+            return res
+
+    property peak_bytes:
+        "Highest value of inuse_bytes since the last :meth:`reset_peak`"
+        def __get__(self):
+            cdef size_t res
+            ctx_property(self, GA_CTX_PROP_PEAK_BYTES, &res)
+            return res
+
+    property cached_bytes:
+        "Memory, in bytes, kept by the allocation cache of this context"
+        def __get__(self):
+            cdef size_t res
+            ctx_property(self, GA_CTX_PROP_CACHED_BYTES, &res)
+            return res
+
+    property num_buffers:
+        "Number of buffers allocated in this context still in use"
+        def __get__(self):
+            cdef size_t res
+            ctx_property(self, GA_CTX_PROP_NUM_BUFFERS, &res)
+            return res
+
+    property num_allocs:
+        "Number of allocations requested from the driver by this context"
+        def __get__(self):
+            cdef size_t res
+            ctx_property(self, GA_CTX_PROP_NUM_ALLOCS, &res)
+            return res
+
+    property kernel_cache_hits:
+        "Number of kernels that were shared with an identical live kernel"
+        def __get__(self):
+            cdef size_t res
+            ctx_property(self, GA_CTX_PROP_KERNEL_CACHE_HITS, &res)
+            return res
+
+    property kernel_cache_misses:
+        "Number of kernels that had to be built"
+        def __get__(self):
+            cdef size_t res
+            ctx_property(self, GA_CTX_PROP_KERNEL_CACHE_MISSES, &res)
+            return res
+
+    def load_kernels(self, KernelManifest manifest not None):
+        """
+        load_kernels(manifest)
+
+        Build all the kernels of `manifest` in this context.
+
+        The kernels recorded with a binary for the :attr:`bin_id` of
+        this context are loaded from it, the others are compiled.  They
+        stay loaded as long as the context, so the :class:`GpuKernel`
+        made from the same parameters later are ready immediately.
+
+        Returns the number of kernels loaded from their binary.
+        """
+        cdef size_t nbin = 0
+        cdef int err
+        cdef char *err_str = NULL
+        with nogil:
+            err = GpuKernelManifest_replay(manifest.m, self.ops, self.ctx,
+                                           &nbin, &err_str)
+        # The manifest holds the kernels it built, even on failure
+        if self.manifests is None:
+            self.manifests = []
+        self.manifests.append(manifest)
+        if err != GA_NO_ERROR:
+            if err_str != NULL:
+                try:
+                    py_err_str = err_str.decode('UTF-8')
+                finally:
+                    free(err_str)
+                raise get_exc(err), py_err_str
+            raise get_exc(err), self.ops.ctx_error(self.ctx)
+        return nbin
+
+    def reset_peak(self):
+        """
+        reset_peak()
+
+        Reset :attr:`peak_bytes` to the current value of :attr:`inuse_bytes`.
+        """
+        cdef int err
+        err = self.ops.buffer_reset_peak(self.ctx)
+        if err != GA_NO_ERROR:
+            raise get_exc(err), Gpu_error(self.ops, self.ctx, err)
+
 cdef class flags(object):
     cdef int fl
 
@@ -1473,6 +1676,77 @@ cdef class GpuArray:
         """
         pygpu_sync(self)
 
+    def fill(self, value):
+        """
+        fill(value)
+
+        Set all the elements of this array to the scalar `value`.
+
+        This is done on the device, without transferring an array of
+        the values.
+        """
+        cdef np.ndarray v = numpy.asarray(value, dtype=self.dtype)
+        if v.ndim != 0:
+            raise ValueError, "fill expects a scalar value"
+        array_fill(self, np.PyArray_DATA(v))
+
+    cdef __check_host(self, np.ndarray h):
+        if h.dtype != self.dtype or h.shape != self.shape:
+            raise ValueError, "host array does not match this array"
+        if not py_ISONESEGMENT(self):
+            raise ValueError, "this array is not contiguous"
+        if not ((py_CHKFLAGS(self, GA_C_CONTIGUOUS) and
+                 h.flags['C_CONTIGUOUS']) or
+                (py_CHKFLAGS(self, GA_F_CONTIGUOUS) and
+                 h.flags['F_CONTIGUOUS'])):
+            raise ValueError, "host array does not have the same layout"
+
+    def write_async(self, np.ndarray src not None):
+        """
+        write_async(src)
+
+        Start copying the host array `src` into this array and return
+        a :class:`GpuEvent` that completes with the copy.
+
+        `src` must have the shape, dtype and memory order of this array.
+        It must not be modified until the event is complete.
+        """
+        cdef GpuEvent res
+        cdef int err
+        self.__check_host(src)
+        res = GpuEvent.__new__(GpuEvent)
+        res.context = self.context
+        res.keep = src
+        err = GpuArray_write_async(&self.ga, np.PyArray_DATA(src),
+                                   np.PyArray_NBYTES(src), &res.ev)
+        if err != GA_NO_ERROR:
+            raise get_exc(err), GpuArray_error(&self.ga, err)
+        return res
+
+    def read_async(self, np.ndarray out not None):
+        """
+        read_async(out)
+
+        Start copying this array into the host array `out` and return
+        a :class:`GpuEvent` that completes with the copy.
+
+        `out` must have the shape, dtype and memory order of this array.
+        Its content is undefined until the event is complete.
+        """
+        cdef GpuEvent res
+        cdef int err
+        self.__check_host(out)
+        if not out.flags['WRITEABLE']:
+            raise ValueError, "output array is not writeable"
+        res = GpuEvent.__new__(GpuEvent)
+        res.context = self.context
+        res.keep = out
+        err = GpuArray_read_async(np.PyArray_DATA(out), np.PyArray_NBYTES(out),
+                                  &self.ga, &res.ev)
+        if err != GA_NO_ERROR:
+            raise get_exc(err), GpuArray_error(&self.ga, err)
+        return res
+
     def view(self, type cls=GpuArray):
         """
         view(cls=GpuArray)
@@ -1637,9 +1911,14 @@ cdef class GpuArray:
 
     def __setitem__(self, idx, v):
         cdef GpuArray tmp = self.__getitem__(idx)
-        cdef GpuArray gv = asarray(v, dtype=self.dtype,
-                                   context=self.context)
+        cdef GpuArray gv
+
+        if numpy.isscalar(v) or (isinstance(v, numpy.ndarray) and
+                                 v.ndim == 0):
+            tmp.fill(v)
+            return
 
+        gv = asarray(v, dtype=self.dtype, context=self.context)
         array_setarray(tmp, gv)
 
     def __hash__(self):
@@ -1668,7 +1947,7 @@ cdef class GpuArray:
             cdef size_t *newdims
             cdef unsigned int nd
             cdef unsigned int i
-            cdef GpuArray res
+            cdef int err
             nd = <unsigned int>len(newshape)
             newdims = <size_t *>calloc(nd, sizeof(size_t))
             if newdims == NULL:
@@ -1676,20 +1955,13 @@ cdef class GpuArray:
             try:
                 for i in range(nd):
                     newdims[i] = newshape[i]
-                res = new_GpuArray(GpuArray, self.context, None)
-                array_reshape(res, self, nd, newdims, GA_C_ORDER, 1)
+                # This leaves the array untouched if it would need a copy
+                err = GpuArray_reshape_inplace(&self.ga, nd, newdims,
+                                               GA_C_ORDER)
+                if err != GA_NO_ERROR:
+                    raise get_exc(err), GpuArray_error(&self.ga, err)
             finally:
                 free(newdims)
-            # This is safe becase the reshape above is a nocopy one
-            free(self.ga.dimensions)
-            free(self.ga.strides)
-            self.ga.dimensions = res.ga.dimensions
-            self.ga.strides = res.ga.strides
-            self.ga.nd = res.ga.nd
-            res.ga.dimensions = NULL
-            res.ga.strides = NULL
-            res.ga.nd = 0
-            array_clear(res)
 
     property T:
         def __get__(self):
@@ -1783,6 +2055,13 @@ cdef class GpuKernel:
     :param ptx: kernel is PTX code?
     :param cuda: kernel is cuda code?
     :param opencl: kernel is opencl code?
+    :param fast_math: allow the compiler to trade accuracy for speed?
+    :param mad: allow the compiler to fuse multiplies and adds?
+                (OpenCL only)
+    :param opt_level: optimization level between 0 and 3 (None for the
+                      compiler default)
+    :param defines: list of "NAME" or "NAME=VALUE" preprocessor
+                    definitions to put before the source
 
     The kernel function is retrieved using the provided `name` which
     must match what you named your kernel in `source`.  You can safely
@@ -1826,6 +2105,8 @@ cdef class GpuKernel:
 
     If you choose to use this interface, make sure to stay within the
     limits of `k.maxlsize` and `ctx.maxgsize` or the call will fail.
+
+    To compile a kernel in the background, see :class:`GpuKernelFuture`.
     """
     def __dealloc__(self):
         free(self.callbuf)
@@ -1834,14 +2115,16 @@ cdef class GpuKernel:
     def __cinit__(self, source, name, types, GpuContext context=None,
                   cluda=True, have_double=False, have_small=False,
                   have_complex=False, have_half=False, binary=False,
-                  ptx=False, cuda=False, opencl=False, *a, **kwa):
+                  ptx=False, cuda=False, opencl=False, fast_math=False,
+                  mad=False, opt_level=None, defines=None,
+                  GpuKernelFuture future=None, *a, **kwa):
         cdef const char *s[1]
         cdef size_t l
         cdef unsigned int numargs
         cdef unsigned int i
         cdef int *_types
         cdef const gpuarray_buffer_ops *ops
-        cdef int flags = 0
+        cdef int flags
 
         if not isinstance(source, (str, unicode)):
             raise TypeError, "Expected a string for the kernel source"
@@ -1850,24 +2133,11 @@ cdef class GpuKernel:
 
         self.context = ensure_context(context)
 
-        if cluda:
-            flags |= GA_USE_CLUDA
-        if have_double:
-            flags |= GA_USE_DOUBLE
-        if have_small:
-            flags |= GA_USE_SMALL
-        if have_complex:
-            flags |= GA_USE_COMPLEX
-        if have_half:
-            flags |= GA_USE_HALF
-        if binary:
-            flags |= GA_USE_BINARY
-        if ptx:
-            flags |= GA_USE_PTX
-        if cuda:
-            flags |= GA_USE_CUDA
-        if opencl:
-            flags |= GA_USE_OPENCL
+        flags = kernel_flags(cluda, have_double, have_small, have_complex,
+                             have_half, binary, ptx, cuda, opencl)
+        flags |= kernel_options(fast_math, mad, opt_level)
+        if not binary:
+            source = kernel_defines(source, defines)
 
         s[0] = source
         l = len(source)
@@ -1880,15 +2150,15 @@ cdef class GpuKernel:
             raise MemoryError
         try:
             for i in range(numargs):
-                if (types[i] == GpuArray):
-                    _types[i] = GA_BUFFER
-                else:
-                    _types[i] = dtype_to_typecode(types[i])
+                _types[i] = kernel_typecode(types[i])
                 self.callbuf[i] = malloc(gpuarray_get_elsize(_types[i]))
                 if self.callbuf[i] == NULL:
                     raise MemoryError
-            kernel_init(self, self.context.ops, self.context.ctx, 1, s, &l,
-                        name, numargs, _types, flags)
+            if future is None:
+                kernel_init(self, self.context.ops, self.context.ctx, 1, s,
+                            &l, name, numargs, _types, flags)
+            else:
+                kernel_wait(self, future)
         finally:
             free(_types)
 
@@ -2031,3 +2301,506 @@ cdef class GpuKernel:
                 return <bytes>bin[:sz]
             finally:
                 free(bin)
+
+
+def kernel_module(source, names, types, GpuContext context=None, **kwargs):
+    """
+    kernel_module(source, names, types, context=None, cluda=True, have_double=False, have_small=False, have_complex=False, have_half=False)
+
+    Compile many kernels from the same source at once
+
+    `names` is the list of kernel functions to get out of `source` and
+    `types` the list of argument types for each of them.  The other
+    parameters are the same as for :class:`GpuKernel`.
+
+    The source is only compiled once and a list of :class:`GpuKernel`
+    is returned, in the order of `names`.
+    """
+    cdef _GpuKernel *ks
+    cdef const char *s[1]
+    cdef size_t l
+    cdef const char **_names
+    cdef unsigned int *argcounts
+    cdef int **_types
+    cdef unsigned int n
+    cdef unsigned int i
+    cdef unsigned int j
+    cdef int flags
+    cdef int err
+    cdef char *err_str = NULL
+
+    if not isinstance(source, (str, unicode)):
+        raise TypeError, "Expected a string for the kernel source"
+    if len(names) != len(types):
+        raise ValueError, "Expected one list of types for each kernel name"
+
+    context = ensure_context(context)
+    flags = kernel_flags(kwargs.get('cluda', True),
+                         kwargs.get('have_double', False),
+                         kwargs.get('have_small', False),
+                         kwargs.get('have_complex', False),
+                         kwargs.get('have_half', False),
+                         kwargs.get('binary', False), kwargs.get('ptx', False),
+                         kwargs.get('cuda', False), kwargs.get('opencl', False))
+    flags |= kernel_options(kwargs.get('fast_math', False),
+                            kwargs.get('mad', False),
+                            kwargs.get('opt_level', None))
+    src = source
+    if not kwargs.get('binary', False):
+        src = kernel_defines(source, kwargs.get('defines', None))
+
+    s[0] = src
+    l = len(src)
+    n = <unsigned int>len(names)
+    ks = <_GpuKernel *>calloc(n, sizeof(_GpuKernel))
+    _names = <const char **>calloc(n, sizeof(char *))
+    argcounts = <unsigned int *>calloc(n, sizeof(unsigned int))
+    _types = <int **>calloc(n, sizeof(int *))
+    try:
+        if ks == NULL or _names == NULL or argcounts == NULL or _types == NULL:
+            raise MemoryError
+        for i in range(n):
+            if not isinstance(names[i], (str, unicode)):
+                raise TypeError, "Expected a string for the kernel name"
+            _names[i] = names[i]
+            argcounts[i] = <unsigned int>len(types[i])
+            _types[i] = <int *>calloc(argcounts[i], sizeof(int))
+            if _types[i] == NULL:
+                raise MemoryError
+            for j in range(argcounts[i]):
+                _types[i][j] = kernel_typecode(types[i][j])
+        err = GpuKernel_init_module(ks, context.ops, context.ctx, 1, s, &l, n,
+                                    _names, argcounts, <const int **>_types,
+                                    flags, &err_str)
+        if err != GA_NO_ERROR:
+            if err_str != NULL:
+                try:
+                    py_err_str = err_str.decode('UTF-8')
+                finally:
+                    free(err_str)
+                raise get_exc(err), py_err_str
+            raise get_exc(err), Gpu_error(context.ops, context.ctx, err)
+        # The kernels are in the context's kernel table now, so these
+        # will not compile anything.  They add the defines themselves.
+        try:
+            return [GpuKernel(source, names[i], types[i], context=context,
+                              **kwargs) for i in range(n)]
+        finally:
+            for i in range(n):
+                GpuKernel_clear(&ks[i])
+    finally:
+        if _types != NULL:
+            for i in range(n):
+                free(_types[i])
+        free(_types)
+        free(argcounts)
+        free(_names)
+        free(ks)
+
+
+cdef class KernelManifest:
+    """
+    .. code-block:: python
+
+        KernelManifest(path=None)
+
+    List of kernels to build ahead of time
+
+    :param path: file written by :meth:`save` to read, the manifest
+                 starts empty if this is None
+
+    A manifest records the kernels used by a program, with their
+    binaries, to build them all when a later run creates its context
+    instead of on first use::
+
+        m = KernelManifest()
+        m.record()
+        # ... run a typical workload ...
+        m.stop_recording()
+        m.save("kernels.manifest")
+
+    and then at startup::
+
+        ctx = pygpu.init("cuda0", manifest="kernels.manifest")
+    """
+    def __dealloc__(self):
+        GpuKernelManifest_free(self.m)
+
+    def __cinit__(self, path=None):
+        cdef int err = GA_NO_ERROR
+        if path is None:
+            self.m = GpuKernelManifest_new()
+            if self.m == NULL:
+                raise MemoryError
+        else:
+            self.m = GpuKernelManifest_load(path, &err)
+            if self.m == NULL:
+                raise get_exc(err), "Could not read kernel manifest %s" % (path,)
+
+    def __len__(self):
+        return GpuKernelManifest_size(self.m)
+
+    def record(self):
+        """
+        record()
+
+        Add every kernel built from now on to this manifest, in any
+        context, until :meth:`stop_recording` is called.
+        """
+        GpuKernelManifest_record(self.m)
+
+    def stop_recording(self):
+        """
+        stop_recording()
+
+        Stop recording kernels.
+        """
+        GpuKernelManifest_record(NULL)
+
+    def save(self, path):
+        """
+        save(path)
+
+        Write this manifest to `path`.
+        """
+        cdef int err
+        err = GpuKernelManifest_save(self.m, path)
+        if err != GA_NO_ERROR:
+            raise get_exc(err), "Could not write kernel manifest %s" % (path,)
+
+
+cdef class GpuKernelFuture:
+    """
+    .. code-block:: python
+
+        GpuKernelFuture(source, name, types, context=None, cluda=True, have_double=False, have_small=False, have_complex=False, have_half=False)
+
+    Compile a kernel in the background
+
+    This takes the same parameters as :class:`GpuKernel` but returns
+    as soon as the source is handed to the compile threads of
+    libgpuarray.  Use :meth:`result` to get the kernel.
+
+    This is meant to start the compilation of the kernels you will
+    need early and do something else in the mean time::
+
+        fs = [GpuKernelFuture(src, "k", types) for src in sources]
+        # ... load data ...
+        ks = [f.result() for f in fs]
+
+    The number of compile threads can be set with the
+    GPUARRAY_COMPILE_THREADS environment variable.
+    """
+    def __dealloc__(self):
+        with nogil:
+            GpuKernelFuture_free(self.f)
+
+    def __cinit__(self, source, name, types, GpuContext context=None,
+                  cluda=True, have_double=False, have_small=False,
+                  have_complex=False, have_half=False, binary=False,
+                  ptx=False, cuda=False, opencl=False, fast_math=False,
+                  mad=False, opt_level=None, defines=None, *a, **kwa):
+        cdef const char *s[1]
+        cdef size_t l
+        cdef unsigned int numargs
+        cdef unsigned int i
+        cdef int *_types
+        cdef int flags
+        cdef int err = GA_NO_ERROR
+
+        if not isinstance(source, (str, unicode)):
+            raise TypeError, "Expected a string for the kernel source"
+        if not isinstance(name, (str, unicode)):
+            raise TypeError, "Expected a string for the kernel name"
+
+        self.context = ensure_context(context)
+        self.source = source
+        self.name = name
+        self.types = tuple(types)
+
+        flags = kernel_flags(cluda, have_double, have_small, have_complex,
+                             have_half, binary, ptx, cuda, opencl)
+        flags |= kernel_options(fast_math, mad, opt_level)
+        if not binary:
+            source = kernel_defines(source, defines)
+
+        s[0] = source
+        l = len(source)
+        numargs = <unsigned int>len(self.types)
+        _types = <int *>calloc(numargs, sizeof(int))
+        if _types == NULL:
+            raise MemoryError
+        try:
+            for i in range(numargs):
+                _types[i] = kernel_typecode(self.types[i])
+            self.f = GpuKernel_init_async(self.context.ops, self.context.ctx,
+                                          1, s, &l, name, numargs, _types,
+                                          flags, &err)
+        finally:
+            free(_types)
+        if self.f == NULL:
+            raise get_exc(err), Gpu_error(self.context.ops, self.context.ctx, err)
+
+    def ready(self):
+        """
+        ready()
+
+        Return True if the compilation is finished, successfully or not.
+        """
+        return GpuKernelFuture_ready(self.f) != 0
+
+    def error(self):
+        """
+        error()
+
+        Wait for the compilation and return the compiler output if it
+        failed or None if it succeeded.
+        """
+        cdef int err
+        cdef char *err_str = NULL
+        with nogil:
+            err = GpuKernelFuture_error(self.f, &err_str)
+        if err == GA_NO_ERROR:
+            return None
+        if err_str != NULL:
+            try:
+                return err_str.decode('UTF-8')
+            finally:
+                free(err_str)
+        return Gpu_error(self.context.ops, self.context.ctx, err)
+
+    def result(self):
+        """
+        result()
+
+        Wait for the compilation and return the :class:`GpuKernel`.
+
+        Compile errors are raised here, as they would be by the
+        :class:`GpuKernel` constructor.
+        """
+        return GpuKernel(self.source, self.name, self.types,
+                         context=self.context, future=self)
+
+
+cdef class GpuStream:
+    """
+    .. code-block:: python
+
+        GpuStream(context=None, default=False)
+
+    Stream of operations on a context
+
+    :param context: context of the stream
+    :type context: GpuContext
+    :param default: refer to the default stream of the context instead
+                    of creating a new one
+    :type default: bool
+
+    Operations on a context (kernel calls, copies, fills, blas calls,
+    ...) go to the stream in use, which is the default stream unless
+    another one is selected with :meth:`use` or a `with` block.
+    Operations on different streams may overlap while the uses of the
+    same array stay ordered::
+
+        s1 = GpuStream()
+        s2 = GpuStream()
+        with s1:
+            a[:] = b
+        with s2:
+            k(c, d, n=c.size)
+        s1.sync()
+
+    The work on a released stream is completed before what is issued to
+    the default stream after that.
+    """
+    def __dealloc__(self):
+        GpuStream_clear(&self.s)
+
+    def __cinit__(self, GpuContext context=None, default=False, *a, **kwa):
+        cdef int err
+        self.context = ensure_context(context)
+        if default:
+            GpuStream_default(&self.s, self.context.ops, self.context.ctx)
+        else:
+            err = GpuStream_init(&self.s, self.context.ops, self.context.ctx)
+            if err != GA_NO_ERROR:
+                raise get_exc(err), Gpu_error(self.context.ops,
+                                              self.context.ctx, err)
+
+    def __enter__(self):
+        self.use()
+        return self
+
+    def __exit__(self, *exc):
+        cdef _GpuStream s0
+        GpuStream_default(&s0, self.context.ops, self.context.ctx)
+        GpuStream_use(&s0)
+
+    property default:
+        "True if this is the default stream of its context"
+        def __get__(self):
+            return self.s.s == NULL
+
+    def use(self):
+        """
+        use()
+
+        Issue the following operations on the context to this stream.
+        """
+        cdef int err
+        err = GpuStream_use(&self.s)
+        if err != GA_NO_ERROR:
+            raise get_exc(err), Gpu_error(self.context.ops,
+                                          self.context.ctx, err)
+
+    def sync(self):
+        """
+        sync()
+
+        Wait for the work issued to this stream to complete.
+        """
+        cdef int err
+        with nogil:
+            err = GpuStream_sync(&self.s)
+        if err != GA_NO_ERROR:
+            raise get_exc(err), Gpu_error(self.context.ops,
+                                          self.context.ctx, err)
+
+    def wait(self, GpuStream other not None):
+        """
+        wait(other)
+
+        Make the work issued to this stream from now on wait for the
+        work issued to `other` so far.  This does not block.
+        """
+        cdef int err
+        if other.context is not self.context:
+            raise ValueError, "Streams are not in the same context"
+        err = GpuStream_wait(&self.s, &other.s)
+        if err != GA_NO_ERROR:
+            raise get_exc(err), Gpu_error(self.context.ops,
+                                          self.context.ctx, err)
+
+
+cdef class GpuEvent:
+    """
+    .. code-block:: python
+
+        GpuEvent(context=None, timing=False)
+
+    Point in the work issued to a context
+
+    :param context: context of the event
+    :type context: GpuContext
+    :param timing: allow measuring time with :meth:`elapsed`
+    :type timing: bool
+
+    An event completes when the work issued to a stream before it was
+    recorded is done.  This can time work on the device::
+
+        start = GpuEvent(timing=True)
+        end = GpuEvent(timing=True)
+        start.record()
+        k(a, b, n=a.size)
+        end.record()
+        print(start.elapsed(end), "ms")
+
+    Events are also returned by :meth:`GpuArray.read_async` and
+    :meth:`GpuArray.write_async` to tell when the copy is done, in
+    which case they keep the host array of the copy alive.
+    """
+    def __dealloc__(self):
+        GpuEvent_clear(&self.ev)
+
+    def __cinit__(self, *a, **kwa):
+        self.ev.ev = NULL
+
+    def __init__(self, GpuContext context=None, timing=False):
+        cdef int err
+        self.context = ensure_context(context)
+        err = GpuEvent_init(&self.ev, self.context.ops, self.context.ctx,
+                            GA_EVENT_TIMING if timing else 0)
+        if err != GA_NO_ERROR:
+            raise get_exc(err), Gpu_error(self.context.ops,
+                                          self.context.ctx, err)
+
+    def record(self, GpuStream stream=None):
+        """
+        record(stream=None)
+
+        Record this event on `stream`, or the default stream of its
+        context if None.
+        """
+        cdef _GpuStream *s = NULL
+        cdef int err
+        if stream is not None:
+            if stream.context is not self.context:
+                raise ValueError, "Stream is not in the context of the event"
+            s = &stream.s
+        err = GpuEvent_record(&self.ev, s)
+        if err != GA_NO_ERROR:
+            raise get_exc(err), Gpu_error(self.context.ops,
+                                          self.context.ctx, err)
+
+    def wait(self, GpuStream stream=None):
+        """
+        wait(stream=None)
+
+        Make the work issued to `stream`, or the default stream if None,
+        from now on wait for this event.  This does not block.
+        """
+        cdef _GpuStream *s = NULL
+        cdef int err
+        if stream is not None:
+            if stream.context is not self.context:
+                raise ValueError, "Stream is not in the context of the event"
+            s = &stream.s
+        err = GpuEvent_wait(&self.ev, s)
+        if err != GA_NO_ERROR:
+            raise get_exc(err), Gpu_error(self.context.ops,
+                                          self.context.ctx, err)
+
+    def elapsed(self, GpuEvent end not None):
+        """
+        elapsed(end)
+
+        Return the device time from this event to `end` in
+        milliseconds, waiting for both to complete.
+
+        Both must be created with `timing=True` and recorded.
+        """
+        cdef int err
+        cdef double ms
+        if end.context is not self.context:
+            raise ValueError, "Events are not in the same context"
+        with nogil:
+            err = GpuEvent_elapsed(&self.ev, &end.ev, &ms)
+        if err != GA_NO_ERROR:
+            raise get_exc(err), Gpu_error(self.context.ops,
+                                          self.context.ctx, err)
+        return ms
+
+    def query(self):
+        """
+        query()
+
+        Return True if the event is complete, without waiting.
+        """
+        if self.ev.ev == NULL:
+            return True
+        return GpuEvent_query(&self.ev) != 0
+
+    def sync(self):
+        """
+        sync()
+
+        Wait for the event to complete.
+        """
+        cdef int err
+        if self.ev.ev == NULL:
+            return
+        with nogil:
+            err = GpuEvent_sync(&self.ev)
+        if err != GA_NO_ERROR:
+            raise get_exc(err), Gpu_error(self.context.ops,
+                                          self.context.ctx, err)
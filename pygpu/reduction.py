@@ -172,9 +172,24 @@ class ReductionKernel(object):
                                    self.out_arg.dtype.itemsize,
                                    context.maxlsize)
 
+        self._pending = {}
         # this is to prep the cache
         if init_nd is not None:
-            self._get_basic_kernel(self.init_local_size, init_nd)
+            self.precompile([init_nd])
+
+    def precompile(self, nds):
+        """
+        Start compiling the kernels for the given numbers of
+        dimensions and the self.init_local_size value in the
+        background.
+        """
+        ls = 2**_ceil_log2(self.init_local_size)
+        for nd in nds:
+            if (ls, nd) not in self._pending:
+                src, spec = self._src_basic(ls, nd)
+                self._pending[(ls, nd)] = gpuarray.GpuKernelFuture(
+                    src, "reduk", spec, context=self.context, cluda=True,
+                    **self.flags)
 
     def _find_kernel_ls(self, tmpl, max_ls, *tmpl_args):
         local_size = min(self.init_local_size, max_ls)
@@ -195,7 +210,7 @@ class ReductionKernel(object):
                            " Please report this along with your "
                            "reduction code.")
 
-    def _gen_basic(self, ls, nd):
+    def _src_basic(self, ls, nd):
         src = basic_kernel.render(preamble=self.preamble,
                                   reduce_expr=self.reduce_expr,
                                   name="reduk",
@@ -212,8 +227,16 @@ class ReductionKernel(object):
             if arg.isarray():
                 spec.append('uint32')
                 spec.extend('int32' for _ in range(nd))
-        k = gpuarray.GpuKernel(src, "reduk", spec, context=self.context,
-                               cluda=True, **self.flags)
+        return src, spec
+
+    def _gen_basic(self, ls, nd):
+        src, spec = self._src_basic(ls, nd)
+        f = self._pending.pop((ls, nd), None)
+        if f is not None:
+            k = f.result()
+        else:
+            k = gpuarray.GpuKernel(src, "reduk", spec, context=self.context,
+                                   cluda=True, **self.flags)
         return k, src, spec
 
     @lru_cache()
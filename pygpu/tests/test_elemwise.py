@@ -421,3 +421,44 @@ def elemwise_collapse(dtype1, dtype2, shape1, shape2, expected):
             assert nd >= expected
         else:
             assert nd == expected2
+
+
+def test_elemwise_precompile():
+    k = ElemwiseKernel(context, "float *a, float *b, float *c",
+                       "c[i] = a[i] + b[i]")
+    k.precompile([1, 2, 3])
+    for shape in [(20,), (4, 5), (3, 4, 5)]:
+        ac, ag = gen_gpuarray(shape, dtype='float32', sliced=2, ctx=context)
+        bc, bg = gen_gpuarray(shape, dtype='float32', sliced=2, ctx=context)
+        outg = gpuarray.empty(shape, dtype='float32', context=context)
+        k.call_basic(ag, bg, outg)
+        assert numpy.allclose(numpy.asarray(outg), ac + bc)
+
+
+def test_kernel_manifest():
+    import os, tempfile
+    m = gpuarray.KernelManifest()
+    m.record()
+    try:
+        k = ElemwiseKernel(context, "float *a, float *b",
+                           "b[i] = a[i] * 3")
+        k.contig_k
+    finally:
+        m.stop_recording()
+    assert len(m) >= 1
+    fd, path = tempfile.mkstemp()
+    os.close(fd)
+    try:
+        m.save(path)
+        del k, m
+        m = gpuarray.KernelManifest(path)
+    finally:
+        os.unlink(path)
+    context.load_kernels(m)
+    misses = context.kernel_cache_misses
+    k = ElemwiseKernel(context, "float *a, float *b", "b[i] = a[i] * 3")
+    ac, ag = gen_gpuarray((5,), dtype='float32', ctx=context)
+    outg = gpuarray.empty((5,), dtype='float32', context=context)
+    k(ag, outg)
+    assert numpy.allclose(numpy.asarray(outg), ac * 3)
+    assert context.kernel_cache_misses == misses
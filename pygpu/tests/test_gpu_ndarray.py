@@ -295,6 +295,84 @@ def mapping_setitem_ellipsis2(shp, dtype, offseted):
     assert numpy.allclose(a, numpy.asarray(b_gpu))
 
 
+def test_fill():
+    for shp in [(), (9,), (8, 9), (4, 8, 9)]:
+        for dtype in dtypes_all:
+            for sliced in [1, 2]:
+                yield fill, shp, dtype, sliced
+
+
+@guard_devsup
+def fill(shp, dtype, sliced):
+    a, a_gpu = gen_gpuarray(shp, dtype, sliced=sliced, ctx=ctx)
+    a.fill(3)
+    a_gpu.fill(3)
+    assert numpy.allclose(a, numpy.asarray(a_gpu))
+    if len(shp) > 0:
+        a[1] = 5
+        a_gpu[1] = 5
+        assert numpy.allclose(a, numpy.asarray(a_gpu))
+
+
+def test_stream():
+    a = numpy.arange(1000, dtype='float32')
+    s1 = gpu_ndarray.GpuStream(context=ctx)
+    s2 = gpu_ndarray.GpuStream(context=ctx)
+    s0 = gpu_ndarray.GpuStream(context=ctx, default=True)
+    assert s0.default and not s1.default
+    with s1:
+        a_gpu = gpu_ndarray.array(a, context=ctx)
+        b_gpu = a_gpu.copy()
+    with s2:
+        # Ordered after the copy on s1 through b_gpu
+        b_gpu.fill(2)
+    s0.wait(s2)
+    s1.sync()
+    s2.sync()
+    assert numpy.allclose(numpy.asarray(a_gpu), a)
+    assert numpy.allclose(numpy.asarray(b_gpu), 2)
+    del s1, s2
+
+
+def test_read_write_async():
+    for shp in [(), (9,), (8, 9), (4, 8, 9)]:
+        for order in ['c', 'f']:
+            yield read_write_async, shp, order
+
+
+def read_write_async(shp, order):
+    a = numpy.asarray(numpy.random.rand(*shp), dtype='float32', order=order)
+    a_gpu = gpu_ndarray.empty(shp, dtype='float32', order=order, context=ctx)
+    ev = a_gpu.write_async(a)
+    b = numpy.empty_like(a, order=order)
+    ev2 = a_gpu.read_async(b)
+    ev2.sync()
+    assert ev.query() and ev2.query()
+    assert numpy.all(a == b)
+
+
+def test_event_timing():
+    a_gpu = gpu_ndarray.zeros((1000,), dtype='float32', context=ctx)
+    start = gpu_ndarray.GpuEvent(context=ctx, timing=True)
+    end = gpu_ndarray.GpuEvent(context=ctx, timing=True)
+    start.record()
+    a_gpu.fill(1)
+    end.record()
+    s = gpu_ndarray.GpuStream(context=ctx)
+    end.wait(s)
+    assert start.elapsed(end) >= 0
+    assert end.query()
+    plain = gpu_ndarray.GpuEvent(context=ctx)
+    plain.record(s)
+    plain.sync()
+    try:
+        start.elapsed(plain)
+    except ValueError:
+        pass
+    else:
+        assert False, "elapsed needs timing events"
+
+
 def test_copy_view():
     for shp in [(5,), (6, 7), (4, 8, 9), (1, 8, 9)]:
         for dtype in dtypes_all:
@@ -615,3 +693,29 @@ def flag_prop(p):
 
     assert getattr(c2.flags, p) == getattr(g2.flags, p)
     assert getattr(c3.flags, p) == getattr(g3.flags, p)
+
+
+def test_kernel_module_defines():
+    src = """
+KERNEL void set_val(GLOBAL_MEM float *a, ga_size off) {
+  a = (GLOBAL_MEM float *)(((GLOBAL_MEM char *)a) + off);
+  a[GID_0 * LDIM_0 + LID_0] = VAL;
+}
+KERNEL void add_val(GLOBAL_MEM float *a, ga_size off) {
+  a = (GLOBAL_MEM float *)(((GLOBAL_MEM char *)a) + off);
+  a[GID_0 * LDIM_0 + LID_0] += VAL;
+}
+"""
+    spec = [gpu_ndarray.GpuArray, gpu_ndarray.SIZE]
+    hits = ctx.kernel_cache_hits
+    misses = ctx.kernel_cache_misses
+    ks = gpu_ndarray.kernel_module(src, ["set_val", "add_val"], [spec, spec],
+                                   context=ctx, defines=["VAL=3.0f"])
+    # Each name is looked up once for the module, then the returned
+    # kernels must find the same source in the table.
+    assert ctx.kernel_cache_misses == misses + 2
+    assert ctx.kernel_cache_hits == hits + 2
+    a = gpu_ndarray.zeros((32,), dtype='float32', context=ctx)
+    ks[0](a, a.offset, n=32)
+    ks[1](a, a.offset, n=32)
+    assert numpy.all(numpy.asarray(a) == 6.0)
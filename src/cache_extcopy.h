@@ -1,11 +1,30 @@
 /*
  * This whole cache business is ugly, but fast.
+ *
+ * The offsets are passed to the kernels as arguments so they are not
+ * part of the key.
+ *
+ * There are two caches per context.  The first is keyed on the full
+ * layout and counts how many times it was copied.  Layouts start out
+ * using a generic kernel from the second cache, which reads the
+ * dimensions and strides from its arguments and is keyed only on the
+ * types and number of dimensions (`generic` is set in the key and its
+ * arrays are NULL).  Once a layout has been seen more than
+ * EXTCOPY_SPEC_LIMIT times it gets its own kernel with the layout
+ * baked in.
  */
+
+/* Layouts kept per context, unless set by GPUARRAY_EXTCOPY_CACHE_SIZE */
+#define EXTCOPY_CACHE_DEFAULT 64
+
+/* Calls with a layout before it gets a specialized kernel */
+#define EXTCOPY_SPEC_LIMIT 10
+/* Layouts with more dimensions are always specialized */
+#define EXTCOPY_GENERIC_ND 8
+
 typedef struct _extcopy_args {
   unsigned int ind;
   unsigned int ond;
-  size_t ioff;
-  size_t ooff;
   int itype;
   int otype;
   const size_t *idims;
@@ -13,15 +32,22 @@ typedef struct _extcopy_args {
   const ssize_t *istr;
   const ssize_t *ostr;
   size_t hash;
+  int generic;
 } cache_key_t;
 
-typedef gpukernel *cache_val_t;
+typedef struct _extcopy_val {
+  gpukernel *k; /* NULL until specialized */
+  unsigned int ncall;
+} cache_val_t;
 
 #define key_hash(k) (k)->hash
 
 static inline int key_eq(const cache_key_t *k1, const cache_key_t *k2) {
+  if (k1->generic || k2->generic)
+    return (k1->generic && k2->generic &&
+	    k1->ind == k2->ind && k1->ond == k2->ond &&
+	    k1->itype == k2->itype && k1->otype == k2->otype);
   return (k1->ind == k2->ind && k1->ond == k2->ond &&
-	  k1->ioff == k2->ioff && k1->ooff == k2->ooff &&
 	  k1->itype == k2->itype && k1->otype == k2->otype &&
 	  memcmp(k1->idims, k2->idims, k1->ind * sizeof(size_t)) == 0 &&
 	  memcmp(k1->odims, k2->odims, k1->ond * sizeof(size_t)) == 0 &&
@@ -91,17 +117,98 @@ static inline void hashword2(const uint32_t *k, size_t l,
   *pb = b; *pc = c;
 }
 
+/*
+ * Number of layouts the cache of a new context keeps.  The cache may
+ * go over it by half before the least recently used layouts are
+ * dropped.
+ */
+static inline size_t extcopy_cache_limit(void) {
+  const char *s = getenv("GPUARRAY_EXTCOPY_CACHE_SIZE");
+  char *end;
+  unsigned long v;
+
+  if (s != NULL) {
+    v = strtoul(s, &end, 10);
+    if (end != s && *end == '\0' && v > 0)
+      return (size_t)v;
+  }
+  return EXTCOPY_CACHE_DEFAULT;
+}
+
+/*
+ * Number of kernels held by the two caches of a context.  The layouts
+ * still counting their calls don't have one.
+ */
+static inline size_t extcopy_nkernels(cache *spec, cache *generic) {
+  size_t res = hash_size(&generic->cache);
+  node *n;
+
+  for (n = spec->keys.head; n != NULL; n = n->next)
+    if (n->val.k != NULL)
+      res++;
+  return res;
+}
+
 static inline void do_key_hash(cache_key_t *k) {
   uint32_t b = k->ind, c = k->ond;
-  hashword2((uint32_t *)(((char *)k) + offsetof(cache_key_t, ioff)),
-	    (offsetof(cache_key_t, idims) - offsetof(cache_key_t, ioff))/4, &b, &c);
-  hashword2((uint32_t *)k->idims, k->ind*(sizeof(size_t)/4), &b, &c);
-  hashword2((uint32_t *)k->odims, k->ond*(sizeof(size_t)/4), &b, &c);
-  hashword2((uint32_t *)k->istr, k->ind*(sizeof(size_t)/4), &b, &c);
-  hashword2((uint32_t *)k->ostr, k->ond*(sizeof(size_t)/4), &b, &c);
+  hashword2((uint32_t *)(((char *)k) + offsetof(cache_key_t, itype)),
+	    (offsetof(cache_key_t, idims) - offsetof(cache_key_t, itype))/4, &b, &c);
+  if (!k->generic) {
+    hashword2((uint32_t *)k->idims, k->ind*(sizeof(size_t)/4), &b, &c);
+    hashword2((uint32_t *)k->odims, k->ond*(sizeof(size_t)/4), &b, &c);
+    hashword2((uint32_t *)k->istr, k->ind*(sizeof(size_t)/4), &b, &c);
+    hashword2((uint32_t *)k->ostr, k->ond*(sizeof(size_t)/4), &b, &c);
+  }
   if (sizeof(size_t) == 4)
     k->hash = c;
   else
     k->hash = ((size_t)b) << 32 | c;
 }
 
+
+/*
+ * Argument types of the extcopy kernel for `k`: the two buffers and
+ * offsets, followed for generic kernels by the number of elements and
+ * the dimensions and strides of both sides.  `types` must have room
+ * for 5 + 2*(k->ind + k->ond) entries.  Returns the number of
+ * arguments.
+ */
+static inline unsigned int extcopy_types(const cache_key_t *k, int *types) {
+  unsigned int n = 0, i;
+
+  types[n++] = GA_BUFFER;
+  types[n++] = GA_BUFFER;
+  types[n++] = GA_SIZE;
+  types[n++] = GA_SIZE;
+  if (k->generic) {
+    types[n++] = GA_SIZE;
+    for (i = 0; i < k->ind; i++)
+      types[n++] = GA_SIZE;
+    for (i = 0; i < k->ind; i++)
+      types[n++] = GA_SSIZE;
+    for (i = 0; i < k->ond; i++)
+      types[n++] = GA_SIZE;
+    for (i = 0; i < k->ond; i++)
+      types[n++] = GA_SSIZE;
+  }
+  return n;
+}
+
+/* Arguments of a generic kernel that come after the offsets */
+static inline void extcopy_generic_args(void **args, size_t *nEls,
+					unsigned int a_nd, const size_t *a_dims,
+					const ssize_t *a_str,
+					unsigned int b_nd, const size_t *b_dims,
+					const ssize_t *b_str) {
+  unsigned int n = 0, i;
+
+  args[n++] = nEls;
+  for (i = 0; i < a_nd; i++)
+    args[n++] = (void *)&a_dims[i];
+  for (i = 0; i < a_nd; i++)
+    args[n++] = (void *)&a_str[i];
+  for (i = 0; i < b_nd; i++)
+    args[n++] = (void *)&b_dims[i];
+  for (i = 0; i < b_nd; i++)
+    args[n++] = (void *)&b_str[i];
+}
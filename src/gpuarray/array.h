@@ -6,6 +6,7 @@
  */
 
 #include <gpuarray/buffer.h>
+#include <gpuarray/event.h>
 
 #ifdef _MSC_VER
 #define inline
@@ -18,6 +19,12 @@ extern "C" {
 }
 #endif
 
+/**
+ * Number of dimensions up to which the dimensions and strides of an
+ * array are stored inside the GpuArray structure.
+ */
+#define GA_INLINE_ND 8
+
 /**
  * Main array structure.
  */
@@ -32,6 +39,9 @@ typedef struct _GpuArray {
   const gpuarray_buffer_ops *ops;
   /**
    * Size of each dimension.  The number of elements is #nd.
+   *
+   * This may point inside the structure (see #_dims), so don't copy
+   * GpuArray structures around, make a view instead.
    */
   size_t *dimensions;
   /**
@@ -54,6 +64,12 @@ typedef struct _GpuArray {
    * Type of the array elements.
    */
   int typecode;
+  /**
+   * Storage for #dimensions and #strides when #nd is at most
+   * GA_INLINE_ND.  Don't use directly.
+   */
+  size_t _dims[GA_INLINE_ND];
+  ssize_t _strs[GA_INLINE_ND];
 
 /**
  * \defgroup aflags Array Flags
@@ -503,6 +519,44 @@ GPUARRAY_PUBLIC int GpuArray_write(GpuArray *dst, const void *src,
 GPUARRAY_PUBLIC int GpuArray_read(void *dst, size_t dst_sz,
                                   const GpuArray *src);
 
+/**
+ * Start a copy from the host memory to the device memory.
+ *
+ * This is GpuArray_write() without waiting for the copy.  `src` must
+ * not be modified until `ev` is complete.  The copy is ordered with
+ * the other work on `dst`.
+ *
+ * \param dst destination array (must be contiguous)
+ * \param src source host memory (contiguous block)
+ * \param src_sz size of data to copy (in bytes)
+ * \param ev event that completes with the copy, to clear with
+ *           GpuEvent_clear()
+ *
+ * \return GA_NO_ERROR if the operation was succesful.
+ * \return an error code otherwise
+ */
+GPUARRAY_PUBLIC int GpuArray_write_async(GpuArray *dst, const void *src,
+                                         size_t src_sz, GpuEvent *ev);
+
+/**
+ * Start a copy from the device memory to the host memory.
+ *
+ * This is GpuArray_read() without waiting for the copy.  `dst` must
+ * not be used until `ev` is complete.  With CUDA, the copy only
+ * overlaps with the host if `dst` is page-locked memory.
+ *
+ * \param dst destination host memory (contiguous block)
+ * \param dst_sz size of data to copy (in bytes)
+ * \param src source array (must be contiguous)
+ * \param ev event that completes with the copy, to clear with
+ *           GpuEvent_clear()
+ *
+ * \return GA_NO_ERROR if the operation was succesful.
+ * \return an error code otherwise
+ */
+GPUARRAY_PUBLIC int GpuArray_read_async(void *dst, size_t dst_sz,
+                                        const GpuArray *src, GpuEvent *ev);
+
 /**
  * Set all of an array's data to a byte pattern.
  *
@@ -514,6 +568,23 @@ GPUARRAY_PUBLIC int GpuArray_read(void *dst, size_t dst_sz,
  */
 GPUARRAY_PUBLIC int GpuArray_memset(GpuArray *a, int data);
 
+/**
+ * Set all the elements of an array to a value.
+ *
+ * This works for any type and layout.  The fill operations of the
+ * driver are used when the array has no gaps and they support the
+ * value, otherwise a kernel that is kept in the context is used.
+ *
+ * \param a an array
+ * \param value pointer to one element of the type of `a`
+ *
+ * \return GA_NO_ERROR if the operation was succesful.
+ * \return GA_UNSUPPORTED_ERROR for elements of more than 64 bytes that
+ *         the driver can't fill.
+ * \return an error code otherwise
+ */
+GPUARRAY_PUBLIC int GpuArray_fill(GpuArray *a, const void *value);
+
 /**
  * Make a copy of an array.
  *
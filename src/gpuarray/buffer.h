@@ -37,6 +37,20 @@ struct _gpukernel;
  */
 typedef struct _gpukernel gpukernel;
 
+struct _gpustream;
+
+/**
+ * Opaque struct for stream data.
+ */
+typedef struct _gpustream gpustream;
+
+struct _gpuevent;
+
+/**
+ * Opaque struct for event data.
+ */
+typedef struct _gpuevent gpuevent;
+
 /**
  * Function table that a backend must provide.
  * \headerfile gpuarray/buffer.h
@@ -84,6 +98,43 @@ typedef struct _gpuarray_buffer_ops {
  */
 #define GA_CTX_SINGLE_THREAD 0x2
 
+/**
+ * Disable the allocation cache.
+ *
+ * By default, released buffers are kept around by the context to
+ * serve later allocations of a similar size without going through
+ * the driver.  With this flag every allocation and release goes to
+ * the driver.
+ */
+#define GA_CTX_DISABLE_ALLOCATION_CACHE 0x4
+
+/**
+ * Disable sub-allocation.
+ *
+ * By default, small buffers are carved out of larger blocks shared
+ * with other buffers of the same size to reduce the number of driver
+ * allocations.  With this flag each buffer gets its own allocation.
+ * Sub-allocation is also disabled when the allocation cache is.
+ */
+#define GA_CTX_DISABLE_SUBALLOCATION 0x8
+
+/**
+ * @}
+ */
+
+/**
+ * \defgroup event_flags Event flags
+ * @{
+ */
+
+/**
+ * Record timing information.
+ *
+ * Only events created with this flag can be passed to event_elapsed().
+ * Recording them may be slower.
+ */
+#define GA_EVENT_TIMING 0x1
+
 /**
  * @}
  */
@@ -462,6 +513,392 @@ typedef struct _gpuarray_buffer_ops {
    * \returns string description of the last error
    */
   const char *(*ctx_error)(void *ctx);
+
+  /**
+   * Release the memory held by the allocation cache of a context.
+   *
+   * The buffers in use are not affected.  This is also done
+   * automatically when an allocation fails for lack of memory.
+   *
+   * \param ctx context
+   *
+   * \returns GA_NO_ERROR or an error code if an error occurred.
+   */
+  int (*buffer_trim)(void *ctx);
+
+  /**
+   * Reset the GA_CTX_PROP_PEAK_BYTES property of a context to the
+   * current value of GA_CTX_PROP_INUSE_BYTES.
+   *
+   * \param ctx context
+   *
+   * \returns GA_NO_ERROR or an error code if an error occurred.
+   */
+  int (*buffer_reset_peak)(void *ctx);
+
+  /**
+   * Find a kernel stored in a context with kernel_keep().
+   *
+   * This is meant for the kernels that libraries generate for their
+   * own operations, to skip generating the source again when it only
+   * depends on a few parameters.
+   *
+   * \param ctx context
+   * \param key key the kernel was stored under
+   * \param len length of the key
+   *
+   * \returns a new reference to the kernel or NULL if there is none.
+   */
+  gpukernel *(*kernel_lookup)(void *ctx, const char *key, size_t len);
+
+  /**
+   * Store a reference to a kernel in its context.
+   *
+   * The context holds on to a limited number of kernels and drops the
+   * least recently used ones to make room.  Storing a kernel under a
+   * key already in use replaces the previous one.  Keys are arbitrary
+   * bytes; prefix them with the name of the library or function to
+   * avoid clashes.
+   *
+   * \param k kernel
+   * \param key key to store the kernel under
+   * \param len length of the key
+   *
+   * \returns GA_NO_ERROR or an error code if an error occurred.
+   */
+  int (*kernel_keep)(gpukernel *k, const char *key, size_t len);
+
+  /**
+   * Compile the source of a kernel without loading it.
+   *
+   * The parameters are the same as for kernel_alloc().  The result is
+   * the blob that kernel_alloc() accepts with GA_USE_BINARY, so the
+   * expensive part of building a kernel can be done ahead of time.
+   *
+   * Unlike the other operations this one may be called from any
+   * thread, concurrently with other uses of the context.  It does not
+   * record errors in the context, use `err_str` to get the compiler
+   * output.  The context must stay alive until it returns.
+   *
+   * \param ctx context
+   * \param count number of source code strings
+   * \param strings C array of source code strings
+   * \param lengths C array of lengths or NULL
+   * \param fname name of the kernel function
+   * \param argcount number of kernel arguments
+   * \param types argument types
+   * \param flags kernel use flags (see \ref ga_usefl), GA_USE_BINARY is
+   *              not allowed
+   * \param bin returned binary, to free()
+   * \param bin_sz returned size of `bin`
+   * \param err_str (if not NULL) location to write the build log on
+   *                failure, to free()
+   *
+   * \returns GA_NO_ERROR or an error code if an error occurred.
+   */
+  int (*kernel_compile)(void *ctx, unsigned int count, const char **strings,
+                        const size_t *lengths, const char *fname,
+                        unsigned int argcount, const int *types, int flags,
+                        void **bin, size_t *bin_sz, char **err_str);
+
+  /**
+   * Build several kernels from the same source.
+   *
+   * The source is compiled once and each kernel is looked up in the
+   * result by name.  The kernels share the compiled program, which
+   * stays loaded as long as one of them is alive.
+   *
+   * Each kernel is the one kernel_alloc() would return for the same
+   * source, flags, name and arguments, so they are shared with it.
+   *
+   * \param ctx context
+   * \param count number of source code strings
+   * \param strings C array of source code strings
+   * \param lengths C array of lengths or NULL
+   * \param n number of kernels
+   * \param fnames names of the kernel functions
+   * \param argcounts number of arguments of each kernel
+   * \param types argument types of each kernel
+   * \param flags kernel use flags (see \ref ga_usefl)
+   * \param res returned kernels, `n` of them
+   * \param err_str (if not NULL) location to write the build log on
+   *                failure, to free()
+   *
+   * \returns GA_NO_ERROR or an error code if an error occurred, in
+   *          which case no kernel is returned.
+   */
+  int (*kernel_alloc_module)(void *ctx, unsigned int count,
+                             const char **strings, const size_t *lengths,
+                             unsigned int n, const char **fnames,
+                             const unsigned int *argcounts, const int **types,
+                             int flags, gpukernel **res, char **err_str);
+
+  /**
+   * Load a kernel from the binary of its source.
+   *
+   * The kernel is made from `bin` as kernel_alloc() would with
+   * GA_USE_BINARY, but it is registered under its source, flags, name
+   * and arguments so that a kernel_alloc() with those returns it
+   * instead of compiling.  If there already is such a kernel, it is
+   * returned and `bin` is not used.
+   *
+   * `bin` must come from kernel_compile() or kernel_binary() for the
+   * same parameters on a context with the same GA_CTX_PROP_BIN_ID.
+   *
+   * \param ctx context
+   * \param count number of source code strings
+   * \param strings C array of source code strings
+   * \param lengths C array of lengths or NULL
+   * \param fname name of the kernel function
+   * \param argcount number of kernel arguments
+   * \param types argument types
+   * \param flags kernel use flags the binary was compiled with
+   * \param bin the binary
+   * \param bin_sz size of `bin`
+   * \param ret error return pointer
+   * \param err_str (if not NULL) location to write GPU-backend provided
+   *                debug info, to free()
+   *
+   * \returns a new reference to the kernel or NULL if an error occured.
+   */
+  gpukernel *(*kernel_load)(void *ctx, unsigned int count,
+                            const char **strings, const size_t *lengths,
+                            const char *fname, unsigned int argcount,
+                            const int *types, int flags, const void *bin,
+                            size_t bin_sz, int *ret, char **err_str);
+
+  /**
+   * Set part of a buffer to a byte pattern.
+   *
+   * Like buffer_memset() but only the `sz` bytes starting at `dstoff`
+   * are written.  This does not compile anything after the first call
+   * for a given context.
+   *
+   * \param dst destination buffer
+   * \param dstoff offset into the destination buffer
+   * \param sz number of bytes to set
+   * \param data byte value to write into the destination.
+   *
+   * \returns GA_NO_ERROR or an error code if an error occurred.
+   */
+  int (*buffer_memset_range)(gpudata *dst, size_t dstoff, size_t sz,
+                             int data);
+
+  /**
+   * Fill part of a buffer with copies of a value.
+   *
+   * The `sz` bytes starting at `dstoff` are set to repetitions of the
+   * `psz` bytes at `pattern`.  `sz` must be a multiple of `psz`.
+   *
+   * This only uses the fill operations of the driver, so it may not
+   * support every pattern size or alignment.  GpuArray_fill() falls
+   * back to a kernel in that case.
+   *
+   * \param dst destination buffer
+   * \param dstoff offset into the destination buffer
+   * \param sz number of bytes to set
+   * \param pattern value to repeat
+   * \param psz size of `pattern`
+   *
+   * \returns GA_NO_ERROR, GA_UNSUPPORTED_ERROR if the backend can't do
+   *          it for this pattern or another error code if an error
+   *          occurred.
+   */
+  int (*buffer_fill)(gpudata *dst, size_t dstoff, size_t sz,
+                     const void *pattern, size_t psz);
+
+  /**
+   * Create a new stream in a context.
+   *
+   * A stream (command queue for OpenCL) is a sequence of operations
+   * that executes in order.  Operations issued to different streams
+   * may run concurrently.  Every context has a default stream which is
+   * the one in use until stream_use() selects another.
+   *
+   * The new stream starts after the work already issued to the stream
+   * in use.  Dependencies between streams through buffers (a kernel
+   * reading what a copy on another stream wrote) are tracked by the
+   * backend.
+   *
+   * \param ctx a context
+   * \param ret error return location
+   *
+   * \returns the new stream or NULL if an error occurred.
+   */
+  gpustream *(*stream_new)(void *ctx, int *ret);
+
+  /**
+   * Release a stream.
+   *
+   * The work already issued to the stream is completed before anything
+   * issued to the default stream afterwards.  If the stream was in use
+   * the context goes back to its default stream.
+   *
+   * \param s stream to release
+   */
+  void (*stream_free)(gpustream *s);
+
+  /**
+   * Select the stream to which operations are issued.
+   *
+   * This applies to every operation on the context (kernel calls,
+   * copies, memsets, blas calls, ...) until the next call.
+   *
+   * \param ctx a context
+   * \param s stream to use, NULL for the default stream
+   *
+   * \returns GA_NO_ERROR or an error code if an error occurred.
+   */
+  int (*stream_use)(void *ctx, gpustream *s);
+
+  /**
+   * Wait for all the work issued to a stream to complete.
+   *
+   * \param ctx a context
+   * \param s stream to wait for, NULL for the default stream
+   *
+   * \returns GA_NO_ERROR or an error code if an error occurred.
+   */
+  int (*stream_sync)(void *ctx, gpustream *s);
+
+  /**
+   * Make a stream wait for the work issued to another one.
+   *
+   * Operations issued to `s` after this call will start once all the
+   * work issued to `other` before it is complete.  This does not block
+   * the host.
+   *
+   * \param ctx a context
+   * \param s stream that waits, NULL for the default stream
+   * \param other stream to wait for, NULL for the default stream
+   *
+   * \returns GA_NO_ERROR or an error code if an error occurred.
+   */
+  int (*stream_wait)(void *ctx, gpustream *s, gpustream *other);
+
+  /**
+   * Start a copy from a buffer to host memory.
+   *
+   * This is buffer_read() without waiting for the copy to finish.
+   * The copy is ordered like other operations on the stream in use and
+   * `ev` is set to an event that completes with it.  `dst` must stay
+   * valid and not be read until then.
+   *
+   * The copy only overlaps with the host when `dst` is page-locked
+   * memory, like the host mapping of a GA_BUFFER_HOST buffer.  The
+   * driver may finish it before returning otherwise.
+   *
+   * \param dst destination host memory
+   * \param src source buffer
+   * \param srcoff offset to read from
+   * \param sz size of data to read (in bytes)
+   * \param ev return location for the completion event, to release
+   *           with event_free()
+   *
+   * \returns GA_NO_ERROR or an error code if an error occurred.
+   */
+  int (*buffer_read_async)(void *dst, gpudata *src, size_t srcoff, size_t sz,
+                           gpuevent **ev);
+
+  /**
+   * Start a copy from host memory to a buffer.
+   *
+   * This is buffer_write() without waiting for the copy to finish.
+   * `src` must stay valid and not be modified until `ev` completes.
+   *
+   * \param dst destination buffer
+   * \param dstoff offset to write to
+   * \param src source host memory
+   * \param sz size of data to write (in bytes)
+   * \param ev return location for the completion event, to release
+   *           with event_free()
+   *
+   * \returns GA_NO_ERROR or an error code if an error occurred.
+   */
+  int (*buffer_write_async)(gpudata *dst, size_t dstoff, const void *src,
+                            size_t sz, gpuevent **ev);
+
+  /**
+   * Check if an event is complete.
+   *
+   * \param ev an event
+   *
+   * \returns 1 if it is complete (or failed), 0 otherwise
+   */
+  int (*event_query)(gpuevent *ev);
+
+  /**
+   * Wait for an event to complete.
+   *
+   * \param ev an event
+   *
+   * \returns GA_NO_ERROR or an error code if an error occurred.
+   */
+  int (*event_sync)(gpuevent *ev);
+
+  /**
+   * Release an event.
+   *
+   * This does not wait for it.
+   *
+   * \param ev the event to release
+   */
+  void (*event_free)(gpuevent *ev);
+
+  /**
+   * Create an event.
+   *
+   * The event is complete until it is recorded with event_record().
+   *
+   * \param ctx a context
+   * \param flags event flags (see \ref event_flags)
+   * \param ret error return location
+   *
+   * \returns the new event or NULL if an error occurred.
+   */
+  gpuevent *(*event_new)(void *ctx, int flags, int *ret);
+
+  /**
+   * Record an event on a stream.
+   *
+   * The event completes when the work issued to the stream so far is
+   * complete.  Recording it again moves it to the current point.
+   *
+   * \param ev an event
+   * \param s stream in the context of the event, NULL for the default
+   *          stream
+   *
+   * \returns GA_NO_ERROR or an error code if an error occurred.
+   */
+  int (*event_record)(gpuevent *ev, gpustream *s);
+
+  /**
+   * Make a stream wait for an event.
+   *
+   * The work issued to `s` afterwards starts once `ev` is complete.
+   * This does not block the host.
+   *
+   * \param ev an event
+   * \param s stream in the context of the event, NULL for the default
+   *          stream
+   *
+   * \returns GA_NO_ERROR or an error code if an error occurred.
+   */
+  int (*event_wait)(gpuevent *ev, gpustream *s);
+
+  /**
+   * Time between two events.
+   *
+   * Both events must have been created with GA_EVENT_TIMING in the
+   * same context and recorded.  This waits for them to complete.
+   *
+   * \param start first event
+   * \param end second event
+   * \param ms return location for the time in milliseconds
+   *
+   * \returns GA_NO_ERROR or an error code if an error occurred.
+   */
+  int (*event_elapsed)(gpuevent *start, gpuevent *end, double *ms);
 } gpuarray_buffer_ops;
 
 /**
@@ -545,6 +982,117 @@ typedef struct _gpuarray_buffer_ops {
  */
 #define GA_CTX_PROP_ERRBUF    8
 
+/**
+ * Number of times a thread of the context took work from another.
+ *
+ * Only available for backends that run kernels on a pool of CPU
+ * threads.
+ *
+ * Type: `size_t`
+ */
+#define GA_CTX_PROP_POOL_STEALS 9
+
+/**
+ * Total time in seconds spent by the threads of the context waiting
+ * for the others to finish a kernel call.
+ *
+ * Only available for backends that run kernels on a pool of CPU
+ * threads.
+ *
+ * Type: `double`
+ */
+#define GA_CTX_PROP_POOL_IDLE 10
+
+/**
+ * Average number of work-groups (or elements for copies) handled by
+ * a thread in one go.
+ *
+ * Only available for backends that run kernels on a pool of CPU
+ * threads.
+ *
+ * Type: `size_t`
+ */
+#define GA_CTX_PROP_POOL_CHUNKSIZE 11
+
+/**
+ * Number of bytes held by the allocation cache of the context.
+ *
+ * Type: `size_t`
+ */
+#define GA_CTX_PROP_CACHED_BYTES 12
+
+/**
+ * Number of bytes allocated for the buffers currently in use in the
+ * context.
+ *
+ * This counts the rounded up size of the allocations, not the size
+ * requested.  Buffers that were not allocated by the context (like
+ * the ones wrapped from external memory) are not counted.
+ *
+ * Type: `size_t`
+ */
+#define GA_CTX_PROP_INUSE_BYTES 13
+
+/**
+ * Highest value of GA_CTX_PROP_INUSE_BYTES since the creation of the
+ * context or the last call to buffer_reset_peak().
+ *
+ * Type: `size_t`
+ */
+#define GA_CTX_PROP_PEAK_BYTES 14
+
+/**
+ * Number of buffers currently in use in the context.
+ *
+ * Like for GA_CTX_PROP_INUSE_BYTES, buffers that were not allocated
+ * by the context are not counted.
+ *
+ * Type: `size_t`
+ */
+#define GA_CTX_PROP_NUM_BUFFERS 15
+
+/**
+ * Number of memory allocations the context requested from the driver
+ * (or the system for host contexts) since its creation.
+ *
+ * Allocations served from the allocation cache or carved out of an
+ * existing block are not counted.
+ *
+ * Type: `size_t`
+ */
+#define GA_CTX_PROP_NUM_ALLOCS 16
+
+/**
+ * Number of times kernel_alloc returned an existing kernel of the
+ * context instead of building a new one.
+ *
+ * Type: `size_t`
+ */
+#define GA_CTX_PROP_KERNEL_CACHE_HITS 17
+
+/**
+ * Number of times kernel_alloc had to build a new kernel.
+ *
+ * Type: `size_t`
+ */
+#define GA_CTX_PROP_KERNEL_CACHE_MISSES 18
+
+/**
+ * Number of kernels kept in the cache of the context for
+ * buffer_extcopy(): one for each combination of types and number of
+ * dimensions that was copied, plus one for each layout that was
+ * copied often enough to get its own kernel.
+ *
+ * The cache keeps the 64 most recently used layouts by default.  Set
+ * the GPUARRAY_EXTCOPY_CACHE_SIZE environment variable before
+ * creating the context to change that.
+ *
+ * This is always 0 for backends that don't compile these kernels.
+ *
+ * Type: `size_t`
+ */
+#define GA_CTX_PROP_EXTCOPY_CACHE_SIZE 19
+
 /* Start at 512 for GA_BUFFER_PROP_ */
 /**
  * Get the context in which this buffer was allocated.
@@ -570,6 +1118,17 @@ typedef struct _gpuarray_buffer_ops {
  */
 #define GA_BUFFER_PROP_SIZE  514
 
+/**
+ * Host pointer to the contents of a buffer allocated with
+ * GA_BUFFER_HOST.
+ *
+ * Wait for the work on the buffer to be done (by reading from it for
+ * example) before accessing the memory from the host.
+ *
+ * Type: `void *`
+ */
+#define GA_BUFFER_PROP_HOSTPOINTER 515
+
 /* Start at 1024 for GA_KERNEL_PROP_ */
 /**
  * Get the context for which this kernel was compiled.
@@ -651,6 +1210,22 @@ typedef enum _ga_usefl {
    * The source code passed is actually a kernel binary.
    */
   GA_USE_BINARY =     0x20,
+  /**
+   * Allow optimizations of floating-point math that break IEEE
+   * compliance (-cl-fast-relaxed-math, --use_fast_math, -ffast-math).
+   */
+  GA_USE_FAST_MATH =  0x40,
+  /**
+   * Allow a * b + c to be computed with reduced accuracy
+   * (-cl-mad-enable).  Only OpenCL kernels are affected: CUDA fuses
+   * them by default and the host backend leaves it to its compiler.
+   */
+  GA_USE_MAD =        0x80,
+  /**
+   * Optimization level, set with GA_OPT_LEVEL().  The backend default
+   * is used if none is set.
+   */
+  GA_OPT_LEVEL_MASK = 0x700,
   /* If you add a new flag, don't forget to update both
      gpuarray_buffer_{cuda,opencl}.c with the implementation of your flag */
   /**
@@ -667,6 +1242,19 @@ typedef enum _ga_usefl {
   GA_USE_OPENCL =   0x4000,
 } ga_usefl;
 
+/**
+ * Flag for optimization level `n`, from 0 (none) to 3.
+ *
+ * OpenCL only distinguishes level 0 (-cl-opt-disable) from the others.
+ * On CUDA it is the ptxas (or JIT) optimization level.
+ */
+#define GA_OPT_LEVEL(n) ((((n) & 3) + 1) << 8)
+
+/**
+ * Optimization level requested in `flags` or -1 for the default.
+ */
+#define GA_GET_OPT_LEVEL(flags) ((int)(((flags) & GA_OPT_LEVEL_MASK) >> 8) - 1)
+
 /**
  * Get the error string corresponding to `err`.
  *
@@ -685,7 +1273,8 @@ GPUARRAY_PUBLIC const char *Gpu_error(const gpuarray_buffer_ops *o, void *ctx,
  *
  * The available backends depend on how the library was built.
  *
- * \param name backend name, currently one of `"cuda"`  or `"opencl"`
+ * \param name backend name, currently one of `"cuda"`, `"opencl"`
+ *             or `"host"`
  *
  * \returns the operation vector or NULL if the backend name is unrecognized.
  */
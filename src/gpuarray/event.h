@@ -0,0 +1,130 @@
+#ifndef GPUARRAY_EVENT_H
+#define GPUARRAY_EVENT_H
+/** \file event.h
+ *  \brief Event functions.
+ */
+
+#include <gpuarray/buffer.h>
+#include <gpuarray/stream.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifdef CONFUSE_EMACS
+}
+#endif
+
+/**
+ * Event information structure.
+ *
+ * An event marks a point in the work issued to a context, like the end
+ * of an asynchronous copy.  It holds a reference to the context.
+ *
+ * Events can be recorded on a stream to know when it reaches that
+ * point, to make another stream wait for it or to time the work
+ * between two of them on the device.
+ */
+typedef struct _GpuEvent {
+  /**
+   * Device event reference.
+   */
+  gpuevent *ev;
+  /**
+   * Backend operations vector.
+   */
+  const gpuarray_buffer_ops *ops;
+} GpuEvent;
+
+/**
+ * Create an event.
+ *
+ * The event is complete until it is recorded.
+ *
+ * \param e an event structure
+ * \param ops operations vector
+ * \param ctx context of the event
+ * \param flags event flags (see \ref event_flags)
+ *
+ * \return GA_NO_ERROR if the operation is successful
+ * \return any other value if an error occured
+ */
+GPUARRAY_PUBLIC int GpuEvent_init(GpuEvent *e, const gpuarray_buffer_ops *ops,
+                                  void *ctx, int flags);
+
+/**
+ * Record an event on a stream.
+ *
+ * The event completes once the work issued to `s` so far is done.
+ *
+ * \param e an event
+ * \param s a stream in the context of `e` or NULL for the default
+ *          stream of that context
+ *
+ * \return GA_NO_ERROR if the operation is successful
+ * \return any other value if an error occured
+ */
+GPUARRAY_PUBLIC int GpuEvent_record(GpuEvent *e, const GpuStream *s);
+
+/**
+ * Make a stream wait for an event.
+ *
+ * This does not block the host.
+ *
+ * \param e an event
+ * \param s a stream in the context of `e` or NULL for the default
+ *          stream of that context
+ *
+ * \return GA_NO_ERROR if the operation is successful
+ * \return any other value if an error occured
+ */
+GPUARRAY_PUBLIC int GpuEvent_wait(const GpuEvent *e, const GpuStream *s);
+
+/**
+ * Measure the device time between two events.
+ *
+ * Both must be created with GA_EVENT_TIMING and recorded.  This waits
+ * for them to complete.
+ *
+ * \param start first event
+ * \param end second event
+ * \param ms time from `start` to `end` in milliseconds
+ *
+ * \return GA_NO_ERROR if the operation is successful
+ * \return any other value if an error occured
+ */
+GPUARRAY_PUBLIC int GpuEvent_elapsed(const GpuEvent *start,
+                                     const GpuEvent *end, double *ms);
+
+/**
+ * Check if an event is complete.
+ *
+ * \param e an event
+ *
+ * \return 1 if it is complete (or failed), 0 otherwise
+ */
+GPUARRAY_PUBLIC int GpuEvent_query(const GpuEvent *e);
+
+/**
+ * Wait for an event to complete.
+ *
+ * \param e an event
+ *
+ * \return GA_NO_ERROR if the operation is successful
+ * \return any other value if an error occured
+ */
+GPUARRAY_PUBLIC int GpuEvent_sync(const GpuEvent *e);
+
+/**
+ * Release an event.
+ *
+ * This does not wait for it.
+ *
+ * \param e the event to release
+ */
+GPUARRAY_PUBLIC void GpuEvent_clear(GpuEvent *e);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
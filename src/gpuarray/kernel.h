@@ -60,6 +60,88 @@ GPUARRAY_PUBLIC int GpuKernel_init(GpuKernel *k, const gpuarray_buffer_ops *ops,
                                   const char *name, unsigned int argcount,
                                   const int *types, int flags, char **err_str);
 
+/**
+ * Format preprocessor definitions.
+ *
+ * Returns the `#define` lines that GpuKernel_init_opts() places before
+ * the sources, for bindings that need to add them themselves.
+ *
+ * \param ndefs number of definitions
+ * \param defines C array of definitions of the form "NAME" or "NAME=VALUE"
+ *
+ * \returns a NUL-terminated string that must be free()d by the caller
+ * (empty if `ndefs` is 0) or NULL if out of memory.
+ */
+GPUARRAY_PUBLIC char *GpuKernel_defines(unsigned int ndefs,
+                                        const char **defines);
+
+/**
+ * Initialize a kernel with preprocessor definitions.
+ *
+ * This is GpuKernel_init() with a `#define` line for each element of
+ * `defines` placed before the sources.  The elements are of the form
+ * "NAME" or "NAME=VALUE".  Since the definitions become part of the
+ * source, kernels built with different ones are cached separately.
+ *
+ * Compiler options like GA_USE_FAST_MATH or GA_OPT_LEVEL() go in
+ * `flags`.
+ *
+ * \param ndefs number of definitions
+ * \param defines C array of definitions
+ *
+ * The other parameters are the same as for GpuKernel_init().
+ *
+ * \return GA_NO_ERROR if the operation is successful
+ * \return any other value if an error occured
+ */
+GPUARRAY_PUBLIC int GpuKernel_init_opts(GpuKernel *k,
+                                        const gpuarray_buffer_ops *ops,
+                                        void *ctx, unsigned int count,
+                                        const char **strs,
+                                        const size_t *lens,
+                                        const char *name,
+                                        unsigned int argcount,
+                                        const int *types, int flags,
+                                        unsigned int ndefs,
+                                        const char **defines,
+                                        char **err_str);
+
+/**
+ * Initialize several kernels from the same source.
+ *
+ * The source is compiled once and the kernels share the result.  This
+ * is cheaper than calling GpuKernel_init() for each of them when they
+ * are all defined in the same source.
+ *
+ * \param ks array of `n` kernel structures
+ * \param ops operations vector
+ * \param ctx context in which to build the kernels
+ * \param count number of source code strings
+ * \param strs C array of source code strings
+ * \param lens C array with the size of each string or NULL
+ * \param n number of kernels
+ * \param names name of the function for each kernel
+ * \param argcounts number of arguments of each kernel
+ * \param types argument types of each kernel
+ * \param flags kernel use flags (see \ref ga_usefl)
+ * \param err_str (if not NULL) location to write GPU-backend provided debug info
+ *
+ * If `*err_str` is returned not NULL then it must be free()d by the caller
+ *
+ * \return GA_NO_ERROR if the operation is successful
+ * \return any other value if an error occured, none of the kernels are
+ *         initialized in that case
+ */
+GPUARRAY_PUBLIC int GpuKernel_init_module(GpuKernel *ks,
+                                          const gpuarray_buffer_ops *ops,
+                                          void *ctx, unsigned int count,
+                                          const char **strs,
+                                          const size_t *lens, unsigned int n,
+                                          const char **names,
+                                          const unsigned int *argcounts,
+                                          const int **types, int flags,
+                                          char **err_str);
+
 /**
  * Clear and release data associated with a kernel.
  *
@@ -114,6 +196,207 @@ GPUARRAY_PUBLIC int GpuKernel_binary(const GpuKernel *k, size_t *sz,
 
 GPUARRAY_PUBLIC const char *GpuKernel_error(const GpuKernel *k, int err);
 
+/**
+ * Handle on a kernel being compiled in the background.
+ */
+typedef struct _GpuKernelFuture GpuKernelFuture;
+
+/**
+ * Start compiling a kernel in the background.
+ *
+ * This takes the same parameters as GpuKernel_init() and returns as
+ * soon as the sources are handed to a pool of compile threads.  The
+ * kernel is loaded in the context by GpuKernelFuture_wait().
+ *
+ * The size of the pool can be set with the GPUARRAY_COMPILE_THREADS
+ * environment variable and defaults to the number of cores.  On
+ * platforms without threads the compilation is done before returning.
+ *
+ * The context must stay alive until the future is freed.
+ *
+ * \param ops operations vector
+ * \param ctx context in which to build the kernel
+ * \param count number of source code strings
+ * \param strs C array of source code strings
+ * \param lens C array with the size of each string or NULL
+ * \param name name of the kernel function
+ * \param argcount number of kernel arguments
+ * \param types argument types
+ * \param flags kernel use flags (see \ref ga_usefl)
+ * \param ret error code if the compilation could not be started
+ *
+ * \return a future to release with GpuKernelFuture_free() or NULL if
+ *         an error occured
+ */
+GPUARRAY_PUBLIC GpuKernelFuture *GpuKernel_init_async(
+  const gpuarray_buffer_ops *ops, void *ctx, unsigned int count,
+  const char **strs, const size_t *lens, const char *name,
+  unsigned int argcount, const int *types, int flags, int *ret);
+
+/**
+ * Check if the compilation is finished.
+ *
+ * \param f a future
+ *
+ * \return 1 if it is finished (successfully or not), 0 otherwise
+ */
+GPUARRAY_PUBLIC int GpuKernelFuture_ready(GpuKernelFuture *f);
+
+/**
+ * Get the result of the compilation, waiting for it if needed.
+ *
+ * \param f a future
+ * \param err_str (if not NULL) location to write a copy of the
+ *                compiler output on failure, to free()
+ *
+ * \return GA_NO_ERROR if the kernel compiled
+ * \return any other value if an error occured
+ */
+GPUARRAY_PUBLIC int GpuKernelFuture_error(GpuKernelFuture *f, char **err_str);
+
+/**
+ * Wait for the compilation and initialize a kernel with the result.
+ *
+ * This may be called more than once to get more kernels from the same
+ * future.
+ *
+ * \param f a future
+ * \param k the kernel structure to initialize
+ * \param err_str (if not NULL) location to write GPU-backend provided
+ *                debug info, to free()
+ *
+ * \return GA_NO_ERROR if the operation is successful
+ * \return any other value if an error occured
+ */
+GPUARRAY_PUBLIC int GpuKernelFuture_wait(GpuKernelFuture *f, GpuKernel *k,
+                                         char **err_str);
+
+/**
+ * Release a future.
+ *
+ * If the compilation is not started yet it is cancelled, otherwise
+ * this waits for it to finish.
+ *
+ * \param f the future to release
+ */
+GPUARRAY_PUBLIC void GpuKernelFuture_free(GpuKernelFuture *f);
+
+/**
+ * List of kernels to build ahead of time.
+ *
+ * A manifest records the kernels a program uses so that a later run
+ * can build them all when it creates its context, instead of on first
+ * use.  Each entry has the parameters of GpuKernel_init() and, when
+ * available, the binary of the kernel for the GA_CTX_PROP_BIN_ID of
+ * the context it was recorded in.
+ */
+typedef struct _GpuKernelManifest GpuKernelManifest;
+
+/**
+ * Create an empty manifest.
+ *
+ * \return the new manifest or NULL if out of memory
+ */
+GPUARRAY_PUBLIC GpuKernelManifest *GpuKernelManifest_new(void);
+
+/**
+ * Read a manifest written by GpuKernelManifest_save().
+ *
+ * \param path file to read
+ * \param ret error code if the manifest could not be read
+ *
+ * \return the manifest or NULL if an error occured
+ */
+GPUARRAY_PUBLIC GpuKernelManifest *GpuKernelManifest_load(const char *path,
+                                                          int *ret);
+
+/**
+ * Write a manifest to a file.
+ *
+ * \param m a manifest
+ * \param path file to write, it is replaced if it exists
+ *
+ * \return GA_NO_ERROR if the operation is successful
+ * \return any other value if an error occured
+ */
+GPUARRAY_PUBLIC int GpuKernelManifest_save(const GpuKernelManifest *m,
+                                           const char *path);
+
+/**
+ * Release a manifest and the kernels it built.
+ *
+ * This stops the recording if `m` is being recorded into.
+ *
+ * \param m the manifest to release
+ */
+GPUARRAY_PUBLIC void GpuKernelManifest_free(GpuKernelManifest *m);
+
+/**
+ * Number of kernels in a manifest.
+ */
+GPUARRAY_PUBLIC size_t GpuKernelManifest_size(const GpuKernelManifest *m);
+
+/**
+ * Add a kernel to a manifest.
+ *
+ * The parameters up to `flags` are the same as for GpuKernel_init()
+ * except that GA_USE_BINARY is not allowed.  Adding a kernel that is
+ * already there only replaces its binary, if one is given.
+ *
+ * \param bin_id GA_CTX_PROP_BIN_ID of the contexts `bin` works on
+ * \param bin binary from GpuKernel_binary() or NULL
+ * \param bin_sz size of `bin`
+ *
+ * \return GA_NO_ERROR if the operation is successful
+ * \return any other value if an error occured
+ */
+GPUARRAY_PUBLIC int GpuKernelManifest_add(GpuKernelManifest *m,
+                                          unsigned int count,
+                                          const char **strs,
+                                          const size_t *lens,
+                                          const char *name,
+                                          unsigned int argcount,
+                                          const int *types, int flags,
+                                          const char *bin_id,
+                                          const void *bin, size_t bin_sz);
+
+/**
+ * Record the kernels initialized from now on in a manifest.
+ *
+ * Every kernel built from source by GpuKernel_init(),
+ * GpuKernel_init_module() or GpuKernelFuture_wait() in the process is
+ * added to `m` along with its binary.  Pass NULL to stop recording.
+ *
+ * `m` must not be used otherwise while it is being recorded into.
+ *
+ * \param m the manifest to record into or NULL
+ */
+GPUARRAY_PUBLIC void GpuKernelManifest_record(GpuKernelManifest *m);
+
+/**
+ * Build all the kernels of a manifest in a context.
+ *
+ * The kernels are loaded from their binary when it was made for the
+ * GA_CTX_PROP_BIN_ID of `ctx` and compiled otherwise.  They stay
+ * loaded until the manifest is freed, so GpuKernel_init() with their
+ * parameters finds them without compiling.
+ *
+ * \param m a manifest
+ * \param ops operations vector
+ * \param ctx context to build the kernels in
+ * \param nbin (if not NULL) returns the number of kernels loaded from
+ *             their binary
+ * \param err_str (if not NULL) location to write GPU-backend provided
+ *                debug info, to free()
+ *
+ * \return GA_NO_ERROR if the operation is successful
+ * \return any other value if an error occured
+ */
+GPUARRAY_PUBLIC int GpuKernelManifest_replay(GpuKernelManifest *m,
+                                             const gpuarray_buffer_ops *ops,
+                                             void *ctx, size_t *nbin,
+                                             char **err_str);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,118 @@
+#ifndef GPUARRAY_STREAM_H
+#define GPUARRAY_STREAM_H
+/** \file stream.h
+ *  \brief Stream functions.
+ */
+
+#include <gpuarray/buffer.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifdef CONFUSE_EMACS
+}
+#endif
+
+/**
+ * Stream information structure.
+ *
+ * Operations on a context go to the stream selected with
+ * GpuStream_use(), which is the default stream of the context until
+ * another one is selected.  Work on different streams may overlap.
+ * The ordering between uses of the same buffer is kept across streams.
+ */
+typedef struct _GpuStream {
+  /**
+   * Device stream reference, NULL for the default stream.
+   */
+  gpustream *s;
+  /**
+   * Backend operations vector.
+   */
+  const gpuarray_buffer_ops *ops;
+  /**
+   * Context of the stream.
+   */
+  void *ctx;
+} GpuStream;
+
+/**
+ * Create a new stream.
+ *
+ * The stream starts after the work already issued to the stream in
+ * use.  It holds a reference to the context.
+ *
+ * \param s a stream structure
+ * \param ops operations vector
+ * \param ctx context in which to create the stream
+ *
+ * \return GA_NO_ERROR if the operation is successful
+ * \return any other value if an error occured
+ */
+GPUARRAY_PUBLIC int GpuStream_init(GpuStream *s,
+                                   const gpuarray_buffer_ops *ops,
+                                   void *ctx);
+
+/**
+ * Refer to the default stream of a context.
+ *
+ * This can't fail and the structure does not need to be cleared.
+ *
+ * \param s a stream structure
+ * \param ops operations vector
+ * \param ctx a context
+ */
+GPUARRAY_PUBLIC void GpuStream_default(GpuStream *s,
+                                       const gpuarray_buffer_ops *ops,
+                                       void *ctx);
+
+/**
+ * Release a stream.
+ *
+ * The work issued to it is ordered before what is issued to the
+ * default stream afterwards.  If the stream was in use, the context
+ * goes back to its default stream.
+ *
+ * \param s the stream to release
+ */
+GPUARRAY_PUBLIC void GpuStream_clear(GpuStream *s);
+
+/**
+ * Issue the following operations on the context of `s` to it.
+ *
+ * \param s a stream
+ *
+ * \return GA_NO_ERROR if the operation is successful
+ * \return any other value if an error occured
+ */
+GPUARRAY_PUBLIC int GpuStream_use(const GpuStream *s);
+
+/**
+ * Wait for the work issued to a stream to complete.
+ *
+ * \param s a stream
+ *
+ * \return GA_NO_ERROR if the operation is successful
+ * \return any other value if an error occured
+ */
+GPUARRAY_PUBLIC int GpuStream_sync(const GpuStream *s);
+
+/**
+ * Make a stream wait for the work issued to another one so far.
+ *
+ * This does not block the host.
+ *
+ * \param s the stream that waits
+ * \param other the stream to wait for, in the same context
+ *
+ * \return GA_NO_ERROR if the operation is successful
+ * \return any other value if an error occured
+ */
+GPUARRAY_PUBLIC int GpuStream_wait(const GpuStream *s,
+                                   const GpuStream *other);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
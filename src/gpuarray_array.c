@@ -52,6 +52,57 @@ static void ga_boundaries(size_t *start, size_t *end, size_t offset,
   }
 }
 
+/*
+ * Get storage for `nd` dimensions and strides.  This uses `d` and `s`
+ * (which must have room for GA_INLINE_ND elements) if it can, to
+ * avoid the allocation.  Release with put_dims().
+ */
+static int get_dims(unsigned int nd, size_t **dims, ssize_t **strs,
+                    size_t *d, ssize_t *s) {
+  if (nd <= GA_INLINE_ND) {
+    *dims = d;
+    *strs = s;
+    return 0;
+  }
+  *dims = calloc(nd, sizeof(size_t));
+  *strs = calloc(nd, sizeof(ssize_t));
+  if (*dims == NULL || *strs == NULL) {
+    free(*dims);
+    free(*strs);
+    *dims = NULL;
+    *strs = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+static void put_dims(size_t *dims, ssize_t *strs, const size_t *d) {
+  if (dims != d) {
+    free(dims);
+    free(strs);
+  }
+}
+
+/*
+ * Replace the dimensions and strides of `a` with those obtained by
+ * get_dims() using `d` as local storage.  This takes ownership of
+ * them.
+ */
+static void set_dims(GpuArray *a, unsigned int nd, size_t *dims,
+                     ssize_t *strs, const size_t *d) {
+  put_dims(a->dimensions, a->strides, a->_dims);
+  if (dims == d) {
+    memcpy(a->_dims, dims, nd * sizeof(size_t));
+    memcpy(a->_strs, strs, nd * sizeof(ssize_t));
+    a->dimensions = a->_dims;
+    a->strides = a->_strs;
+  } else {
+    a->dimensions = dims;
+    a->strides = strs;
+  }
+  a->nd = nd;
+}
+
 /* Value below which a size_t multiplication will never overflow. */
 #define MUL_NO_OVERFLOW (1UL << (sizeof(size_t) * 4))
 
@@ -86,15 +137,13 @@ int GpuArray_empty(GpuArray *a, const gpuarray_buffer_ops *ops, void *ctx,
   a->nd = nd;
   a->offset = 0;
   a->typecode = typecode;
-  a->dimensions = calloc(nd, sizeof(size_t));
-  a->strides = calloc(nd, sizeof(ssize_t));
   /* F/C distinction comes later */
   a->flags = GA_BEHAVED;
-  if (a->dimensions == NULL || a->strides == NULL) {
+  if (get_dims(nd, &a->dimensions, &a->strides, a->_dims, a->_strs) != 0) {
     GpuArray_clear(a);
     return GA_MEMORY_ERROR;
   }
-  /* Mult will not overflow since calloc succeded */
+  /* Mult will not overflow since we have the storage */
   memcpy(a->dimensions, dims, sizeof(size_t)*nd);
 
   size = gpuarray_get_elsize(typecode);
@@ -151,10 +200,8 @@ int GpuArray_fromdata(GpuArray *a, const gpuarray_buffer_ops *ops,
   a->nd = nd;
   a->offset = offset;
   a->typecode = typecode;
-  a->dimensions = calloc(nd, sizeof(size_t));
-  a->strides = calloc(nd, sizeof(ssize_t));
   a->flags = (writeable ? GA_WRITEABLE : 0);
-  if (a->dimensions == NULL || a->strides == NULL) {
+  if (get_dims(nd, &a->dimensions, &a->strides, a->_dims, a->_strs) != 0) {
     GpuArray_clear(a);
     return GA_MEMORY_ERROR;
   }
@@ -210,9 +257,7 @@ int GpuArray_view(GpuArray *v, const GpuArray *a) {
   v->offset = a->offset;
   v->typecode = a->typecode;
   v->flags = a->flags;
-  v->dimensions = calloc(v->nd, sizeof(size_t));
-  v->strides = calloc(v->nd, sizeof(ssize_t));
-  if (v->dimensions == NULL || v->strides == NULL) {
+  if (get_dims(v->nd, &v->dimensions, &v->strides, v->_dims, v->_strs) != 0) {
     GpuArray_clear(v);
     return GA_MEMORY_ERROR;
   }
@@ -229,6 +274,8 @@ int GpuArray_index_inplace(GpuArray *a, const ssize_t *starts,
                            const ssize_t *stops, const ssize_t *steps) {
   unsigned int i, new_i;
   unsigned int new_nd = a->nd;
+  size_t d[GA_INLINE_ND];
+  ssize_t s[GA_INLINE_ND];
   size_t *newdims;
   ssize_t *newstrs;
   size_t new_offset = a->offset;
@@ -239,26 +286,19 @@ int GpuArray_index_inplace(GpuArray *a, const ssize_t *starts,
   for (i = 0; i < a->nd; i++) {
     if (steps[i] == 0) new_nd -= 1;
   }
-  newdims = calloc(new_nd, sizeof(size_t));
-  newstrs = calloc(new_nd, sizeof(ssize_t));
-  if (newdims == NULL || newstrs == NULL) {
-    free(newdims);
-    free(newstrs);
+  if (get_dims(new_nd, &newdims, &newstrs, d, s) != 0)
     return GA_MEMORY_ERROR;
-  }
 
   new_i = 0;
   for (i = 0; i < a->nd; i++) {
     if (starts[i] < -1 || (starts[i] > 0 &&
 			   (size_t)starts[i] > a->dimensions[i])) {
-      free(newdims);
-      free(newstrs);
+      put_dims(newdims, newstrs, d);
       return GA_VALUE_ERROR;
     }
     if (steps[i] == 0 &&
 	(starts[i] == -1 || starts[i] >= a->dimensions[i])) {
-      free(newdims);
-      free(newstrs);
+      put_dims(newdims, newstrs, d);
       return GA_VALUE_ERROR;
     }
     new_offset += starts[i] * a->strides[i];
@@ -266,8 +306,7 @@ int GpuArray_index_inplace(GpuArray *a, const ssize_t *starts,
       if ((stops[i] < -1 || (stops[i] > 0 &&
 			      (size_t)stops[i] > a->dimensions[i])) ||
 	  (stops[i]-starts[i])/steps[i] < 0) {
-        free(newdims);
-        free(newstrs);
+        put_dims(newdims, newstrs, d);
 	return GA_VALUE_ERROR;
       }
       newstrs[new_i] = steps[i] * a->strides[i];
@@ -276,12 +315,8 @@ int GpuArray_index_inplace(GpuArray *a, const ssize_t *starts,
       new_i++;
     }
   }
-  a->nd = new_nd;
+  set_dims(a, new_nd, newdims, newstrs, d);
   a->offset = new_offset;
-  free(a->dimensions);
-  a->dimensions = newdims;
-  free(a->strides);
-  a->strides = newstrs;
   if (GpuArray_is_c_contiguous(a))
     a->flags |= GA_C_CONTIGUOUS;
   else
@@ -392,15 +427,57 @@ bail:
   return res;
 }
 
+/*
+ * The source of the take1 kernel only depends on the types and the
+ * number of dimensions, so it is kept in the context under a key made
+ * of those.
+ */
+static int get_take1_kernel(GpuKernel *k, GpuArray *a, const GpuArray *v,
+                            const GpuArray *ind) {
+  char key[64];
+  size_t len;
+#if DEBUG
+  char *errstr = NULL;
+#endif
+  int err;
+
+  len = (size_t)snprintf(key, sizeof(key), "take1 %d %d %u", a->typecode,
+                         v->typecode, v->nd);
+  k->k = a->ops->kernel_lookup(GpuArray_context(a), key, len);
+  if (k->k != NULL) {
+    k->ops = a->ops;
+    k->args = NULL;
+    return GA_NO_ERROR;
+  }
+
+  err = gen_take1_kernel(k, a->ops, GpuArray_context(a),
+#if DEBUG
+                         &errstr,
+#else
+                         NULL,
+#endif
+                         a, v, ind);
+#if DEBUG
+  if (errstr != NULL) {
+    fprintf(stderr, "%s\n", errstr);
+    free(errstr);
+  }
+#endif
+  if (err != GA_NO_ERROR)
+    return err;
+
+  /* If this fails we'll just build it again next time */
+  (void)a->ops->kernel_keep(k->k, key, len);
+  return GA_NO_ERROR;
+}
+
 int GpuArray_take1(GpuArray *a, const GpuArray *v, const GpuArray *i,
                    int check_error) {
   size_t n[2], ls[2] = {0, 0}, gs[2] = {0, 0};
   size_t pl;
   gpudata *errbuf;
-#if DEBUG
-  char *errstr = NULL;
-#endif
-  void **args = NULL;
+  void *args_s[7 + 2 * GA_INLINE_ND];
+  void **args = args_s;
   size_t argp;
   GpuKernel k;
   unsigned int j;
@@ -438,19 +515,7 @@ int GpuArray_take1(GpuArray *a, const GpuArray *v, const GpuArray *i,
   if (err != GA_NO_ERROR)
     return err;
 
-  err = gen_take1_kernel(&k, a->ops, GpuArray_context(a),
-#if DEBUG
-                         &errstr,
-#else
-                         NULL,
-#endif
-                         a, v, i);
-#if DEBUG
-  if (errstr != NULL) {
-    fprintf(stderr, "%s\n", errstr);
-    free(errstr);
-  }
-#endif
+  err = get_take1_kernel(&k, a, v, i);
   if (err != GA_NO_ERROR)
     return err;
 
@@ -469,10 +534,12 @@ int GpuArray_take1(GpuArray *a, const GpuArray *v, const GpuArray *i,
   }
   gs[0] = 1;
 
-  args = calloc(7 + 2 * v->nd, sizeof(void *));
-  if (args == NULL) {
-    err = GA_MEMORY_ERROR;
-    goto out;
+  if (v->nd > GA_INLINE_ND) {
+    args = calloc(7 + 2 * v->nd, sizeof(void *));
+    if (args == NULL) {
+      err = GA_MEMORY_ERROR;
+      goto out;
+    }
   }
 
   argp = 0;
@@ -489,7 +556,8 @@ int GpuArray_take1(GpuArray *a, const GpuArray *v, const GpuArray *i,
   args[argp++] = errbuf;
 
   err = GpuKernel_call(&k, 2, ls, gs, 0, args);
-  free(args);
+  if (args != args_s)
+    free(args);
   if (err == GA_NO_ERROR && check_error) {
     err = v->ops->buffer_read(&kerr, errbuf, 0, sizeof(int));
     if (err == GA_NO_ERROR && kerr != 0) {
@@ -577,6 +645,8 @@ int GpuArray_reshape(GpuArray *res, const GpuArray *a, unsigned int nd,
 
 int GpuArray_reshape_inplace(GpuArray *a, unsigned int nd,
                              const size_t *newdims, ga_order ord) {
+  size_t d[GA_INLINE_ND];
+  ssize_t s[GA_INLINE_ND];
   ssize_t *newstrides;
   size_t *tmpdims;
   size_t np;
@@ -616,8 +686,7 @@ int GpuArray_reshape_inplace(GpuArray *a, unsigned int nd,
     goto do_final_copy;
   }
 
-  newstrides = calloc(nd, sizeof(ssize_t));
-  if (newstrides == NULL)
+  if (get_dims(nd, &tmpdims, &newstrides, d, s) != 0)
     return GA_MEMORY_ERROR;
 
   while (ni < nd && oi < a->nd) {
@@ -668,32 +737,17 @@ int GpuArray_reshape_inplace(GpuArray *a, unsigned int nd,
     }
   }
 
-  /* We can reuse newstrides since it was allocated in this function.
-     Can't do the same with newdims (which is a parameter). */
-  tmpdims = calloc(nd, sizeof(size_t));
-  if (tmpdims == NULL) {
-    return GA_MEMORY_ERROR;
-  }
   memcpy(tmpdims, newdims, nd*sizeof(size_t));
-  a->nd = nd;
-  free(a->dimensions);
-  free(a->strides);
-  a->dimensions = tmpdims;
-  a->strides = newstrides;
+  set_dims(a, nd, tmpdims, newstrides, d);
 
   goto fix_flags;
  need_copy:
-  free(newstrides);
+  put_dims(tmpdims, newstrides, d);
   return GA_COPY_ERROR;
 
  do_final_copy:
-  tmpdims = calloc(nd, sizeof(size_t));
-  newstrides = calloc(nd, sizeof(ssize_t));
-  if (tmpdims == NULL || newstrides == NULL) {
-    free(tmpdims);
-    free(newstrides);
+  if (get_dims(nd, &tmpdims, &newstrides, d, s) != 0)
     return GA_MEMORY_ERROR;
-  }
   memcpy(tmpdims, newdims, nd*sizeof(size_t));
   if (nd > 0) {
     if (ord == GA_F_ORDER) {
@@ -708,11 +762,7 @@ int GpuArray_reshape_inplace(GpuArray *a, unsigned int nd,
       }
     }
   }
-  free(a->dimensions);
-  free(a->strides);
-  a->nd = nd;
-  a->dimensions = tmpdims;
-  a->strides = newstrides;
+  set_dims(a, nd, tmpdims, newstrides, d);
 
  fix_flags:
   if (GpuArray_is_c_contiguous(a))
@@ -742,19 +792,16 @@ int GpuArray_transpose(GpuArray *res, const GpuArray *a,
 }
 
 int GpuArray_transpose_inplace(GpuArray *a, const unsigned int *new_axes) {
+  size_t d[GA_INLINE_ND];
+  ssize_t s[GA_INLINE_ND];
   size_t *newdims;
   ssize_t *newstrs;
   unsigned int i;
   unsigned int j;
   unsigned int k;
 
-  newdims = calloc(a->nd, sizeof(size_t));
-  newstrs = calloc(a->nd, sizeof(ssize_t));
-  if (newdims == NULL || newstrs == NULL) {
-    free(newdims);
-    free(newstrs);
+  if (get_dims(a->nd, &newdims, &newstrs, d, s) != 0)
     return GA_MEMORY_ERROR;
-  }
 
   for (i = 0; i < a->nd; i++) {
     if (new_axes == NULL) {
@@ -764,8 +811,7 @@ int GpuArray_transpose_inplace(GpuArray *a, const unsigned int *new_axes) {
       // Repeated axes will lead to a broken output
       for (k = 0; k < i; k++)
         if (j == new_axes[k]) {
-          free(newdims);
-          free(newstrs);
+          put_dims(newdims, newstrs, d);
           return GA_VALUE_ERROR;
         }
     }
@@ -773,10 +819,7 @@ int GpuArray_transpose_inplace(GpuArray *a, const unsigned int *new_axes) {
     newstrs[i] = a->strides[j];
   }
 
-  free(a->dimensions);
-  free(a->strides);
-  a->dimensions = newdims;
-  a->strides = newstrs;
+  set_dims(a, a->nd, newdims, newstrs, d);
 
   a->flags &= ~(GA_C_CONTIGUOUS|GA_F_CONTIGUOUS);
   if (GpuArray_is_c_contiguous(a))
@@ -790,8 +833,7 @@ int GpuArray_transpose_inplace(GpuArray *a, const unsigned int *new_axes) {
 void GpuArray_clear(GpuArray *a) {
   if (a->data)
     a->ops->buffer_release(a->data);
-  free(a->dimensions);
-  free(a->strides);
+  put_dims(a->dimensions, a->strides, a->_dims);
   memset(a, 0, sizeof(*a));
 }
 
@@ -851,10 +893,235 @@ int GpuArray_read(void *dst, size_t dst_sz, const GpuArray *src) {
   return src->ops->buffer_read(dst, src->data, src->offset, dst_sz);
 }
 
+int GpuArray_write_async(GpuArray *dst, const void *src, size_t src_sz,
+                         GpuEvent *ev) {
+  ev->ops = dst->ops;
+  ev->ev = NULL;
+  if (!GpuArray_ISWRITEABLE(dst))
+    return GA_VALUE_ERROR;
+  if (!GpuArray_ISONESEGMENT(dst))
+    return GA_UNSUPPORTED_ERROR;
+  return dst->ops->buffer_write_async(dst->data, dst->offset, src, src_sz,
+                                      &ev->ev);
+}
+
+int GpuArray_read_async(void *dst, size_t dst_sz, const GpuArray *src,
+                        GpuEvent *ev) {
+  ev->ops = src->ops;
+  ev->ev = NULL;
+  if (!GpuArray_ISONESEGMENT(src))
+    return GA_UNSUPPORTED_ERROR;
+  return src->ops->buffer_read_async(dst, src->data, src->offset, dst_sz,
+                                     &ev->ev);
+}
+
 int GpuArray_memset(GpuArray *a, int data) {
+  size_t start, end;
+  unsigned int i;
+
   if (!GpuArray_ISONESEGMENT(a))
     return GA_UNSUPPORTED_ERROR;
-  return a->ops->buffer_memset(a->data, a->offset, data);
+  for (i = 0; i < a->nd; i++)
+    if (a->dimensions[i] == 0)
+      return GA_NO_ERROR;
+  /* Only touch the array, not the rest of the buffer */
+  ga_boundaries(&start, &end, a->offset, a->nd, a->dimensions, a->strides);
+  end += GpuArray_ITEMSIZE(a);
+  return a->ops->buffer_memset_range(a->data, start, end - start, data);
+}
+
+/*
+ * The fill kernel stores the value as `nw` words of `w` bytes, so the
+ * same kernel works for every type with that layout and `nd`.
+ */
+static int gen_fill_kernel(GpuKernel *k, const gpuarray_buffer_ops *ops,
+                           void *ctx, char **err_str, unsigned int w,
+                           unsigned int nw, unsigned int nd) {
+  strb sb = STRB_STATIC_INIT;
+  const char *wtype;
+  int *atypes;
+  size_t nargs, apos;
+  unsigned int i, i2;
+  int flags = GA_USE_CLUDA;
+  int wcode;
+  int res;
+
+  switch (w) {
+  case 1:
+    wtype = "ga_ubyte";
+    wcode = GA_UBYTE;
+    flags |= GA_USE_SMALL;
+    break;
+  case 2:
+    wtype = "ga_ushort";
+    wcode = GA_USHORT;
+    flags |= GA_USE_SMALL;
+    break;
+  default:
+    wtype = "ga_uint";
+    wcode = GA_UINT;
+    break;
+  }
+
+  nargs = 3 + nw + 2 * nd;
+  atypes = calloc(nargs, sizeof(int));
+  if (atypes == NULL)
+    return GA_MEMORY_ERROR;
+
+  apos = 0;
+  strb_appends(&sb, "KERNEL void fill(GLOBAL_MEM ga_byte *a, ga_size off, "
+               "ga_size n");
+  atypes[apos++] = GA_BUFFER;
+  atypes[apos++] = GA_SIZE;
+  atypes[apos++] = GA_SIZE;
+  for (i = 0; i < nw; i++) {
+    strb_appendf(&sb, ", %s v%u", wtype, i);
+    atypes[apos++] = wcode;
+  }
+  for (i = 0; i < nd; i++) {
+    strb_appendf(&sb, ", ga_size d%u, ga_ssize s%u", i, i);
+    atypes[apos++] = GA_SIZE;
+    atypes[apos++] = GA_SSIZE;
+  }
+  assert(apos == nargs);
+  strb_appends(&sb, ") {\n"
+               "  const ga_size idx = LDIM_0 * GID_0 + LID_0;\n"
+               "  const ga_size numThreads = LDIM_0 * GDIM_0;\n"
+               "  ga_size i;\n"
+               "  for (i = idx; i < n; i += numThreads) {\n"
+               "    GLOBAL_MEM ga_byte *p = a + off;\n");
+  if (nd > 0) {
+    strb_appends(&sb, "    ga_size ii = i;\n");
+    for (i2 = nd; i2 > 0; i2--) {
+      i = i2 - 1;
+      if (i > 0)
+        strb_appendf(&sb, "    p += (ii %% d%u) * s%u;\n"
+                     "    ii /= d%u;\n", i, i, i);
+      else
+        strb_appends(&sb, "    p += ii * s0;\n");
+    }
+  }
+  for (i = 0; i < nw; i++)
+    strb_appendf(&sb, "    ((GLOBAL_MEM %s *)p)[%u] = v%u;\n", wtype, i, i);
+  strb_appends(&sb, "  }\n"
+               "}\n");
+  if (strb_error(&sb)) {
+    res = GA_MEMORY_ERROR;
+    goto bail;
+  }
+  res = GpuKernel_init(k, ops, ctx, 1, (const char **)&sb.s, &sb.l, "fill",
+                       nargs, atypes, flags, err_str);
+bail:
+  free(atypes);
+  strb_clear(&sb);
+  return res;
+}
+
+static int get_fill_kernel(GpuKernel *k, GpuArray *a, unsigned int w,
+                           unsigned int nw) {
+  char key[64];
+  size_t len;
+#if DEBUG
+  char *errstr = NULL;
+#endif
+  int err;
+
+  len = (size_t)snprintf(key, sizeof(key), "fill %u %u %u", w, nw, a->nd);
+  k->k = a->ops->kernel_lookup(GpuArray_context(a), key, len);
+  if (k->k != NULL) {
+    k->ops = a->ops;
+    k->args = NULL;
+    return GA_NO_ERROR;
+  }
+
+  err = gen_fill_kernel(k, a->ops, GpuArray_context(a),
+#if DEBUG
+                        &errstr,
+#else
+                        NULL,
+#endif
+                        w, nw, a->nd);
+#if DEBUG
+  if (errstr != NULL) {
+    fprintf(stderr, "%s\n", errstr);
+    free(errstr);
+  }
+#endif
+  if (err != GA_NO_ERROR)
+    return err;
+
+  /* If this fails we'll just build it again next time */
+  (void)a->ops->kernel_keep(k->k, key, len);
+  return GA_NO_ERROR;
+}
+
+int GpuArray_fill(GpuArray *a, const void *value) {
+  size_t elsize = GpuArray_ITEMSIZE(a);
+  size_t n = 1, ls = 0, gs = 0;
+  void *args_s[3 + 16 + 2 * GA_INLINE_ND];
+  void **args = args_s;
+  uint32_t words[16];
+  size_t argp;
+  GpuKernel k;
+  unsigned int w, nw, j;
+  int err;
+
+  if (!GpuArray_ISWRITEABLE(a))
+    return GA_INVALID_ERROR;
+  if (!GpuArray_ISALIGNED(a))
+    return GA_UNALIGNED_ERROR;
+
+  for (j = 0; j < a->nd; j++)
+    n *= a->dimensions[j];
+  if (n == 0)
+    return GA_NO_ERROR;
+
+  /* Without gaps the driver may be able to do it */
+  if (GpuArray_IS_C_CONTIGUOUS(a) || GpuArray_IS_F_CONTIGUOUS(a)) {
+    err = a->ops->buffer_fill(a->data, a->offset, n * elsize, value, elsize);
+    if (err != GA_UNSUPPORTED_ERROR)
+      return err;
+  }
+
+  /* Use the widest stores the alignment of the type allows */
+  w = 4;
+  while (w > 1 && (elsize % w != 0 ||
+                   gpuarray_get_type(a->typecode)->align % w != 0))
+    w /= 2;
+  nw = (unsigned int)(elsize / w);
+  if (nw > 16)
+    return GA_UNSUPPORTED_ERROR;
+  memcpy(words, value, elsize);
+
+  if (a->nd > GA_INLINE_ND) {
+    args = calloc(3 + nw + 2 * a->nd, sizeof(void *));
+    if (args == NULL)
+      return GA_MEMORY_ERROR;
+  }
+
+  err = get_fill_kernel(&k, a, w, nw);
+  if (err != GA_NO_ERROR)
+    goto out;
+
+  argp = 0;
+  args[argp++] = a->data;
+  args[argp++] = &a->offset;
+  args[argp++] = &n;
+  for (j = 0; j < nw; j++)
+    args[argp++] = (char *)words + j * w;
+  for (j = 0; j < a->nd; j++) {
+    args[argp++] = &a->dimensions[j];
+    args[argp++] = &a->strides[j];
+  }
+
+  err = GpuKernel_sched(&k, n, &ls, &gs);
+  if (err == GA_NO_ERROR)
+    err = GpuKernel_call(&k, 1, &ls, &gs, 0, args);
+  GpuKernel_clear(&k);
+out:
+  if (args != args_s)
+    free(args);
+  return err;
 }
 
 int GpuArray_copy(GpuArray *res, const GpuArray *a, ga_order order) {
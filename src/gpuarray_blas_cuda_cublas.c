@@ -98,6 +98,8 @@ static int sgemm(cb_order order, cb_transpose transA, cb_transpose transB,
   }
 
   cuda_enter(ctx);
+  /* The stream in use may have changed since setup() */
+  cublasSetStream(ctx->blas_handle, ctx->s);
 
   cuda_wait(A, CUDA_WAIT_READ);
   cuda_wait(B, CUDA_WAIT_READ);
@@ -157,6 +159,7 @@ static int dgemm(cb_order order, cb_transpose transA, cb_transpose transB,
   }
 
   cuda_enter(ctx);
+  cublasSetStream(ctx->blas_handle, ctx->s);
 
   cuda_wait(A, CUDA_WAIT_READ);
   cuda_wait(B, CUDA_WAIT_READ);
@@ -220,6 +223,7 @@ static int hgemm(cb_order order, cb_transpose transA, cb_transpose transB,
   }
 
   cuda_enter(ctx);
+  cublasSetStream(ctx->blas_handle, ctx->s);
 
   cuda_wait(A, CUDA_WAIT_READ);
   cuda_wait(B, CUDA_WAIT_READ);
@@ -296,6 +300,7 @@ static int sgemmBatch(cb_order order, cb_transpose transA, cb_transpose transB,
   }
 
   cuda_enter(ctx);
+  cublasSetStream(ctx->blas_handle, ctx->s);
 
   for (i = 0; i < batchCount; i++) {
     ASSERT_BUF(A[i]);
@@ -386,6 +391,7 @@ static int dgemmBatch(cb_order order, cb_transpose transA, cb_transpose transB,
   }
 
   cuda_enter(ctx);
+  cublasSetStream(ctx->blas_handle, ctx->s);
 
   for (i = 0; i < batchCount; i++) {
     ASSERT_BUF(A[i]);
@@ -453,6 +459,7 @@ static int sgemv(cb_order order, cb_transpose transA, size_t M, size_t N,
   }
 
   cuda_enter(ctx);
+  cublasSetStream(ctx->blas_handle, ctx->s);
 
   cuda_wait(A, CUDA_WAIT_READ);
   cuda_wait(X, CUDA_WAIT_READ);
@@ -503,6 +510,7 @@ static int dgemv(cb_order order, cb_transpose transA, size_t M, size_t N,
   }
 
   cuda_enter(ctx);
+  cublasSetStream(ctx->blas_handle, ctx->s);
 
   cuda_wait(A, CUDA_WAIT_READ);
   cuda_wait(X, CUDA_WAIT_READ);
@@ -556,6 +564,7 @@ static int sger(cb_order order, size_t M, size_t N, float alpha, gpudata *X,
   }
 
   cuda_enter(ctx);
+  cublasSetStream(ctx->blas_handle, ctx->s);
 
   cuda_wait(X, CUDA_WAIT_READ);
   cuda_wait(Y, CUDA_WAIT_READ);
@@ -609,6 +618,7 @@ static int dger(cb_order order, size_t M, size_t N, double alpha, gpudata *X,
   }
 
   cuda_enter(ctx);
+  cublasSetStream(ctx->blas_handle, ctx->s);
 
   cuda_wait(X, CUDA_WAIT_READ);
   cuda_wait(Y, CUDA_WAIT_READ);
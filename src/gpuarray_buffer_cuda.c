@@ -23,10 +23,12 @@ static CUresult err;
 static gpudata *cuda_alloc(void *c, size_t size, void *data, int flags,
                            int *ret);
 static void cuda_free(gpudata *);
+static int cuda_trim(void *);
 static void cuda_freekernel(gpukernel *);
+static void release_stored(gpukernel *);
 static int cuda_property(void *, gpudata *, gpukernel *, int, void *);
 
-#define val_free(v) cuda_freekernel(*v);
+#define val_free(v) if ((v)->k != NULL) cuda_freekernel((v)->k);
 #include "cache_extcopy.h"
 
 static int detect_arch(const char *prefix, char *ret, CUresult *err);
@@ -34,6 +36,7 @@ static int detect_arch(const char *prefix, char *ret, CUresult *err);
 void *cuda_make_ctx(CUcontext ctx, int flags) {
   int64_t v = 0;
   cuda_context *res;
+  size_t lim = extcopy_cache_limit();
   int e = 0;
 
   res = malloc(sizeof(*res));
@@ -45,17 +48,53 @@ void *cuda_make_ctx(CUcontext ctx, int flags) {
   res->refcnt = 1;
   res->flags = flags;
   res->enter = 0;
+  res->nstreams = 0;
+  memset(res->freebufs, 0, sizeof(res->freebufs));
+  res->cached = 0;
+  res->inuse = 0;
+  res->peak = 0;
+  res->nbufs = 0;
+  res->nallocs = 0;
+  memset(res->arena, 0, sizeof(res->arena));
+  memset(res->arena_off, 0, sizeof(res->arena_off));
+  res->pending = NULL;
+  memset(res->staging, 0, sizeof(res->staging));
   if (detect_arch(ARCH_PREFIX, res->bin_id, &err)) {
     free(res);
     return NULL;
   }
-  res->extcopy_cache = cache_alloc(64, 32);
+  res->extcopy_cache = cache_alloc(lim, lim / 2);
   if (res->extcopy_cache == NULL) {
     free(res);
     return NULL;
   }
-  err = cuStreamCreate(&res->s, 0);
+  res->extcopy_generic = cache_alloc(16, 16);
+  if (res->extcopy_generic == NULL) {
+    cache_free(res->extcopy_cache);
+    free(res);
+    return NULL;
+  }
+  res->kernels = kernel_table_new();
+  if (res->kernels == NULL) {
+    cache_free(res->extcopy_generic);
+    cache_free(res->extcopy_cache);
+    free(res);
+    return NULL;
+  }
+  res->kept = kernel_store_new(release_stored);
+  if (res->kept == NULL) {
+    kernel_table_free(res->kernels);
+    cache_free(res->extcopy_generic);
+    cache_free(res->extcopy_cache);
+    free(res);
+    return NULL;
+  }
+  err = cuStreamCreate(&res->s0, 0);
+  res->s = res->s0;
   if (err != CUDA_SUCCESS) {
+    kernel_store_free(res->kept);
+    kernel_table_free(res->kernels);
+    cache_free(res->extcopy_generic);
     cache_free(res->extcopy_cache);
     free(res);
     return NULL;
@@ -64,8 +103,11 @@ void *cuda_make_ctx(CUcontext ctx, int flags) {
   res->errbuf = cuda_alloc(res, 8, &v, GA_BUFFER_INIT, &e);
   if (e != GA_NO_ERROR) {
     err = res->err;
+    kernel_store_free(res->kept);
+    kernel_table_free(res->kernels);
+    cache_free(res->extcopy_generic);
     cache_free(res->extcopy_cache);
-    cuStreamDestroy(res->s);
+    cuStreamDestroy(res->s0);
     free(res);
     return NULL;
   }
@@ -87,10 +129,16 @@ static void cuda_free_ctx(cuda_context *ctx) {
     }
     ctx->refcnt = 2; /* Prevent recursive calls */
     cuda_free(ctx->errbuf);
-    cuStreamDestroy(ctx->s);
+    /* This needs refcnt != 0, see release_stored() */
+    kernel_store_free(ctx->kept);
+    cuda_trim(ctx);
+    /* The streams hold a reference so this is the only one left */
+    cuStreamDestroy(ctx->s0);
     if (!(ctx->flags & DONTFREE))
       cuCtxDestroy(ctx->ctx);
     cache_free(ctx->extcopy_cache);
+    cache_free(ctx->extcopy_generic);
+    kernel_table_free(ctx->kernels);
     CLEAR(ctx);
     free(ctx);
   }
@@ -143,6 +191,10 @@ gpudata *cuda_make_buf(void *c, CUdeviceptr p, size_t sz) {
     }
     res->sz = sz;
     res->flags = DONTFREE;
+    res->host = NULL;
+    res->base = NULL;
+    res->off = 0;
+    res->next = NULL;
     res->ctx = ctx;
     ctx->refcnt++;
 
@@ -259,7 +311,8 @@ static void *cuda_init(int ord, int flags, int *ret) {
     CUcontext ctx;
     cuda_context *res;
     static int init_done = 0;
-    unsigned int fl = CU_CTX_SCHED_AUTO;
+    /* Needed for GA_BUFFER_HOST */
+    unsigned int fl = CU_CTX_MAP_HOST;
 
     if (ord == -1) {
       /* Grab the ambient context */
@@ -281,9 +334,9 @@ static void *cuda_init(int ord, int flags, int *ret) {
     err = cuDeviceGet(&dev, ord);
     CHKFAIL(NULL);
     if (flags & GA_CTX_SINGLE_THREAD)
-      fl = CU_CTX_SCHED_SPIN;
+      fl |= CU_CTX_SCHED_SPIN;
     if (flags & GA_CTX_MULTI_THREAD)
-      fl = CU_CTX_SCHED_YIELD;
+      fl |= CU_CTX_SCHED_YIELD;
     err = cuCtxCreate(&ctx, fl, dev);
     CHKFAIL(NULL);
     res = cuda_make_ctx(ctx, 0);
@@ -301,60 +354,263 @@ static void cuda_deinit(void *c) {
   cuda_free_ctx((cuda_context *)c);
 }
 
+/*
+ * Size of the allocation backing a buffer of `sz` bytes and its class
+ * in the allocation cache (-1 if it doesn't go in the cache).
+ */
+static int buf_class(cuda_context *ctx, int flags, size_t sz, size_t *csz) {
+  if (!(ctx->flags & GA_CTX_DISABLE_ALLOCATION_CACHE) &&
+      !(flags & GA_BUFFER_HOST))
+    return alloc_class(sz, csz);
+  *csz = sz;
+  return -1;
+}
+
+static int make_event(cuda_context *ctx, CUevent *ev) {
+  int fl = CU_EVENT_DISABLE_TIMING;
+
+  if (ctx->flags & GA_CTX_MULTI_THREAD)
+    fl |= CU_EVENT_BLOCKING_SYNC;
+  ctx->err = cuEventCreate(ev, fl);
+  return ctx->err == CUDA_SUCCESS ? 0 : -1;
+}
+
+/*
+ * GA_BUFFER_HOST buffers live in page-locked host memory mapped in
+ * the device address space.
+ */
+static CUresult mem_alloc(gpudata *b, size_t sz, int host) {
+  CUresult err;
+
+  if (!host)
+    return cuMemAlloc(&b->ptr, sz);
+  err = cuMemHostAlloc(&b->host, sz, CU_MEMHOSTALLOC_DEVICEMAP);
+  if (err != CUDA_SUCCESS)
+    return err;
+  err = cuMemHostGetDevicePointer(&b->ptr, b->host, 0);
+  if (err != CUDA_SUCCESS)
+    cuMemFreeHost(b->host);
+  return err;
+}
+
+static void mem_free(gpudata *b) {
+  if (b->host != NULL)
+    cuMemFreeHost(b->host);
+  else
+    cuMemFree(b->ptr);
+}
+
+/*
+ * Allocate memory and an event for a buffer, giving back the cache if
+ * we are short.  Must be called inside the context.
+ */
+static int get_mem(cuda_context *ctx, gpudata *b, size_t sz, int host) {
+  if (make_event(ctx, &b->ev) != 0)
+    return -1;
+
+  b->host = NULL;
+  if (sz == 0) sz = 1;
+  ctx->err = mem_alloc(b, sz, host);
+  if (ctx->err == CUDA_ERROR_OUT_OF_MEMORY) {
+    /* This waits for the pending frees */
+    cuda_trim(ctx);
+    ctx->err = mem_alloc(b, sz, host);
+  }
+  if (ctx->err != CUDA_SUCCESS) {
+    cuEventDestroy(b->ev);
+    return -1;
+  }
+  ctx->nallocs++;
+  return 0;
+}
+
+/*
+ * Free the memory of `b` (and `b` itself) once the GPU is done with it.
+ *
+ * From testing, I have discovered that cuMemFree() will just block
+ * until nothing uses the region on the GPU.  To avoid stalling the
+ * host, buffers that still have work pending go on ctx->pending and
+ * are freed by reclaim() once their event has fired.  Must be called
+ * inside the context.
+ */
+static void put_mem(gpudata *b) {
+  cuda_context *ctx = b->ctx;
+
+  if (cuEventQuery(b->ev) == CUDA_ERROR_NOT_READY) {
+    b->next = ctx->pending;
+    ctx->pending = b;
+    return;
+  }
+  mem_free(b);
+  cuEventDestroy(b->ev);
+  free(b);
+}
+
+/*
+ * Free the pending buffers that the GPU is done with.  If `wait` is
+ * set, wait for all of them.  Must be called inside the context.
+ */
+static void reclaim(cuda_context *ctx, int wait) {
+  gpudata **p = &ctx->pending;
+  gpudata *b;
+
+  while (*p != NULL) {
+    b = *p;
+    if (wait)
+      cuEventSynchronize(b->ev);
+    else if (cuEventQuery(b->ev) == CUDA_ERROR_NOT_READY) {
+      p = &b->next;
+      continue;
+    }
+    *p = b->next;
+    mem_free(b);
+    cuEventDestroy(b->ev);
+    free(b);
+  }
+}
+
+/*
+ * Arena blocks are only referenced by the buffers carved out of them
+ * and by ctx->arena.  They don't hold a reference on the context.
+ */
+static void block_release(gpudata *blk) {
+  blk->refcnt--;
+  if (blk->refcnt == 0)
+    put_mem(blk);
+}
+
+/*
+ * Point `b` to the next free `csz` bytes of the block for `cls`.
+ *
+ * The buffers of a block share its event.  Every operation on one of
+ * them waits on the event before it is issued and records it again
+ * after (see track_wait()), so the event always follows the latest
+ * operation on the block, which itself came after all the earlier
+ * ones.  With a single stream the stream keeps that order by itself.
+ */
+static int arena_carve(cuda_context *ctx, int cls, size_t csz, gpudata *b) {
+  gpudata *blk = ctx->arena[cls];
+
+  if (blk == NULL || ARENA_BLOCKSIZE - ctx->arena_off[cls] < csz) {
+    blk = malloc(sizeof(*blk));
+    if (blk == NULL)
+      return -1;
+    if (get_mem(ctx, blk, ARENA_BLOCKSIZE, 0) != 0) {
+      free(blk);
+      return -1;
+    }
+    blk->sz = ARENA_BLOCKSIZE;
+    blk->ctx = ctx;
+    blk->flags = 0;
+    blk->refcnt = 1;
+    blk->base = NULL;
+    blk->off = 0;
+    blk->next = NULL;
+    /* get_mem() may have trimmed ctx->arena[cls] */
+    if (ctx->arena[cls] != NULL)
+      block_release(ctx->arena[cls]);
+    ctx->arena[cls] = blk;
+    ctx->arena_off[cls] = 0;
+  }
+
+  b->base = blk;
+  b->off = ctx->arena_off[cls];
+  b->ptr = blk->ptr + b->off;
+  b->host = NULL;
+  b->ev = blk->ev;
+  blk->refcnt++;
+  ctx->arena_off[cls] += csz;
+  return 0;
+}
+
+/* Give back the memory of a buffer that is not referenced anymore */
+static void free_buf(gpudata *b) {
+  if (b->base != NULL) {
+    block_release(b->base);
+    free(b);
+  } else {
+    put_mem(b);
+  }
+}
+
 static gpudata *cuda_alloc(void *c, size_t size, void *data, int flags,
 			   int *ret) {
     gpudata *res;
     cuda_context *ctx = (cuda_context *)c;
-    int fl = CU_EVENT_DISABLE_TIMING;
+    size_t csz;
+    int cls;
 
     if ((flags & GA_BUFFER_INIT) && data == NULL) FAIL(NULL, GA_VALUE_ERROR);
     if ((flags & (GA_BUFFER_READ_ONLY|GA_BUFFER_WRITE_ONLY)) ==
 	(GA_BUFFER_READ_ONLY|GA_BUFFER_WRITE_ONLY)) FAIL(NULL, GA_VALUE_ERROR);
 
-    /* TODO: figure out how to make this work */
-    if (flags & GA_BUFFER_HOST) FAIL(NULL, GA_DEVSUP_ERROR);
-
-    res = malloc(sizeof(*res));
-    if (res == NULL) FAIL(NULL, GA_SYS_ERROR);
-    res->refcnt = 1;
-
-    res->sz = size;
-    res->flags = flags & (GA_BUFFER_READ_ONLY|GA_BUFFER_WRITE_ONLY);
-
     cuda_enter(ctx);
 
-    if (ctx->flags & GA_CTX_MULTI_THREAD)
-      fl |= CU_EVENT_BLOCKING_SYNC;
-    ctx->err = cuEventCreate(&res->ev, fl);
+    if (ctx->pending != NULL)
+      reclaim(ctx, 0);
+
+    cls = buf_class(ctx, flags, size, &csz);
+    if (cls != -1 && ctx->freebufs[cls] != NULL) {
+      /*
+       * The new owner is ordered after the pending work of the
+       * previous one.  With a single stream the stream does it.
+       * Otherwise the last operation of the previous owner recorded
+       * the event of the buffer and the first one of the new owner
+       * waits on it (see track_wait()).  New streams start after the
+       * work issued before them, which covers the buffers that were
+       * last used with a single stream.
+       */
+      res = ctx->freebufs[cls];
+      ctx->freebufs[cls] = res->next;
+      ctx->cached -= csz;
+    } else {
+      res = malloc(sizeof(*res));
+      if (res == NULL) {
+        cuda_exit(ctx);
+        FAIL(NULL, GA_SYS_ERROR);
+      }
 
-    if (ctx->err != CUDA_SUCCESS) {
-      free(res);
-      cuda_exit(ctx);
-      FAIL(NULL, GA_IMPL_ERROR);
+      if (cls != -1 && cls < ARENA_NCLASSES &&
+          !(ctx->flags & GA_CTX_DISABLE_SUBALLOCATION)) {
+        if (arena_carve(ctx, cls, csz, res) != 0) {
+          free(res);
+          cuda_exit(ctx);
+          FAIL(NULL, GA_IMPL_ERROR);
+        }
+      } else {
+        res->base = NULL;
+        res->off = 0;
+        if (get_mem(ctx, res, csz, flags & GA_BUFFER_HOST) != 0) {
+          free(res);
+          cuda_exit(ctx);
+          FAIL(NULL, GA_IMPL_ERROR);
+        }
+      }
     }
 
-    if (size == 0) size = 1;
-
-    ctx->err = cuMemAlloc(&res->ptr, size);
-    if (ctx->err != CUDA_SUCCESS) {
-        cuEventDestroy(res->ev);
-        free(res);
-        cuda_exit(ctx);
-        FAIL(NULL, GA_IMPL_ERROR);
-    }
+    res->refcnt = 1;
+    res->sz = size;
+    res->flags = flags & (GA_BUFFER_READ_ONLY|GA_BUFFER_WRITE_ONLY|
+                          GA_BUFFER_HOST);
+    res->next = NULL;
     res->ctx = ctx;
     ctx->refcnt++;
+    ctx->inuse += csz;
+    if (ctx->inuse > ctx->peak)
+      ctx->peak = ctx->inuse;
+    ctx->nbufs++;
+    TAG_BUF(res);
 
     if (flags & GA_BUFFER_INIT) {
       ctx->err = cuMemcpyHtoD(res->ptr, data, size);
       if (ctx->err != CUDA_SUCCESS) {
 	cuda_free(res);
+	cuda_exit(ctx);
 	FAIL(NULL, GA_IMPL_ERROR)
       }
     }
 
     cuda_exit(ctx);
-    TAG_BUF(res);
     return res;
 }
 
@@ -364,27 +620,92 @@ static void cuda_retain(gpudata *d) {
 }
 
 static void cuda_free(gpudata *d) {
+  cuda_context *ctx;
+  gpudata *base;
+  size_t csz;
+  int cls;
+
   /* We ignore errors on free */
   ASSERT_BUF(d);
   d->refcnt--;
   if (d->refcnt == 0) {
-    cuda_enter(d->ctx);
-    /*
-     * From testing, I have discovered that cuMemFree() will just
-     * block until nothing uses the region on the GPU.  Since this is
-     * not documented behavior, we will emulate that here.
-     */
-    cuEventSynchronize(d->ev);
-    if (!(d->flags & DONTFREE))
-      cuMemFree(d->ptr);
-    cuEventDestroy(d->ev);
-    cuda_exit(d->ctx);
-    cuda_free_ctx(d->ctx);
     CLEAR(d);
-    free(d);
+    ctx = d->ctx;
+    cuda_enter(ctx);
+    if (d->flags & DONTFREE) {
+      base = d->base;
+      if (base == NULL) {
+        /* The owner may free the memory as soon as we give it back */
+        cuEventSynchronize(d->ev);
+        cuEventDestroy(d->ev);
+      }
+      free(d);
+      if (base != NULL)
+        cuda_free(base);
+    } else {
+      cls = buf_class(ctx, d->flags, d->sz, &csz);
+      ctx->inuse -= csz;
+      ctx->nbufs--;
+      if (cls != -1) {
+        d->next = ctx->freebufs[cls];
+        ctx->freebufs[cls] = d;
+        ctx->cached += csz;
+      } else {
+        free_buf(d);
+      }
+    }
+    cuda_exit(ctx);
+    /* This may free the context, which empties the cache */
+    cuda_free_ctx(ctx);
   }
 }
 
+static int cuda_trim(void *c) {
+  cuda_context *ctx = (cuda_context *)c;
+  gpudata *d;
+  unsigned int i;
+
+  ASSERT_CTX(ctx);
+
+  cuda_enter(ctx);
+  for (i = 0; i < ALLOC_NCLASSES; i++) {
+    while (ctx->freebufs[i] != NULL) {
+      d = ctx->freebufs[i];
+      ctx->freebufs[i] = d->next;
+      free_buf(d);
+    }
+  }
+  ctx->cached = 0;
+
+  /* Blocks stay around as long as some of their buffers are in use */
+  for (i = 0; i < ARENA_NCLASSES; i++) {
+    if (ctx->arena[i] != NULL) {
+      block_release(ctx->arena[i]);
+      ctx->arena[i] = NULL;
+    }
+  }
+  reclaim(ctx, 1);
+
+  if (ctx->staging[0] != NULL) {
+    for (i = 0; i < STAGING_NBUFS; i++) {
+      cuEventSynchronize(ctx->staging_ev[i]);
+      cuMemFreeHost(ctx->staging[i]);
+      cuEventDestroy(ctx->staging_ev[i]);
+      ctx->staging[i] = NULL;
+    }
+  }
+  cuda_exit(ctx);
+  return GA_NO_ERROR;
+}
+
+static int cuda_reset_peak(void *c) {
+  cuda_context *ctx = (cuda_context *)c;
+
+  ASSERT_CTX(ctx);
+  ctx->peak = ctx->inuse;
+  return GA_NO_ERROR;
+}
+
 static int cuda_share(gpudata *a, gpudata *b, int *ret) {
   ASSERT_BUF(a);
   ASSERT_BUF(b);
@@ -395,13 +716,20 @@ static int cuda_share(gpudata *a, gpudata *b, int *ret) {
 
 int cuda_wait(gpudata *a, int flags) {
   ASSERT_BUF(a);
-  /* If others are only reads, no need to wait */
-  if (flags & CUDA_WAIT_READ && !(a->flags & CUDA_WAIT_WRITE))
+  /*
+   * If others are only reads, no need to wait.  With more than one
+   * stream we do since the event only covers the last read and the
+   * next write must come after all of them.
+   */
+  if (flags & CUDA_WAIT_READ && !(a->flags & CUDA_WAIT_WRITE) &&
+      a->ctx->nstreams == 0)
     return GA_NO_ERROR;
   cuda_enter(a->ctx);
   a->ctx->err = cuStreamWaitEvent(a->ctx->s, a->ev, 0);
-  if (a->ctx->err != CUDA_SUCCESS)
+  if (a->ctx->err != CUDA_SUCCESS) {
+    cuda_exit(a->ctx);
     return GA_IMPL_ERROR;
+  }
   cuda_exit(a->ctx);
   return GA_NO_ERROR;
 }
@@ -411,11 +739,31 @@ int cuda_record(gpudata *a, int flags) {
   cuda_enter(a->ctx);
   a->ctx->err = cuEventRecord(a->ev, a->ctx->s);
   a->flags &= ~(CUDA_WAIT_MASK);
-  a->flags &= (flags & CUDA_WAIT_MASK);
+  a->flags |= (flags & CUDA_WAIT_MASK);
   cuda_exit(a->ctx);
   return GA_NO_ERROR;
 }
 
+/*
+ * With a single stream everything is ordered by it.  Once there are
+ * more, operations on a buffer wait for its event and record it again
+ * so that they are ordered with the uses on the other streams.  Must
+ * be called inside the context.
+ *
+ * Buffers in host memory always get their event recorded since the
+ * host reads and writes them directly and has to wait on it.
+ */
+static int track_wait(gpudata *b, int flags) {
+  if (b->ctx->nstreams == 0)
+    return GA_NO_ERROR;
+  return cuda_wait(b, flags);
+}
+
+static void track_record(gpudata *b, int flags) {
+  if (b->ctx->nstreams != 0 || b->host != NULL)
+    cuda_record(b, flags);
+}
+
 static int cuda_move(gpudata *dst, size_t dstoff, gpudata *src,
                      size_t srcoff, size_t sz) {
     cuda_context *ctx = dst->ctx;
@@ -431,16 +779,111 @@ static int cuda_move(gpudata *dst, size_t dstoff, gpudata *src,
 
     cuda_enter(ctx);
 
+    if (track_wait(src, CUDA_WAIT_READ) != GA_NO_ERROR ||
+        track_wait(dst, CUDA_WAIT_WRITE) != GA_NO_ERROR) {
+      cuda_exit(ctx);
+      return GA_IMPL_ERROR;
+    }
     ctx->err = cuMemcpyDtoDAsync(dst->ptr + dstoff, src->ptr + srcoff, sz,
                                  ctx->s);
     if (ctx->err != CUDA_SUCCESS) {
       cuda_exit(ctx);
       return GA_IMPL_ERROR;
     }
+    track_record(src, CUDA_WAIT_READ);
+    track_record(dst, CUDA_WAIT_WRITE);
     cuda_exit(ctx);
     return res;
 }
 
+/*
+ * Allocate the staging buffers if needed.  Returns -1 if they are not
+ * available, in which case the transfer should be done directly.
+ */
+static int get_staging(cuda_context *ctx) {
+  unsigned int i;
+
+  if (ctx->staging[0] != NULL)
+    return 0;
+  for (i = 0; i < STAGING_NBUFS; i++) {
+    if (make_event(ctx, &ctx->staging_ev[i]) != 0)
+      break;
+    ctx->err = cuMemHostAlloc(&ctx->staging[i], STAGING_BUFSIZE, 0);
+    if (ctx->err != CUDA_SUCCESS) {
+      ctx->staging[i] = NULL;
+      cuEventDestroy(ctx->staging_ev[i]);
+      break;
+    }
+  }
+  if (i == STAGING_NBUFS)
+    return 0;
+  while (i-- > 0) {
+    cuMemFreeHost(ctx->staging[i]);
+    cuEventDestroy(ctx->staging_ev[i]);
+    ctx->staging[i] = NULL;
+  }
+  return -1;
+}
+
+/*
+ * Copy through the staging buffers, each chunk goes to the user
+ * memory while the next one is in flight.
+ */
+static int read_staged(cuda_context *ctx, char *dst, CUdeviceptr src,
+                       size_t sz) {
+  size_t len[STAGING_NBUFS];
+  unsigned int i, cur = 0, busy = 0;
+
+  for (;;) {
+    while (sz > 0 && busy < STAGING_NBUFS) {
+      i = (cur + busy) % STAGING_NBUFS;
+      len[i] = sz < STAGING_BUFSIZE ? sz : STAGING_BUFSIZE;
+      ctx->err = cuMemcpyDtoHAsync(ctx->staging[i], src, len[i], ctx->s);
+      if (ctx->err != CUDA_SUCCESS) return -1;
+      ctx->err = cuEventRecord(ctx->staging_ev[i], ctx->s);
+      if (ctx->err != CUDA_SUCCESS) return -1;
+      src += len[i];
+      sz -= len[i];
+      busy++;
+    }
+    if (busy == 0)
+      return 0;
+    ctx->err = cuEventSynchronize(ctx->staging_ev[cur]);
+    if (ctx->err != CUDA_SUCCESS) return -1;
+    memcpy(dst, ctx->staging[cur], len[cur]);
+    dst += len[cur];
+    cur = (cur + 1) % STAGING_NBUFS;
+    busy--;
+  }
+}
+
+/*
+ * Copy through the staging buffers.  This returns as soon as the last
+ * chunk is queued.
+ */
+static int write_staged(cuda_context *ctx, CUdeviceptr dst, const char *src,
+                        size_t sz) {
+  unsigned int i = 0;
+  size_t n;
+
+  while (sz > 0) {
+    n = sz < STAGING_BUFSIZE ? sz : STAGING_BUFSIZE;
+    /* Wait for the previous copy out of this buffer */
+    ctx->err = cuEventSynchronize(ctx->staging_ev[i]);
+    if (ctx->err != CUDA_SUCCESS) return -1;
+    memcpy(ctx->staging[i], src, n);
+    ctx->err = cuMemcpyHtoDAsync(dst, ctx->staging[i], n, ctx->s);
+    if (ctx->err != CUDA_SUCCESS) return -1;
+    ctx->err = cuEventRecord(ctx->staging_ev[i], ctx->s);
+    if (ctx->err != CUDA_SUCCESS) return -1;
+    dst += n;
+    src += n;
+    sz -= n;
+    i = (i + 1) % STAGING_NBUFS;
+  }
+  return 0;
+}
+
 static int cuda_read(void *dst, gpudata *src, size_t srcoff, size_t sz) {
     cuda_context *ctx = src->ctx;
 
@@ -453,12 +896,29 @@ static int cuda_read(void *dst, gpudata *src, size_t srcoff, size_t sz) {
 
     cuda_enter(ctx);
 
+    /* Staged copies are ordered after the pending work on the stream */
+    if (src->host == NULL && sz >= STAGING_MINSIZE && get_staging(ctx) == 0) {
+      if (track_wait(src, CUDA_WAIT_READ) != GA_NO_ERROR ||
+          read_staged(ctx, dst, src->ptr + srcoff, sz) != 0) {
+        cuda_exit(ctx);
+        return GA_IMPL_ERROR;
+      }
+      cuda_exit(ctx);
+      return GA_NO_ERROR;
+    }
+
     ctx->err = cuEventSynchronize(src->ev);
     if (ctx->err != CUDA_SUCCESS) {
       cuda_exit(ctx);
       return GA_IMPL_ERROR;
     }
 
+    if (src->host != NULL) {
+      memcpy(dst, (char *)src->host + srcoff, sz);
+      cuda_exit(ctx);
+      return GA_NO_ERROR;
+    }
+
     ctx->err = cuMemcpyDtoH(dst, src->ptr + srcoff, sz);
     if (ctx->err != CUDA_SUCCESS) {
       cuda_exit(ctx);
@@ -481,12 +941,29 @@ static int cuda_write(gpudata *dst, size_t dstoff, const void *src,
 
     cuda_enter(ctx);
 
+    if (dst->host == NULL && sz >= STAGING_MINSIZE && get_staging(ctx) == 0) {
+      if (track_wait(dst, CUDA_WAIT_WRITE) != GA_NO_ERROR ||
+          write_staged(ctx, dst->ptr + dstoff, src, sz) != 0) {
+        cuda_exit(ctx);
+        return GA_IMPL_ERROR;
+      }
+      cuda_record(dst, CUDA_WAIT_WRITE);
+      cuda_exit(ctx);
+      return GA_NO_ERROR;
+    }
+
     ctx->err = cuEventSynchronize(dst->ev);
     if (ctx->err != CUDA_SUCCESS) {
       cuda_exit(ctx);
       return GA_IMPL_ERROR;
     }
 
+    if (dst->host != NULL) {
+      memcpy((char *)dst->host + dstoff, src, sz);
+      cuda_exit(ctx);
+      return GA_NO_ERROR;
+    }
+
     ctx->err = cuMemcpyHtoD(dst->ptr + dstoff, src, sz);
     if (ctx->err != CUDA_SUCCESS) {
       cuda_exit(ctx);
@@ -496,25 +973,309 @@ static int cuda_write(gpudata *dst, size_t dstoff, const void *src,
     return GA_NO_ERROR;
 }
 
-static int cuda_memset(gpudata *dst, size_t dstoff, int data) {
+/*
+ * Make an event that completes with the work issued so far to the
+ * stream in use.  Must be called inside the context.
+ */
+static gpuevent *new_event(cuda_context *ctx) {
+  gpuevent *res;
+
+  res = malloc(sizeof(*res));
+  if (res == NULL)
+    return NULL;
+  if (make_event(ctx, &res->ev) != 0) {
+    free(res);
+    return NULL;
+  }
+  ctx->err = cuEventRecord(res->ev, ctx->s);
+  if (ctx->err != CUDA_SUCCESS) {
+    cuEventDestroy(res->ev);
+    free(res);
+    return NULL;
+  }
+  res->ctx = ctx;
+  res->flags = 0;
+  res->recorded = 1;
+  ctx->refcnt++;
+  return res;
+}
+
+static int cuda_read_async(void *dst, gpudata *src, size_t srcoff, size_t sz,
+                           gpuevent **ev) {
+    cuda_context *ctx = src->ctx;
+
+    ASSERT_BUF(src);
+
+    if (srcoff > src->sz || (src->sz - srcoff) < sz)
+        return GA_VALUE_ERROR;
+
+    cuda_enter(ctx);
+
+    if (sz != 0) {
+      if (track_wait(src, CUDA_WAIT_READ) != GA_NO_ERROR) {
+        cuda_exit(ctx);
+        return GA_IMPL_ERROR;
+      }
+      ctx->err = cuMemcpyDtoHAsync(dst, src->ptr + srcoff, sz, ctx->s);
+      if (ctx->err != CUDA_SUCCESS) {
+        cuda_exit(ctx);
+        return GA_IMPL_ERROR;
+      }
+      /* Writes to src must wait for the copy */
+      cuda_record(src, CUDA_WAIT_READ);
+    }
+    *ev = new_event(ctx);
+    cuda_exit(ctx);
+    if (*ev == NULL)
+      return GA_IMPL_ERROR;
+    return GA_NO_ERROR;
+}
+
+static int cuda_write_async(gpudata *dst, size_t dstoff, const void *src,
+                            size_t sz, gpuevent **ev) {
     cuda_context *ctx = dst->ctx;
 
     ASSERT_BUF(dst);
 
-    if ((dst->sz - dstoff) == 0) return GA_NO_ERROR;
+    if (dstoff > dst->sz || (dst->sz - dstoff) < sz)
+        return GA_VALUE_ERROR;
 
     cuda_enter(ctx);
 
-    ctx->err = cuMemsetD8Async(dst->ptr + dstoff, data, dst->sz - dstoff,
-                               ctx->s);
+    if (sz != 0) {
+      if (track_wait(dst, CUDA_WAIT_WRITE) != GA_NO_ERROR) {
+        cuda_exit(ctx);
+        return GA_IMPL_ERROR;
+      }
+      ctx->err = cuMemcpyHtoDAsync(dst->ptr + dstoff, src, sz, ctx->s);
+      if (ctx->err != CUDA_SUCCESS) {
+        cuda_exit(ctx);
+        return GA_IMPL_ERROR;
+      }
+      cuda_record(dst, CUDA_WAIT_WRITE);
+    }
+    *ev = new_event(ctx);
+    cuda_exit(ctx);
+    if (*ev == NULL)
+      return GA_IMPL_ERROR;
+    return GA_NO_ERROR;
+}
+
+static int cuda_event_query(gpuevent *ev) {
+  CUresult err;
+
+  cuda_enter(ev->ctx);
+  err = cuEventQuery(ev->ev);
+  cuda_exit(ev->ctx);
+  return err != CUDA_ERROR_NOT_READY;
+}
+
+static int cuda_event_sync(gpuevent *ev) {
+  cuda_context *ctx = ev->ctx;
+
+  cuda_enter(ctx);
+  ctx->err = cuEventSynchronize(ev->ev);
+  cuda_exit(ctx);
+  if (ctx->err != CUDA_SUCCESS)
+    return GA_IMPL_ERROR;
+  return GA_NO_ERROR;
+}
+
+static void cuda_event_free(gpuevent *ev) {
+  cuda_context *ctx = ev->ctx;
+
+  cuda_enter(ctx);
+  cuEventDestroy(ev->ev);
+  cuda_exit(ctx);
+  free(ev);
+  cuda_free_ctx(ctx);
+}
+
+static gpuevent *cuda_event_new(void *c, int flags, int *ret) {
+  cuda_context *ctx = (cuda_context *)c;
+  gpuevent *res;
+  int fl = 0;
+
+  ASSERT_CTX(ctx);
+  if (!(flags & GA_EVENT_TIMING))
+    fl |= CU_EVENT_DISABLE_TIMING;
+  if (ctx->flags & GA_CTX_MULTI_THREAD)
+    fl |= CU_EVENT_BLOCKING_SYNC;
+
+  res = malloc(sizeof(*res));
+  if (res == NULL)
+    FAIL(NULL, GA_SYS_ERROR);
+  cuda_enter(ctx);
+  ctx->err = cuEventCreate(&res->ev, fl);
+  cuda_exit(ctx);
+  if (ctx->err != CUDA_SUCCESS) {
+    free(res);
+    FAIL(NULL, GA_IMPL_ERROR);
+  }
+  res->ctx = ctx;
+  res->flags = flags;
+  res->recorded = 0;
+  ctx->refcnt++;
+  return res;
+}
+
+static int cuda_event_record(gpuevent *ev, gpustream *s) {
+  cuda_context *ctx = ev->ctx;
+
+  if (s != NULL && s->ctx != ctx)
+    return GA_VALUE_ERROR;
+  cuda_enter(ctx);
+  ctx->err = cuEventRecord(ev->ev, s == NULL ? ctx->s0 : s->s);
+  cuda_exit(ctx);
+  if (ctx->err != CUDA_SUCCESS)
+    return GA_IMPL_ERROR;
+  ev->recorded = 1;
+  return GA_NO_ERROR;
+}
+
+static int cuda_event_wait(gpuevent *ev, gpustream *s) {
+  cuda_context *ctx = ev->ctx;
+
+  if (s != NULL && s->ctx != ctx)
+    return GA_VALUE_ERROR;
+  cuda_enter(ctx);
+  ctx->err = cuStreamWaitEvent(s == NULL ? ctx->s0 : s->s, ev->ev, 0);
+  cuda_exit(ctx);
+  if (ctx->err != CUDA_SUCCESS)
+    return GA_IMPL_ERROR;
+  return GA_NO_ERROR;
+}
+
+static int cuda_event_elapsed(gpuevent *start, gpuevent *end, double *ms) {
+  cuda_context *ctx = start->ctx;
+  float t;
+
+  if (end->ctx != ctx || !(start->flags & end->flags & GA_EVENT_TIMING) ||
+      !start->recorded || !end->recorded)
+    return GA_VALUE_ERROR;
+  cuda_enter(ctx);
+  ctx->err = cuEventSynchronize(start->ev);
+  if (ctx->err == CUDA_SUCCESS)
+    ctx->err = cuEventSynchronize(end->ev);
+  if (ctx->err == CUDA_SUCCESS)
+    ctx->err = cuEventElapsedTime(&t, start->ev, end->ev);
+  cuda_exit(ctx);
+  if (ctx->err != CUDA_SUCCESS)
+    return GA_IMPL_ERROR;
+  *ms = t;
+  return GA_NO_ERROR;
+}
+
+static int cuda_memset_range(gpudata *dst, size_t dstoff, size_t sz,
+                             int data) {
+    cuda_context *ctx = dst->ctx;
+    unsigned char val = (unsigned char)data;
+    unsigned int pattern;
+
+    ASSERT_BUF(dst);
+
+    if (dstoff > dst->sz || dst->sz - dstoff < sz) return GA_VALUE_ERROR;
+
+    if (sz == 0) return GA_NO_ERROR;
+
+    cuda_enter(ctx);
+
+    if (track_wait(dst, CUDA_WAIT_WRITE) != GA_NO_ERROR) {
+      cuda_exit(ctx);
+      return GA_IMPL_ERROR;
+    }
+    /* Wider stores are faster when the range allows them */
+    if (((dst->ptr + dstoff) | sz) % 4 == 0) {
+      pattern = (unsigned int)val | (unsigned int)val << 8 |
+        (unsigned int)val << 16 | (unsigned int)val << 24;
+      ctx->err = cuMemsetD32Async(dst->ptr + dstoff, pattern, sz / 4, ctx->s);
+    } else {
+      ctx->err = cuMemsetD8Async(dst->ptr + dstoff, val, sz, ctx->s);
+    }
     if (ctx->err != CUDA_SUCCESS) {
       cuda_exit(ctx);
       return GA_IMPL_ERROR;
     }
+    track_record(dst, CUDA_WAIT_WRITE);
     cuda_exit(ctx);
     return GA_NO_ERROR;
 }
 
+/*
+ * Shortest repeating unit of 1, 2 or 4 bytes in `p` or 0 if there is
+ * none.
+ */
+static size_t pattern_unit(const unsigned char *p, size_t psz) {
+  size_t w, i;
+
+  for (w = 1; w <= 4; w *= 2) {
+    if (psz % w != 0)
+      continue;
+    for (i = w; i < psz; i++)
+      if (p[i] != p[i % w])
+        break;
+    if (i == psz)
+      return w;
+  }
+  return 0;
+}
+
+static int cuda_fill(gpudata *dst, size_t dstoff, size_t sz,
+                     const void *pattern, size_t psz) {
+    cuda_context *ctx = dst->ctx;
+    CUdeviceptr p;
+    unsigned short us;
+    unsigned int ui;
+    size_t w;
+
+    ASSERT_BUF(dst);
+
+    if (psz == 0 || sz % psz != 0 || dstoff > dst->sz ||
+        dst->sz - dstoff < sz)
+      return GA_VALUE_ERROR;
+
+    if (sz == 0) return GA_NO_ERROR;
+
+    p = dst->ptr + dstoff;
+    w = pattern_unit(pattern, psz);
+    /* The driver needs aligned pointers for the wider fills */
+    if (w == 0 || p % w != 0) return GA_UNSUPPORTED_ERROR;
+
+    cuda_enter(ctx);
+    if (track_wait(dst, CUDA_WAIT_WRITE) != GA_NO_ERROR) {
+      cuda_exit(ctx);
+      return GA_IMPL_ERROR;
+    }
+    switch (w) {
+    case 1:
+      ctx->err = cuMemsetD8Async(p, *(const unsigned char *)pattern, sz,
+                                 ctx->s);
+      break;
+    case 2:
+      memcpy(&us, pattern, 2);
+      ctx->err = cuMemsetD16Async(p, us, sz / 2, ctx->s);
+      break;
+    default:
+      memcpy(&ui, pattern, 4);
+      ctx->err = cuMemsetD32Async(p, ui, sz / 4, ctx->s);
+      break;
+    }
+    if (ctx->err != CUDA_SUCCESS) {
+      cuda_exit(ctx);
+      return GA_IMPL_ERROR;
+    }
+    track_record(dst, CUDA_WAIT_WRITE);
+    cuda_exit(ctx);
+    return GA_NO_ERROR;
+}
+
+static int cuda_memset(gpudata *dst, size_t dstoff, int data) {
+    ASSERT_BUF(dst);
+
+    if (dstoff > dst->sz) return GA_VALUE_ERROR;
+    return cuda_memset_range(dst, dstoff, dst->sz - dstoff, data);
+}
+
 static CUresult get_cc(CUdevice dev, int *maj, int *min) {
 #if CUDA_VERSION < 6500
   return cuDeviceComputeCapability(maj, min, dev);
@@ -550,29 +1311,28 @@ static int detect_arch(const char *prefix, char *ret, CUresult *err) {
 #include <nvrtc.h>
 
 static void *call_compiler(const char *src, size_t len, const char *arch_arg,
-                           size_t *bin_len, char **log, size_t *log_len,
-                           int *ret) {
+                           int flags, size_t *bin_len, char **log,
+                           size_t *log_len, int *ret) {
   nvrtcProgram prog;
   void *buf = NULL;
   size_t buflen;
-  const char *opts[4] = {
-    "-arch", ""
-    , "-G", "-lineinfo"
-  };
+  const char *opts[6];
+  int nopts = 0;
   nvrtcResult err, err2;
 
-  opts[1] = arch_arg;
+  opts[nopts++] = "-arch";
+  opts[nopts++] = arch_arg;
+  if (flags & GA_USE_FAST_MATH)
+    opts[nopts++] = "--use_fast_math";
+#ifdef DEBUG
+  opts[nopts++] = "-G";
+  opts[nopts++] = "-lineinfo";
+#endif
 
   err = nvrtcCreateProgram(&prog, src, NULL, 0, NULL, NULL);
   if (err != NVRTC_SUCCESS) FAIL(NULL, GA_SYS_ERROR);
 
-  err = nvrtcCompileProgram(prog,
-#ifdef DEBUG
-                            4,
-#else
-                            2,
-#endif
-                            opts);
+  err = nvrtcCompileProgram(prog, nopts, opts);
   if (log != NULL) {
     err2 = nvrtcGetProgramLogSize(prog, &buflen);
     if (err2 != NVRTC_SUCCESS) goto end2;
@@ -645,10 +1405,13 @@ static const char *TMP_VAR_NAMES[] = {"GPUARRAY_TMPDIR", "TMPDIR", "TMP",
                                       "TEMP", "USERPROFILE"};
 
 static void *call_compiler(const char *src, size_t len, const char *arch_arg,
-                           size_t *bin_len, char **log, size_t *log_len,
-                           int *ret) {
+                           int flags, size_t *bin_len, char **log,
+                           size_t *log_len, int *ret) {
     char namebuf[PATH_MAX];
     char outbuf[PATH_MAX];
+    char optbuf[4] = "-O3";
+    const char *args[16];
+    unsigned int nargs = 0;
     char *tmpdir;
     struct stat st;
     ssize_t s;
@@ -691,22 +1454,36 @@ static void *call_compiler(const char *src, size_t len, const char *arch_arg,
     }
 
     /* This block executes nvcc on the written-out file */
+    args[nargs++] = NVCC_BIN;
 #ifdef DEBUG
-#define NVCC_ARGS NVCC_BIN, "-g", "-G", "-arch", arch_arg, "-x", "cu", \
-      "--cubin", namebuf, "-o", outbuf
-#else
-#define NVCC_ARGS NVCC_BIN, "-arch", arch_arg, "-x", "cu", \
-      "--cubin", namebuf, "-o", outbuf
+    args[nargs++] = "-g";
+    args[nargs++] = "-G";
 #endif
+    args[nargs++] = "-arch";
+    args[nargs++] = arch_arg;
+    if (flags & GA_USE_FAST_MATH)
+      args[nargs++] = "--use_fast_math";
+    if (GA_GET_OPT_LEVEL(flags) >= 0) {
+      optbuf[2] = '0' + GA_GET_OPT_LEVEL(flags);
+      args[nargs++] = "-Xptxas";
+      args[nargs++] = optbuf;
+    }
+    args[nargs++] = "-x";
+    args[nargs++] = "cu";
+    args[nargs++] = "--cubin";
+    args[nargs++] = namebuf;
+    args[nargs++] = "-o";
+    args[nargs++] = outbuf;
+    args[nargs] = NULL;
 #ifdef _WIN32
-    sys_err = _spawnl(_P_WAIT, NVCC_BIN, NVCC_ARGS, NULL);
+    sys_err = _spawnv(_P_WAIT, NVCC_BIN, args);
     unlink(namebuf);
     if (sys_err == -1) FAIL(NULL, GA_SYS_ERROR);
     if (sys_err != 0) FAIL(NULL, GA_RUN_ERROR);
 #else
     p = fork();
     if (p == 0) {
-        execl(NVCC_BIN, NVCC_ARGS, NULL);
+        execv(NVCC_BIN, (char * const *)args);
         exit(1);
     }
     if (p == -1) {
@@ -769,149 +1546,165 @@ static void *call_compiler(const char *src, size_t len, const char *arch_arg,
 #endif /* WITH_NVRTC */
 
 static void _cuda_freekernel(gpukernel *k) {
-  k->refcnt--;
-  if (k->refcnt == 0) {
+  if (kernel_table_unref(k->entry, &k->refcnt) == 0) {
     if (k->ctx != NULL) {
       cuda_enter(k->ctx);
-      cuModuleUnload(k->m);
+      if (k->mod == NULL)
+        cuModuleUnload(k->m);
       cuda_exit(k->ctx);
       cuda_free_ctx(k->ctx);
     }
     CLEAR(k);
     free(k->args);
-    free(k->bin);
+    if (k->mod != NULL)
+      _cuda_freekernel(k->mod);
+    else
+      free(k->bin);
     free(k->types);
     free(k);
   }
 }
 
-static gpukernel *cuda_newkernel(void *c, unsigned int count,
-                                 const char **strings, const size_t *lengths,
-                                 const char *fname, unsigned int argcount,
-                                 const int *types, int flags, int *ret,
-                                 char **err_str) {
-    cuda_context *ctx = (cuda_context *)c;
+/*
+ * Produces the module image for the sources of a kernel.  This only
+ * reads ctx->bin_id so it is safe to call from any thread.
+ */
+static int cuda_compile(cuda_context *ctx, unsigned int count,
+                        const char **strings, const size_t *lengths,
+                        int flags, char **bin, size_t *bin_len,
+                        char **err_str) {
     strb sb = STRB_STATIC_INIT;
-    char *bin, *log = NULL;
-    gpukernel *res;
-    size_t bin_len = 0, log_len = 0;
-    CUdevice dev;
+    strb key = STRB_STATIC_INIT;
+    char *log = NULL;
+    size_t log_len = 0;
     unsigned int i;
-    int ptx_mode = 0;
-    int binary_mode = 0;
     int major, minor;
+    int err = GA_NO_ERROR;
 
-    if (count == 0) FAIL(NULL, GA_VALUE_ERROR);
+    if (count == 0) return GA_VALUE_ERROR;
 
     if (flags & GA_USE_OPENCL)
-      FAIL(NULL, GA_DEVSUP_ERROR);
+      return GA_DEVSUP_ERROR;
 
-    if (flags & GA_USE_BINARY) {
-      // GA_USE_BINARY is exclusive
-      if (flags & ~GA_USE_BINARY)
-        FAIL(NULL, GA_INVALID_ERROR);
-      // We need the length for binary data and there is only one blob.
-      if (count != 1 || lengths == NULL || lengths[0] == 0)
-        FAIL(NULL, GA_VALUE_ERROR);
-    }
-
-    cuda_enter(ctx);
-
-    ctx->err = cuCtxGetDevice(&dev);
-    if (ctx->err != CUDA_SUCCESS) {
-      cuda_exit(ctx);
-      FAIL(NULL, GA_IMPL_ERROR);
-    }
-    ctx->err = cuDeviceComputeCapability(&major, &minor, dev);
-    if (ctx->err != CUDA_SUCCESS) {
-      cuda_exit(ctx);
-      FAIL(NULL, GA_IMPL_ERROR);
-    }
+    /* bin_id is ARCH_PREFIX followed by the compute capability */
+    major = ctx->bin_id[strlen(ARCH_PREFIX)] - '0';
+    minor = ctx->bin_id[strlen(ARCH_PREFIX) + 1] - '0';
 
     // GA_USE_CLUDA is done later
     // GA_USE_SMALL will always work
     if (flags & GA_USE_DOUBLE) {
-      if (major < 1 || (major == 1 && minor < 3)) {
-        cuda_exit(ctx);
-        FAIL(NULL, GA_DEVSUP_ERROR);
-      }
+      if (major < 1 || (major == 1 && minor < 3))
+        return GA_DEVSUP_ERROR;
     }
     if (flags & GA_USE_COMPLEX) {
       // just for now since it is most likely broken
-      cuda_exit(ctx);
-      FAIL(NULL, GA_DEVSUP_ERROR);
+      return GA_DEVSUP_ERROR;
     }
     // GA_USE_HALF should always work
 
-    if (flags & GA_USE_PTX) {
-      ptx_mode = 1;
-    } else if (flags & GA_USE_BINARY) {
-      binary_mode = 1;
+    if (flags & GA_USE_CLUDA) {
+      strb_appends(&sb, CUDA_PREAMBLE);
     }
 
-    if (binary_mode) {
-      bin = memdup(strings[0], lengths[0]);
-      bin_len = lengths[0];
-      if (bin == NULL) {
-        cuda_exit(ctx);
-        FAIL(NULL, GA_MEMORY_ERROR);
-      }
+    if (lengths == NULL) {
+      for (i = 0; i < count; i++)
+      strb_appends(&sb, strings[i]);
     } else {
-      if (flags & GA_USE_CLUDA) {
-        strb_appends(&sb, CUDA_PREAMBLE);
+      for (i = 0; i < count; i++) {
+        if (lengths[i] == 0)
+          strb_appends(&sb, strings[i]);
+        else
+          strb_appendn(&sb, strings[i], lengths[i]);
       }
+    }
 
-      if (lengths == NULL) {
-        for (i = 0; i < count; i++)
-        strb_appends(&sb, strings[i]);
-      } else {
-        for (i = 0; i < count; i++) {
-          if (lengths[i] == 0)
-            strb_appends(&sb, strings[i]);
-          else
-            strb_appendn(&sb, strings[i], lengths[i]);
-        }
-      }
+    strb_append0(&sb);
 
-      strb_append0(&sb);
+    if (strb_error(&sb)) {
+      strb_clear(&sb);
+      return GA_MEMORY_ERROR;
+    }
 
-      if (strb_error(&sb)) {
-        strb_clear(&sb);
-        cuda_exit(ctx);
-        return NULL;
-      }
+    if (flags & GA_USE_PTX) {
+      *bin = sb.s;
+      *bin_len = sb.l;
+      return GA_NO_ERROR;
+    }
 
-      if (ptx_mode) {
-        bin = sb.s;
-      } else {
-        bin = call_compiler(sb.s, sb.l, ctx->bin_id, &bin_len,
-                            &log, &log_len, ret);
-        if (bin == NULL) {
-          if (err_str != NULL) {
-            strb debug_msg = STRB_STATIC_INIT;
-
-            // We're substituting debug_msg for a string with this first line:
-            strb_appends(&debug_msg, "CUDA kernel build failure ::\n");
-
-            gpukernel_source_with_line_numbers(1, (const char **)&sb.s,
-                                               &sb.l, &debug_msg);
-
-            if (log != NULL) {
-              strb_appends(&debug_msg, "\nCompiler log:\n");
-              strb_appendn(&debug_msg, log, log_len);
-              free(log);
-            }
-            *err_str = strb_cstr(&debug_msg);
-            // *err_str will be free()d by the caller (see docs in kernel.h)
-          }
-          strb_clear(&sb);
-          cuda_exit(ctx);
-          return NULL;
+    *bin = NULL;
+    if (disk_cache_key(&key, ctx->bin_id, flags, 1, (const char **)&sb.s,
+                       &sb.l) == 0)
+      *bin = disk_cache_get(&key, bin_len);
+    if (*bin == NULL) {
+      *bin = call_compiler(sb.s, sb.l, ctx->bin_id, flags, bin_len,
+                           &log, &log_len, &err);
+      if (*bin != NULL && !strb_error(&key))
+        disk_cache_put(&key, *bin, *bin_len);
+    }
+    strb_clear(&key);
+    if (*bin == NULL) {
+      if (err_str != NULL) {
+        strb debug_msg = STRB_STATIC_INIT;
+
+        // We're substituting debug_msg for a string with this first line:
+        strb_appends(&debug_msg, "CUDA kernel build failure ::\n");
+
+        gpukernel_source_with_line_numbers(1, (const char **)&sb.s,
+                                           &sb.l, &debug_msg);
+
+        if (log != NULL) {
+          strb_appends(&debug_msg, "\nCompiler log:\n");
+          strb_appendn(&debug_msg, log, log_len);
         }
-        strb_clear(&sb);
+        *err_str = strb_cstr(&debug_msg);
+        // *err_str will be free()d by the caller (see docs in kernel.h)
       }
+      free(log);
+      strb_clear(&sb);
+      return err;
+    }
+    free(log);
+    strb_clear(&sb);
+    return GA_NO_ERROR;
+}
+
+static gpukernel *cuda_build_kernel(cuda_context *ctx, unsigned int count,
+                                    const char **strings,
+                                    const size_t *lengths, const char *fname,
+                                    unsigned int argcount, const int *types,
+                                    int flags, int *ret, char **err_str) {
+    char *bin;
+    gpukernel *res;
+    size_t bin_len = 0;
+    CUjit_option jit_opt;
+    void *jit_val;
+    int err;
+
+    if (count == 0) FAIL(NULL, GA_VALUE_ERROR);
+
+    if (flags & GA_USE_OPENCL)
+      FAIL(NULL, GA_DEVSUP_ERROR);
+
+    if (flags & GA_USE_BINARY) {
+      // GA_USE_BINARY is exclusive
+      if (flags & ~GA_USE_BINARY)
+        FAIL(NULL, GA_INVALID_ERROR);
+      // We need the length for binary data and there is only one blob.
+      if (count != 1 || lengths == NULL || lengths[0] == 0)
+        FAIL(NULL, GA_VALUE_ERROR);
+      bin = memdup(strings[0], lengths[0]);
+      bin_len = lengths[0];
+      if (bin == NULL)
+        FAIL(NULL, GA_MEMORY_ERROR);
+    } else {
+      err = cuda_compile(ctx, count, strings, lengths, flags, &bin, &bin_len,
+                         err_str);
+      if (err != GA_NO_ERROR)
+        FAIL(NULL, err);
     }
 
+    cuda_enter(ctx);
+
     res = calloc(1, sizeof(*res));
     if (res == NULL) {
       free(bin);
@@ -938,7 +1731,14 @@ static gpukernel *cuda_newkernel(void *c, unsigned int count,
       FAIL(NULL, GA_MEMORY_ERROR);
     }
 
-    ctx->err = cuModuleLoadData(&res->m, bin);
+    if (GA_GET_OPT_LEVEL(flags) >= 0 && !(flags & GA_USE_BINARY)) {
+      /* For PTX, the JIT does the work of ptxas */
+      jit_opt = CU_JIT_OPTIMIZATION_LEVEL;
+      jit_val = (void *)(size_t)GA_GET_OPT_LEVEL(flags);
+      ctx->err = cuModuleLoadDataEx(&res->m, bin, 1, &jit_opt, &jit_val);
+    } else {
+      ctx->err = cuModuleLoadData(&res->m, bin);
+    }
 
     if (ctx->err != CUDA_SUCCESS) {
       _cuda_freekernel(res);
@@ -965,20 +1765,192 @@ static void cuda_retainkernel(gpukernel *k) {
   k->refcnt++;
 }
 
+/*
+ * Makes a kernel for another function in the module of `owner`.  The
+ * new kernel holds a reference to `owner` which keeps the module
+ * loaded.
+ */
+static gpukernel *cuda_sibling(gpukernel *owner, const char *fname,
+                               unsigned int argcount, const int *types,
+                               int *ret) {
+    cuda_context *ctx = owner->ctx;
+    gpukernel *res;
+
+    res = calloc(1, sizeof(*res));
+    if (res == NULL) FAIL(NULL, GA_SYS_ERROR);
+
+    res->refcnt = 1;
+    res->argcount = argcount;
+    res->types = calloc(argcount, sizeof(int));
+    if (res->types == NULL) {
+      _cuda_freekernel(res);
+      FAIL(NULL, GA_MEMORY_ERROR);
+    }
+    memcpy(res->types, types, argcount*sizeof(int));
+    res->args = calloc(argcount, sizeof(void *));
+    if (res->args == NULL) {
+      _cuda_freekernel(res);
+      FAIL(NULL, GA_MEMORY_ERROR);
+    }
+
+    cuda_enter(ctx);
+    ctx->err = cuModuleGetFunction(&res->k, owner->m, fname);
+    cuda_exit(ctx);
+    if (ctx->err != CUDA_SUCCESS) {
+      _cuda_freekernel(res);
+      FAIL(NULL, GA_IMPL_ERROR);
+    }
+
+    cuda_retainkernel(owner);
+    res->mod = owner;
+    res->m = owner->m;
+    res->bin = owner->bin;
+    res->bin_sz = owner->bin_sz;
+    res->ctx = ctx;
+    ctx->refcnt++;
+    TAG_KER(res);
+    return res;
+}
+
+/*
+ * Returns the kernel for these sources from the kernel table or builds it
+ * and adds it there.  If `bin` is not NULL the kernel is loaded from it
+ * instead of compiling the sources.
+ */
+static gpukernel *cuda_table_kernel(cuda_context *ctx, unsigned int count,
+                                    const char **strings,
+                                    const size_t *lengths, const char *fname,
+                                    unsigned int argcount, const int *types,
+                                    int flags, const void *bin, size_t bin_sz,
+                                    int *ret, char **err_str) {
+  strb key = STRB_STATIC_INIT;
+  const char *b = (const char *)bin;
+  gpukernel *res;
+
+  if (kernel_table_key(&key, count, strings, lengths, fname, argcount,
+                       types, flags) == 0) {
+    res = kernel_table_get(ctx->kernels, &key, cuda_retainkernel);
+    if (res != NULL) {
+      strb_clear(&key);
+      return res;
+    }
+  }
+  if (bin != NULL)
+    res = cuda_build_kernel(ctx, 1, &b, &bin_sz, fname, argcount, types,
+                            GA_USE_BINARY, ret, err_str);
+  else
+    res = cuda_build_kernel(ctx, count, strings, lengths, fname, argcount,
+                            types, flags, ret, err_str);
+  if (res != NULL && !strb_error(&key))
+    res->entry = kernel_table_add(ctx->kernels, &key, res);
+  strb_clear(&key);
+  return res;
+}
+
+static gpukernel *cuda_newkernel(void *c, unsigned int count,
+                                 const char **strings, const size_t *lengths,
+                                 const char *fname, unsigned int argcount,
+                                 const int *types, int flags, int *ret,
+                                 char **err_str) {
+  cuda_context *ctx = (cuda_context *)c;
+
+  ASSERT_CTX(ctx);
+
+  return cuda_table_kernel(ctx, count, strings, lengths, fname, argcount,
+                           types, flags, NULL, 0, ret, err_str);
+}
+
+static gpukernel *cuda_kernel_load(void *c, unsigned int count,
+                                   const char **strings, const size_t *lengths,
+                                   const char *fname, unsigned int argcount,
+                                   const int *types, int flags, const void *bin,
+                                   size_t bin_sz, int *ret, char **err_str) {
+  cuda_context *ctx = (cuda_context *)c;
+
+  ASSERT_CTX(ctx);
+
+  return cuda_table_kernel(ctx, count, strings, lengths, fname, argcount,
+                           types, flags, bin, bin_sz, ret, err_str);
+}
+
 static void cuda_freekernel(gpukernel *k) {
   ASSERT_KER(k);
   _cuda_freekernel(k);
 }
 
+static int cuda_kernel_alloc_module(void *c, unsigned int count,
+                                    const char **strings,
+                                    const size_t *lengths, unsigned int n,
+                                    const char **fnames,
+                                    const unsigned int *argcounts,
+                                    const int **types, int flags,
+                                    gpukernel **res, char **err_str) {
+  cuda_context *ctx = (cuda_context *)c;
+  strb key = STRB_STATIC_INIT;
+  gpukernel *owner = NULL;
+  unsigned int i;
+  int err = GA_NO_ERROR;
+
+  ASSERT_CTX(ctx);
+
+  if (n == 0) return GA_VALUE_ERROR;
+
+  for (i = 0; i < n; i++) {
+    res[i] = NULL;
+    strb_reset(&key);
+    if (kernel_table_key(&key, count, strings, lengths, fnames[i],
+                         argcounts[i], types[i], flags) == 0)
+      res[i] = kernel_table_get(ctx->kernels, &key, cuda_retainkernel);
+  }
+  for (i = 0; i < n && err == GA_NO_ERROR; i++) {
+    if (res[i] != NULL)
+      continue;
+    if (owner == NULL) {
+      /* Only the first missing one pays for the compilation */
+      owner = cuda_build_kernel(ctx, count, strings, lengths, fnames[i],
+                                argcounts[i], types[i], flags, &err,
+                                err_str);
+      res[i] = owner;
+    } else {
+      res[i] = cuda_sibling(owner, fnames[i], argcounts[i], types[i], &err);
+    }
+    strb_reset(&key);
+    if (res[i] != NULL &&
+        kernel_table_key(&key, count, strings, lengths, fnames[i],
+                         argcounts[i], types[i], flags) == 0)
+      res[i]->entry = kernel_table_add(ctx->kernels, &key, res[i]);
+  }
+  strb_clear(&key);
+
+  if (err != GA_NO_ERROR) {
+    for (i = 0; i < n; i++) {
+      if (res[i] != NULL)
+        cuda_freekernel(res[i]);
+      res[i] = NULL;
+    }
+  }
+  return err;
+}
+
 static int cuda_callkernel(gpukernel *k, unsigned int n,
                            const size_t *bs, const size_t *gs,
                            size_t shared, void **args) {
     cuda_context *ctx = k->ctx;
+    unsigned int i;
     int res = GA_NO_ERROR;
 
     ASSERT_KER(k);
     cuda_enter(ctx);
 
+    /* We don't know which buffers are written to */
+    for (i = 0; i < k->argcount; i++) {
+      if (k->types[i] == GA_BUFFER &&
+          track_wait((gpudata *)args[i], CUDA_WAIT_WRITE) != GA_NO_ERROR) {
+        cuda_exit(ctx);
+        return GA_IMPL_ERROR;
+      }
+    }
+
     switch (n) {
     case 1:
       ctx->err = cuLaunchKernel(k->k, gs[0], 1, 1, bs[0], 1, 1, shared,
@@ -998,6 +1970,10 @@ static int cuda_callkernel(gpukernel *k, unsigned int n,
     }
     if (ctx->err != CUDA_SUCCESS) {
       res = GA_IMPL_ERROR;
+    } else {
+      for (i = 0; i < k->argcount; i++)
+        if (k->types[i] == GA_BUFFER)
+          track_record((gpudata *)args[i], CUDA_WAIT_WRITE);
     }
 
     cuda_exit(ctx);
@@ -1014,6 +1990,50 @@ static int cuda_kernelbin(gpukernel *k, size_t *sz, void **obj) {
   return GA_NO_ERROR;
 }
 
+/*
+ * The kernels kept in a context don't hold a reference on it,
+ * otherwise it would never go away.  Give it back before releasing
+ * them.
+ */
+static void release_stored(gpukernel *k) {
+  k->ctx->refcnt++;
+  cuda_freekernel(k);
+}
+
+static gpukernel *cuda_kernel_lookup(void *c, const char *key, size_t len) {
+  cuda_context *ctx = (cuda_context *)c;
+  gpukernel *res;
+
+  ASSERT_CTX(ctx);
+  res = kernel_store_get(ctx->kept, key, len);
+  if (res != NULL)
+    cuda_retainkernel(res);
+  return res;
+}
+
+static int cuda_kernel_keep(gpukernel *k, const char *key, size_t len) {
+  ASSERT_KER(k);
+  cuda_retainkernel(k);
+  if (kernel_store_put(k->ctx->kept, key, len, k) != 0) {
+    cuda_freekernel(k);
+    return GA_MEMORY_ERROR;
+  }
+  k->ctx->refcnt--; /* Prevent ref loop */
+  return GA_NO_ERROR;
+}
+
+static int cuda_kernel_compile(void *c, unsigned int count,
+                               const char **strings, const size_t *lengths,
+                               const char *fname, unsigned int argcount,
+                               const int *types, int flags, void **bin,
+                               size_t *bin_sz, char **err_str) {
+  ASSERT_CTX((cuda_context *)c);
+  if (flags & GA_USE_BINARY)
+    return GA_INVALID_ERROR;
+  return cuda_compile((cuda_context *)c, count, strings, lengths, flags,
+                      (char **)bin, bin_sz, err_str);
+}
+
 static int cuda_sync(gpudata *b) {
   cuda_context *ctx = (cuda_context *)b->ctx;
 
@@ -1029,15 +2049,24 @@ static int cuda_sync(gpudata *b) {
 static const char ELEM_HEADER_PTX[] = ".version %s\n.target %s\n\n"
     ".entry extcpy (\n"
     ".param .u%u a_data,\n"
-    ".param .u%u b_data ) {\n"
+    ".param .u%u b_data,\n"
+    ".param .u%u a_off,\n"
+    ".param .u%u b_off";
+
+/* After the parameters of generic kernels */
+static const char ELEM_START_PTX[] = " ) {\n"
     ".reg .u16 rh1, rh2;\n"
     ".reg .u32 r1;\n"
-    ".reg .u%u numThreads, i, a_pi, b_pi, a_p, b_p, rl1;\n"
-    ".reg .u%u rp1, rp2;\n"
+    ".reg .u%u numThreads, i, n, a_pi, b_pi, a_p, b_p, rl1, rl2, rl3;\n"
+    ".reg .u%u rp1, rp2, a_o, b_o;\n"
     ".reg .%s tmpa;\n"
     ".reg .%s tmpb;\n"
     ".reg .pred p;\n"
-    "mov.u16 rh1, %%ntid.x;\n"
+    "ld.param.u%u a_o, [a_off];\n"
+    "ld.param.u%u b_o, [b_off];\n";
+
+/* After n is set */
+static const char ELEM_LOOP_PTX[] = "mov.u16 rh1, %%ntid.x;\n"
     "mov.u16 rh2, %%ctaid.x;\n"
     "mul.wide.u16 r1, rh1, rh2;\n"
     "cvt.u%u.u32 i, r1;\n"
@@ -1047,7 +2076,7 @@ static const char ELEM_HEADER_PTX[] = ".version %s\n.target %s\n\n"
     "mov.u16 rh2, %%nctaid.x;\n"
     "mul.wide.u16 r1, rh2, rh1;\n"
     "cvt.u%u.u32 numThreads, r1;\n"
-    "setp.ge.u%u p, i, %" SPREFIX "uU;\n"
+    "setp.ge.u%u p, i, n;\n"
     "@p bra $end;\n"
     "$loop_begin:\n"
     "mov.u%u a_p, 0U;\n"
@@ -1057,6 +2086,10 @@ static inline ssize_t ssabs(ssize_t v) {
     return (v < 0 ? -v : v);
 }
 
+/*
+ * With dims == NULL the dimensions and strides are read from the
+ * parameters <id>_d<n> and <id>_s<n>.
+ */
 static void cuda_perdim_ptx(strb *sb, unsigned int nd,
 			    const size_t *dims, const ssize_t *str,
 			    const char *id, unsigned int bits) {
@@ -1065,21 +2098,50 @@ static void cuda_perdim_ptx(strb *sb, unsigned int nd,
   if (nd > 0) {
     strb_appendf(sb, "mov.u%u %si, i;\n", bits, id);
     for (i = nd-1; i > 0; i--) {
-      strb_appendf(sb, "rem.u%u rl1, %si, %" SPREFIX "uU;\n"
-		   "mad.lo.s%u %s, rl1, %" SPREFIX "d, %s;\n"
-		   "div.u%u %si, %si, %" SPREFIX "uU;\n",
-		   bits, id, dims[i],
-		   bits, id, str[i], id,
-		   bits, id, id, dims[i]);
+      if (dims == NULL) {
+	strb_appendf(sb, "ld.param.u%u rl2, [%s_d%u];\n"
+		     "ld.param.s%u rl3, [%s_s%u];\n"
+		     "rem.u%u rl1, %si, rl2;\n"
+		     "mad.lo.s%u %s, rl1, rl3, %s;\n"
+		     "div.u%u %si, %si, rl2;\n",
+		     bits, id, i,
+		     bits, id, i,
+		     bits, id,
+		     bits, id, id,
+		     bits, id, id);
+      } else {
+	strb_appendf(sb, "rem.u%u rl1, %si, %" SPREFIX "uU;\n"
+		     "mad.lo.s%u %s, rl1, %" SPREFIX "d, %s;\n"
+		     "div.u%u %si, %si, %" SPREFIX "uU;\n",
+		     bits, id, dims[i],
+		     bits, id, str[i], id,
+		     bits, id, id, dims[i]);
+      }
     }
 
-    strb_appendf(sb, "mad.lo.s%u %s, %si, %" SPREFIX "d, %s;\n",
-		 bits, id, id, str[0], id);
+    if (dims == NULL)
+      strb_appendf(sb, "ld.param.s%u rl3, [%s_s0];\n"
+		   "mad.lo.s%u %s, %si, rl3, %s;\n",
+		   bits, id, bits, id, id, id);
+    else
+      strb_appendf(sb, "mad.lo.s%u %s, %si, %" SPREFIX "d, %s;\n",
+		   bits, id, id, str[0], id);
   }
 }
 
+/* Parameters read by cuda_perdim_ptx() for dims == NULL */
+static void cuda_perdim_params(strb *sb, unsigned int nd, const char *id,
+			       unsigned int bits) {
+  unsigned int i;
+
+  for (i = 0; i < nd; i++)
+    strb_appendf(sb, ",\n.param .u%u %s_d%u", bits, id, i);
+  for (i = 0; i < nd; i++)
+    strb_appendf(sb, ",\n.param .s%u %s_s%u", bits, id, i);
+}
+
 static const char ELEM_FOOTER_PTX[] = "add.u%u i, i, numThreads;\n"
-    "setp.lt.u%u p, i, %" SPREFIX "uU;\n"
+    "setp.lt.u%u p, i, n;\n"
     "@p bra $loop_begin;\n"
     "$end:\n"
     "ret;\n"
@@ -1158,14 +2220,16 @@ static inline unsigned int xmin(unsigned long a, unsigned long b) {
     return (unsigned int)((a < b) ? a : b);
 }
 
+/* For generic keys nEls is ignored */
 static inline int gen_extcopy_kernel(const cache_key_t *a,
-				     cuda_context *ctx, cache_val_t *v,
+				     cuda_context *ctx, gpukernel **k,
 				     size_t nEls) {
   strb sb = STRB_STATIC_INIT;
   int res = GA_SYS_ERROR;
   int flags = GA_USE_PTX;
   unsigned int bits = sizeof(void *)*8;
-  int types[2];
+  unsigned int argcount;
+  int types[5 + 4*EXTCOPY_GENERIC_ND];
   const char *in_t, *in_ld_t;
   const char *out_t, *out_ld_t;
   const char *rmod;
@@ -1188,8 +2252,18 @@ static inline int gen_extcopy_kernel(const cache_key_t *a,
   strb_appendf(&sb, ELEM_HEADER_PTX,
 	       /* This is a giant hack to see if we are on CC < 3.0 */
 	       ctx->bin_id[strlen(ARCH_PREFIX)] < '3' ? "3.0" : "4.2",
-	       ctx->bin_id, bits, bits, bits, bits, in_t, out_t, bits,
-	       bits, bits, bits, bits, nEls, bits, bits);
+	       ctx->bin_id, bits, bits, bits, bits);
+  if (a->generic) {
+    strb_appendf(&sb, ",\n.param .u%u nels", bits);
+    cuda_perdim_params(&sb, a->ind, "a_p", bits);
+    cuda_perdim_params(&sb, a->ond, "b_p", bits);
+  }
+  strb_appendf(&sb, ELEM_START_PTX, bits, bits, in_t, out_t, bits, bits);
+  if (a->generic)
+    strb_appendf(&sb, "ld.param.u%u n, [nels];\n", bits);
+  else
+    strb_appendf(&sb, "mov.u%u n, %" SPREFIX "uU;\n", bits, nEls);
+  strb_appendf(&sb, ELEM_LOOP_PTX, bits, bits, bits, bits, bits, bits, bits);
 
   cuda_perdim_ptx(&sb, a->ind, a->idims, a->istr, "a_p", bits);
   cuda_perdim_ptx(&sb, a->ond, a->odims, a->ostr, "b_p", bits);
@@ -1197,22 +2271,26 @@ static inline int gen_extcopy_kernel(const cache_key_t *a,
   strb_appendf(&sb, "ld.param.u%u rp1, [a_data];\n"
 	       "cvt.s%u.s%u rp2, a_p;\n"
 	       "add.s%u rp1, rp1, rp2;\n"
-	       "ld.global.%s tmpa, [rp1+%" SPREFIX "u];\n"
+	       "add.u%u rp1, rp1, a_o;\n"
+	       "ld.global.%s tmpa, [rp1];\n"
 	       "cvt%s.%s.%s tmpb, tmpa;\n"
 	       "ld.param.u%u rp1, [b_data];\n"
 	       "cvt.s%u.s%u rp2, b_p;\n"
 	       "add.s%u rp1, rp1, rp2;\n"
-	       "st.global.%s [rp1+%" SPREFIX "u], tmpb;\n", bits,
+	       "add.u%u rp1, rp1, b_o;\n"
+	       "st.global.%s [rp1], tmpb;\n", bits,
 	       bits, bits,
 	       bits,
-	       in_ld_t, a->ioff,
+	       bits,
+	       in_ld_t,
 	       rmod, out_t, in_t,
 	       bits,
 	       bits, bits,
 	       bits,
-	       out_ld_t, a->ooff);
+	       bits,
+	       out_ld_t);
 
-  strb_appendf(&sb, ELEM_FOOTER_PTX, bits, bits, nEls);
+  strb_appendf(&sb, ELEM_FOOTER_PTX, bits, bits);
 
   if (strb_error(&sb))
     goto fail;
@@ -1236,10 +2314,10 @@ static inline int gen_extcopy_kernel(const cache_key_t *a,
     flags |= GA_USE_COMPLEX;
   }
 
-  types[0] = types[1] = GA_BUFFER;
+  argcount = extcopy_types(a, types);
   res = GA_NO_ERROR;
-  *v = cuda_newkernel(ctx, 1, (const char **)&sb.s, &sb.l, "extcpy",
-                      2, types, flags, &res, NULL);
+  *k = cuda_newkernel(ctx, 1, (const char **)&sb.s, &sb.l, "extcpy",
+                      argcount, types, flags, &res, NULL);
  fail:
   strb_clear(&sb);
   return res;
@@ -1253,13 +2331,13 @@ static int cuda_extcopy(gpudata *input, size_t ioff, gpudata *output,
                         const ssize_t *a_str, unsigned int b_nd,
                         const size_t *b_dims, const ssize_t *b_str) {
   cuda_context *ctx = input->ctx;
-  void *args[2];
+  void *args[5 + 4*EXTCOPY_GENERIC_ND];
   int res = GA_SYS_ERROR;
-  int in_cache = 1;
   unsigned int i;
   size_t nEls = 1, ls, gs;
   gpukernel *k;
-  cache_val_t *v;
+  gpukernel *owned = NULL; /* kernel that didn't make it in a cache */
+  cache_val_t l, *v;
   cache_key_t a;
 
   ASSERT_BUF(input);
@@ -1276,51 +2354,89 @@ static int cuda_extcopy(gpudata *input, size_t ioff, gpudata *output,
   a.ond = b_nd;
   a.itype = intype;
   a.otype = outtype;
-  a.ioff = ioff;
-  a.ooff = ooff;
   a.idims = a_dims;
   a.odims = b_dims;
   a.istr = a_str;
   a.ostr = b_str;
+  a.generic = 0;
 
   do_key_hash(&a);
 
   v = cache_get(ctx->extcopy_cache, &a);
   if (v == NULL) {
-    v = &k;
-    res = gen_extcopy_kernel(&a, input->ctx, v, nEls);
-    if (res != GA_NO_ERROR)
-      return res;
-
-    /* Cache the kernel */
+    /* Start counting calls for this layout */
+    l.k = NULL;
+    l.ncall = 0;
     a.idims = memdup(a_dims, a_nd*sizeof(size_t));
     a.odims = memdup(b_dims, b_nd*sizeof(size_t));
     a.istr = memdup(a_str, a_nd*sizeof(ssize_t));
     a.ostr = memdup(b_str, b_nd*sizeof(ssize_t));
     if (a.idims == NULL || a.odims == NULL ||
 	a.istr == NULL || a.ostr == NULL ||
-	cache_insert(ctx->extcopy_cache, &a, v)) {
+	cache_insert(ctx->extcopy_cache, &a, &l)) {
       /* Cache insert or memdup failed */
       free((void *)a.idims);
       free((void *)a.odims);
       free((void *)a.istr);
       free((void *)a.ostr);
-      in_cache = 0;
+      v = &l;
+    } else {
+      v = cache_get(ctx->extcopy_cache, &a);
+    }
+    a.idims = a_dims;
+    a.odims = b_dims;
+    a.istr = a_str;
+    a.ostr = b_str;
+  }
+
+  if (v->k == NULL &&
+      (++v->ncall > EXTCOPY_SPEC_LIMIT ||
+       a_nd > EXTCOPY_GENERIC_ND || b_nd > EXTCOPY_GENERIC_ND)) {
+    res = gen_extcopy_kernel(&a, ctx, &v->k, nEls);
+    if (res != GA_NO_ERROR)
+      return res;
+    if (v == &l)
+      owned = l.k;
+  }
+
+  args[0] = input;
+  args[1] = output;
+  args[2] = &ioff;
+  args[3] = &ooff;
+  if (v->k != NULL) {
+    k = v->k;
+  } else {
+    a.idims = a.odims = NULL;
+    a.istr = a.ostr = NULL;
+    a.generic = 1;
+    do_key_hash(&a);
+
+    v = cache_get(ctx->extcopy_generic, &a);
+    if (v == NULL) {
+      l.k = NULL;
+      l.ncall = 0;
+      res = gen_extcopy_kernel(&a, ctx, &l.k, 0);
+      if (res != GA_NO_ERROR)
+        return res;
+      if (cache_insert(ctx->extcopy_generic, &a, &l))
+        owned = l.k;
+      v = &l;
     }
+    k = v->k;
+    extcopy_generic_args(args + 4, &nEls, a_nd, a_dims, a_str,
+                         b_nd, b_dims, b_str);
   }
 
   /* Cheap kernel scheduling */
-  res = cuda_property(NULL, NULL, *v, GA_KERNEL_PROP_MAXLSIZE, &ls);
+  res = cuda_property(NULL, NULL, k, GA_KERNEL_PROP_MAXLSIZE, &ls);
   if (res != GA_NO_ERROR) goto fail;
 
   gs = ((nEls-1) / ls) + 1;
-  args[0] = input;
-  args[1] = output;
-  res = cuda_callkernel(*v, 1, &ls, &gs, 0, args);
+  res = cuda_callkernel(k, 1, &ls, &gs, 0, args);
 
 fail:
-  if (!in_cache)
-    cuda_freekernel(*v);
+  if (owned != NULL)
+    cuda_freekernel(owned);
   return res;
 }
 
@@ -1339,17 +2455,46 @@ static gpudata *cuda_transfer(gpudata *src, size_t offset, size_t sz,
         cuda_retain(src);
         return src;
     }
+    if (may_share && offset <= src->sz && src->sz - offset >= sz) {
+      /* Make a view of the requested part */
+      dst = malloc(sizeof(*dst));
+      if (dst == NULL) return NULL;
+      dst->ptr = src->ptr + offset;
+      dst->host = src->host == NULL ? NULL : (char *)src->host + offset;
+      dst->ev = src->ev;
+      dst->sz = sz;
+      dst->flags = DONTFREE |
+        (src->flags & (GA_BUFFER_READ_ONLY|GA_BUFFER_WRITE_ONLY|
+                       GA_BUFFER_HOST));
+      dst->refcnt = 1;
+      dst->base = src;
+      dst->off = offset;
+      dst->next = NULL;
+      dst->ctx = ctx;
+      cuda_retain(src);
+      ctx->refcnt++;
+      TAG_BUF(dst);
+      return dst;
+    }
     dst = cuda_alloc(ctx, sz, NULL, src->flags & (GA_BUFFER_READ_ONLY|
                                                   GA_BUFFER_WRITE_ONLY), NULL);
     if (dst == NULL) return NULL;
     cuda_enter(ctx);
 
+    if (track_wait(src, CUDA_WAIT_READ) != GA_NO_ERROR ||
+        track_wait(dst, CUDA_WAIT_WRITE) != GA_NO_ERROR) {
+      cuda_exit(ctx);
+      cuda_free(dst);
+      return NULL;
+    }
     ctx->err = cuMemcpyDtoDAsync(dst->ptr, src->ptr+offset, sz, ctx->s);
     if (ctx->err != CUDA_SUCCESS) {
       cuda_exit(ctx);
       cuda_free(dst);
       return NULL;
     }
+    track_record(src, CUDA_WAIT_READ);
+    track_record(dst, CUDA_WAIT_WRITE);
     cuda_exit(ctx);
     return dst;
   }
@@ -1377,6 +2522,111 @@ static gpudata *cuda_transfer(gpudata *src, size_t offset, size_t sz,
   return NULL;
 }
 
+/*
+ * Make `s` wait for the work issued to `other` so far.  Must be called
+ * inside the context.
+ */
+static int stream_join(cuda_context *ctx, CUstream s, CUstream other) {
+  CUevent ev;
+
+  if (s == other)
+    return GA_NO_ERROR;
+  if (make_event(ctx, &ev) != 0)
+    return GA_IMPL_ERROR;
+  ctx->err = cuEventRecord(ev, other);
+  if (ctx->err == CUDA_SUCCESS)
+    ctx->err = cuStreamWaitEvent(s, ev, 0);
+  /* The event is released once it completes */
+  cuEventDestroy(ev);
+  return ctx->err == CUDA_SUCCESS ? GA_NO_ERROR : GA_IMPL_ERROR;
+}
+
+static gpustream *cuda_stream_new(void *c, int *ret) {
+  cuda_context *ctx = (cuda_context *)c;
+  gpustream *res;
+
+  ASSERT_CTX(ctx);
+  res = malloc(sizeof(*res));
+  if (res == NULL)
+    FAIL(NULL, GA_SYS_ERROR);
+  res->ctx = ctx;
+
+  cuda_enter(ctx);
+  ctx->err = cuStreamCreate(&res->s, 0);
+  if (ctx->err != CUDA_SUCCESS) {
+    free(res);
+    cuda_exit(ctx);
+    FAIL(NULL, GA_IMPL_ERROR);
+  }
+  /*
+   * Buffers used with a single stream don't have their event
+   * recorded (except those in host memory), so order the new stream
+   * after all of that work.
+   */
+  if (stream_join(ctx, res->s, ctx->s) != GA_NO_ERROR) {
+    cuStreamDestroy(res->s);
+    free(res);
+    cuda_exit(ctx);
+    FAIL(NULL, GA_IMPL_ERROR);
+  }
+  cuda_exit(ctx);
+  ctx->nstreams++;
+  ctx->refcnt++;
+  return res;
+}
+
+static void cuda_stream_free(gpustream *s) {
+  cuda_context *ctx = s->ctx;
+
+  ASSERT_CTX(ctx);
+  cuda_enter(ctx);
+  if (ctx->s == s->s)
+    ctx->s = ctx->s0;
+  /* The default stream will not track the buffers anymore without it */
+  stream_join(ctx, ctx->s0, s->s);
+  cuStreamDestroy(s->s);
+  cuda_exit(ctx);
+  ctx->nstreams--;
+  free(s);
+  cuda_free_ctx(ctx);
+}
+
+static int cuda_stream_use(void *c, gpustream *s) {
+  cuda_context *ctx = (cuda_context *)c;
+
+  ASSERT_CTX(ctx);
+  if (s != NULL && s->ctx != ctx)
+    return GA_VALUE_ERROR;
+  ctx->s = s == NULL ? ctx->s0 : s->s;
+  return GA_NO_ERROR;
+}
+
+static int cuda_stream_sync(void *c, gpustream *s) {
+  cuda_context *ctx = (cuda_context *)c;
+
+  ASSERT_CTX(ctx);
+  if (s != NULL && s->ctx != ctx)
+    return GA_VALUE_ERROR;
+  cuda_enter(ctx);
+  ctx->err = cuStreamSynchronize(s == NULL ? ctx->s0 : s->s);
+  cuda_exit(ctx);
+  return ctx->err == CUDA_SUCCESS ? GA_NO_ERROR : GA_IMPL_ERROR;
+}
+
+static int cuda_stream_wait(void *c, gpustream *s, gpustream *other) {
+  cuda_context *ctx = (cuda_context *)c;
+  int res;
+
+  ASSERT_CTX(ctx);
+  if ((s != NULL && s->ctx != ctx) || (other != NULL && other->ctx != ctx))
+    return GA_VALUE_ERROR;
+  cuda_enter(ctx);
+  res = stream_join(ctx, s == NULL ? ctx->s0 : s->s,
+                    other == NULL ? ctx->s0 : other->s);
+  cuda_exit(ctx);
+  return res;
+}
+
 #ifdef WITH_CUDA_CUBLAS
 extern gpuarray_blas_ops cublas_ops;
 #endif
@@ -1520,6 +2770,44 @@ static int cuda_property(void *c, gpudata *buf, gpukernel *k, int prop_id,
     *((gpudata **)res) = ctx->errbuf;
     return GA_NO_ERROR;
 
+  case GA_CTX_PROP_POOL_STEALS:
+  case GA_CTX_PROP_POOL_IDLE:
+  case GA_CTX_PROP_POOL_CHUNKSIZE:
+    return GA_DEVSUP_ERROR;
+
+  case GA_CTX_PROP_CACHED_BYTES:
+    *((size_t *)res) = ctx->cached;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_INUSE_BYTES:
+    *((size_t *)res) = ctx->inuse;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_PEAK_BYTES:
+    *((size_t *)res) = ctx->peak;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_NUM_BUFFERS:
+    *((size_t *)res) = ctx->nbufs;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_NUM_ALLOCS:
+    *((size_t *)res) = ctx->nallocs;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_KERNEL_CACHE_HITS:
+    kernel_table_stats(ctx->kernels, (size_t *)res, NULL);
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_KERNEL_CACHE_MISSES:
+    kernel_table_stats(ctx->kernels, NULL, (size_t *)res);
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_EXTCOPY_CACHE_SIZE:
+    *((size_t *)res) = extcopy_nkernels(ctx->extcopy_cache,
+                                        ctx->extcopy_generic);
+    return GA_NO_ERROR;
+
   case GA_BUFFER_PROP_REFCNT:
     *((unsigned int *)res) = buf->refcnt;
     return GA_NO_ERROR;
@@ -1528,6 +2816,12 @@ static int cuda_property(void *c, gpudata *buf, gpukernel *k, int prop_id,
     *((size_t *)res) = buf->sz;
     return GA_NO_ERROR;
 
+  case GA_BUFFER_PROP_HOSTPOINTER:
+    if (buf->host == NULL)
+      return GA_VALUE_ERROR;
+    *((void **)res) = buf->host;
+    return GA_NO_ERROR;
+
   case GA_BUFFER_PROP_CTX:
   case GA_KERNEL_PROP_CTX:
     *((void **)res) = (void *)ctx;
@@ -1601,4 +2895,27 @@ const gpuarray_buffer_ops cuda_ops = {cuda_init,
                                       cuda_extcopy,
                                       cuda_transfer,
                                       cuda_property,
-                                      cuda_error};
+                                      cuda_error,
+                                      cuda_trim,
+                                      cuda_reset_peak,
+                                      cuda_kernel_lookup,
+                                      cuda_kernel_keep,
+                                      cuda_kernel_compile,
+                                      cuda_kernel_alloc_module,
+                                      cuda_kernel_load,
+                                      cuda_memset_range,
+                                      cuda_fill,
+                                      cuda_stream_new,
+                                      cuda_stream_free,
+                                      cuda_stream_use,
+                                      cuda_stream_sync,
+                                      cuda_stream_wait,
+                                      cuda_read_async,
+                                      cuda_write_async,
+                                      cuda_event_query,
+                                      cuda_event_sync,
+                                      cuda_event_free,
+                                      cuda_event_new,
+                                      cuda_event_record,
+                                      cuda_event_wait,
+                                      cuda_event_elapsed};
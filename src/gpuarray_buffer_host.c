@@ -0,0 +1,1593 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "private.h"
+#include "private_host.h"
+
+#include <sys/types.h>
+#include <sys/utsname.h>
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gpuarray/buffer.h"
+#include "gpuarray/util.h"
+#include "gpuarray/error.h"
+#include "gpuarray/buffer_blas.h"
+
+/*
+ * Private buffer flag (upper 16 bits): memory is owned by someone else,
+ * which is `base` if set.
+ */
+#define HOST_DONTFREE 0x10000
+
+/* Limits we report for kernel launches */
+#define HOST_MAXLSIZE 1024
+#define HOST_LMEMSIZE 65536
+
+/* Alignment of buffer allocations (enough for any vector type) */
+#define HOST_ALIGN 64
+
+static char err[256];
+
+#define FAIL(v, e) { if (ret) *ret = e; return v; }
+
+static gpudata *host_alloc(void *c, size_t size, void *data, int flags,
+                           int *ret);
+static void host_release(gpudata *b);
+static int host_trim(void *c);
+static void host_releasekernel(gpukernel *k);
+static void release_stored(gpukernel *k);
+
+/* Record an error message for `ctx` or globally if `ctx` is NULL */
+static void seterr(host_ctx *ctx, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  if (ctx == NULL)
+    vsnprintf(err, sizeof(err), fmt, ap);
+  else
+    vsnprintf(ctx->err, sizeof(ctx->err), fmt, ap);
+  va_end(ap);
+}
+
+host_ctx *host_make_ctx(int flags) {
+  struct utsname u;
+  host_ctx *res;
+  long ncpu;
+  int64_t v = 0;
+  int e = 0;
+
+  res = malloc(sizeof(*res));
+  if (res == NULL) return NULL;
+
+  res->refcnt = 1;
+  res->flags = flags;
+  res->err[0] = '\0';
+  memset(res->freebufs, 0, sizeof(res->freebufs));
+  res->cached = 0;
+  res->inuse = 0;
+  res->peak = 0;
+  res->nbufs = 0;
+  res->nallocs = 0;
+  memset(res->arena, 0, sizeof(res->arena));
+  memset(res->arena_off, 0, sizeof(res->arena_off));
+
+  if (uname(&u) == 0)
+    snprintf(res->bin_id, sizeof(res->bin_id), "host %.24s %.24s", u.sysname,
+             u.machine);
+  else
+    strlcpy(res->bin_id, "host", sizeof(res->bin_id));
+
+  if (flags & GA_CTX_SINGLE_THREAD) {
+    ncpu = 1;
+  } else {
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1) ncpu = 1;
+  }
+
+  res->kernels = kernel_table_new();
+  if (res->kernels == NULL) {
+    free(res);
+    return NULL;
+  }
+
+  res->kept = kernel_store_new(release_stored);
+  if (res->kept == NULL) {
+    kernel_table_free(res->kernels);
+    free(res);
+    return NULL;
+  }
+
+  res->pool = host_pool_new((unsigned int)ncpu);
+  if (res->pool == NULL) {
+    seterr(NULL, "Could not start thread pool");
+    kernel_store_free(res->kept);
+    kernel_table_free(res->kernels);
+    free(res);
+    return NULL;
+  }
+
+  TAG_CTX(res);
+  res->errbuf = host_alloc(res, 8, &v, GA_BUFFER_INIT, &e);
+  if (e != GA_NO_ERROR) {
+    host_pool_free(res->pool);
+    kernel_store_free(res->kept);
+    kernel_table_free(res->kernels);
+    free(res);
+    return NULL;
+  }
+  res->refcnt--; /* Prevent ref loop */
+  return res;
+}
+
+static void host_free_ctx(host_ctx *ctx) {
+  ASSERT_CTX(ctx);
+  assert(ctx->refcnt != 0);
+  ctx->refcnt--;
+  if (ctx->refcnt == 0) {
+    if (ctx->errbuf != NULL) {
+      ctx->refcnt = 2; /* Avoid recursive release */
+      host_release(ctx->errbuf);
+    }
+    /* This needs refcnt != 0, see release_stored() */
+    kernel_store_free(ctx->kept);
+    host_trim(ctx);
+    host_pool_free(ctx->pool);
+    kernel_table_free(ctx->kernels);
+    CLEAR(ctx);
+    free(ctx);
+  }
+}
+
+gpudata *host_make_buf(void *c, void *p, size_t sz) {
+  host_ctx *ctx = (host_ctx *)c;
+  gpudata *res;
+
+  ASSERT_CTX(ctx);
+
+  res = malloc(sizeof(*res));
+  if (res == NULL) return NULL;
+
+  res->ptr = p;
+  res->sz = sz;
+  res->flags = HOST_DONTFREE;
+  res->refcnt = 1;
+  res->base = NULL;
+  res->off = 0;
+  res->next = NULL;
+  res->ctx = ctx;
+  ctx->refcnt++;
+
+  TAG_BUF(res);
+  return res;
+}
+
+void *host_get_ptr(gpudata *g) { ASSERT_BUF(g); return g->ptr; }
+
+static void *host_init(int devno, int flags, int *ret) {
+  host_ctx *res;
+
+  /* There is only the one host */
+  if (devno != 0) FAIL(NULL, GA_VALUE_ERROR);
+
+  res = host_make_ctx(flags);
+  if (res == NULL) FAIL(NULL, GA_IMPL_ERROR);
+  return res;
+}
+
+static void host_deinit(void *c) {
+  ASSERT_CTX((host_ctx *)c);
+  host_free_ctx((host_ctx *)c);
+}
+
+/*
+ * Size of the allocation backing a buffer of `sz` bytes and its class
+ * in the allocation cache (-1 if it doesn't go in the cache).
+ */
+static int buf_class(host_ctx *ctx, size_t sz, size_t *csz) {
+  if (!(ctx->flags & GA_CTX_DISABLE_ALLOCATION_CACHE))
+    return alloc_class(sz, csz);
+  *csz = sz;
+  return -1;
+}
+
+/* Memory for a buffer, giving back the cache if we are short */
+static void *get_mem(host_ctx *ctx, size_t sz) {
+  void *res;
+
+  /* Avoid handing out a NULL pointer for a zero-sized buffer */
+  if (sz == 0) sz = 1;
+  if (posix_memalign(&res, HOST_ALIGN, sz) != 0) {
+    host_trim(ctx);
+    if (posix_memalign(&res, HOST_ALIGN, sz) != 0)
+      return NULL;
+  }
+  ctx->nallocs++;
+  return res;
+}
+
+/*
+ * Arena blocks are only referenced by the buffers carved out of them
+ * and by ctx->arena.  They don't hold a reference on the context.
+ */
+static void block_release(gpudata *blk) {
+  blk->refcnt--;
+  if (blk->refcnt == 0) {
+    free(blk->ptr);
+    free(blk);
+  }
+}
+
+/* Point `b` to the next free `csz` bytes of the block for `cls` */
+static int arena_carve(host_ctx *ctx, int cls, size_t csz, gpudata *b) {
+  gpudata *blk = ctx->arena[cls];
+
+  if (blk == NULL || ARENA_BLOCKSIZE - ctx->arena_off[cls] < csz) {
+    blk = malloc(sizeof(*blk));
+    if (blk == NULL)
+      return -1;
+    blk->ptr = get_mem(ctx, ARENA_BLOCKSIZE);
+    if (blk->ptr == NULL) {
+      free(blk);
+      return -1;
+    }
+    blk->sz = ARENA_BLOCKSIZE;
+    blk->ctx = ctx;
+    blk->flags = 0;
+    blk->refcnt = 1;
+    blk->base = NULL;
+    blk->off = 0;
+    blk->next = NULL;
+    /* get_mem() may have trimmed ctx->arena[cls] */
+    if (ctx->arena[cls] != NULL)
+      block_release(ctx->arena[cls]);
+    ctx->arena[cls] = blk;
+    ctx->arena_off[cls] = 0;
+  }
+
+  b->base = blk;
+  b->off = ctx->arena_off[cls];
+  b->ptr = (char *)blk->ptr + b->off;
+  blk->refcnt++;
+  ctx->arena_off[cls] += csz;
+  return 0;
+}
+
+/* Give back the memory of a buffer that is not in use */
+static void free_buf(gpudata *b) {
+  if (b->base != NULL)
+    block_release(b->base);
+  else
+    free(b->ptr);
+  free(b);
+}
+
+static gpudata *host_alloc(void *c, size_t size, void *data, int flags,
+                           int *ret) {
+  host_ctx *ctx = (host_ctx *)c;
+  gpudata *res;
+  size_t csz;
+  int cls;
+
+  ASSERT_CTX(ctx);
+
+  if ((flags & GA_BUFFER_INIT) && data == NULL) FAIL(NULL, GA_VALUE_ERROR);
+  if ((flags & (GA_BUFFER_READ_ONLY|GA_BUFFER_WRITE_ONLY)) ==
+      (GA_BUFFER_READ_ONLY|GA_BUFFER_WRITE_ONLY)) FAIL(NULL, GA_VALUE_ERROR);
+
+  cls = buf_class(ctx, size, &csz);
+  if (cls != -1 && ctx->freebufs[cls] != NULL) {
+    res = ctx->freebufs[cls];
+    ctx->freebufs[cls] = res->next;
+    ctx->cached -= csz;
+  } else {
+    res = malloc(sizeof(*res));
+    if (res == NULL) FAIL(NULL, GA_SYS_ERROR);
+
+    if (cls != -1 && cls < ARENA_NCLASSES &&
+        !(ctx->flags & GA_CTX_DISABLE_SUBALLOCATION)) {
+      if (arena_carve(ctx, cls, csz, res) != 0) {
+        free(res);
+        FAIL(NULL, GA_MEMORY_ERROR);
+      }
+    } else {
+      res->base = NULL;
+      res->off = 0;
+      res->ptr = get_mem(ctx, csz);
+      if (res->ptr == NULL) {
+        free(res);
+        FAIL(NULL, GA_MEMORY_ERROR);
+      }
+    }
+  }
+
+  if (flags & GA_BUFFER_INIT)
+    memcpy(res->ptr, data, size);
+
+  res->sz = size;
+  res->flags = flags & (GA_BUFFER_READ_ONLY|GA_BUFFER_WRITE_ONLY);
+  res->refcnt = 1;
+  res->next = NULL;
+  res->ctx = ctx;
+  ctx->refcnt++;
+  ctx->inuse += csz;
+  if (ctx->inuse > ctx->peak)
+    ctx->peak = ctx->inuse;
+  ctx->nbufs++;
+
+  TAG_BUF(res);
+  return res;
+}
+
+static void host_retain(gpudata *b) {
+  ASSERT_BUF(b);
+  b->refcnt++;
+}
+
+static void host_release(gpudata *b) {
+  host_ctx *ctx;
+  gpudata *base;
+  size_t csz;
+  int cls;
+
+  ASSERT_BUF(b);
+  b->refcnt--;
+  if (b->refcnt == 0) {
+    CLEAR(b);
+    ctx = b->ctx;
+    if (b->flags & HOST_DONTFREE) {
+      base = b->base;
+      free(b);
+      if (base != NULL)
+        host_release(base);
+    } else {
+      cls = buf_class(ctx, b->sz, &csz);
+      ctx->inuse -= csz;
+      ctx->nbufs--;
+      if (cls != -1) {
+        b->next = ctx->freebufs[cls];
+        ctx->freebufs[cls] = b;
+        ctx->cached += csz;
+      } else {
+        free_buf(b);
+      }
+    }
+    /* This may free the context, which empties the cache */
+    host_free_ctx(ctx);
+  }
+}
+
+static int host_trim(void *c) {
+  host_ctx *ctx = (host_ctx *)c;
+  gpudata *b;
+  unsigned int i;
+
+  ASSERT_CTX(ctx);
+
+  for (i = 0; i < ALLOC_NCLASSES; i++) {
+    while (ctx->freebufs[i] != NULL) {
+      b = ctx->freebufs[i];
+      ctx->freebufs[i] = b->next;
+      free_buf(b);
+    }
+  }
+  ctx->cached = 0;
+
+  /* Blocks stay around as long as some of their buffers are in use */
+  for (i = 0; i < ARENA_NCLASSES; i++) {
+    if (ctx->arena[i] != NULL) {
+      block_release(ctx->arena[i]);
+      ctx->arena[i] = NULL;
+    }
+  }
+  return GA_NO_ERROR;
+}
+
+static int host_reset_peak(void *c) {
+  host_ctx *ctx = (host_ctx *)c;
+
+  ASSERT_CTX(ctx);
+  ctx->peak = ctx->inuse;
+  return GA_NO_ERROR;
+}
+
+static int host_share(gpudata *a, gpudata *b, int *ret) {
+  const char *pa, *pb;
+
+  ASSERT_BUF(a);
+  ASSERT_BUF(b);
+
+  pa = (const char *)a->ptr;
+  pb = (const char *)b->ptr;
+  return (a->ctx == b->ctx && a->sz != 0 && b->sz != 0 &&
+          ((pa <= pb && pa + a->sz > pb) ||
+           (pb <= pa && pb + b->sz > pa)));
+}
+
+static int host_move(gpudata *dst, size_t dstoff, gpudata *src, size_t srcoff,
+                     size_t sz) {
+  ASSERT_BUF(dst);
+  ASSERT_BUF(src);
+
+  if (dst->ctx != src->ctx) return GA_VALUE_ERROR;
+
+  if (sz == 0) return GA_NO_ERROR;
+
+  if (dstoff > dst->sz || (dst->sz - dstoff) < sz ||
+      srcoff > src->sz || (src->sz - srcoff) < sz)
+    return GA_VALUE_ERROR;
+
+  memmove((char *)dst->ptr + dstoff, (char *)src->ptr + srcoff, sz);
+  return GA_NO_ERROR;
+}
+
+static int host_read(void *dst, gpudata *src, size_t srcoff, size_t sz) {
+  ASSERT_BUF(src);
+
+  if (sz == 0) return GA_NO_ERROR;
+
+  if (srcoff > src->sz || (src->sz - srcoff) < sz)
+    return GA_VALUE_ERROR;
+
+  memcpy(dst, (char *)src->ptr + srcoff, sz);
+  return GA_NO_ERROR;
+}
+
+static int host_write(gpudata *dst, size_t dstoff, const void *src,
+                      size_t sz) {
+  ASSERT_BUF(dst);
+
+  if (sz == 0) return GA_NO_ERROR;
+
+  if (dstoff > dst->sz || (dst->sz - dstoff) < sz)
+    return GA_VALUE_ERROR;
+
+  memcpy((char *)dst->ptr + dstoff, src, sz);
+  return GA_NO_ERROR;
+}
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Operations are done when they return, so an event is complete as
+ * soon as it is recorded and its time is the time of the record.
+ */
+static gpuevent *host_event_new(void *c, int flags, int *ret) {
+  host_ctx *ctx = (host_ctx *)c;
+  gpuevent *res;
+
+  ASSERT_CTX(ctx);
+  res = malloc(sizeof(*res));
+  if (res == NULL) FAIL(NULL, GA_MEMORY_ERROR);
+  res->ctx = ctx;
+  res->t = -1;
+  res->flags = flags;
+  ctx->refcnt++;
+  return res;
+}
+
+static int host_read_async(void *dst, gpudata *src, size_t srcoff, size_t sz,
+                           gpuevent **ev) {
+  int err;
+
+  err = host_read(dst, src, srcoff, sz);
+  if (err != GA_NO_ERROR)
+    return err;
+  *ev = host_event_new(src->ctx, 0, &err);
+  if (*ev != NULL)
+    (*ev)->t = now();
+  return err;
+}
+
+static int host_write_async(gpudata *dst, size_t dstoff, const void *src,
+                            size_t sz, gpuevent **ev) {
+  int err;
+
+  err = host_write(dst, dstoff, src, sz);
+  if (err != GA_NO_ERROR)
+    return err;
+  *ev = host_event_new(dst->ctx, 0, &err);
+  if (*ev != NULL)
+    (*ev)->t = now();
+  return err;
+}
+
+static int host_event_query(gpuevent *ev) {
+  return 1;
+}
+
+static int host_event_sync(gpuevent *ev) {
+  return GA_NO_ERROR;
+}
+
+static void host_event_free(gpuevent *ev) {
+  host_ctx *ctx = ev->ctx;
+
+  free(ev);
+  host_free_ctx(ctx);
+}
+
+static int host_event_record(gpuevent *ev, gpustream *s) {
+  if (s != NULL && s->ctx != ev->ctx)
+    return GA_VALUE_ERROR;
+  ev->t = now();
+  return GA_NO_ERROR;
+}
+
+static int host_event_wait(gpuevent *ev, gpustream *s) {
+  if (s != NULL && s->ctx != ev->ctx)
+    return GA_VALUE_ERROR;
+  return GA_NO_ERROR;
+}
+
+static int host_event_elapsed(gpuevent *start, gpuevent *end, double *ms) {
+  if (end->ctx != start->ctx ||
+      !(start->flags & end->flags & GA_EVENT_TIMING) ||
+      start->t < 0 || end->t < 0)
+    return GA_VALUE_ERROR;
+  *ms = (end->t - start->t) * 1e3;
+  return GA_NO_ERROR;
+}
+
+static int host_memset_range(gpudata *dst, size_t dstoff, size_t sz,
+                             int data) {
+  ASSERT_BUF(dst);
+
+  if (dst->flags & GA_BUFFER_READ_ONLY) return GA_READONLY_ERROR;
+
+  if (dstoff > dst->sz || dst->sz - dstoff < sz) return GA_VALUE_ERROR;
+
+  memset((char *)dst->ptr + dstoff, data, sz);
+  return GA_NO_ERROR;
+}
+
+static int host_fill(gpudata *dst, size_t dstoff, size_t sz,
+                     const void *pattern, size_t psz) {
+  char *p;
+  size_t done;
+
+  ASSERT_BUF(dst);
+
+  if (dst->flags & GA_BUFFER_READ_ONLY) return GA_READONLY_ERROR;
+
+  if (psz == 0 || sz % psz != 0 || dstoff > dst->sz || dst->sz - dstoff < sz)
+    return GA_VALUE_ERROR;
+
+  if (sz == 0) return GA_NO_ERROR;
+
+  p = (char *)dst->ptr + dstoff;
+  memcpy(p, pattern, psz);
+  /* Double the filled part at each step */
+  for (done = psz; done < sz; done *= 2)
+    memcpy(p + done, p, done < sz - done ? done : sz - done);
+  return GA_NO_ERROR;
+}
+
+static int host_memset(gpudata *dst, size_t dstoff, int data) {
+  ASSERT_BUF(dst);
+
+  if (dstoff > dst->sz) return GA_VALUE_ERROR;
+  return host_memset_range(dst, dstoff, dst->sz - dstoff, data);
+}
+
+/*
+ * Produces the shared object image with the entry points of the `n`
+ * kernels defined in the sources.  This only reads ctx->bin_id so it
+ * is safe to call from any thread.
+ */
+static int host_compile_kernel(host_ctx *ctx, unsigned int count,
+                               const char **strings, const size_t *lengths,
+                               unsigned int n, const char **fnames,
+                               const unsigned int *argcounts,
+                               const int **types, int flags, void **bin,
+                               size_t *bin_len, char **err_str) {
+  strb sb = STRB_STATIC_INIT;
+  strb key = STRB_STATIC_INIT;
+  char *log = NULL;
+  int error;
+
+  if (count == 0) return GA_VALUE_ERROR;
+
+  error = host_translate(&sb, count, strings, lengths, n, fnames, argcounts,
+                         types, flags);
+  if (error != GA_NO_ERROR) {
+    strb_clear(&sb);
+    return error;
+  }
+
+  *bin = NULL;
+  if (disk_cache_key(&key, ctx->bin_id, flags, 1, (const char **)&sb.s,
+                     &sb.l) == 0)
+    *bin = disk_cache_get(&key, bin_len);
+  if (*bin == NULL) {
+    *bin = host_compile(sb.s, sb.l, flags, bin_len, &log, NULL, &error);
+    if (*bin != NULL && !strb_error(&key))
+      disk_cache_put(&key, *bin, *bin_len);
+  }
+  strb_clear(&key);
+  if (*bin == NULL && err_str != NULL) {
+    strb debug_msg = STRB_STATIC_INIT;
+
+    *err_str = NULL;
+    strb_appends(&debug_msg, "Program build failure ::\n");
+    if (log != NULL)
+      strb_appends(&debug_msg, log);
+    gpukernel_source_with_line_numbers(1, (const char **)&sb.s, NULL,
+                                       &debug_msg);
+    strb_append0(&debug_msg);
+    if (!strb_error(&debug_msg))
+      *err_str = strndup(debug_msg.s, debug_msg.l);
+    strb_clear(&debug_msg);
+  }
+  free(log);
+  strb_clear(&sb);
+  return *bin == NULL ? error : GA_NO_ERROR;
+}
+
+/* Returns the kernel for the first of the `n` functions */
+static gpukernel *host_build_kernel(host_ctx *ctx, unsigned int count,
+                                    const char **strings,
+                                    const size_t *lengths, unsigned int n,
+                                    const char **fnames,
+                                    const unsigned int *argcounts,
+                                    const int **types, int flags, int *ret,
+                                    char **err_str) {
+  const char *fname = fnames[0];
+  unsigned int argcount = argcounts[0];
+  gpukernel *res;
+  void *bin;
+  size_t bin_len;
+  int error;
+
+  if (count == 0) FAIL(NULL, GA_VALUE_ERROR);
+
+  if (flags & GA_USE_BINARY) {
+    // GA_USE_BINARY is exclusive
+    if (flags & ~GA_USE_BINARY)
+      FAIL(NULL, GA_INVALID_ERROR);
+    // We need the length for binary data and there is only one blob.
+    if (count != 1 || lengths == NULL || lengths[0] == 0)
+      FAIL(NULL, GA_VALUE_ERROR);
+    bin = memdup(strings[0], lengths[0]);
+    if (bin == NULL) FAIL(NULL, GA_MEMORY_ERROR);
+    bin_len = lengths[0];
+  } else {
+    error = host_compile_kernel(ctx, count, strings, lengths, n, fnames,
+                                argcounts, types, flags, &bin, &bin_len,
+                                err_str);
+    if (error != GA_NO_ERROR) {
+      seterr(ctx, "Could not compile kernel %s", fname);
+      FAIL(NULL, error);
+    }
+  }
+
+  res = calloc(1, sizeof(*res));
+  if (res == NULL) {
+    free(bin);
+    FAIL(NULL, GA_MEMORY_ERROR);
+  }
+  res->refcnt = 1;
+  res->bin = bin;
+  res->bin_sz = bin_len;
+  res->argcount = argcount;
+  res->ctx = ctx;
+  ctx->refcnt++;
+  TAG_KER(res);
+
+  res->handle = host_load(bin, bin_len, fname, &res->fn, &error);
+  if (res->handle == NULL) {
+    seterr(ctx, "Could not load kernel %s", fname);
+    host_releasekernel(res);
+    FAIL(NULL, error);
+  }
+
+  res->types = calloc(argcount, sizeof(int));
+  if (res->types == NULL) {
+    host_releasekernel(res);
+    FAIL(NULL, GA_MEMORY_ERROR);
+  }
+  memcpy(res->types, types[0], argcount * sizeof(int));
+
+  return res;
+}
+
+static void host_retainkernel(gpukernel *k) {
+  ASSERT_KER(k);
+  k->refcnt++;
+}
+
+/*
+ * Makes a kernel for another function in the image of `owner`.  The
+ * new kernel holds a reference to `owner` which keeps the image
+ * loaded.
+ */
+static gpukernel *host_sibling(gpukernel *owner, const char *fname,
+                               unsigned int argcount, const int *types,
+                               int *ret) {
+  gpukernel *res;
+  int error;
+
+  res = calloc(1, sizeof(*res));
+  if (res == NULL) FAIL(NULL, GA_MEMORY_ERROR);
+  error = host_symbol(owner->handle, fname, &res->fn);
+  if (error != GA_NO_ERROR) {
+    seterr(owner->ctx, "Could not load kernel %s", fname);
+    free(res);
+    FAIL(NULL, error);
+  }
+  res->types = calloc(argcount, sizeof(int));
+  if (res->types == NULL) {
+    free(res);
+    FAIL(NULL, GA_MEMORY_ERROR);
+  }
+  memcpy(res->types, types, argcount * sizeof(int));
+  host_retainkernel(owner);
+  res->mod = owner;
+  res->refcnt = 1;
+  res->handle = owner->handle;
+  res->bin = owner->bin;
+  res->bin_sz = owner->bin_sz;
+  res->argcount = argcount;
+  res->ctx = owner->ctx;
+  res->ctx->refcnt++;
+  TAG_KER(res);
+  return res;
+}
+
+/*
+ * Returns the kernel for these sources from the kernel table or builds it
+ * and adds it there.  If `bin` is not NULL the kernel is loaded from it
+ * instead of compiling the sources.
+ */
+static gpukernel *host_table_kernel(host_ctx *ctx, unsigned int count,
+                                    const char **strings,
+                                    const size_t *lengths, const char *fname,
+                                    unsigned int argcount, const int *types,
+                                    int flags, const void *bin, size_t bin_sz,
+                                    int *ret, char **err_str) {
+  strb key = STRB_STATIC_INIT;
+  const char *b = (const char *)bin;
+  gpukernel *res;
+
+  if (kernel_table_key(&key, count, strings, lengths, fname, argcount,
+                       types, flags) == 0) {
+    res = kernel_table_get(ctx->kernels, &key, host_retainkernel);
+    if (res != NULL) {
+      strb_clear(&key);
+      return res;
+    }
+  }
+  if (bin != NULL)
+    res = host_build_kernel(ctx, 1, &b, &bin_sz, 1, &fname, &argcount,
+                            &types, GA_USE_BINARY, ret, err_str);
+  else
+    res = host_build_kernel(ctx, count, strings, lengths, 1, &fname,
+                            &argcount, &types, flags, ret, err_str);
+  if (res != NULL && !strb_error(&key))
+    res->entry = kernel_table_add(ctx->kernels, &key, res);
+  strb_clear(&key);
+  return res;
+}
+
+static gpukernel *host_newkernel(void *c, unsigned int count,
+                                 const char **strings, const size_t *lengths,
+                                 const char *fname, unsigned int argcount,
+                                 const int *types, int flags, int *ret,
+                                 char **err_str) {
+  host_ctx *ctx = (host_ctx *)c;
+
+  ASSERT_CTX(ctx);
+
+  return host_table_kernel(ctx, count, strings, lengths, fname, argcount,
+                           types, flags, NULL, 0, ret, err_str);
+}
+
+static gpukernel *host_kernel_load(void *c, unsigned int count,
+                                   const char **strings, const size_t *lengths,
+                                   const char *fname, unsigned int argcount,
+                                   const int *types, int flags, const void *bin,
+                                   size_t bin_sz, int *ret, char **err_str) {
+  host_ctx *ctx = (host_ctx *)c;
+
+  ASSERT_CTX(ctx);
+
+  return host_table_kernel(ctx, count, strings, lengths, fname, argcount,
+                           types, flags, bin, bin_sz, ret, err_str);
+}
+
+static void host_releasekernel(gpukernel *k) {
+  ASSERT_KER(k);
+  if (kernel_table_unref(k->entry, &k->refcnt) == 0) {
+    CLEAR(k);
+    if (k->mod != NULL) {
+      host_releasekernel(k->mod);
+    } else {
+      if (k->handle != NULL)
+        host_unload(k->handle);
+      free(k->bin);
+    }
+    free(k->types);
+    host_free_ctx(k->ctx);
+    free(k);
+  }
+}
+
+static int host_kernel_alloc_module(void *c, unsigned int count,
+                                    const char **strings,
+                                    const size_t *lengths, unsigned int n,
+                                    const char **fnames,
+                                    const unsigned int *argcounts,
+                                    const int **types, int flags,
+                                    gpukernel **res, char **err_str) {
+  host_ctx *ctx = (host_ctx *)c;
+  strb key = STRB_STATIC_INIT;
+  gpukernel *owner = NULL;
+  unsigned int i;
+  int err = GA_NO_ERROR;
+
+  ASSERT_CTX(ctx);
+
+  if (n == 0) return GA_VALUE_ERROR;
+
+  for (i = 0; i < n; i++) {
+    res[i] = NULL;
+    strb_reset(&key);
+    if (kernel_table_key(&key, count, strings, lengths, fnames[i],
+                         argcounts[i], types[i], flags) == 0)
+      res[i] = kernel_table_get(ctx->kernels, &key, host_retainkernel);
+  }
+  for (i = 0; i < n && err == GA_NO_ERROR; i++) {
+    if (res[i] != NULL)
+      continue;
+    if (owner == NULL) {
+      /* Only the first missing one pays for the compilation.  The
+         image gets the entry points for it and all those after it. */
+      owner = host_build_kernel(ctx, count, strings, lengths, n - i,
+                                fnames + i, argcounts + i, types + i, flags,
+                                &err, err_str);
+      res[i] = owner;
+    } else {
+      res[i] = host_sibling(owner, fnames[i], argcounts[i], types[i], &err);
+    }
+    strb_reset(&key);
+    if (res[i] != NULL &&
+        kernel_table_key(&key, count, strings, lengths, fnames[i],
+                         argcounts[i], types[i], flags) == 0)
+      res[i]->entry = kernel_table_add(ctx->kernels, &key, res[i]);
+  }
+  strb_clear(&key);
+
+  if (err != GA_NO_ERROR) {
+    for (i = 0; i < n; i++) {
+      if (res[i] != NULL)
+        host_releasekernel(res[i]);
+      res[i] = NULL;
+    }
+  }
+  return err;
+}
+
+/*
+ * The kernels kept in a context don't hold a reference on it,
+ * otherwise it would never go away.  Give it back before releasing
+ * them.
+ */
+static void release_stored(gpukernel *k) {
+  k->ctx->refcnt++;
+  host_releasekernel(k);
+}
+
+static gpukernel *host_kernel_lookup(void *c, const char *key, size_t len) {
+  host_ctx *ctx = (host_ctx *)c;
+  gpukernel *res;
+
+  ASSERT_CTX(ctx);
+  res = kernel_store_get(ctx->kept, key, len);
+  if (res != NULL)
+    host_retainkernel(res);
+  return res;
+}
+
+static int host_kernel_keep(gpukernel *k, const char *key, size_t len) {
+  ASSERT_KER(k);
+  host_retainkernel(k);
+  if (kernel_store_put(k->ctx->kept, key, len, k) != 0) {
+    host_releasekernel(k);
+    return GA_MEMORY_ERROR;
+  }
+  k->ctx->refcnt--; /* Prevent ref loop */
+  return GA_NO_ERROR;
+}
+
+static int host_kernel_compile(void *c, unsigned int count,
+                               const char **strings, const size_t *lengths,
+                               const char *fname, unsigned int argcount,
+                               const int *types, int flags, void **bin,
+                               size_t *bin_sz, char **err_str) {
+  ASSERT_CTX((host_ctx *)c);
+  if (flags & GA_USE_BINARY)
+    return GA_INVALID_ERROR;
+  return host_compile_kernel((host_ctx *)c, count, strings, lengths, 1,
+                             &fname, &argcount, &types, flags, bin, bin_sz,
+                             err_str);
+}
+
+typedef struct _call_job {
+  gpukernel *k;
+  void **args;
+  size_t gdim[3];
+  size_t ldim[3];
+  int err;
+} call_job;
+
+static void call_range(void *arg, size_t start, size_t end) {
+  call_job *j = (call_job *)arg;
+  host_group g;
+  size_t i, r;
+  int err;
+
+  memcpy(g.gdim, j->gdim, sizeof(g.gdim));
+  memcpy(g.ldim, j->ldim, sizeof(g.ldim));
+  g.run_items = host_fibers_run;
+  g.barrier = host_fibers_barrier;
+  g.priv = host_fibers_get();
+  if (g.priv == NULL) {
+    j->err = GA_MEMORY_ERROR;
+    return;
+  }
+
+  for (i = start; i < end; i++) {
+    r = i;
+    g.gid[0] = r % g.gdim[0];
+    r /= g.gdim[0];
+    g.gid[1] = r % g.gdim[1];
+    g.gid[2] = r / g.gdim[1];
+    err = j->k->fn(j->args, &g);
+    if (err != GA_NO_ERROR) {
+      j->err = err;
+      return;
+    }
+  }
+}
+
+static int host_callkernel(gpukernel *k, unsigned int n,
+                           const size_t *ls, const size_t *gs,
+                           size_t shared, void **args) {
+  host_ctx *ctx = k->ctx;
+  call_job j;
+  size_t ngroups;
+  unsigned int i;
+
+  ASSERT_KER(k);
+  ASSERT_CTX(ctx);
+
+  if (n == 0 || n > 3)
+    return GA_VALUE_ERROR;
+
+  /* Kernels only have the LOCAL_MEM arrays they declare */
+  if (shared != 0)
+    return GA_DEVSUP_ERROR;
+
+  j.k = k;
+  j.args = args;
+  j.err = GA_NO_ERROR;
+  ngroups = 1;
+  for (i = 0; i < 3; i++) {
+    j.gdim[i] = (i < n) ? gs[i] : 1;
+    j.ldim[i] = (i < n) ? ls[i] : 1;
+    ngroups *= j.gdim[i];
+  }
+  if (j.ldim[0] * j.ldim[1] * j.ldim[2] > HOST_MAXLSIZE)
+    return GA_VALUE_ERROR;
+
+  if (ngroups == 0)
+    return GA_NO_ERROR;
+
+  host_pool_run(ctx->pool, ngroups, call_range, &j);
+
+  return j.err;
+}
+
+static int host_kernelbin(gpukernel *k, size_t *sz, void **obj) {
+  void *res;
+
+  ASSERT_KER(k);
+
+  if (k->bin == NULL)
+    return GA_DEVSUP_ERROR;
+
+  res = memdup(k->bin, k->bin_sz);
+  if (res == NULL)
+    return GA_MEMORY_ERROR;
+  *sz = k->bin_sz;
+  *obj = res;
+  return GA_NO_ERROR;
+}
+
+static int host_sync(gpudata *b) {
+  ASSERT_BUF(b);
+  /* All operations complete before returning */
+  return GA_NO_ERROR;
+}
+
+static gpustream *host_stream_new(void *c, int *ret) {
+  host_ctx *ctx = (host_ctx *)c;
+  gpustream *res;
+
+  ASSERT_CTX(ctx);
+  res = malloc(sizeof(*res));
+  if (res == NULL) FAIL(NULL, GA_SYS_ERROR);
+  res->ctx = ctx;
+  ctx->refcnt++;
+  return res;
+}
+
+static void host_stream_free(gpustream *s) {
+  host_ctx *ctx = s->ctx;
+
+  free(s);
+  host_free_ctx(ctx);
+}
+
+static int host_stream_use(void *c, gpustream *s) {
+  ASSERT_CTX((host_ctx *)c);
+  if (s != NULL && s->ctx != c)
+    return GA_VALUE_ERROR;
+  return GA_NO_ERROR;
+}
+
+static int host_stream_sync(void *c, gpustream *s) {
+  ASSERT_CTX((host_ctx *)c);
+  if (s != NULL && s->ctx != c)
+    return GA_VALUE_ERROR;
+  return GA_NO_ERROR;
+}
+
+static int host_stream_wait(void *c, gpustream *s, gpustream *other) {
+  ASSERT_CTX((host_ctx *)c);
+  if ((s != NULL && s->ctx != c) || (other != NULL && other->ctx != c))
+    return GA_VALUE_ERROR;
+  return GA_NO_ERROR;
+}
+
+static gpudata *host_transfer(gpudata *buf, size_t offset, size_t sz,
+                              void *dst_ctx, int may_share) {
+  host_ctx *ctx = (host_ctx *)dst_ctx;
+  gpudata *res;
+
+  ASSERT_BUF(buf);
+  ASSERT_CTX(ctx);
+
+  if (buf->ctx == ctx && may_share) {
+    if (offset == 0) {
+      host_retain(buf);
+      return buf;
+    }
+    if (offset > buf->sz || buf->sz - offset < sz)
+      return NULL;
+
+    /* Make a view of the requested part */
+    res = malloc(sizeof(*res));
+    if (res == NULL)
+      return NULL;
+    res->ptr = (char *)buf->ptr + offset;
+    res->sz = sz;
+    res->flags = HOST_DONTFREE |
+      (buf->flags & (GA_BUFFER_READ_ONLY|GA_BUFFER_WRITE_ONLY));
+    res->refcnt = 1;
+    res->base = buf;
+    res->off = offset;
+    res->next = NULL;
+    res->ctx = ctx;
+    host_retain(buf);
+    ctx->refcnt++;
+    TAG_BUF(res);
+    return res;
+  }
+
+  /* All contexts share the same address space */
+  res = host_alloc(ctx, sz, (char *)buf->ptr + offset, GA_BUFFER_INIT, NULL);
+  return res;
+}
+
+/*
+ * Conversion between the scalar types for extcopy.  Every value goes
+ * through a long double pair which is wide enough to hold all the 64
+ * bit integers exactly.
+ */
+
+static float half_to_float(uint16_t h) {
+  uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1f;
+  uint32_t man = h & 0x3ff;
+  uint32_t bits;
+  float res;
+
+  if (exp == 0) {
+    if (man == 0) {
+      bits = sign;
+    } else {
+      /* Subnormal, renormalize */
+      exp = 127 - 15 + 1;
+      while (!(man & 0x400)) {
+        man <<= 1;
+        exp--;
+      }
+      man &= 0x3ff;
+      bits = sign | (exp << 23) | (man << 13);
+    }
+  } else if (exp == 0x1f) {
+    bits = sign | 0x7f800000 | (man << 13);
+  } else {
+    bits = sign | ((exp + 127 - 15) << 23) | (man << 13);
+  }
+  memcpy(&res, &bits, sizeof(res));
+  return res;
+}
+
+static uint16_t float_to_half(float f) {
+  uint32_t bits;
+  uint32_t sign, man;
+  int32_t exp;
+  uint16_t res;
+
+  memcpy(&bits, &f, sizeof(bits));
+  sign = (bits >> 16) & 0x8000;
+  exp = (int32_t)((bits >> 23) & 0xff) - 127 + 15;
+  man = bits & 0x7fffff;
+
+  if (((bits >> 23) & 0xff) == 0xff) {
+    /* Inf or NaN */
+    return sign | 0x7c00 | (man ? 0x200 : 0);
+  }
+  if (exp >= 0x1f)
+    return sign | 0x7c00;
+  if (exp <= 0) {
+    uint32_t shift, rem, half;
+    if (exp < -10)
+      return sign;
+    man |= 0x800000;
+    shift = 14 - exp;
+    res = man >> shift;
+    rem = man & ((1U << shift) - 1);
+    half = 1U << (shift - 1);
+    /* Round to nearest even */
+    if (rem > half || (rem == half && (res & 1)))
+      res++;
+    return sign | res;
+  }
+  res = sign | (exp << 10) | (man >> 13);
+  /* Round to nearest even, a carry into the exponent is correct */
+  if ((man & 0x1fff) > 0x1000 || ((man & 0x1fff) == 0x1000 && (res & 1)))
+    res++;
+  return res;
+}
+
+static int conv_supported(int typecode) {
+  switch (typecode) {
+  case GA_BOOL: case GA_BYTE: case GA_UBYTE: case GA_SHORT: case GA_USHORT:
+  case GA_INT: case GA_UINT: case GA_LONG: case GA_ULONG:
+  case GA_FLOAT: case GA_DOUBLE: case GA_CFLOAT: case GA_CDOUBLE:
+  case GA_HALF: case GA_SIZE: case GA_SSIZE:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+#define LOAD(t) { t v; memcpy(&v, p, sizeof(v)); *re = v; *im = 0; break; }
+#define LOADC(t) { t v[2]; memcpy(v, p, sizeof(v)); *re = v[0]; *im = v[1]; \
+    break; }
+
+static void load_val(int typecode, const char *p, long double *re,
+                     long double *im) {
+  switch (typecode) {
+  case GA_BOOL:   LOAD(uint8_t);
+  case GA_BYTE:   LOAD(int8_t);
+  case GA_UBYTE:  LOAD(uint8_t);
+  case GA_SHORT:  LOAD(int16_t);
+  case GA_USHORT: LOAD(uint16_t);
+  case GA_INT:    LOAD(int32_t);
+  case GA_UINT:   LOAD(uint32_t);
+  case GA_LONG:   LOAD(int64_t);
+  case GA_ULONG:  LOAD(uint64_t);
+  case GA_FLOAT:  LOAD(float);
+  case GA_DOUBLE: LOAD(double);
+  case GA_SIZE:   LOAD(size_t);
+  case GA_SSIZE:  LOAD(ssize_t);
+  case GA_CFLOAT: LOADC(float);
+  case GA_CDOUBLE: LOADC(double);
+  case GA_HALF: {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    *re = half_to_float(v);
+    *im = 0;
+    break;
+  }
+  default:
+    assert(0 && "unsupported type in load_val");
+  }
+}
+
+#undef LOAD
+#undef LOADC
+
+#define STORE(t) { t v = (t)re; memcpy(p, &v, sizeof(v)); break; }
+#define STOREC(t) { t v[2]; v[0] = (t)re; v[1] = (t)im; \
+    memcpy(p, v, sizeof(v)); break; }
+
+static void store_val(int typecode, char *p, long double re, long double im) {
+  switch (typecode) {
+  case GA_BOOL: {
+    uint8_t v = (re != 0 || im != 0);
+    *p = v;
+    break;
+  }
+  case GA_BYTE:   STORE(int8_t);
+  case GA_UBYTE:  STORE(uint8_t);
+  case GA_SHORT:  STORE(int16_t);
+  case GA_USHORT: STORE(uint16_t);
+  case GA_INT:    STORE(int32_t);
+  case GA_UINT:   STORE(uint32_t);
+  case GA_LONG:   STORE(int64_t);
+  case GA_ULONG:  STORE(uint64_t);
+  case GA_FLOAT:  STORE(float);
+  case GA_DOUBLE: STORE(double);
+  case GA_SIZE:   STORE(size_t);
+  case GA_SSIZE:  STORE(ssize_t);
+  case GA_CFLOAT: STOREC(float);
+  case GA_CDOUBLE: STOREC(double);
+  case GA_HALF: {
+    uint16_t v = float_to_half((float)re);
+    memcpy(p, &v, sizeof(v));
+    break;
+  }
+  default:
+    assert(0 && "unsupported type in store_val");
+  }
+}
+
+#undef STORE
+#undef STOREC
+
+typedef struct _extcopy_job {
+  const char *in;
+  char *out;
+  int intype;
+  int outtype;
+  size_t insz;
+  size_t outsz;
+  unsigned int a_nd;
+  const size_t *a_dims;
+  const ssize_t *a_str;
+  unsigned int b_nd;
+  const size_t *b_dims;
+  const ssize_t *b_str;
+  int err;
+} extcopy_job;
+
+/* Compute the offset of element `i` and fill `idx` with its position */
+static ssize_t unravel(size_t i, unsigned int nd, const size_t *dims,
+                       const ssize_t *str, size_t *idx) {
+  ssize_t off = 0;
+  unsigned int d;
+
+  for (d = nd; d > 0; d--) {
+    idx[d-1] = i % dims[d-1];
+    i /= dims[d-1];
+    off += idx[d-1] * str[d-1];
+  }
+  return off;
+}
+
+/* Advance `idx` to the next element in C order and adjust the offset */
+static ssize_t step(unsigned int nd, const size_t *dims, const ssize_t *str,
+                    size_t *idx, ssize_t off) {
+  unsigned int d;
+
+  for (d = nd; d > 0; d--) {
+    idx[d-1]++;
+    off += str[d-1];
+    if (idx[d-1] < dims[d-1])
+      break;
+    off -= idx[d-1] * str[d-1];
+    idx[d-1] = 0;
+  }
+  return off;
+}
+
+static void extcopy_range(void *arg, size_t start, size_t end) {
+  extcopy_job *j = (extcopy_job *)arg;
+  size_t *a_idx, *b_idx;
+  ssize_t a_off, b_off;
+  long double re, im;
+  size_t i;
+
+  a_idx = calloc(j->a_nd + j->b_nd + 1, sizeof(size_t));
+  if (a_idx == NULL) {
+    j->err = GA_MEMORY_ERROR;
+    return;
+  }
+  b_idx = a_idx + j->a_nd;
+
+  a_off = unravel(start, j->a_nd, j->a_dims, j->a_str, a_idx);
+  b_off = unravel(start, j->b_nd, j->b_dims, j->b_str, b_idx);
+
+  for (i = start; i < end; i++) {
+    if (j->intype == j->outtype) {
+      memcpy(j->out + b_off, j->in + a_off, j->insz);
+    } else {
+      load_val(j->intype, j->in + a_off, &re, &im);
+      store_val(j->outtype, j->out + b_off, re, im);
+    }
+    a_off = step(j->a_nd, j->a_dims, j->a_str, a_idx, a_off);
+    b_off = step(j->b_nd, j->b_dims, j->b_str, b_idx, b_off);
+  }
+
+  free(a_idx);
+}
+
+static int host_extcopy(gpudata *input, size_t ioff, gpudata *output,
+                        size_t ooff, int intype, int outtype,
+                        unsigned int a_nd, const size_t *a_dims,
+                        const ssize_t *a_str, unsigned int b_nd,
+                        const size_t *b_dims, const ssize_t *b_str) {
+  host_ctx *ctx = input->ctx;
+  extcopy_job j;
+  size_t nEls;
+  unsigned int i;
+
+  ASSERT_BUF(input);
+  ASSERT_BUF(output);
+  ASSERT_CTX(ctx);
+
+  if (input->ctx != output->ctx) return GA_VALUE_ERROR;
+
+  if (input->flags & GA_BUFFER_WRITE_ONLY) return GA_WRITEONLY_ERROR;
+  if (output->flags & GA_BUFFER_READ_ONLY) return GA_READONLY_ERROR;
+
+  if (intype != outtype &&
+      (!conv_supported(intype) || !conv_supported(outtype)))
+    return GA_DEVSUP_ERROR;
+
+  nEls = 1;
+  for (i = 0; i < a_nd; i++) {
+    nEls *= a_dims[i];
+  }
+
+  if (nEls == 0) return GA_NO_ERROR;
+
+  j.in = (const char *)input->ptr + ioff;
+  j.out = (char *)output->ptr + ooff;
+  j.intype = intype;
+  j.outtype = outtype;
+  j.insz = gpuarray_get_elsize(intype);
+  j.outsz = gpuarray_get_elsize(outtype);
+  j.a_nd = a_nd;
+  j.a_dims = a_dims;
+  j.a_str = a_str;
+  j.b_nd = b_nd;
+  j.b_dims = b_dims;
+  j.b_str = b_str;
+  j.err = GA_NO_ERROR;
+
+  host_pool_run(ctx->pool, nEls, extcopy_range, &j);
+
+  return j.err;
+}
+
+static int host_property(void *c, gpudata *buf, gpukernel *k, int prop_id,
+                         void *res) {
+  host_ctx *ctx = NULL;
+  if (c != NULL) {
+    ctx = (host_ctx *)c;
+    ASSERT_CTX(ctx);
+  } else if (buf != NULL) {
+    ASSERT_BUF(buf);
+    ctx = buf->ctx;
+  } else if (k != NULL) {
+    ASSERT_KER(k);
+    ctx = k->ctx;
+  }
+  /* I know that 512 and 1024 are magic numbers.
+     There is an indication in buffer.h, though. */
+  if (prop_id < 512) {
+    if (ctx == NULL)
+      return GA_VALUE_ERROR;
+  } else if (prop_id < 1024) {
+    if (buf == NULL)
+      return GA_VALUE_ERROR;
+  } else {
+    if (k == NULL)
+      return GA_VALUE_ERROR;
+  }
+
+  switch (prop_id) {
+    char *s;
+    host_pool_stats st;
+
+  case GA_CTX_PROP_DEVNAME:
+    s = malloc(64);
+    if (s == NULL)
+      return GA_MEMORY_ERROR;
+    snprintf(s, 64, "Host CPU (%u threads)", host_pool_size(ctx->pool));
+    *((char **)res) = s;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_MAXLSIZE:
+    *((size_t *)res) = HOST_MAXLSIZE;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_LMEMSIZE:
+    *((size_t *)res) = HOST_LMEMSIZE;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_NUMPROCS:
+    *((unsigned int *)res) = host_pool_size(ctx->pool);
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_MAXGSIZE:
+    *((size_t *)res) = SIZE_MAX / HOST_MAXLSIZE;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_BLAS_OPS:
+    *((void **)res) = NULL;
+    return GA_DEVSUP_ERROR;
+
+  case GA_CTX_PROP_BIN_ID:
+    *((const char **)res) = ctx->bin_id;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_ERRBUF:
+    *((gpudata **)res) = ctx->errbuf;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_POOL_STEALS:
+    host_pool_get_stats(ctx->pool, &st);
+    *((size_t *)res) = st.steals;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_POOL_IDLE:
+    host_pool_get_stats(ctx->pool, &st);
+    *((double *)res) = st.idle;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_POOL_CHUNKSIZE:
+    host_pool_get_stats(ctx->pool, &st);
+    *((size_t *)res) = st.chunks == 0 ? 0 : st.items / st.chunks;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_CACHED_BYTES:
+    *((size_t *)res) = ctx->cached;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_INUSE_BYTES:
+    *((size_t *)res) = ctx->inuse;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_PEAK_BYTES:
+    *((size_t *)res) = ctx->peak;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_NUM_BUFFERS:
+    *((size_t *)res) = ctx->nbufs;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_NUM_ALLOCS:
+    *((size_t *)res) = ctx->nallocs;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_KERNEL_CACHE_HITS:
+    kernel_table_stats(ctx->kernels, (size_t *)res, NULL);
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_KERNEL_CACHE_MISSES:
+    kernel_table_stats(ctx->kernels, NULL, (size_t *)res);
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_EXTCOPY_CACHE_SIZE:
+    /* Copies run on the CPU, nothing to compile */
+    *((size_t *)res) = 0;
+    return GA_NO_ERROR;
+
+  case GA_BUFFER_PROP_REFCNT:
+    *((unsigned int *)res) = buf->refcnt;
+    return GA_NO_ERROR;
+
+  case GA_BUFFER_PROP_SIZE:
+    *((size_t *)res) = buf->sz;
+    return GA_NO_ERROR;
+
+  /* All our buffers are in host memory */
+  case GA_BUFFER_PROP_HOSTPOINTER:
+    *((void **)res) = buf->ptr;
+    return GA_NO_ERROR;
+
+  /* GA_BUFFER_PROP_CTX is not ordered to simplify code */
+  case GA_BUFFER_PROP_CTX:
+  case GA_KERNEL_PROP_CTX:
+    *((void **)res) = (void *)ctx;
+    return GA_NO_ERROR;
+
+  case GA_KERNEL_PROP_MAXLSIZE:
+    *((size_t *)res) = HOST_MAXLSIZE;
+    return GA_NO_ERROR;
+
+  case GA_KERNEL_PROP_PREFLSIZE:
+    *((size_t *)res) = 1;
+    return GA_NO_ERROR;
+
+  case GA_KERNEL_PROP_NUMARGS:
+    *((unsigned int *)res) = k->argcount;
+    return GA_NO_ERROR;
+
+  case GA_KERNEL_PROP_TYPES:
+    *((const int **)res) = k->types;
+    return GA_NO_ERROR;
+
+  default:
+    return GA_INVALID_ERROR;
+  }
+}
+
+static const char *host_error(void *c) {
+  host_ctx *ctx = (host_ctx *)c;
+  if (ctx == NULL)
+    return err;
+  ASSERT_CTX(ctx);
+  return ctx->err;
+}
+
+GPUARRAY_LOCAL
+const gpuarray_buffer_ops host_ops = {host_init,
+                                      host_deinit,
+                                      host_alloc,
+                                      host_retain,
+                                      host_release,
+                                      host_share,
+                                      host_move,
+                                      host_read,
+                                      host_write,
+                                      host_memset,
+                                      host_newkernel,
+                                      host_retainkernel,
+                                      host_releasekernel,
+                                      host_callkernel,
+                                      host_kernelbin,
+                                      host_sync,
+                                      host_extcopy,
+                                      host_transfer,
+                                      host_property,
+                                      host_error,
+                                      host_trim,
+                                      host_reset_peak,
+                                      host_kernel_lookup,
+                                      host_kernel_keep,
+                                      host_kernel_compile,
+                                      host_kernel_alloc_module,
+                                      host_kernel_load,
+                                      host_memset_range,
+                                      host_fill,
+                                      host_stream_new,
+                                      host_stream_free,
+                                      host_stream_use,
+                                      host_stream_sync,
+                                      host_stream_wait,
+                                      host_read_async,
+                                      host_write_async,
+                                      host_event_query,
+                                      host_event_sync,
+                                      host_event_free,
+                                      host_event_new,
+                                      host_event_record,
+                                      host_event_wait,
+                                      host_event_elapsed};
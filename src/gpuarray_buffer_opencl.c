@@ -28,7 +28,13 @@ static int cl_property(void *c, gpudata *b, gpukernel *k, int p, void *r);
 static gpudata *cl_alloc(void *c, size_t size, void *data, int flags,
                          int *ret);
 static void cl_release(gpudata *b);
+static int cl_trim(void *c);
 static void cl_free_ctx(cl_ctx *ctx);
+static void free_staging(cl_ctx *ctx);
+static void release_cached(gpukernel *k);
+
+#define val_free(v) release_cached((v)->k);
+#include "cache_extcopy.h"
 
 static cl_device_id get_dev(cl_context ctx, int *ret) {
   size_t sz;
@@ -49,13 +55,36 @@ static cl_device_id get_dev(cl_context ctx, int *ret) {
   return res;
 }
 
+/* Returns the extensions supported by `dev`, to free() */
+static char *dev_exts(cl_device_id dev, cl_int *e) {
+  char *res;
+  size_t sz;
+
+  *e = clGetDeviceInfo(dev, CL_DEVICE_EXTENSIONS, 0, NULL, &sz);
+  if (*e != CL_SUCCESS) return NULL;
+
+  res = malloc(sz);
+  if (res == NULL) return NULL;
+
+  *e = clGetDeviceInfo(dev, CL_DEVICE_EXTENSIONS, sz, res, NULL);
+  if (*e != CL_SUCCESS) {
+    free(res);
+    return NULL;
+  }
+  return res;
+}
+
 cl_ctx *cl_make_ctx(cl_context ctx) {
   cl_ctx *res;
   cl_device_id id;
   cl_command_queue_properties qprop;
   char vendor[32];
   char driver_version[64];
+  char version[64];
+  char name[128];
   cl_uint vendor_id;
+  cl_uint align;
+  size_t lim = extcopy_cache_limit();
   size_t len;
   int64_t v = 0;
   int e = 0;
@@ -77,6 +106,17 @@ cl_ctx *cl_make_ctx(cl_context ctx) {
                         driver_version, NULL);
   if (err != CL_SUCCESS)
     return NULL;
+  err = clGetDeviceInfo(id, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(align),
+                        &align, NULL);
+  if (err != CL_SUCCESS)
+    return NULL;
+  err = clGetDeviceInfo(id, CL_DEVICE_VERSION, sizeof(version), version,
+                        NULL);
+  if (err != CL_SUCCESS)
+    return NULL;
+  err = clGetDeviceInfo(id, CL_DEVICE_NAME, sizeof(name), name, NULL);
+  if (err != CL_SUCCESS)
+    return NULL;
 
   res = malloc(sizeof(*res));
   if (res == NULL) return NULL;
@@ -84,12 +124,61 @@ cl_ctx *cl_make_ctx(cl_context ctx) {
   res->ctx = ctx;
   res->err = CL_SUCCESS;
   res->refcnt = 1;
+  res->flags = 0;
   res->exts = NULL;
+  /* "OpenCL <major>.<minor> <vendor specific>" */
+  res->has_fill = strncmp(version, "OpenCL 1.0", 10) != 0 &&
+    strncmp(version, "OpenCL 1.1", 10) != 0;
   res->blas_handle = NULL;
-  res->q = clCreateCommandQueue(ctx, id,
-				qprop&CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE,
-				&err);
-  if (res->q == NULL) {
+  memset(res->freebufs, 0, sizeof(res->freebufs));
+  res->cached = 0;
+  res->inuse = 0;
+  res->peak = 0;
+  res->nbufs = 0;
+  res->nallocs = 0;
+  memset(res->arena, 0, sizeof(res->arena));
+  memset(res->arena_off, 0, sizeof(res->arena_off));
+  memset(res->staging, 0, sizeof(res->staging));
+  memset(res->staging_ev, 0, sizeof(res->staging_ev));
+  /* The device gives it in bits */
+  res->align = align < 8 ? 1 : align / 8;
+  res->kernels = kernel_table_new();
+  if (res->kernels == NULL) {
+    free(res);
+    return NULL;
+  }
+  res->extcopy_cache = cache_alloc(lim, lim / 2);
+  if (res->extcopy_cache == NULL) {
+    kernel_table_free(res->kernels);
+    free(res);
+    return NULL;
+  }
+  res->extcopy_generic = cache_alloc(16, 16);
+  if (res->extcopy_generic == NULL) {
+    cache_free(res->extcopy_cache);
+    kernel_table_free(res->kernels);
+    free(res);
+    return NULL;
+  }
+  res->kept = kernel_store_new(release_cached);
+  if (res->kept == NULL) {
+    cache_free(res->extcopy_generic);
+    cache_free(res->extcopy_cache);
+    kernel_table_free(res->kernels);
+    free(res);
+    return NULL;
+  }
+  /* Profiling is needed for the timing of events (cl_event_elapsed()) */
+  res->q0 = clCreateCommandQueue(ctx, id,
+                                 qprop&(CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE|
+                                        CL_QUEUE_PROFILING_ENABLE),
+                                 &err);
+  res->q = res->q0;
+  if (res->q0 == NULL) {
+    kernel_store_free(res->kept);
+    cache_free(res->extcopy_generic);
+    cache_free(res->extcopy_cache);
+    kernel_table_free(res->kernels);
     free(res);
     return NULL;
   }
@@ -98,6 +187,12 @@ cl_ctx *cl_make_ctx(cl_context ctx) {
   len = strlcpy(res->bin_id, vendor, sizeof(res->bin_id));
   snprintf(res->bin_id + len, sizeof(res->bin_id) - len, " %#x ", vendor_id);
   strlcat(res->bin_id, driver_version, sizeof(res->bin_id));
+  /*
+   * Devices with the same vendor and driver can still not run each
+   * other's binaries.
+   */
+  snprintf(res->cache_id, sizeof(res->cache_id), "%s %#x %s %s", vendor,
+           vendor_id, driver_version, name);
 
   clRetainContext(res->ctx);
   TAG_CTX(res);
@@ -108,6 +203,13 @@ cl_ctx *cl_make_ctx(cl_context ctx) {
     return NULL;
   }
   res->refcnt--; /* Prevent ref loop */
+  /* Fetched here rather than on first use since kernels can be
+     compiled from other threads (see cl_kernel_compile()) */
+  res->exts = dev_exts(id, &err);
+  if (res->exts == NULL) {
+    cl_free_ctx(res);
+    return NULL;
+  }
   return res;
 }
 
@@ -136,8 +238,16 @@ static void cl_free_ctx(cl_ctx *ctx) {
       ctx->refcnt = 2; /* Avoid recursive release */
       cl_release(ctx->errbuf);
     }
-    clReleaseCommandQueue(ctx->q);
+    /* These need refcnt != 0, see release_cached() */
+    cache_free(ctx->extcopy_cache);
+    cache_free(ctx->extcopy_generic);
+    kernel_store_free(ctx->kept);
+    cl_trim(ctx);
+    /* The streams hold a reference so this is the only queue left */
+    clReleaseCommandQueue(ctx->q0);
     clReleaseContext(ctx->ctx);
+    kernel_table_free(ctx->kernels);
+    free(ctx->exts);
     CLEAR(ctx);
     free(ctx);
   }
@@ -157,9 +267,18 @@ gpudata *cl_make_buf(void *c, cl_mem buf) {
   res = malloc(sizeof(*res));
   if (res == NULL) return NULL;
 
+  ctx->err = clGetMemObjectInfo(buf, CL_MEM_SIZE, sizeof(res->size),
+                                &res->size, NULL);
+  if (ctx->err != CL_SUCCESS) {
+    free(res);
+    return NULL;
+  }
   res->buf = buf;
   res->ev = NULL;
   res->refcnt = 1;
+  res->sz = 0;
+  res->cls = -1;
+  res->next = NULL;
   ctx->err = clRetainMemObject(buf);
   if (ctx->err != CL_SUCCESS) {
     free(res);
@@ -185,6 +304,11 @@ static gpukernel *cl_newkernel(void *ctx, unsigned int count,
                                const char *fname, unsigned int argcount,
                                const int *types, int flags, int *ret,
                                char **err_str);
+static gpukernel *cl_build_kernel(cl_ctx *ctx, unsigned int count,
+                                  const char **strings, const size_t *lengths,
+                                  const char *fname, unsigned int argcount,
+                                  const int *types, int flags, int *ret,
+                                  char **err_str);
 static void cl_releasekernel(gpukernel *k);
 static int cl_callkernel(gpukernel *k, unsigned int n,
                          const size_t *bs, const size_t *gs,
@@ -289,27 +413,6 @@ static const char *get_error_string(cl_int err) {
 }
 
 static int check_ext(cl_ctx *ctx, const char *name) {
-  cl_device_id dev;
-  size_t sz;
-  int res = 0;
-
-  if (ctx->exts == NULL) {
-    dev = get_dev(ctx->ctx, &res);
-    if (dev == NULL) return res;
-
-    ctx->err = clGetDeviceInfo(dev, CL_DEVICE_EXTENSIONS, 0, NULL, &sz);
-    if (ctx->err != CL_SUCCESS) return GA_IMPL_ERROR;
-
-    ctx->exts = malloc(sz);
-    if (ctx->exts == NULL) return GA_MEMORY_ERROR;
-
-    ctx->err = clGetDeviceInfo(dev, CL_DEVICE_EXTENSIONS, sz, ctx->exts, NULL);
-    if (ctx->err != CL_SUCCESS) {
-      free(ctx->exts);
-      ctx->exts = NULL;
-      return GA_IMPL_ERROR;
-    }
-  }
   return (strstr(ctx->exts, name) == NULL) ? GA_DEVSUP_ERROR : 0;
 }
 
@@ -371,6 +474,7 @@ static void *cl_init(int devno, int flags, int *ret) {
   res = cl_make_ctx(ctx);
   clReleaseContext(ctx);
   if (res == NULL) FAIL(NULL, GA_IMPL_ERROR);  // can also be a sys_error
+  res->flags |= flags;
   return res;
 }
 
@@ -379,12 +483,83 @@ static void cl_deinit(void *c) {
   cl_free_ctx((cl_ctx *)c);
 }
 
+/*
+ * Create a buffer, giving back the cache if we are short.
+ */
+static cl_mem get_mem(cl_ctx *ctx, cl_mem_flags fl, size_t sz, void *hostp) {
+  cl_mem res;
+
+  res = clCreateBuffer(ctx->ctx, fl, sz, hostp, &ctx->err);
+  if (ctx->err == CL_MEM_OBJECT_ALLOCATION_FAILURE ||
+      ctx->err == CL_OUT_OF_RESOURCES) {
+    cl_trim(ctx);
+    res = clCreateBuffer(ctx->ctx, fl, sz, hostp, &ctx->err);
+  }
+  if (ctx->err != CL_SUCCESS)
+    return NULL;
+  ctx->nallocs++;
+  return res;
+}
+
+#ifdef CL_VERSION_1_1
+/*
+ * Return a sub-buffer for the next free `csz` bytes of the block for
+ * `cls`.
+ *
+ * The sub-buffers keep their block alive so we drop our reference on
+ * a block as soon as it is full.
+ */
+static cl_mem arena_carve(cl_ctx *ctx, int cls, size_t csz) {
+  cl_buffer_region reg;
+  cl_mem blk;
+
+  if (ctx->arena[cls] == NULL || ARENA_BLOCKSIZE - ctx->arena_off[cls] < csz) {
+    blk = get_mem(ctx, CL_MEM_READ_WRITE, ARENA_BLOCKSIZE, NULL);
+    if (blk == NULL)
+      return NULL;
+    /* get_mem() may have trimmed ctx->arena[cls] */
+    if (ctx->arena[cls] != NULL)
+      clReleaseMemObject(ctx->arena[cls]);
+    ctx->arena[cls] = blk;
+    ctx->arena_off[cls] = 0;
+  }
+
+  reg.origin = ctx->arena_off[cls];
+  reg.size = csz;
+  blk = clCreateSubBuffer(ctx->arena[cls], CL_MEM_READ_WRITE,
+                          CL_BUFFER_CREATE_TYPE_REGION, &reg, &ctx->err);
+  if (ctx->err != CL_SUCCESS)
+    return NULL;
+  ctx->arena_off[cls] += csz;
+  return blk;
+}
+
+/*
+ * Find the buffer that holds the memory of `b` and the region of it
+ * that `b` covers.
+ */
+static int get_region(cl_ctx *ctx, cl_mem b, cl_mem *root, size_t *off,
+                      size_t *sz) {
+  ctx->err = clGetMemObjectInfo(b, CL_MEM_ASSOCIATED_MEMOBJECT,
+                                sizeof(*root), root, NULL);
+  if (ctx->err != CL_SUCCESS) return -1;
+  ctx->err = clGetMemObjectInfo(b, CL_MEM_OFFSET, sizeof(*off), off, NULL);
+  if (ctx->err != CL_SUCCESS) return -1;
+  ctx->err = clGetMemObjectInfo(b, CL_MEM_SIZE, sizeof(*sz), sz, NULL);
+  if (ctx->err != CL_SUCCESS) return -1;
+  if (*root == NULL) *root = b;
+  return 0;
+}
+#endif
+
 static gpudata *cl_alloc(void *c, size_t size, void *data, int flags,
                          int *ret) {
   cl_ctx *ctx = (cl_ctx *)c;
   gpudata *res;
   void *hostp = NULL;
   cl_mem_flags clflags = CL_MEM_READ_WRITE;
+  size_t csz;
+  int cls = -1;
 
   ASSERT_CTX(ctx);
 
@@ -408,26 +583,70 @@ static gpudata *cl_alloc(void *c, size_t size, void *data, int flags,
     clflags |= CL_MEM_WRITE_ONLY;
   }
 
-  res = malloc(sizeof(*res));
-  if (res == NULL) FAIL(NULL, GA_SYS_ERROR);
-  res->refcnt = 1;
-
-  if (size == 0) {
-    /* OpenCL doesn't like a zero-sized buffer */
-    size = 1;
+  /* OpenCL doesn't like a zero-sized buffer */
+  csz = size == 0 ? 1 : size;
+
+  /*
+   * The flags are fixed at creation so only plain buffers go through
+   * the cache.  They are initialized with a separate write since the
+   * allocation is larger than `data`.
+   */
+  if (!(ctx->flags & GA_CTX_DISABLE_ALLOCATION_CACHE) &&
+      !(flags & (GA_BUFFER_HOST|GA_BUFFER_READ_ONLY|GA_BUFFER_WRITE_ONLY))) {
+    cls = alloc_class(size, &csz);
+    if (cls != -1) {
+      hostp = NULL;
+      clflags = CL_MEM_READ_WRITE;
+    }
   }
 
-  res->buf = clCreateBuffer(ctx->ctx, clflags, size, hostp, &ctx->err);
-  res->ev = NULL;
-  if (ctx->err != CL_SUCCESS) {
-    free(res);
-    FAIL(NULL, GA_IMPL_ERROR);
+  if (cls != -1 && ctx->freebufs[cls] != NULL) {
+    res = ctx->freebufs[cls];
+    ctx->freebufs[cls] = res->next;
+    ctx->cached -= csz;
+  } else {
+    res = malloc(sizeof(*res));
+    if (res == NULL) FAIL(NULL, GA_SYS_ERROR);
+
+#ifdef CL_VERSION_1_1
+    /* Sub-buffers have to start on a multiple of the device alignment */
+    if (cls != -1 && cls < ARENA_NCLASSES && csz % ctx->align == 0 &&
+        !(ctx->flags & GA_CTX_DISABLE_SUBALLOCATION))
+      res->buf = arena_carve(ctx, cls, csz);
+    else
+#endif
+      res->buf = get_mem(ctx, clflags, csz, hostp);
+    res->ev = NULL;
+    if (res->buf == NULL) {
+      free(res);
+      FAIL(NULL, GA_IMPL_ERROR);
+    }
   }
 
+  res->refcnt = 1;
+  res->size = size;
+  res->sz = csz;
+  res->cls = cls;
+  res->next = NULL;
   res->ctx = ctx;
   ctx->refcnt++;
+  ctx->inuse += csz;
+  if (ctx->inuse > ctx->peak)
+    ctx->peak = ctx->inuse;
+  ctx->nbufs++;
 
   TAG_BUF(res);
+
+  if (cls != -1 && (flags & GA_BUFFER_INIT)) {
+    ctx->err = clEnqueueWriteBuffer(ctx->q, res->buf, CL_TRUE, 0, size, data,
+                                    res->ev == NULL ? 0 : 1,
+                                    res->ev == NULL ? NULL : &res->ev, NULL);
+    if (ctx->err != CL_SUCCESS) {
+      cl_release(res);
+      FAIL(NULL, GA_IMPL_ERROR);
+    }
+  }
+
   return res;
 }
 
@@ -437,22 +656,82 @@ static void cl_retain(gpudata *b) {
 }
 
 static void cl_release(gpudata *b) {
+  cl_ctx *ctx;
+
   ASSERT_BUF(b);
   b->refcnt--;
   if (b->refcnt == 0) {
     CLEAR(b);
-    clReleaseMemObject(b->buf);
-    if (b->ev != NULL)
-      clReleaseEvent(b->ev);
-    cl_free_ctx(b->ctx);
-    free(b);
+    ctx = b->ctx;
+    ctx->inuse -= b->sz;
+    /* sz is 0 for the buffers we didn't allocate */
+    if (b->sz != 0)
+      ctx->nbufs--;
+    if (b->cls != -1) {
+      /* Keep the event so that the next user waits on pending work */
+      b->next = ctx->freebufs[b->cls];
+      ctx->freebufs[b->cls] = b;
+      ctx->cached += b->sz;
+    } else {
+      /*
+       * This doesn't block, the memory is only freed once the
+       * commands queued on it are done.
+       */
+      clReleaseMemObject(b->buf);
+      if (b->ev != NULL)
+        clReleaseEvent(b->ev);
+      free(b);
+    }
+    /* This may free the context, which empties the cache */
+    cl_free_ctx(ctx);
   }
 }
 
+static int cl_trim(void *c) {
+  cl_ctx *ctx = (cl_ctx *)c;
+  gpudata *b;
+  unsigned int i;
+
+  ASSERT_CTX(ctx);
+
+  for (i = 0; i < ALLOC_NCLASSES; i++) {
+    while (ctx->freebufs[i] != NULL) {
+      b = ctx->freebufs[i];
+      ctx->freebufs[i] = b->next;
+      clReleaseMemObject(b->buf);
+      if (b->ev != NULL)
+        clReleaseEvent(b->ev);
+      free(b);
+    }
+  }
+  ctx->cached = 0;
+
+  free_staging(ctx);
+
+#ifdef CL_VERSION_1_1
+  for (i = 0; i < ARENA_NCLASSES; i++) {
+    if (ctx->arena[i] != NULL) {
+      clReleaseMemObject(ctx->arena[i]);
+      ctx->arena[i] = NULL;
+    }
+  }
+#endif
+  return GA_NO_ERROR;
+}
+
+static int cl_reset_peak(void *c) {
+  cl_ctx *ctx = (cl_ctx *)c;
+
+  ASSERT_CTX(ctx);
+  ctx->peak = ctx->inuse;
+  return GA_NO_ERROR;
+}
+
 static int cl_share(gpudata *a, gpudata *b, int *ret) {
 #ifdef CL_VERSION_1_1
   cl_ctx *ctx;
   cl_mem aa, bb;
+  size_t aoff, asz, boff, bsz;
 #endif
   ASSERT_BUF(a);
   ASSERT_BUF(b);
@@ -461,19 +740,28 @@ static int cl_share(gpudata *a, gpudata *b, int *ret) {
   if (a->ctx != b->ctx) return 0;
   ctx = a->ctx;
   ASSERT_CTX(ctx);
-  ctx->err = clGetMemObjectInfo(a->buf, CL_MEM_ASSOCIATED_MEMOBJECT,
-				sizeof(aa), &aa, NULL);
-  CHKFAIL(-1);
-  ctx->err = clGetMemObjectInfo(b->buf, CL_MEM_ASSOCIATED_MEMOBJECT,
-				sizeof(bb), &bb, NULL);
-  CHKFAIL(-1);
-  if (aa == NULL) aa = a->buf;
-  if (bb == NULL) bb = b->buf;
-  if (aa == bb) return 1;
+  if (get_region(ctx, a->buf, &aa, &aoff, &asz) != 0)
+    FAIL(-1, GA_IMPL_ERROR);
+  if (get_region(ctx, b->buf, &bb, &boff, &bsz) != 0)
+    FAIL(-1, GA_IMPL_ERROR);
+  /* Sub-buffers of the same block only share if they overlap */
+  if (aa == bb && asz != 0 && bsz != 0 &&
+      ((aoff <= boff && aoff + asz > boff) ||
+       (boff <= aoff && boff + bsz > aoff)))
+    return 1;
 #endif
   return 0;
 }
 
+/*
+ * Check that [off, off + sz) is inside `b`.  Cached buffers are
+ * larger than asked for, so this can't be left to the driver.
+ */
+static int check_range(gpudata *b, size_t off, size_t sz) {
+  if (off > b->size || b->size - off < sz) return GA_VALUE_ERROR;
+  return GA_NO_ERROR;
+}
+
 static int cl_move(gpudata *dst, size_t dstoff, gpudata *src, size_t srcoff,
                    size_t sz) {
   cl_ctx *ctx;
@@ -490,6 +778,10 @@ static int cl_move(gpudata *dst, size_t dstoff, gpudata *src, size_t srcoff,
 
   ASSERT_CTX(ctx);
 
+  if (check_range(dst, dstoff, sz) != GA_NO_ERROR ||
+      check_range(src, srcoff, sz) != GA_NO_ERROR)
+    return GA_VALUE_ERROR;
+
   if (sz == 0) return GA_NO_ERROR;
 
   if (src->ev != NULL)
@@ -517,6 +809,155 @@ static int cl_move(gpudata *dst, size_t dstoff, gpudata *src, size_t srcoff,
   return GA_NO_ERROR;
 }
 
+static void free_staging(cl_ctx *ctx) {
+  unsigned int i;
+
+  for (i = 0; i < STAGING_NBUFS; i++) {
+    if (ctx->staging_ev[i] != NULL) {
+      clWaitForEvents(1, &ctx->staging_ev[i]);
+      clReleaseEvent(ctx->staging_ev[i]);
+      ctx->staging_ev[i] = NULL;
+    }
+    if (ctx->staging[i] != NULL) {
+      if (ctx->staging_ptr[i] != NULL)
+        clEnqueueUnmapMemObject(ctx->q, ctx->staging[i], ctx->staging_ptr[i],
+                                0, NULL, NULL);
+      clReleaseMemObject(ctx->staging[i]);
+      ctx->staging[i] = NULL;
+    }
+  }
+}
+
+/*
+ * Allocate the staging buffers if needed.  Returns -1 if they are not
+ * available, in which case the transfer should be done directly.
+ *
+ * The mapping of a CL_MEM_ALLOC_HOST_PTR buffer is page-locked memory
+ * on most implementations.  The buffers themselves are never used by
+ * commands, only their mapping as the host side of transfers.
+ */
+static int get_staging(cl_ctx *ctx) {
+  unsigned int i;
+
+  if (ctx->staging[0] != NULL)
+    return 0;
+  for (i = 0; i < STAGING_NBUFS; i++) {
+    ctx->staging_ptr[i] = NULL;
+    ctx->staging[i] = clCreateBuffer(ctx->ctx, CL_MEM_READ_WRITE|
+                                     CL_MEM_ALLOC_HOST_PTR, STAGING_BUFSIZE,
+                                     NULL, &ctx->err);
+    if (ctx->err != CL_SUCCESS) {
+      ctx->staging[i] = NULL;
+      break;
+    }
+    ctx->staging_ptr[i] = clEnqueueMapBuffer(ctx->q, ctx->staging[i], CL_TRUE,
+                                             CL_MAP_READ|CL_MAP_WRITE, 0,
+                                             STAGING_BUFSIZE, 0, NULL, NULL,
+                                             &ctx->err);
+    if (ctx->err != CL_SUCCESS) {
+      ctx->staging_ptr[i] = NULL;
+      break;
+    }
+  }
+  if (i == STAGING_NBUFS)
+    return 0;
+  free_staging(ctx);
+  return -1;
+}
+
+/* Wait for the last transfer on staging buffer `i` */
+static int wait_staging(cl_ctx *ctx, unsigned int i) {
+  if (ctx->staging_ev[i] == NULL)
+    return 0;
+  ctx->err = clWaitForEvents(1, &ctx->staging_ev[i]);
+  clReleaseEvent(ctx->staging_ev[i]);
+  ctx->staging_ev[i] = NULL;
+  return ctx->err == CL_SUCCESS ? 0 : -1;
+}
+
+/*
+ * Copy through the staging buffers, each chunk goes to the user
+ * memory while the next one is in flight.
+ */
+static int read_staged(cl_ctx *ctx, char *dst, gpudata *src, size_t off,
+                       size_t sz) {
+  size_t len[STAGING_NBUFS];
+  unsigned int i, cur = 0, busy = 0;
+
+  for (;;) {
+    while (sz > 0 && busy < STAGING_NBUFS) {
+      i = (cur + busy) % STAGING_NBUFS;
+      len[i] = sz < STAGING_BUFSIZE ? sz : STAGING_BUFSIZE;
+      ctx->err = clEnqueueReadBuffer(ctx->q, src->buf, CL_FALSE, off, len[i],
+                                     ctx->staging_ptr[i],
+                                     src->ev == NULL ? 0 : 1,
+                                     src->ev == NULL ? NULL : &src->ev,
+                                     &ctx->staging_ev[i]);
+      if (ctx->err != CL_SUCCESS) {
+        ctx->staging_ev[i] = NULL;
+        return -1;
+      }
+      off += len[i];
+      sz -= len[i];
+      busy++;
+    }
+    if (busy == 0)
+      return 0;
+    if (wait_staging(ctx, cur) != 0)
+      return -1;
+    memcpy(dst, ctx->staging_ptr[cur], len[cur]);
+    dst += len[cur];
+    cur = (cur + 1) % STAGING_NBUFS;
+    busy--;
+  }
+}
+
+/*
+ * Copy through the staging buffers.  This returns as soon as the last
+ * chunk is queued and sets the event of `dst` to it.
+ */
+static int write_staged(cl_ctx *ctx, gpudata *dst, size_t off,
+                        const char *src, size_t sz) {
+  unsigned int i = 0, last = 0;
+  size_t n;
+
+  while (sz > 0) {
+    n = sz < STAGING_BUFSIZE ? sz : STAGING_BUFSIZE;
+    /* Wait for the previous copy out of this buffer */
+    if (wait_staging(ctx, i) != 0)
+      return -1;
+    memcpy(ctx->staging_ptr[i], src, n);
+    ctx->err = clEnqueueWriteBuffer(ctx->q, dst->buf, CL_FALSE, off, n,
+                                    ctx->staging_ptr[i],
+                                    dst->ev == NULL ? 0 : 1,
+                                    dst->ev == NULL ? NULL : &dst->ev,
+                                    &ctx->staging_ev[i]);
+    if (ctx->err != CL_SUCCESS) {
+      ctx->staging_ev[i] = NULL;
+      return -1;
+    }
+    last = i;
+    off += n;
+    src += n;
+    sz -= n;
+    i = (i + 1) % STAGING_NBUFS;
+  }
+
+  /*
+   * The queue may be out of order, so only leave the last chunk
+   * pending to have a single event to wait on.
+   */
+  for (i = 0; i < STAGING_NBUFS; i++) {
+    if (i != last && wait_staging(ctx, i) != 0)
+      return -1;
+  }
+  if (dst->ev != NULL)
+    clReleaseEvent(dst->ev);
+  dst->ev = ctx->staging_ev[last];
+  clRetainEvent(dst->ev);
+  return 0;
+}
+
 static int cl_read(void *dst, gpudata *src, size_t srcoff, size_t sz) {
   cl_ctx *ctx = src->ctx;
   cl_event ev[1];
@@ -526,17 +967,24 @@ static int cl_read(void *dst, gpudata *src, size_t srcoff, size_t sz) {
   ASSERT_BUF(src);
   ASSERT_CTX(ctx);
 
+  if (check_range(src, srcoff, sz) != GA_NO_ERROR) return GA_VALUE_ERROR;
+
   if (sz == 0) return GA_NO_ERROR;
 
-  if (src->ev != NULL) {
-    ev[0] = src->ev;
-    evl = ev;
-    num_ev = 1;
-  }
+  if (sz >= STAGING_MINSIZE && get_staging(ctx) == 0) {
+    if (read_staged(ctx, dst, src, srcoff, sz) != 0)
+      return GA_IMPL_ERROR;
+  } else {
+    if (src->ev != NULL) {
+      ev[0] = src->ev;
+      evl = ev;
+      num_ev = 1;
+    }
 
-  ctx->err = clEnqueueReadBuffer(ctx->q, src->buf, CL_TRUE, srcoff, sz, dst,
-				 num_ev, evl, NULL);
-  if (ctx->err != CL_SUCCESS) return GA_IMPL_ERROR;
+    ctx->err = clEnqueueReadBuffer(ctx->q, src->buf, CL_TRUE, srcoff, sz, dst,
+                                   num_ev, evl, NULL);
+    if (ctx->err != CL_SUCCESS) return GA_IMPL_ERROR;
+  }
   if (src->ev != NULL) clReleaseEvent(src->ev);
   src->ev = NULL;
 
@@ -552,8 +1000,16 @@ static int cl_write(gpudata *dst, size_t dstoff, const void *src, size_t sz) {
   ASSERT_BUF(dst);
   ASSERT_CTX(ctx);
 
+  if (check_range(dst, dstoff, sz) != GA_NO_ERROR) return GA_VALUE_ERROR;
+
   if (sz == 0) return GA_NO_ERROR;
 
+  if (sz >= STAGING_MINSIZE && get_staging(ctx) == 0) {
+    if (write_staged(ctx, dst, dstoff, src, sz) != 0)
+      return GA_IMPL_ERROR;
+    return GA_NO_ERROR;
+  }
+
   if (dst->ev != NULL) {
     ev[0] = dst->ev;
     evl = ev;
@@ -562,153 +1018,555 @@ static int cl_write(gpudata *dst, size_t dstoff, const void *src, size_t sz) {
 
   ctx->err = clEnqueueWriteBuffer(ctx->q, dst->buf, CL_TRUE, dstoff, sz, src,
 				  num_ev, evl, NULL);
-  if (err != CL_SUCCESS) return GA_IMPL_ERROR;
+  if (ctx->err != CL_SUCCESS) return GA_IMPL_ERROR;
   if (dst->ev != NULL) clReleaseEvent(dst->ev);
   dst->ev = NULL;
 
   return GA_NO_ERROR;
 }
 
-static int cl_memset(gpudata *dst, size_t offset, int data) {
-  char local_kern[256];
-  cl_ctx *ctx = dst->ctx;
-  const char *rlk[1];
-  void *args[1];
-  size_t sz, bytes, n, ls, gs;
-  gpukernel *m;
-  cl_mem_flags fl;
-  int type;
-  int r, res = GA_IMPL_ERROR;
+/*
+ * Wrap `ev` (the completion of a command) in an event for the user,
+ * and make `b` wait for it.  This takes over the reference of `ev`.
+ */
+static gpuevent *user_event(cl_ctx *ctx, gpudata *b, cl_event ev) {
+  gpuevent *res;
 
-  unsigned char val = (unsigned char)data;
-  cl_uint pattern = (cl_uint)val & (cl_uint)val >> 8 & \
-    (cl_uint)val >> 16 & (cl_uint)val >> 24;
+  if (b != NULL) {
+    if (b->ev != NULL)
+      clReleaseEvent(b->ev);
+    b->ev = ev;
+    clRetainEvent(ev);
+  }
+  /* Non-blocking commands may not be submitted until a flush */
+  clFlush(ctx->q);
+  res = malloc(sizeof(*res));
+  if (res == NULL) {
+    clReleaseEvent(ev);
+    return NULL;
+  }
+  res->ctx = ctx;
+  res->ev = ev;
+  res->flags = 0;
+  ctx->refcnt++;
+  return res;
+}
 
-  ASSERT_BUF(dst);
+static int cl_read_async(void *dst, gpudata *src, size_t srcoff, size_t sz,
+                         gpuevent **ev) {
+  cl_ctx *ctx = src->ctx;
+  cl_event e;
+  int res;
+
+  ASSERT_BUF(src);
   ASSERT_CTX(ctx);
 
-  ctx->err = clGetMemObjectInfo(dst->buf, CL_MEM_FLAGS, sizeof(fl), &fl, NULL);
-  if (ctx->err != CL_SUCCESS) return GA_IMPL_ERROR;
+  res = check_range(src, srcoff, sz);
+  if (res != GA_NO_ERROR) return res;
 
-  if (fl & CL_MEM_READ_ONLY) return GA_READONLY_ERROR;
+  if (sz == 0) {
+    ctx->err = clEnqueueMarker(ctx->q, &e);
+    if (ctx->err != CL_SUCCESS) return GA_IMPL_ERROR;
+    *ev = user_event(ctx, NULL, e);
+  } else {
+    ctx->err = clEnqueueReadBuffer(ctx->q, src->buf, CL_FALSE, srcoff, sz,
+                                   dst, src->ev == NULL ? 0 : 1,
+                                   src->ev == NULL ? NULL : &src->ev, &e);
+    if (ctx->err != CL_SUCCESS) return GA_IMPL_ERROR;
+    /* Writes to src must wait for the copy */
+    *ev = user_event(ctx, src, e);
+  }
+  if (*ev == NULL) return GA_MEMORY_ERROR;
+  return GA_NO_ERROR;
+}
 
-  ctx->err = clGetMemObjectInfo(dst->buf, CL_MEM_SIZE, sizeof(bytes), &bytes,
-				NULL);
-  if (ctx->err != CL_SUCCESS) return GA_IMPL_ERROR;
+static int cl_write_async(gpudata *dst, size_t dstoff, const void *src,
+                          size_t sz, gpuevent **ev) {
+  cl_ctx *ctx = dst->ctx;
+  cl_event e;
+  int res;
+
+  ASSERT_BUF(dst);
+  ASSERT_CTX(ctx);
+
+  res = check_range(dst, dstoff, sz);
+  if (res != GA_NO_ERROR) return res;
 
-  bytes -= offset;
-
-  if (bytes == 0) return GA_NO_ERROR;
-
-  if ((bytes % 16) == 0) {
-    n = bytes/16;
-    r = snprintf(local_kern, sizeof(local_kern),
-                 "__kernel void kmemset(__global uint4 *mem) {"
-                 "unsigned int i; __global char *tmp = (__global char *)mem;"
-                 "tmp += %" SPREFIX "u; mem = (__global uint4 *)tmp;"
-                 "for (i = get_global_id(0); i < %" SPREFIX "u; "
-                 "i += get_global_size(0)) {mem[i] = (uint4)(%u,%u,%u,%u); }}",
-                 offset, n, pattern, pattern, pattern, pattern);
-  } else if ((bytes % 8) == 0) {
-    n = bytes/8;
-    r = snprintf(local_kern, sizeof(local_kern),
-                 "__kernel void kmemset(__global uint2 *mem) {"
-                 "unsigned int i; __global char *tmp = (__global char *)mem;"
-                 "tmp += %" SPREFIX "u; mem = (__global uint2 *)tmp;"
-                 "for (i = get_global_id(0); i < %" SPREFIX "u;"
-                 "i += get_global_size(0)) {mem[i] = (uint2)(%u,%u); }}",
-                 offset, n, pattern, pattern);
-  } else if ((bytes % 4) == 0) {
-    n = bytes/4;
-    r = snprintf(local_kern, sizeof(local_kern),
-                 "__kernel void kmemset(__global unsigned int *mem) {"
-                 "unsigned int i; __global char *tmp = (__global char *)mem;"
-                 "tmp += %" SPREFIX "u; mem = (__global unsigned int *)tmp;"
-                 "for (i = get_global_id(0); i < %" SPREFIX "u;"
-                 "i += get_global_size(0)) {mem[i] = %u; }}",
-                 offset, n, pattern);
+  if (sz == 0) {
+    ctx->err = clEnqueueMarker(ctx->q, &e);
+    if (ctx->err != CL_SUCCESS) return GA_IMPL_ERROR;
+    *ev = user_event(ctx, NULL, e);
   } else {
-    if (check_ext(ctx, CL_SMALL))
-      return GA_DEVSUP_ERROR;
-    n = bytes;
-    r = snprintf(local_kern, sizeof(local_kern),
-                 "__kernel void kmemset(__global unsigned char *mem) {"
-                 "unsigned int i; mem += %" SPREFIX "u;"
-                 "for (i = get_global_id(0); i < %" SPREFIX "u;"
-                 "i += get_global_size(0)) {mem[i] = %u; }}",
-                 offset, n, val);
-  }
-  /* If this assert fires, increase the size of local_kern above. */
-  assert(r <= sizeof(local_kern));
-  _unused(r);
-
-  sz = strlen(local_kern);
-  rlk[0] = local_kern;
-  type = GA_BUFFER;
-
-  m = cl_newkernel(ctx, 1, rlk, &sz, "kmemset", 1, &type, 0, &res, NULL);
-  if (m == NULL) return res;
+    ctx->err = clEnqueueWriteBuffer(ctx->q, dst->buf, CL_FALSE, dstoff, sz,
+                                    src, dst->ev == NULL ? 0 : 1,
+                                    dst->ev == NULL ? NULL : &dst->ev, &e);
+    if (ctx->err != CL_SUCCESS) return GA_IMPL_ERROR;
+    *ev = user_event(ctx, dst, e);
+  }
+  if (*ev == NULL) return GA_MEMORY_ERROR;
+  return GA_NO_ERROR;
+}
 
-  /* Cheap kernel scheduling */
-  res = cl_property(NULL, NULL, m, GA_KERNEL_PROP_MAXLSIZE, &ls);
-  if (res != GA_NO_ERROR) goto fail;
-  gs = ((n-1) / ls) + 1;
-  args[0] = dst;
-  res = cl_callkernel(m, 1, &ls, &gs, 0, args);
+static int cl_event_query(gpuevent *ev) {
+  cl_int st;
 
- fail:
-  cl_releasekernel(m);
-  return res;
+  if (ev->ev == NULL)
+    return 1;
+  if (clGetEventInfo(ev->ev, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(st),
+                     &st, NULL) != CL_SUCCESS)
+    return 1;
+  /* Errors are negative */
+  return st <= CL_COMPLETE;
 }
 
-static int cl_check_extensions(const char **preamble, unsigned int *count,
-                               int flags, cl_ctx *ctx) {
-  if (flags & GA_USE_CLUDA) {
-    preamble[*count] = CL_PREAMBLE;
-    (*count)++;
-  }
-  if (flags & GA_USE_SMALL) {
-    if (check_ext(ctx, CL_SMALL)) return GA_DEVSUP_ERROR;
-    preamble[*count] = PRAGMA CL_SMALL ENABLE;
-    (*count)++;
-  }
-  if (flags & GA_USE_DOUBLE) {
-    if (check_ext(ctx, CL_DOUBLE)) return GA_DEVSUP_ERROR;
-    preamble[*count] = PRAGMA CL_DOUBLE ENABLE;
-    (*count)++;
-  }
-  if (flags & GA_USE_COMPLEX) {
-    return GA_DEVSUP_ERROR; // for now
-  }
-  if (flags & GA_USE_HALF) {
-    if (check_ext(ctx, CL_HALF)) return GA_DEVSUP_ERROR;
-    preamble[*count] = PRAGMA CL_HALF ENABLE;
-    (*count)++;
-  }
-  if (flags & (GA_USE_PTX|GA_USE_CUDA)) {
-    return GA_DEVSUP_ERROR;
-  }
+static int cl_event_sync(gpuevent *ev) {
+  if (ev->ev == NULL)
+    return GA_NO_ERROR;
+  ev->ctx->err = clWaitForEvents(1, &ev->ev);
+  if (ev->ctx->err != CL_SUCCESS) return GA_IMPL_ERROR;
   return GA_NO_ERROR;
 }
 
-static gpukernel *cl_newkernel(void *c, unsigned int count,
-                               const char **strings, const size_t *lengths,
-                               const char *fname, unsigned int argcount,
-                               const int *types, int flags, int *ret,
-                               char **err_str) {
-  cl_ctx *ctx = (cl_ctx *)c;
+static void cl_event_free(gpuevent *ev) {
+  cl_ctx *ctx = ev->ctx;
+
+  if (ev->ev != NULL)
+    clReleaseEvent(ev->ev);
+  free(ev);
+  cl_free_ctx(ctx);
+}
+
+static gpuevent *cl_event_new(void *c, int flags, int *ret) {
+  cl_ctx *ctx = (cl_ctx *)c;
+  gpuevent *res;
+
+  ASSERT_CTX(ctx);
+  res = malloc(sizeof(*res));
+  if (res == NULL) FAIL(NULL, GA_SYS_ERROR);
+  res->ctx = ctx;
+  res->ev = NULL;
+  res->flags = flags;
+  ctx->refcnt++;
+  return res;
+}
+
+static int cl_event_record(gpuevent *ev, gpustream *s) {
+  cl_ctx *ctx = ev->ctx;
+  cl_command_queue q;
+  cl_event e;
+
+  if (s != NULL && s->ctx != ctx)
+    return GA_VALUE_ERROR;
+  q = s == NULL ? ctx->q0 : s->q;
+  /* A marker completes with the commands enqueued before it */
+  ctx->err = clEnqueueMarker(q, &e);
+  if (ctx->err != CL_SUCCESS) return GA_IMPL_ERROR;
+  clFlush(q);
+  if (ev->ev != NULL)
+    clReleaseEvent(ev->ev);
+  ev->ev = e;
+  return GA_NO_ERROR;
+}
+
+static int cl_event_wait(gpuevent *ev, gpustream *s) {
+  cl_ctx *ctx = ev->ctx;
+
+  if (s != NULL && s->ctx != ctx)
+    return GA_VALUE_ERROR;
+  if (ev->ev == NULL)
+    return GA_NO_ERROR;
+  ctx->err = clEnqueueWaitForEvents(s == NULL ? ctx->q0 : s->q, 1, &ev->ev);
+  if (ctx->err != CL_SUCCESS) return GA_IMPL_ERROR;
+  return GA_NO_ERROR;
+}
+
+static int cl_event_elapsed(gpuevent *start, gpuevent *end, double *ms) {
+  cl_ctx *ctx = start->ctx;
+  cl_event evs[2];
+  cl_ulong t0, t1;
+
+  if (end->ctx != ctx || !(start->flags & end->flags & GA_EVENT_TIMING) ||
+      start->ev == NULL || end->ev == NULL)
+    return GA_VALUE_ERROR;
+  evs[0] = start->ev;
+  evs[1] = end->ev;
+  ctx->err = clWaitForEvents(2, evs);
+  if (ctx->err != CL_SUCCESS) return GA_IMPL_ERROR;
+  ctx->err = clGetEventProfilingInfo(start->ev, CL_PROFILING_COMMAND_END,
+                                     sizeof(t0), &t0, NULL);
+  if (ctx->err == CL_SUCCESS)
+    ctx->err = clGetEventProfilingInfo(end->ev, CL_PROFILING_COMMAND_END,
+                                       sizeof(t1), &t1, NULL);
+  if (ctx->err == CL_PROFILING_INFO_NOT_AVAILABLE) return GA_DEVSUP_ERROR;
+  if (ctx->err != CL_SUCCESS) return GA_IMPL_ERROR;
+  /* In nanoseconds */
+  *ms = ((double)t1 - (double)t0) / 1e6;
+  return GA_NO_ERROR;
+}
+
+static const char MEMSET_KERNEL[] =
+  "KERNEL void kmemset(GLOBAL_MEM char *mem, ga_size off, ga_size n,"
+  "                    ga_uint p) {"
+  "GLOBAL_MEM MEMSET_T *m = (GLOBAL_MEM MEMSET_T *)(mem + off);"
+  "for (ga_size i = GID_0 * LDIM_0 + LID_0; i < n; i += GDIM_0 * LDIM_0)"
+  "  m[i] = (MEMSET_T)p;}\n";
+
+/*
+ * Fill kernel for items of `width` bytes (1, 4 or 16), built on first
+ * use and kept in the context.  The offset, count and pattern are
+ * arguments so this is the only compile memset ever does.
+ */
+static gpukernel *memset_kernel(cl_ctx *ctx, unsigned int width, int *ret) {
+  static const int types[] = {GA_BUFFER, GA_SIZE, GA_SIZE, GA_UINT};
+  const char *srcs[2];
+  char key[16];
   gpukernel *res;
-  cl_device_id dev;
+  int flags = GA_USE_CLUDA;
+
+  snprintf(key, sizeof(key), "kmemset%u", width);
+  res = kernel_store_get(ctx->kept, key, strlen(key));
+  if (res != NULL)
+    return res;
+
+  switch (width) {
+  case 1:
+    srcs[0] = "#define MEMSET_T ga_ubyte\n";
+    flags |= GA_USE_SMALL;
+    break;
+  case 4:
+    srcs[0] = "#define MEMSET_T ga_uint\n";
+    break;
+  default:
+    srcs[0] = "#define MEMSET_T uint4\n";
+    break;
+  }
+  srcs[1] = MEMSET_KERNEL;
+  /* Not through cl_newkernel(), the store must be the only owner */
+  res = cl_build_kernel(ctx, 2, srcs, NULL, "kmemset", 4, types, flags, ret,
+                        NULL);
+  if (res == NULL)
+    return NULL;
+  if (kernel_store_put(ctx->kept, key, strlen(key), res) != 0) {
+    cl_releasekernel(res);
+    FAIL(NULL, GA_MEMORY_ERROR);
+  }
+  ctx->refcnt--; /* Prevent ref loop */
+  return res;
+}
+
+static int cl_memset_range(gpudata *dst, size_t offset, size_t sz, int data) {
+  cl_ctx *ctx = dst->ctx;
+  void *args[4];
+  size_t n, ls, gs;
+  gpukernel *m;
+  cl_mem_flags fl;
+  unsigned int width;
+  int res = GA_NO_ERROR;
+
+  unsigned char val = (unsigned char)data;
+  cl_uint pattern = (cl_uint)val | (cl_uint)val << 8 |
+    (cl_uint)val << 16 | (cl_uint)val << 24;
+
+  ASSERT_BUF(dst);
+  ASSERT_CTX(ctx);
+
+  ctx->err = clGetMemObjectInfo(dst->buf, CL_MEM_FLAGS, sizeof(fl), &fl, NULL);
+  if (ctx->err != CL_SUCCESS) return GA_IMPL_ERROR;
+
+  if (fl & CL_MEM_READ_ONLY) return GA_READONLY_ERROR;
+
+  if (check_range(dst, offset, sz) != GA_NO_ERROR) return GA_VALUE_ERROR;
+
+  if (sz == 0) return GA_NO_ERROR;
+
+  if (((offset | sz) % 16) == 0)
+    width = 16;
+  else if (((offset | sz) % 4) == 0)
+    width = 4;
+  else
+    width = 1;
+
+#ifdef CL_VERSION_1_2
+  if (ctx->has_fill) {
+    cl_event ev;
+
+    ctx->err = clEnqueueFillBuffer(ctx->q, dst->buf, &pattern,
+                                   width == 1 ? 1 : 4, offset, sz,
+                                   dst->ev == NULL ? 0 : 1,
+                                   dst->ev == NULL ? NULL : &dst->ev, &ev);
+    if (ctx->err != CL_SUCCESS) return GA_IMPL_ERROR;
+    if (dst->ev != NULL)
+      clReleaseEvent(dst->ev);
+    dst->ev = ev;
+    return GA_NO_ERROR;
+  }
+#endif
+
+  if (width == 1 && check_ext(ctx, CL_SMALL))
+    return GA_DEVSUP_ERROR;
+
+  m = memset_kernel(ctx, width, &res);
+  if (m == NULL) return res;
+
+  n = sz / width;
+  /* Cheap kernel scheduling */
+  res = cl_property(NULL, NULL, m, GA_KERNEL_PROP_MAXLSIZE, &ls);
+  if (res != GA_NO_ERROR) return res;
+  gs = ((n-1) / ls) + 1;
+  args[0] = dst;
+  args[1] = &offset;
+  args[2] = &n;
+  args[3] = &pattern;
+  return cl_callkernel(m, 1, &ls, &gs, 0, args);
+}
+
+static int cl_fill(gpudata *dst, size_t offset, size_t sz,
+                   const void *pattern, size_t psz) {
+  cl_ctx *ctx = dst->ctx;
+
+  ASSERT_BUF(dst);
+  ASSERT_CTX(ctx);
+
+  if (psz == 0 || sz % psz != 0 ||
+      check_range(dst, offset, sz) != GA_NO_ERROR)
+    return GA_VALUE_ERROR;
+
+  if (sz == 0) return GA_NO_ERROR;
+
+#ifdef CL_VERSION_1_2
+  /* Patterns can be any power of two up to 128 bytes */
+  if (ctx->has_fill && psz <= 128 && (psz & (psz - 1)) == 0 &&
+      offset % psz == 0) {
+    cl_event ev;
+
+    ctx->err = clEnqueueFillBuffer(ctx->q, dst->buf, pattern, psz, offset, sz,
+                                   dst->ev == NULL ? 0 : 1,
+                                   dst->ev == NULL ? NULL : &dst->ev, &ev);
+    if (ctx->err != CL_SUCCESS) return GA_IMPL_ERROR;
+    if (dst->ev != NULL)
+      clReleaseEvent(dst->ev);
+    dst->ev = ev;
+    return GA_NO_ERROR;
+  }
+#endif
+  return GA_UNSUPPORTED_ERROR;
+}
+
+static int cl_memset(gpudata *dst, size_t offset, int data) {
+  ASSERT_BUF(dst);
+
+  if (offset > dst->size) return GA_VALUE_ERROR;
+  return cl_memset_range(dst, offset, dst->size - offset, data);
+}
+
+static int cl_check_extensions(const char **preamble, unsigned int *count,
+                               int flags, cl_ctx *ctx) {
+  if (flags & GA_USE_CLUDA) {
+    preamble[*count] = CL_PREAMBLE;
+    (*count)++;
+  }
+  if (flags & GA_USE_SMALL) {
+    if (check_ext(ctx, CL_SMALL)) return GA_DEVSUP_ERROR;
+    preamble[*count] = PRAGMA CL_SMALL ENABLE;
+    (*count)++;
+  }
+  if (flags & GA_USE_DOUBLE) {
+    if (check_ext(ctx, CL_DOUBLE)) return GA_DEVSUP_ERROR;
+    preamble[*count] = PRAGMA CL_DOUBLE ENABLE;
+    (*count)++;
+  }
+  if (flags & GA_USE_COMPLEX) {
+    return GA_DEVSUP_ERROR; // for now
+  }
+  if (flags & GA_USE_HALF) {
+    if (check_ext(ctx, CL_HALF)) return GA_DEVSUP_ERROR;
+    preamble[*count] = PRAGMA CL_HALF ENABLE;
+    (*count)++;
+  }
+  if (flags & (GA_USE_PTX|GA_USE_CUDA)) {
+    return GA_DEVSUP_ERROR;
+  }
+  return GA_NO_ERROR;
+}
+
+/* Compiler options for the GA_USE_* and GA_OPT_LEVEL bits of `flags` */
+static void cl_build_options(int flags, char *buf, size_t sz) {
+  buf[0] = '\0';
+  if (flags & GA_USE_FAST_MATH)
+    strlcat(buf, " -cl-fast-relaxed-math", sz);
+  if (flags & GA_USE_MAD)
+    strlcat(buf, " -cl-mad-enable", sz);
+  if (GA_GET_OPT_LEVEL(flags) == 0)
+    strlcat(buf, " -cl-opt-disable", sz);
+}
+
+/* Returns a built program for `key` from the disk cache or NULL */
+static cl_program cached_program(cl_ctx *ctx, cl_device_id dev, strb *key) {
   cl_program p;
+  unsigned char *bin;
+  size_t len;
+  cl_int e;
+
+  bin = disk_cache_get(key, &len);
+  if (bin == NULL)
+    return NULL;
+  p = clCreateProgramWithBinary(ctx->ctx, 1, &dev, &len,
+                                (const unsigned char **)&bin, NULL, &e);
+  free(bin);
+  if (e != CL_SUCCESS)
+    return NULL;
+  if (clBuildProgram(p, 0, NULL, NULL, NULL, NULL) != CL_SUCCESS) {
+    clReleaseProgram(p);
+    return NULL;
+  }
+  return p;
+}
+
+/* Returns the binary of a built program, to free() */
+static unsigned char *program_binary(cl_program p, size_t *len) {
+  unsigned char *bin;
+
+  if (clGetProgramInfo(p, CL_PROGRAM_BINARY_SIZES, sizeof(*len), len,
+                       NULL) != CL_SUCCESS || *len == 0)
+    return NULL;
+  bin = malloc(*len);
+  if (bin == NULL)
+    return NULL;
+  if (clGetProgramInfo(p, CL_PROGRAM_BINARIES, sizeof(bin), &bin,
+                       NULL) != CL_SUCCESS) {
+    free(bin);
+    return NULL;
+  }
+  return bin;
+}
+
+static void cache_program(cl_program p, strb *key) {
+  unsigned char *bin;
+  size_t len;
+
+  bin = program_binary(p, &len);
+  if (bin != NULL)
+    disk_cache_put(key, bin, len);
+  free(bin);
+}
+
+static void build_log(cl_program p, cl_device_id dev, unsigned int count,
+                      const char **strings, size_t *lengths,
+                      char **err_str) {
+  strb debug_msg = STRB_STATIC_INIT;
+  size_t log_size;
+
+  *err_str = NULL;  // Fallback, in case there's an error
+
+  // We're substituting debug_msg for a string with this first line:
+  strb_appends(&debug_msg, "Program build failure ::\n");
+
+  // Determine the size of the log
+  clGetProgramBuildInfo(p, dev, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
+
+  if(strb_ensure(&debug_msg, log_size)!=-1 && log_size>=1) { // Checks strb has enough space
+    // Get the log directly into the debug_msg
+    clGetProgramBuildInfo(p, dev, CL_PROGRAM_BUILD_LOG, log_size, debug_msg.s+debug_msg.l, NULL);
+    debug_msg.l += (log_size-1); // Back off to before final '\0'
+  }
+
+  // Not clear what to do with binary 'source' - the log will have to suffice
+  if (strings != NULL)
+    gpukernel_source_with_line_numbers(count, strings, lengths, &debug_msg);
+
+  strb_append0(&debug_msg); // Make sure a final '\0' is present
+
+  if(!strb_error(&debug_msg)) { // Make sure the strb is in a valid state
+    *err_str = strndup(debug_msg.s, debug_msg.l);
+    // If there's a memory alloc error, fall-through : announcing a compile error is more important
+  }
+  strb_clear(&debug_msg);
+  // *err_str will be free()d by the caller (see docs in kernel.h)
+}
+
+/*
+ * Builds the program for the sources of a kernel.  OpenCL errors are
+ * stored in `*e` rather than in the context so that this can run on
+ * any thread.
+ */
+static int cl_build_program(cl_ctx *ctx, cl_device_id dev, unsigned int count,
+                            const char **strings, const size_t *lengths,
+                            int flags, cl_program *res, cl_int *e,
+                            char **err_str) {
+  strb key = STRB_STATIC_INIT;
+  cl_program p = NULL;
   // Sync this table size with the number of flags that can add stuff
   // at the beginning
   const char *preamble[4];
+  char opts[64];
   size_t *newl = NULL;
   const char **news = NULL;
   unsigned int n = 0;
   int error;
 
-  ASSERT_CTX(ctx);
+  if (count == 0) return GA_VALUE_ERROR;
+
+  cl_build_options(flags, opts, sizeof(opts));
+
+  error = cl_check_extensions(preamble, &n, flags, ctx);
+  if (error != GA_NO_ERROR) return error;
+
+  if (n != 0) {
+    news = calloc(count+n, sizeof(const char *));
+    if (news == NULL)
+      return GA_SYS_ERROR;
+    memcpy(news, preamble, n*sizeof(const char *));
+    memcpy(news+n, strings, count*sizeof(const char *));
+    if (lengths == NULL) {
+      newl = NULL;
+    } else {
+      newl = calloc(count+n, sizeof(size_t));
+      if (newl == NULL) {
+        free(news);
+        return GA_MEMORY_ERROR;
+      }
+      memcpy(newl+n, lengths, count*sizeof(size_t));
+    }
+  } else {
+    news = strings;
+    newl = (size_t *)lengths;
+  }
+
+  if (disk_cache_key(&key, ctx->cache_id, flags, count+n, news, newl) == 0)
+    p = cached_program(ctx, dev, &key);
+  if (p == NULL) {
+    p = clCreateProgramWithSource(ctx->ctx, count+n, news, newl, e);
+    if (*e == CL_SUCCESS)
+      *e = clBuildProgram(p, 0, NULL, opts, NULL, NULL);
+    if (*e != CL_SUCCESS) {
+      error = GA_IMPL_ERROR;
+      if (p != NULL) {
+        if (*e == CL_BUILD_PROGRAM_FAILURE && err_str != NULL)
+          build_log(p, dev, count+n, news, newl, err_str);
+        clReleaseProgram(p);
+      }
+    } else if (key.l != 0 && !strb_error(&key)) {
+      cache_program(p, &key);
+    }
+  }
+  strb_clear(&key);
+
+  if (n != 0) {
+    free(news);
+    free(newl);
+  }
+  if (error == GA_NO_ERROR)
+    *res = p;
+  return error;
+}
+
+static cl_program cl_make_program(cl_ctx *ctx, unsigned int count,
+                                  const char **strings,
+                                  const size_t *lengths, int flags, int *ret,
+                                  char **err_str) {
+  cl_device_id dev;
+  cl_program p;
+  int error;
 
   if (count == 0) FAIL(NULL, GA_VALUE_ERROR);
 
@@ -727,90 +1585,27 @@ static gpukernel *cl_newkernel(void *c, unsigned int count,
       clReleaseProgram(p);
       FAIL(NULL, GA_IMPL_ERROR);
     }
-  } else {
-
-    error = cl_check_extensions(preamble, &n, flags, ctx);
-    if (error != GA_NO_ERROR) FAIL(NULL, error);
-
-    if (n != 0) {
-      news = calloc(count+n, sizeof(const char *));
-      if (news == NULL) {
-        FAIL(NULL, GA_SYS_ERROR);
-      }
-      memcpy(news, preamble, n*sizeof(const char *));
-      memcpy(news+n, strings, count*sizeof(const char *));
-      if (lengths == NULL) {
-        newl = NULL;
-      } else {
-        newl = calloc(count+n, sizeof(size_t));
-        if (newl == NULL) {
-          free(news);
-          FAIL(NULL, GA_MEMORY_ERROR);
-        }
-        memcpy(newl+n, lengths, count*sizeof(size_t));
-      }
-    } else {
-      news = strings;
-      newl = (size_t *)lengths;
-    }
-
-    p = clCreateProgramWithSource(ctx->ctx, count+n, news, newl, &ctx->err);
+    ctx->err = clBuildProgram(p, 0, NULL, NULL, NULL, NULL);
     if (ctx->err != CL_SUCCESS) {
-      if (n != 0) {
-        free(news);
-        free(newl);
-      }
+      if (ctx->err == CL_BUILD_PROGRAM_FAILURE && err_str != NULL)
+        build_log(p, dev, 0, NULL, NULL, err_str);
+      clReleaseProgram(p);
       FAIL(NULL, GA_IMPL_ERROR);
     }
+  } else {
+    error = cl_build_program(ctx, dev, count, strings, lengths, flags, &p,
+                             &ctx->err, err_str);
+    if (error != GA_NO_ERROR)
+      FAIL(NULL, error);
   }
+  return p;
+}
 
-  ctx->err = clBuildProgram(p, 0, NULL, NULL, NULL, NULL);
-  if (ctx->err != CL_SUCCESS) {
-    if (ctx->err == CL_BUILD_PROGRAM_FAILURE && err_str!=NULL) {
-      *err_str = NULL;  // Fallback, in case there's an error
-
-      strb debug_msg = STRB_STATIC_INIT;
-      // We're substituting debug_msg for a string with this first line:
-      strb_appends(&debug_msg, "Program build failure ::\n");
-
-      // Determine the size of the log
-      size_t log_size;
-      clGetProgramBuildInfo(p, dev, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-
-      if(strb_ensure(&debug_msg, log_size)!=-1 && log_size>=1) { // Checks strb has enough space
-        // Get the log directly into the debug_msg
-        clGetProgramBuildInfo(p, dev, CL_PROGRAM_BUILD_LOG, log_size, debug_msg.s+debug_msg.l, NULL);
-        debug_msg.l += (log_size-1); // Back off to before final '\0'
-      }
-
-      if (flags & GA_USE_BINARY) {
-        // Not clear what to do with binary 'source' - the log will have to suffice
-      } else {
-        gpukernel_source_with_line_numbers(count+n, news, newl, &debug_msg);
-      }
-
-      strb_append0(&debug_msg); // Make sure a final '\0' is present
-
-      if(!strb_error(&debug_msg)) { // Make sure the strb is in a valid state
-        *err_str = strndup(debug_msg.s, debug_msg.l);
-        // If there's a memory alloc error, fall-through : announcing a compile error is more important
-      }
-      strb_clear(&debug_msg);
-      // *err_str will be free()d by the caller (see docs in kernel.h)
-    }
-
-    clReleaseProgram(p);
-    if (n != 0) {
-      free(news);
-      free(newl);
-    }
-    FAIL(NULL, GA_IMPL_ERROR);
-  }
-
-  if (n != 0) {
-    free(news);
-    free(newl);
-  }
+/* OpenCL kernels keep their program alive, the caller can release `p` */
+static gpukernel *cl_make_kernel(cl_ctx *ctx, cl_program p, const char *fname,
+                                 unsigned int argcount, const int *types,
+                                 int *ret) {
+  gpukernel *res;
 
   res = malloc(sizeof(*res));
   if (res == NULL) FAIL(NULL, GA_MEMORY_ERROR);
@@ -820,8 +1615,8 @@ static gpukernel *cl_newkernel(void *c, unsigned int count,
   res->k = clCreateKernel(p, fname, &ctx->err);
   res->types = NULL;  /* This avoids a crash in cl_releasekernel */
   res->ctx = ctx;
+  res->entry = NULL;
   ctx->refcnt++;
-  clReleaseProgram(p);
   TAG_KER(res);
   if (ctx->err != CL_SUCCESS) {
     cl_releasekernel(res);
@@ -837,16 +1632,90 @@ static gpukernel *cl_newkernel(void *c, unsigned int count,
   return res;
 }
 
+static gpukernel *cl_build_kernel(cl_ctx *ctx, unsigned int count,
+                                  const char **strings, const size_t *lengths,
+                                  const char *fname, unsigned int argcount,
+                                  const int *types, int flags, int *ret,
+                                  char **err_str) {
+  gpukernel *res;
+  cl_program p;
+
+  p = cl_make_program(ctx, count, strings, lengths, flags, ret, err_str);
+  if (p == NULL) return NULL;
+  res = cl_make_kernel(ctx, p, fname, argcount, types, ret);
+  clReleaseProgram(p);
+  return res;
+}
+
 static void cl_retainkernel(gpukernel *k) {
   ASSERT_KER(k);
   k->refcnt++;
 }
 
+/*
+ * Returns the kernel for these sources from the kernel table or builds it
+ * and adds it there.  If `bin` is not NULL the kernel is loaded from it
+ * instead of compiling the sources.
+ */
+static gpukernel *cl_table_kernel(cl_ctx *ctx, unsigned int count,
+                                  const char **strings, const size_t *lengths,
+                                  const char *fname, unsigned int argcount,
+                                  const int *types, int flags, const void *bin,
+                                  size_t bin_sz, int *ret, char **err_str) {
+  strb key = STRB_STATIC_INIT;
+  const char *b = (const char *)bin;
+  gpukernel *res;
+
+  if (kernel_table_key(&key, count, strings, lengths, fname, argcount,
+                       types, flags) == 0) {
+    res = kernel_table_get(ctx->kernels, &key, cl_retainkernel);
+    if (res != NULL) {
+      strb_clear(&key);
+      return res;
+    }
+  }
+  if (bin != NULL)
+    res = cl_build_kernel(ctx, 1, &b, &bin_sz, fname, argcount, types,
+                          GA_USE_BINARY, ret, err_str);
+  else
+    res = cl_build_kernel(ctx, count, strings, lengths, fname, argcount,
+                          types, flags, ret, err_str);
+  if (res != NULL && !strb_error(&key))
+    res->entry = kernel_table_add(ctx->kernels, &key, res);
+  strb_clear(&key);
+  return res;
+}
+
+static gpukernel *cl_newkernel(void *c, unsigned int count,
+                               const char **strings, const size_t *lengths,
+                               const char *fname, unsigned int argcount,
+                               const int *types, int flags, int *ret,
+                               char **err_str) {
+  cl_ctx *ctx = (cl_ctx *)c;
+
+  ASSERT_CTX(ctx);
+
+  return cl_table_kernel(ctx, count, strings, lengths, fname, argcount,
+                         types, flags, NULL, 0, ret, err_str);
+}
+
+static gpukernel *cl_kernel_load(void *c, unsigned int count,
+                                 const char **strings, const size_t *lengths,
+                                 const char *fname, unsigned int argcount,
+                                 const int *types, int flags, const void *bin,
+                                 size_t bin_sz, int *ret, char **err_str) {
+  cl_ctx *ctx = (cl_ctx *)c;
+
+  ASSERT_CTX(ctx);
+
+  return cl_table_kernel(ctx, count, strings, lengths, fname, argcount,
+                         types, flags, bin, bin_sz, ret, err_str);
+}
+
 static void cl_releasekernel(gpukernel *k) {
   ASSERT_KER(k);
 
-  k->refcnt--;
-  if (k->refcnt == 0) {
+  if (kernel_table_unref(k->entry, &k->refcnt) == 0) {
     CLEAR(k);
     if (k->ev != NULL) clReleaseEvent(k->ev);
     if (k->k) clReleaseKernel(k->k);
@@ -856,6 +1725,59 @@ static void cl_releasekernel(gpukernel *k) {
   }
 }
 
+static int cl_kernel_alloc_module(void *c, unsigned int count,
+                                  const char **strings, const size_t *lengths,
+                                  unsigned int n, const char **fnames,
+                                  const unsigned int *argcounts,
+                                  const int **types, int flags,
+                                  gpukernel **res, char **err_str) {
+  cl_ctx *ctx = (cl_ctx *)c;
+  strb key = STRB_STATIC_INIT;
+  cl_program p = NULL;
+  unsigned int i;
+  int err = GA_NO_ERROR;
+
+  ASSERT_CTX(ctx);
+
+  if (n == 0) return GA_VALUE_ERROR;
+
+  for (i = 0; i < n; i++) {
+    res[i] = NULL;
+    strb_reset(&key);
+    if (kernel_table_key(&key, count, strings, lengths, fnames[i],
+                         argcounts[i], types[i], flags) == 0)
+      res[i] = kernel_table_get(ctx->kernels, &key, cl_retainkernel);
+  }
+  for (i = 0; i < n && err == GA_NO_ERROR; i++) {
+    if (res[i] != NULL)
+      continue;
+    /* Only the first missing one pays for the compilation */
+    if (p == NULL) {
+      p = cl_make_program(ctx, count, strings, lengths, flags, &err, err_str);
+      if (p == NULL)
+        break;
+    }
+    res[i] = cl_make_kernel(ctx, p, fnames[i], argcounts[i], types[i], &err);
+    strb_reset(&key);
+    if (res[i] != NULL &&
+        kernel_table_key(&key, count, strings, lengths, fnames[i],
+                         argcounts[i], types[i], flags) == 0)
+      res[i]->entry = kernel_table_add(ctx->kernels, &key, res[i]);
+  }
+  strb_clear(&key);
+  if (p != NULL)
+    clReleaseProgram(p);
+
+  if (err != GA_NO_ERROR) {
+    for (i = 0; i < n; i++) {
+      if (res[i] != NULL)
+        cl_releasekernel(res[i]);
+      res[i] = NULL;
+    }
+  }
+  return err;
+}
+
 static int cl_callkernel(gpukernel *k, unsigned int n,
                          const size_t *ls, const size_t *gs,
                          size_t shared, void **args) {
@@ -995,6 +1917,99 @@ static int cl_sync(gpudata *b) {
   return GA_NO_ERROR;
 }
 
+/*
+ * Make `q` wait for the commands enqueued on `other` so far.  The
+ * buffers don't need this since every command waits for the event of
+ * the buffers it uses.
+ */
+static int queue_join(cl_ctx *ctx, cl_command_queue q,
+                      cl_command_queue other) {
+  cl_event ev;
+
+  if (q == other)
+    return GA_NO_ERROR;
+  ctx->err = clEnqueueMarker(other, &ev);
+  if (ctx->err != CL_SUCCESS)
+    return GA_IMPL_ERROR;
+  ctx->err = clEnqueueWaitForEvents(q, 1, &ev);
+  clReleaseEvent(ev);
+  return ctx->err == CL_SUCCESS ? GA_NO_ERROR : GA_IMPL_ERROR;
+}
+
+static gpustream *cl_stream_new(void *c, int *ret) {
+  cl_ctx *ctx = (cl_ctx *)c;
+  gpustream *res;
+  cl_device_id id;
+  cl_command_queue_properties qprop;
+  cl_int err;
+
+  ASSERT_CTX(ctx);
+  id = get_dev(ctx->ctx, ret);
+  if (id == NULL) return NULL;
+  err = clGetCommandQueueInfo(ctx->q0, CL_QUEUE_PROPERTIES, sizeof(qprop),
+                              &qprop, NULL);
+  CHKFAIL(NULL);
+
+  res = malloc(sizeof(*res));
+  if (res == NULL) FAIL(NULL, GA_SYS_ERROR);
+  res->ctx = ctx;
+  res->q = clCreateCommandQueue(ctx->ctx, id, qprop, &err);
+  if (res->q == NULL) {
+    ctx->err = err;
+    free(res);
+    FAIL(NULL, GA_IMPL_ERROR);
+  }
+  if (queue_join(ctx, res->q, ctx->q) != GA_NO_ERROR) {
+    clReleaseCommandQueue(res->q);
+    free(res);
+    FAIL(NULL, GA_IMPL_ERROR);
+  }
+  ctx->refcnt++;
+  return res;
+}
+
+static void cl_stream_free(gpustream *s) {
+  cl_ctx *ctx = s->ctx;
+
+  ASSERT_CTX(ctx);
+  if (ctx->q == s->q)
+    ctx->q = ctx->q0;
+  queue_join(ctx, ctx->q0, s->q);
+  clReleaseCommandQueue(s->q);
+  free(s);
+  cl_free_ctx(ctx);
+}
+
+static int cl_stream_use(void *c, gpustream *s) {
+  cl_ctx *ctx = (cl_ctx *)c;
+
+  ASSERT_CTX(ctx);
+  if (s != NULL && s->ctx != ctx)
+    return GA_VALUE_ERROR;
+  ctx->q = s == NULL ? ctx->q0 : s->q;
+  return GA_NO_ERROR;
+}
+
+static int cl_stream_sync(void *c, gpustream *s) {
+  cl_ctx *ctx = (cl_ctx *)c;
+
+  ASSERT_CTX(ctx);
+  if (s != NULL && s->ctx != ctx)
+    return GA_VALUE_ERROR;
+  ctx->err = clFinish(s == NULL ? ctx->q0 : s->q);
+  return ctx->err == CL_SUCCESS ? GA_NO_ERROR : GA_IMPL_ERROR;
+}
+
+static int cl_stream_wait(void *c, gpustream *s, gpustream *other) {
+  cl_ctx *ctx = (cl_ctx *)c;
+
+  ASSERT_CTX(ctx);
+  if ((s != NULL && s->ctx != ctx) || (other != NULL && other->ctx != ctx))
+    return GA_VALUE_ERROR;
+  return queue_join(ctx, s == NULL ? ctx->q0 : s->q,
+                    other == NULL ? ctx->q0 : other->q);
+}
+
 static gpudata *cl_transfer(gpudata *buf, size_t offset, size_t sz,
                             void *dst_ctx, int may_share) {
   cl_ctx *ctx = buf->ctx;
@@ -1007,19 +2022,69 @@ static gpudata *cl_transfer(gpudata *buf, size_t offset, size_t sz,
     cl_retain(buf);
     return buf;
   }
+#ifdef CL_VERSION_1_1
+  if (ctx == dst_ctx && may_share) {
+    cl_buffer_region reg;
+    cl_mem_flags fl;
+    cl_mem root;
+    gpudata *res;
+    size_t off, bsz;
+
+    /* Make a sub-buffer of the requested part if it is aligned */
+    if (get_region(ctx, buf->buf, &root, &off, &bsz) != 0)
+      return NULL;
+    if (check_range(buf, offset, sz) != GA_NO_ERROR || sz == 0 ||
+        (off + offset) % ctx->align != 0)
+      return NULL;
+    ctx->err = clGetMemObjectInfo(root, CL_MEM_FLAGS, sizeof(fl), &fl, NULL);
+    if (ctx->err != CL_SUCCESS)
+      return NULL;
+
+    res = malloc(sizeof(*res));
+    if (res == NULL) return NULL;
+    reg.origin = off + offset;
+    reg.size = sz;
+    res->buf = clCreateSubBuffer(root, fl & (CL_MEM_READ_WRITE|
+                                             CL_MEM_READ_ONLY|
+                                             CL_MEM_WRITE_ONLY),
+                                 CL_BUFFER_CREATE_TYPE_REGION, &reg,
+                                 &ctx->err);
+    if (ctx->err != CL_SUCCESS) {
+      free(res);
+      return NULL;
+    }
+    /* Wait on what was pending for the source */
+    res->ev = buf->ev;
+    if (res->ev != NULL)
+      clRetainEvent(res->ev);
+    res->refcnt = 1;
+    res->size = sz;
+    res->sz = 0;
+    res->cls = -1;
+    res->next = NULL;
+    res->ctx = ctx;
+    ctx->refcnt++;
+    TAG_BUF(res);
+    return res;
+  }
+#endif
   return NULL;
 }
 
 static const char ELEM_HEADER[] = "#define DTYPEA %s\n"
   "#define DTYPEB %s\n"
   "__kernel void elemk(__global const DTYPEA *a_data,"
-  "                    __global DTYPEB *b_data){"
+  "                    __global DTYPEB *b_data,"
+  "                    ga_size a_off, ga_size b_off";
+
+/* After the parameters of generic kernels and the definition of n */
+static const char ELEM_BODY[] =
   "const int idx = get_global_id(0);"
   "const int numThreads = get_global_size(0);"
-  "__global char *tmp; tmp = (__global char *)a_data; tmp += %" SPREFIX "u;"
+  "__global char *tmp; tmp = (__global char *)a_data; tmp += a_off;"
   "a_data = (__global const DTYPEA *)tmp; tmp = (__global char *)b_data;"
-  "tmp += %" SPREFIX "u; b_data = (__global DTYPEB *)tmp;"
-  "for (int i = idx; i < %" SPREFIX "u; i+= numThreads) {"
+  "tmp += b_off; b_data = (__global DTYPEB *)tmp;"
+  "for (int i = idx; i < n; i+= numThreads) {"
   "__global const char *a_p = (__global const char *)a_data;"
   "__global char *b_p = (__global char *)b_data;";
 
@@ -1028,21 +2093,154 @@ static const char ELEM_FOOTER[] =
   "__global DTYPEB *b = (__global DTYPEB *)b_p;"
   "b[0] = a[0];}}\n";
 
+/*
+ * The kernels in the extcopy cache and the ones kept with
+ * cl_kernel_keep() don't hold a reference on their context, otherwise
+ * it would never go away.  Give it back before
+ * releasing them.
+ */
+static void release_cached(gpukernel *k) {
+  if (k == NULL)
+    return;
+  k->ctx->refcnt++;
+  cl_releasekernel(k);
+}
+
+static gpukernel *cl_kernel_lookup(void *c, const char *key, size_t len) {
+  cl_ctx *ctx = (cl_ctx *)c;
+  gpukernel *res;
+
+  ASSERT_CTX(ctx);
+  res = kernel_store_get(ctx->kept, key, len);
+  if (res != NULL)
+    cl_retainkernel(res);
+  return res;
+}
+
+static int cl_kernel_keep(gpukernel *k, const char *key, size_t len) {
+  ASSERT_KER(k);
+  cl_retainkernel(k);
+  if (kernel_store_put(k->ctx->kept, key, len, k) != 0) {
+    cl_releasekernel(k);
+    return GA_MEMORY_ERROR;
+  }
+  k->ctx->refcnt--; /* Prevent ref loop */
+  return GA_NO_ERROR;
+}
+
+static int cl_kernel_compile(void *c, unsigned int count,
+                             const char **strings, const size_t *lengths,
+                             const char *fname, unsigned int argcount,
+                             const int *types, int flags, void **bin,
+                             size_t *bin_sz, char **err_str) {
+  cl_ctx *ctx = (cl_ctx *)c;
+  cl_device_id dev;
+  cl_program p;
+  cl_int e;
+  int error = GA_NO_ERROR;
+
+  ASSERT_CTX(ctx);
+  if (flags & GA_USE_BINARY)
+    return GA_INVALID_ERROR;
+
+  dev = get_dev(ctx->ctx, &error);
+  if (dev == NULL) return error;
+
+  error = cl_build_program(ctx, dev, count, strings, lengths, flags, &p, &e,
+                           err_str);
+  if (error != GA_NO_ERROR)
+    return error;
+  *bin = program_binary(p, bin_sz);
+  clReleaseProgram(p);
+  if (*bin == NULL)
+    return GA_IMPL_ERROR;
+  return GA_NO_ERROR;
+}
+
+/* Parameters read by gpuarray_elem_perdim() for dims == NULL */
+static void perdim_params(strb *sb, unsigned int nd, const char *id) {
+  unsigned int i;
+
+  for (i = 0; i < nd; i++)
+    strb_appendf(sb, ", ga_size %s_d%u", id, i);
+  for (i = 0; i < nd; i++)
+    strb_appendf(sb, ", ga_ssize %s_s%u", id, i);
+}
+
+/* For generic keys nEls is ignored */
+static int gen_extcopy_kernel(const cache_key_t *a, cl_ctx *ctx,
+                              gpukernel **k, size_t nEls) {
+  strb sb = STRB_STATIC_INIT;
+  int res = GA_SYS_ERROR;
+  int flags = GA_USE_CLUDA;
+  unsigned int argcount;
+  int types[5 + 4*EXTCOPY_GENERIC_ND];
+
+  if (a->otype == GA_DOUBLE || a->itype == GA_DOUBLE ||
+      a->otype == GA_CDOUBLE || a->itype == GA_CDOUBLE) {
+    flags |= GA_USE_DOUBLE;
+  }
+
+  if (a->otype == GA_HALF || a->itype == GA_HALF) {
+    flags |= GA_USE_HALF;
+  }
+
+  if (gpuarray_get_elsize(a->otype) < 4 || gpuarray_get_elsize(a->itype) < 4) {
+    /* Should check for non-mod4 strides too */
+    flags |= GA_USE_SMALL;
+  }
+
+  if (a->otype == GA_CFLOAT || a->itype == GA_CFLOAT ||
+      a->otype == GA_CDOUBLE || a->itype == GA_CDOUBLE) {
+    flags |= GA_USE_COMPLEX;
+  }
+
+  strb_appendf(&sb, ELEM_HEADER,
+	       gpuarray_get_type(a->itype)->cluda_name,
+	       gpuarray_get_type(a->otype)->cluda_name);
+  if (a->generic) {
+    strb_appends(&sb, ", ga_size n");
+    perdim_params(&sb, a->ind, "a_p");
+    perdim_params(&sb, a->ond, "b_p");
+    strb_appends(&sb, "){");
+  } else {
+    strb_appendf(&sb, "){const ga_size n = %" SPREFIX "u;", nEls);
+  }
+  strb_appends(&sb, ELEM_BODY);
+
+  gpuarray_elem_perdim(&sb, a->ind, a->idims, a->istr, "a_p");
+  gpuarray_elem_perdim(&sb, a->ond, a->odims, a->ostr, "b_p");
+
+  strb_appends(&sb, ELEM_FOOTER);
+
+  if (strb_error(&sb))
+    goto fail;
+
+  argcount = extcopy_types(a, types);
+  res = GA_NO_ERROR;
+  /* Not through cl_newkernel(), the cache must be the only owner */
+  *k = cl_build_kernel(ctx, 1, (const char **)&sb.s, &sb.l, "elemk",
+                       argcount, types, flags, &res, NULL);
+ fail:
+  strb_clear(&sb);
+  return res;
+}
+
 static int cl_extcopy(gpudata *input, size_t ioff, gpudata *output,
                       size_t ooff, int intype, int outtype, unsigned int a_nd,
                       const size_t *a_dims, const ssize_t *a_str,
                       unsigned int b_nd, const size_t *b_dims,
                       const ssize_t *b_str) {
   cl_ctx *ctx = input->ctx;
-  strb sb = STRB_STATIC_INIT;
   size_t nEls, ls, gs;
   gpukernel *k;
-  void *args[2];
+  gpukernel *owned = NULL; /* kernel that didn't make it in a cache */
+  void *args[5 + 4*EXTCOPY_GENERIC_ND];
   cl_mem_flags fl;
   int res = GA_SYS_ERROR;
   unsigned int i;
-  int flags = GA_USE_CLUDA;
-  int types[2];
+  cache_val_t l, *v;
+  cache_key_t a;
 
   ASSERT_BUF(input);
   ASSERT_BUF(output);
@@ -1067,55 +2265,97 @@ static int cl_extcopy(gpudata *input, size_t ioff, gpudata *output,
 
   if (nEls == 0) return GA_NO_ERROR;
 
-  if (outtype == GA_DOUBLE || intype == GA_DOUBLE ||
-      outtype == GA_CDOUBLE || intype == GA_CDOUBLE) {
-    flags |= GA_USE_DOUBLE;
-  }
-
-  if (outtype == GA_HALF || intype == GA_HALF) {
-    flags |= GA_USE_HALF;
+  a.ind = a_nd;
+  a.ond = b_nd;
+  a.itype = intype;
+  a.otype = outtype;
+  a.idims = a_dims;
+  a.odims = b_dims;
+  a.istr = a_str;
+  a.ostr = b_str;
+  a.generic = 0;
+
+  do_key_hash(&a);
+
+  v = cache_get(ctx->extcopy_cache, &a);
+  if (v == NULL) {
+    /* Start counting calls for this layout */
+    l.k = NULL;
+    l.ncall = 0;
+    a.idims = memdup(a_dims, a_nd*sizeof(size_t));
+    a.odims = memdup(b_dims, b_nd*sizeof(size_t));
+    a.istr = memdup(a_str, a_nd*sizeof(ssize_t));
+    a.ostr = memdup(b_str, b_nd*sizeof(ssize_t));
+    if (a.idims == NULL || a.odims == NULL ||
+        a.istr == NULL || a.ostr == NULL ||
+        cache_insert(ctx->extcopy_cache, &a, &l)) {
+      /* Cache insert or memdup failed */
+      free((void *)a.idims);
+      free((void *)a.odims);
+      free((void *)a.istr);
+      free((void *)a.ostr);
+      v = &l;
+    } else {
+      v = cache_get(ctx->extcopy_cache, &a);
+    }
+    a.idims = a_dims;
+    a.odims = b_dims;
+    a.istr = a_str;
+    a.ostr = b_str;
   }
 
-  if (gpuarray_get_elsize(outtype) < 4 || gpuarray_get_elsize(intype) < 4) {
-    /* Should check for non-mod4 strides too */
-    flags |= GA_USE_SMALL;
+  if (v->k == NULL &&
+      (++v->ncall > EXTCOPY_SPEC_LIMIT ||
+       a_nd > EXTCOPY_GENERIC_ND || b_nd > EXTCOPY_GENERIC_ND)) {
+    res = gen_extcopy_kernel(&a, ctx, &v->k, nEls);
+    if (res != GA_NO_ERROR)
+      return res;
+    if (v == &l)
+      owned = l.k;
+    else
+      ctx->refcnt--; /* Prevent ref loop */
   }
 
-  if (outtype == GA_CFLOAT || intype == GA_CFLOAT ||
-      outtype == GA_CDOUBLE || intype == GA_CDOUBLE) {
-    flags |= GA_USE_COMPLEX;
+  args[0] = input;
+  args[1] = output;
+  args[2] = &ioff;
+  args[3] = &ooff;
+  if (v->k != NULL) {
+    k = v->k;
+  } else {
+    a.idims = a.odims = NULL;
+    a.istr = a.ostr = NULL;
+    a.generic = 1;
+    do_key_hash(&a);
+
+    v = cache_get(ctx->extcopy_generic, &a);
+    if (v == NULL) {
+      l.k = NULL;
+      l.ncall = 0;
+      res = gen_extcopy_kernel(&a, ctx, &l.k, 0);
+      if (res != GA_NO_ERROR)
+        return res;
+      if (cache_insert(ctx->extcopy_generic, &a, &l))
+        owned = l.k;
+      else
+        ctx->refcnt--; /* Prevent ref loop */
+      v = &l;
+    }
+    k = v->k;
+    extcopy_generic_args(args + 4, &nEls, a_nd, a_dims, a_str,
+                         b_nd, b_dims, b_str);
   }
 
-  strb_appendf(&sb, ELEM_HEADER,
-	       gpuarray_get_type(intype)->cluda_name,
-	       gpuarray_get_type(outtype)->cluda_name,
-	       ioff, ooff, nEls);
-
-  gpuarray_elem_perdim(&sb, a_nd, a_dims, a_str, "a_p");
-  gpuarray_elem_perdim(&sb, b_nd, b_dims, b_str, "b_p");
-
-  strb_appends(&sb, ELEM_FOOTER);
-
-  if (strb_error(&sb))
-    goto fail;
-
-  types[0] = types[1] = GA_BUFFER;
-  k = cl_newkernel(ctx, 1, (const char **)&sb.s, &sb.l, "elemk",
-                   2, types, flags, &res, NULL);
-  if (k == NULL) goto fail;
   /* Cheap kernel scheduling */
   res = cl_property(NULL, NULL, k, GA_KERNEL_PROP_MAXLSIZE, &ls);
-  if (res != GA_NO_ERROR) goto kfail;
+  if (res != GA_NO_ERROR) goto fail;
 
   gs = ((nEls-1) / ls) + 1;
-  args[0] = input;
-  args[1] = output;
   res = cl_callkernel(k, 1, &ls, &gs, 0, args);
 
- kfail:
-  cl_releasekernel(k);
  fail:
-  strb_clear(&sb);
+  if (owned != NULL)
+    cl_releasekernel(owned);
   return res;
 }
 
@@ -1260,18 +2500,59 @@ static int cl_property(void *c, gpudata *buf, gpukernel *k, int prop_id,
     *((gpudata **)res) = ctx->errbuf;
     return GA_NO_ERROR;
 
+  case GA_CTX_PROP_POOL_STEALS:
+  case GA_CTX_PROP_POOL_IDLE:
+  case GA_CTX_PROP_POOL_CHUNKSIZE:
+    return GA_DEVSUP_ERROR;
+
+  case GA_CTX_PROP_CACHED_BYTES:
+    *((size_t *)res) = ctx->cached;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_INUSE_BYTES:
+    *((size_t *)res) = ctx->inuse;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_PEAK_BYTES:
+    *((size_t *)res) = ctx->peak;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_NUM_BUFFERS:
+    *((size_t *)res) = ctx->nbufs;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_NUM_ALLOCS:
+    *((size_t *)res) = ctx->nallocs;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_KERNEL_CACHE_HITS:
+    kernel_table_stats(ctx->kernels, (size_t *)res, NULL);
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_KERNEL_CACHE_MISSES:
+    kernel_table_stats(ctx->kernels, NULL, (size_t *)res);
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_EXTCOPY_CACHE_SIZE:
+    *((size_t *)res) = extcopy_nkernels(ctx->extcopy_cache,
+                                        ctx->extcopy_generic);
+    return GA_NO_ERROR;
+
   case GA_BUFFER_PROP_REFCNT:
     *((unsigned int *)res) = buf->refcnt;
     return GA_NO_ERROR;
 
   case GA_BUFFER_PROP_SIZE:
-    ctx->err = clGetMemObjectInfo(buf->buf, CL_MEM_SIZE, sizeof(sz), &sz,
-                                  NULL);
-    if (ctx->err != CL_SUCCESS)
-      return GA_IMPL_ERROR;
-    *((size_t *)res) = sz;
+    *((size_t *)res) = buf->size;
     return GA_NO_ERROR;
 
+  /*
+   * A buffer can't be used by kernels while it is mapped, so we have
+   * no stable host pointer to give.
+   */
+  case GA_BUFFER_PROP_HOSTPOINTER:
+    return GA_DEVSUP_ERROR;
+
   /* GA_BUFFER_PROP_CTX is not ordered to simplify code */
   case GA_BUFFER_PROP_CTX:
   case GA_KERNEL_PROP_CTX:
@@ -1361,4 +2642,27 @@ const gpuarray_buffer_ops opencl_ops = {cl_init,
                                        cl_extcopy,
                                        cl_transfer,
                                        cl_property,
-                                       cl_error};
+                                       cl_error,
+                                       cl_trim,
+                                       cl_reset_peak,
+                                       cl_kernel_lookup,
+                                       cl_kernel_keep,
+                                       cl_kernel_compile,
+                                       cl_kernel_alloc_module,
+                                       cl_kernel_load,
+                                       cl_memset_range,
+                                       cl_fill,
+                                       cl_stream_new,
+                                       cl_stream_free,
+                                       cl_stream_use,
+                                       cl_stream_sync,
+                                       cl_stream_wait,
+                                       cl_read_async,
+                                       cl_write_async,
+                                       cl_event_query,
+                                       cl_event_sync,
+                                       cl_event_free,
+                                       cl_event_new,
+                                       cl_event_record,
+                                       cl_event_wait,
+                                       cl_event_elapsed};
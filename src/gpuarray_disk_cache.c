@@ -0,0 +1,362 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "private.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * On-disk cache of compiled kernels.
+ *
+ * Each entry is a file named after a 64-bit hash of its key.  The file
+ * holds the full key before the binary so that a hash collision shows
+ * up as a miss instead of handing out the wrong binary.  Entries are
+ * written to a temporary file which is then renamed into place, so
+ * readers never see a partial entry and several processes can share
+ * the same directory.
+ *
+ * The modification time of an entry is refreshed on every hit.  When
+ * the directory grows over the size limit the least recently used
+ * entries are removed until it is back to 3/4 of the limit.  The
+ * directory is only scanned for that on the first write of a process
+ * and when what it wrote since would take it over the limit, so
+ * entries from other processes are noticed late.
+ *
+ * GPUARRAY_CACHE_DIR selects the directory (set it to an empty string
+ * to disable the cache) and GPUARRAY_CACHE_SIZE the limit in
+ * megabytes.
+ */
+
+#ifdef _WIN32
+
+/* Not implemented yet, every lookup is a miss */
+
+int disk_cache_key(strb *key, const char *bin_id, int flags,
+                   unsigned int count, const char **strings,
+                   const size_t *lengths) {
+  return -1;
+}
+
+void *disk_cache_get(strb *key, size_t *len) {
+  return NULL;
+}
+
+void disk_cache_put(strb *key, const void *bin, size_t len) {
+}
+
+#else
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+
+#define CACHE_MAGIC "GACACHE1"
+#define CACHE_DEFAULT_SIZE 256 /* MB */
+/* Leftover temporary files older than this (in seconds) are removed */
+#define CACHE_TMP_AGE 3600
+
+typedef struct _entry_hdr {
+  char magic[8];
+  uint64_t key_len;
+  uint64_t bin_len;
+} entry_hdr;
+
+typedef struct _entry_info {
+  char name[20];
+  size_t size;
+  time_t mtime;
+} entry_info;
+
+/* Directory size as of the last scan plus what was written since */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static char cache_scanned[PATH_MAX];
+static size_t cache_total;
+
+static int cache_dir(char *buf, size_t sz) {
+  const char *dir;
+
+  dir = getenv("GPUARRAY_CACHE_DIR");
+  if (dir != NULL) {
+    if (dir[0] == '\0')
+      return -1;
+    if (strlcpy(buf, dir, sz) >= sz)
+      return -1;
+    return 0;
+  }
+  dir = getenv("XDG_CACHE_HOME");
+  if (dir != NULL && dir[0] != '\0') {
+    strlcpy(buf, dir, sz);
+  } else {
+    dir = getenv("HOME");
+    if (dir == NULL || dir[0] == '\0')
+      return -1;
+    strlcpy(buf, dir, sz);
+    strlcat(buf, "/.cache", sz);
+  }
+  if (strlcat(buf, "/libgpuarray", sz) >= sz)
+    return -1;
+  return 0;
+}
+
+static size_t cache_limit(void) {
+  const char *s = getenv("GPUARRAY_CACHE_SIZE");
+  char *end;
+  unsigned long v;
+
+  if (s != NULL) {
+    v = strtoul(s, &end, 10);
+    if (end != s && *end == '\0')
+      return (size_t)v * 1024 * 1024;
+  }
+  return (size_t)CACHE_DEFAULT_SIZE * 1024 * 1024;
+}
+
+/* Create `path` and its missing parents */
+static int make_dirs(char *path) {
+  char *p;
+
+  for (p = path + 1; *p != '\0'; p++) {
+    if (*p != '/')
+      continue;
+    *p = '\0';
+    if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+      *p = '/';
+      return -1;
+    }
+    *p = '/';
+  }
+  if (mkdir(path, 0700) == -1 && errno != EEXIST)
+    return -1;
+  return 0;
+}
+
+static int entry_path(char *buf, size_t sz, strb *key) {
+  uint64_t h = hash_bytes(key->s, key->l);
+  size_t l;
+
+  if (cache_dir(buf, sz) != 0)
+    return -1;
+  l = strlen(buf);
+  if (snprintf(buf + l, sz - l, "/%016llx", (unsigned long long)h) >=
+      (int)(sz - l))
+    return -1;
+  return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+  char *p = (char *)buf;
+  ssize_t s;
+
+  while (len > 0) {
+    s = read(fd, p, len);
+    if (s == -1 && errno == EINTR)
+      continue;
+    if (s <= 0)
+      return -1;
+    p += s;
+    len -= (size_t)s;
+  }
+  return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+  const char *p = (const char *)buf;
+  ssize_t s;
+
+  while (len > 0) {
+    s = write(fd, p, len);
+    if (s == -1 && errno == EINTR)
+      continue;
+    if (s <= 0)
+      return -1;
+    p += s;
+    len -= (size_t)s;
+  }
+  return 0;
+}
+
+static int is_entry(const char *name) {
+  unsigned int i;
+
+  for (i = 0; i < 16; i++) {
+    if (!((name[i] >= '0' && name[i] <= '9') ||
+          (name[i] >= 'a' && name[i] <= 'f')))
+      return 0;
+  }
+  return name[16] == '\0';
+}
+
+static int older_first(const void *a, const void *b) {
+  const entry_info *ea = (const entry_info *)a;
+  const entry_info *eb = (const entry_info *)b;
+
+  if (ea->mtime < eb->mtime) return -1;
+  if (ea->mtime > eb->mtime) return 1;
+  return 0;
+}
+
+/* Returns the size of the entries left */
+static size_t prune(const char *dir, size_t limit) {
+  char path[PATH_MAX];
+  entry_info *entries = NULL, *tmp;
+  size_t n = 0, alloc = 0, total = 0, i;
+  struct dirent *d;
+  struct stat st;
+  time_t now = time(NULL);
+  DIR *dp;
+
+  dp = opendir(dir);
+  if (dp == NULL)
+    return 0;
+  while ((d = readdir(dp)) != NULL) {
+    if (d->d_name[0] == '.')
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, d->d_name);
+    if (stat(path, &st) == -1 || !S_ISREG(st.st_mode))
+      continue;
+    if (!is_entry(d->d_name)) {
+      /* Temporary file left behind by a process that died */
+      if (strncmp(d->d_name, "tmp.", 4) == 0 &&
+          now - st.st_mtime > CACHE_TMP_AGE)
+        unlink(path);
+      continue;
+    }
+    if (n == alloc) {
+      alloc = alloc ? alloc * 2 : 64;
+      tmp = realloc(entries, alloc * sizeof(*entries));
+      if (tmp == NULL)
+        break;
+      entries = tmp;
+    }
+    strlcpy(entries[n].name, d->d_name, sizeof(entries[n].name));
+    entries[n].size = (size_t)st.st_size;
+    entries[n].mtime = st.st_mtime;
+    total += entries[n].size;
+    n++;
+  }
+  closedir(dp);
+
+  if (total > limit) {
+    qsort(entries, n, sizeof(*entries), older_first);
+    for (i = 0; i < n && total > limit - limit / 4; i++) {
+      snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+      if (unlink(path) == 0)
+        total -= entries[i].size;
+    }
+  }
+  free(entries);
+  return total;
+}
+
+int disk_cache_key(strb *key, const char *bin_id, int flags,
+                   unsigned int count, const char **strings,
+                   const size_t *lengths) {
+  unsigned int i;
+
+  strb_appends(key, bin_id);
+  strb_append0(key);
+  strb_appendf(key, "%x", flags);
+  strb_append0(key);
+  for (i = 0; i < count; i++) {
+    if (lengths == NULL || lengths[i] == 0)
+      strb_appends(key, strings[i]);
+    else
+      strb_appendn(key, strings[i], lengths[i]);
+  }
+  return strb_error(key) ? -1 : 0;
+}
+
+void *disk_cache_get(strb *key, size_t *len) {
+  char path[PATH_MAX];
+  entry_hdr hdr;
+  struct stat st;
+  char *buf;
+  int fd;
+
+  if (entry_path(path, sizeof(path), key) != 0)
+    return NULL;
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+  if (fstat(fd, &st) == -1 || read_full(fd, &hdr, sizeof(hdr)) != 0 ||
+      memcmp(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic)) != 0 ||
+      hdr.key_len != key->l ||
+      (uint64_t)st.st_size != sizeof(hdr) + hdr.key_len + hdr.bin_len ||
+      hdr.bin_len == 0) {
+    close(fd);
+    return NULL;
+  }
+  /* The key and the binary share the buffer, the key goes first */
+  buf = malloc(hdr.key_len > hdr.bin_len ? hdr.key_len : hdr.bin_len);
+  if (buf == NULL) {
+    close(fd);
+    return NULL;
+  }
+  if (read_full(fd, buf, key->l) != 0 || memcmp(buf, key->s, key->l) != 0 ||
+      read_full(fd, buf, hdr.bin_len) != 0) {
+    free(buf);
+    close(fd);
+    return NULL;
+  }
+  close(fd);
+  /* Mark as recently used */
+  utime(path, NULL);
+  *len = hdr.bin_len;
+  return buf;
+}
+
+void disk_cache_put(strb *key, const void *bin, size_t len) {
+  char path[PATH_MAX];
+  char tmp[PATH_MAX];
+  char *p;
+  entry_hdr hdr;
+  size_t limit;
+  int fd;
+
+  if (entry_path(path, sizeof(path), key) != 0)
+    return;
+  p = strrchr(path, '/');
+  *p = '\0';
+  if (make_dirs(path) != 0 ||
+      snprintf(tmp, sizeof(tmp), "%s/tmp.XXXXXX", path) >= (int)sizeof(tmp))
+    return;
+  *p = '/';
+
+  fd = mkstemp(tmp);
+  if (fd == -1)
+    return;
+  memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+  hdr.key_len = key->l;
+  hdr.bin_len = len;
+  if (write_full(fd, &hdr, sizeof(hdr)) != 0 ||
+      write_full(fd, key->s, key->l) != 0 ||
+      write_full(fd, bin, len) != 0) {
+    close(fd);
+    unlink(tmp);
+    return;
+  }
+  if (close(fd) != 0 || rename(tmp, path) != 0) {
+    unlink(tmp);
+    return;
+  }
+
+  *p = '\0';
+  limit = cache_limit();
+  pthread_mutex_lock(&cache_lock);
+  cache_total += sizeof(hdr) + key->l + len;
+  if (strcmp(cache_scanned, path) != 0 || cache_total > limit) {
+    cache_total = prune(path, limit);
+    strlcpy(cache_scanned, path, sizeof(cache_scanned));
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+#endif
@@ -0,0 +1,44 @@
+#include "private.h"
+#include "gpuarray/event.h"
+#include "gpuarray/error.h"
+
+int GpuEvent_init(GpuEvent *e, const gpuarray_buffer_ops *ops, void *ctx,
+                  int flags) {
+  int res = GA_NO_ERROR;
+
+  e->ops = ops;
+  e->ev = ops->event_new(ctx, flags, &res);
+  return res;
+}
+
+int GpuEvent_record(GpuEvent *e, const GpuStream *s) {
+  if (s != NULL && s->ops != e->ops)
+    return GA_VALUE_ERROR;
+  return e->ops->event_record(e->ev, s == NULL ? NULL : s->s);
+}
+
+int GpuEvent_wait(const GpuEvent *e, const GpuStream *s) {
+  if (s != NULL && s->ops != e->ops)
+    return GA_VALUE_ERROR;
+  return e->ops->event_wait(e->ev, s == NULL ? NULL : s->s);
+}
+
+int GpuEvent_elapsed(const GpuEvent *start, const GpuEvent *end, double *ms) {
+  if (start->ops != end->ops)
+    return GA_VALUE_ERROR;
+  return start->ops->event_elapsed(start->ev, end->ev, ms);
+}
+
+int GpuEvent_query(const GpuEvent *e) {
+  return e->ops->event_query(e->ev);
+}
+
+int GpuEvent_sync(const GpuEvent *e) {
+  return e->ops->event_sync(e->ev);
+}
+
+void GpuEvent_clear(GpuEvent *e) {
+  if (e->ev != NULL)
+    e->ops->event_free(e->ev);
+  e->ev = NULL;
+}
@@ -0,0 +1,419 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "private.h"
+#include "private_host.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util/strb.h"
+
+#include "gpuarray/buffer.h"
+#include "gpuarray/error.h"
+#include "gpuarray/types.h"
+#include "gpuarray/util.h"
+
+#define FAIL(v, e) { if (ret) *ret = e; return v; }
+
+/*
+ * Definitions shared by all the kernels.  The work-group and
+ * work-item being executed are kept in thread-local variables so that
+ * helper functions can query them like on the devices.
+ */
+static const char HOST_BASE[] =
+  "#include <stddef.h>\n"
+  "#include <stdint.h>\n"
+  "#include <string.h>\n"
+  "#include <math.h>\n"
+  "typedef struct _host_group host_group;\n"
+  "typedef void (*host_item_fn)(void **, const size_t *, const host_group *);\n"
+  "struct _host_group {\n"
+  "  size_t gid[3];\n"
+  "  size_t gdim[3];\n"
+  "  size_t ldim[3];\n"
+  "  int (*run_items)(const host_group *, host_item_fn, void **);\n"
+  "  void (*barrier)(const host_group *);\n"
+  "  void *priv;\n"
+  "};\n"
+  "static __thread const host_group *ga_grp;\n"
+  "static __thread const size_t *ga_lid;\n"
+  "static void ga_barrier(void) {\n"
+  "  const host_group *g = ga_grp;\n"
+  "  const size_t *l = ga_lid;\n"
+  "  g->barrier(g);\n"
+  "  ga_grp = g;\n"
+  "  ga_lid = l;\n"
+  "}\n"
+  "#define ga_bool unsigned char\n"
+  "#define ga_byte signed char\n"
+  "#define ga_ubyte unsigned char\n"
+  "#define ga_short short\n"
+  "#define ga_ushort unsigned short\n"
+  "#define ga_int int\n"
+  "#define ga_uint unsigned int\n"
+  "#define ga_long long long\n"
+  "#define ga_ulong unsigned long long\n"
+  "#define ga_float float\n"
+  "#define ga_double double\n"
+  "#define ga_half ga_ushort\n"
+  "#define ga_size size_t\n"
+  "#define ga_ssize ptrdiff_t\n";
+
+/*
+ * All the work-items of a group run on the same thread, so local
+ * memory is thread-local.
+ */
+static const char HOST_PREAMBLE[] =
+  "#define local_barrier() ga_barrier()\n"
+  "#define WITHIN_KERNEL static\n"
+  "#define KERNEL static\n"
+  "#define GLOBAL_MEM /* empty */\n"
+  "#define LOCAL_MEM static __thread\n"
+  "#define LOCAL_MEM_ARG /* empty */\n"
+  "#define REQD_WG_SIZE(X,Y,Z) /* empty */\n"
+  "#define LID_0 ga_lid[0]\n"
+  "#define LID_1 ga_lid[1]\n"
+  "#define LID_2 ga_lid[2]\n"
+  "#define LDIM_0 ga_grp->ldim[0]\n"
+  "#define LDIM_1 ga_grp->ldim[1]\n"
+  "#define LDIM_2 ga_grp->ldim[2]\n"
+  "#define GID_0 ga_grp->gid[0]\n"
+  "#define GID_1 ga_grp->gid[1]\n"
+  "#define GID_2 ga_grp->gid[2]\n"
+  "#define GDIM_0 ga_grp->gdim[0]\n"
+  "#define GDIM_1 ga_grp->gdim[1]\n"
+  "#define GDIM_2 ga_grp->gdim[2]\n";
+/* XXX: add complex types, quad types, and longlong */
+/* XXX: add vector types */
+
+static int arg_supported(int typecode) {
+  switch (typecode) {
+  case GA_BUFFER: case GA_POINTER:
+  case GA_BOOL: case GA_BYTE: case GA_UBYTE: case GA_SHORT: case GA_USHORT:
+  case GA_INT: case GA_UINT: case GA_LONG: case GA_ULONG:
+  case GA_FLOAT: case GA_DOUBLE: case GA_HALF: case GA_SIZE: case GA_SSIZE:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static int contains(unsigned int count, const char **strings,
+                    const size_t *lengths, const char *needle) {
+  size_t nlen = strlen(needle);
+  size_t len, i;
+  unsigned int s;
+
+  for (s = 0; s < count; s++) {
+    len = (lengths == NULL || lengths[s] == 0) ? strlen(strings[s]) :
+      lengths[s];
+    for (i = 0; i + nlen <= len; i++) {
+      if (memcmp(strings[s] + i, needle, nlen) == 0)
+        return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Work-items that wait on each other have to be run as fibers up to
+ * each barrier.  Everything else is run one work-item after the other
+ * in a loop that the compiler is free to optimize.
+ */
+static int needs_sync(unsigned int count, const char **strings,
+                      const size_t *lengths) {
+  return contains(count, strings, lengths, "local_barrier");
+}
+
+static void append_call(strb *sb, const char *fname, unsigned int argcount,
+                        const int *types) {
+  unsigned int i;
+
+  strb_appendf(sb, "  %s(", fname);
+  for (i = 0; i < argcount; i++) {
+    if (i != 0)
+      strb_appends(sb, ", ");
+    if (types[i] == GA_BUFFER || types[i] == GA_POINTER)
+      strb_appendf(sb, "*(void **)args[%u]", i);
+    else
+      strb_appendf(sb, "*(%s *)args[%u]",
+                   gpuarray_get_type(types[i])->cluda_name, i);
+  }
+  strb_appends(sb, ");\n");
+}
+
+/* The entry point that runs one work-group */
+static void append_entry(strb *sb, int sync, const char *fname,
+                         unsigned int argcount, const int *types) {
+  if (sync) {
+    strb_appendf(sb, "\nstatic void ga_item_%s(void **args, const size_t *lid, "
+                 "const host_group *g) {\n"
+                 "  ga_grp = g;\n"
+                 "  ga_lid = lid;\n", fname);
+    append_call(sb, fname, argcount, types);
+    strb_appendf(sb, "}\n"
+                 "int ga_entry_%s(void **args, const host_group *g) {\n"
+                 "  return g->run_items(g, ga_item_%s, args);\n"
+                 "}\n", fname, fname);
+  } else {
+    strb_appendf(sb, "\nint ga_entry_%s(void **args, const host_group *g) {\n"
+                 "  size_t lid[3] = {0, 0, 0};\n"
+                 "  ga_grp = g;\n"
+                 "  ga_lid = lid;\n"
+                 "  if (g->ldim[1] == 1 && g->ldim[2] == 1) {\n"
+                 "    const size_t n = g->ldim[0];\n"
+                 "    for (lid[0] = 0; lid[0] < n; lid[0]++)\n", fname);
+    append_call(sb, fname, argcount, types);
+    strb_appends(sb, "    return 0;\n"
+                 "  }\n"
+                 "  for (lid[2] = 0; lid[2] < g->ldim[2]; lid[2]++)\n"
+                 "  for (lid[1] = 0; lid[1] < g->ldim[1]; lid[1]++)\n"
+                 "  for (lid[0] = 0; lid[0] < g->ldim[0]; lid[0]++)\n");
+    append_call(sb, fname, argcount, types);
+    strb_appends(sb, "  return 0;\n"
+                 "}\n");
+  }
+}
+
+int host_translate(strb *sb, unsigned int count, const char **strings,
+                   const size_t *lengths, unsigned int n, const char **fnames,
+                   const unsigned int *argcounts, const int **types,
+                   int flags) {
+  unsigned int i, j;
+  int sync;
+
+  if (flags & (GA_USE_PTX|GA_USE_CUDA|GA_USE_OPENCL|GA_USE_COMPLEX))
+    return GA_DEVSUP_ERROR;
+
+  for (j = 0; j < n; j++)
+    for (i = 0; i < argcounts[j]; i++)
+      if (!arg_supported(types[j][i]))
+        return GA_DEVSUP_ERROR;
+
+  sync = needs_sync(count, strings, lengths);
+
+  strb_appends(sb, HOST_BASE);
+  if (flags & GA_USE_CLUDA)
+    strb_appends(sb, HOST_PREAMBLE);
+
+  for (i = 0; i < count; i++) {
+    if (lengths == NULL || lengths[i] == 0)
+      strb_appends(sb, strings[i]);
+    else
+      strb_appendn(sb, strings[i], lengths[i]);
+  }
+
+  for (j = 0; j < n; j++) {
+    /* Each function needs only one entry point */
+    for (i = 0; i < j && strcmp(fnames[i], fnames[j]) != 0; i++);
+    if (i == j)
+      append_entry(sb, sync, fnames[j], argcounts[j], types[j]);
+  }
+  strb_append0(sb);
+
+  if (strb_error(sb))
+    return GA_MEMORY_ERROR;
+  return GA_NO_ERROR;
+}
+
+static const char *TMP_VAR_NAMES[] = {"GPUARRAY_TMPDIR", "TMPDIR", "TMP",
+                                      "TEMP", "USERPROFILE"};
+
+static int tmpfile_name(char *buf, size_t sz) {
+  const char *tmpdir = NULL;
+  unsigned int i;
+
+  for (i = 0; i < sizeof(TMP_VAR_NAMES)/sizeof(TMP_VAR_NAMES[0]); i++) {
+    tmpdir = getenv(TMP_VAR_NAMES[i]);
+    if (tmpdir != NULL) break;
+  }
+  if (tmpdir == NULL)
+    tmpdir = "/tmp";
+
+  strlcpy(buf, tmpdir, sz);
+  strlcat(buf, "/gpuarray.host.XXXXXXXX", sz);
+  return mkstemp(buf);
+}
+
+static void *read_file(const char *name, size_t *len) {
+  struct stat st;
+  ssize_t s;
+  char *buf;
+  int fd;
+
+  fd = open(name, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return NULL;
+  }
+  /* Keep room for a NUL so that logs can be used as strings */
+  buf = malloc((size_t)st.st_size + 1);
+  if (buf == NULL) {
+    close(fd);
+    return NULL;
+  }
+  s = read(fd, buf, (size_t)st.st_size);
+  close(fd);
+  if (s == -1) {
+    free(buf);
+    return NULL;
+  }
+  buf[s] = '\0';
+  *len = (size_t)s;
+  return buf;
+}
+
+void *host_compile(const char *src, size_t len, int flags, size_t *bin_len,
+                   char **log, size_t *log_len, int *ret) {
+  char namebuf[PATH_MAX];
+  char outbuf[PATH_MAX];
+  char logbuf[PATH_MAX];
+  char optbuf[4] = "-O3";
+  const char *args[16];
+  unsigned int nargs = 0;
+  ssize_t s;
+  pid_t p;
+  int sys_err;
+  int fd, lfd;
+  void *buf;
+  size_t sz;
+
+  fd = tmpfile_name(namebuf, sizeof(namebuf));
+  if (fd == -1) FAIL(NULL, GA_SYS_ERROR);
+
+  strlcpy(outbuf, namebuf, sizeof(outbuf));
+  strlcat(outbuf, ".so", sizeof(outbuf));
+  strlcpy(logbuf, namebuf, sizeof(logbuf));
+  strlcat(logbuf, ".log", sizeof(logbuf));
+
+  /* Don't want to write the final NUL */
+  s = write(fd, src, len-1);
+  close(fd);
+  if (s == -1) {
+    unlink(namebuf);
+    FAIL(NULL, GA_SYS_ERROR);
+  }
+
+  args[nargs++] = HOST_CC;
+#ifdef DEBUG
+  args[nargs++] = "-g";
+#endif
+  if (GA_GET_OPT_LEVEL(flags) >= 0)
+    optbuf[2] = '0' + GA_GET_OPT_LEVEL(flags);
+  args[nargs++] = optbuf;
+  if (flags & GA_USE_FAST_MATH)
+    args[nargs++] = "-ffast-math";
+  args[nargs++] = "-w";
+  args[nargs++] = "-fPIC";
+  args[nargs++] = "-shared";
+  args[nargs++] = "-x";
+  args[nargs++] = "c";
+  args[nargs++] = namebuf;
+  args[nargs++] = "-o";
+  args[nargs++] = outbuf;
+  args[nargs++] = "-lm";
+  args[nargs] = NULL;
+
+  p = fork();
+  if (p == 0) {
+    lfd = open(logbuf, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (lfd != -1) {
+      dup2(lfd, 2);
+      close(lfd);
+    }
+    execv(HOST_CC, (char * const *)args);
+    exit(1);
+  }
+  if (p == -1) {
+    unlink(namebuf);
+    FAIL(NULL, GA_SYS_ERROR);
+  }
+
+  if (waitpid(p, &sys_err, 0) == -1) {
+    unlink(namebuf);
+    unlink(outbuf);
+    unlink(logbuf);
+    FAIL(NULL, GA_SYS_ERROR);
+  }
+#ifdef DEBUG
+  /* Only cleanup if GPUARRAY_NOCLEANUP is not set */
+  if (getenv("GPUARRAY_NOCLEANUP") == NULL)
+#endif
+    unlink(namebuf);
+
+  if (log != NULL) {
+    *log = read_file(logbuf, &sz);
+    if (*log != NULL && log_len != NULL)
+      *log_len = sz;
+  }
+  unlink(logbuf);
+
+  if (WIFSIGNALED(sys_err) || WEXITSTATUS(sys_err) != 0) {
+    unlink(outbuf);
+    FAIL(NULL, GA_RUN_ERROR);
+  }
+
+  buf = read_file(outbuf, bin_len);
+  unlink(outbuf);
+  if (buf == NULL) FAIL(NULL, GA_SYS_ERROR);
+  return buf;
+}
+
+void *host_load(const void *bin, size_t bin_len, const char *fname,
+                host_kfunc *fn, int *ret) {
+  char namebuf[PATH_MAX];
+  void *handle;
+  ssize_t s;
+  int fd;
+  int err;
+
+  fd = tmpfile_name(namebuf, sizeof(namebuf));
+  if (fd == -1) FAIL(NULL, GA_SYS_ERROR);
+  s = write(fd, bin, bin_len);
+  close(fd);
+  if (s == -1 || (size_t)s != bin_len) {
+    unlink(namebuf);
+    FAIL(NULL, GA_SYS_ERROR);
+  }
+
+  handle = dlopen(namebuf, RTLD_NOW|RTLD_LOCAL);
+  /* The mapping stays valid after the file is gone */
+  unlink(namebuf);
+  if (handle == NULL) FAIL(NULL, GA_IMPL_ERROR);
+
+  err = host_symbol(handle, fname, fn);
+  if (err != GA_NO_ERROR) {
+    dlclose(handle);
+    FAIL(NULL, err);
+  }
+  return handle;
+}
+
+int host_symbol(void *handle, const char *fname, host_kfunc *fn) {
+  strb sym = STRB_STATIC_INIT;
+
+  strb_appendf(&sym, "ga_entry_%s", fname);
+  strb_append0(&sym);
+  if (strb_error(&sym))
+    return GA_MEMORY_ERROR;
+  *(void **)fn = dlsym(handle, sym.s);
+  strb_clear(&sym);
+
+  if (*fn == NULL)
+    return GA_VALUE_ERROR;
+  return GA_NO_ERROR;
+}
+
+void host_unload(void *handle) {
+  dlclose(handle);
+}
@@ -0,0 +1,175 @@
+#include "private_host.h"
+
+#include <sys/mman.h>
+
+#include <stdlib.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "gpuarray/error.h"
+
+/*
+ * User-space scheduling of the work-items of a group.
+ *
+ * All the work-items of a group run as fibers on the thread that
+ * executes the group.  A fiber runs until it reaches a barrier or
+ * finishes, then the next one is resumed.  Once every fiber had its
+ * turn they have all reached the same barrier and the next round can
+ * start.
+ */
+
+/*
+ * Stack for each work-item.  Local memory is not on it.  Each stack
+ * sits above an inaccessible page so that an overflow faults instead
+ * of running into the stack of the previous work-item.
+ */
+#define FIBER_STACK (64 * 1024)
+
+typedef struct _fiber {
+  ucontext_t uc;
+  size_t lid[3];
+  int done;
+} fiber;
+
+struct _host_fibers {
+  ucontext_t main;
+  fiber *fibers;
+  char *stacks;
+  size_t slot; /* guard page + stack */
+  size_t cap;
+  size_t cur;
+  const host_group *g;
+  host_item_fn item;
+  void **args;
+};
+
+static pthread_key_t fibers_key;
+static pthread_once_t fibers_once = PTHREAD_ONCE_INIT;
+
+static void fibers_free(void *p) {
+  host_fibers *f = (host_fibers *)p;
+  free(f->fibers);
+  if (f->stacks != NULL)
+    munmap(f->stacks, f->cap * f->slot);
+  free(f);
+}
+
+static void fibers_key_init(void) {
+  pthread_key_create(&fibers_key, fibers_free);
+}
+
+host_fibers *host_fibers_get(void) {
+  host_fibers *res;
+
+  pthread_once(&fibers_once, fibers_key_init);
+  res = pthread_getspecific(fibers_key);
+  if (res == NULL) {
+    res = calloc(1, sizeof(*res));
+    if (res == NULL)
+      return NULL;
+    if (pthread_setspecific(fibers_key, res) != 0) {
+      free(res);
+      return NULL;
+    }
+  }
+  return res;
+}
+
+/* Make room for `n` fibers, keeping the stacks around for reuse */
+static int reserve(host_fibers *s, size_t n) {
+  size_t page, slot, i;
+  fiber *f;
+  void *st;
+
+  if (n <= s->cap)
+    return 0;
+  page = (size_t)sysconf(_SC_PAGESIZE);
+  slot = page + ((FIBER_STACK + page - 1) & ~(page - 1));
+  f = malloc(n * sizeof(*f));
+  if (f == NULL)
+    return -1;
+  st = mmap(NULL, n * slot, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,
+            -1, 0);
+  if (st == MAP_FAILED) {
+    free(f);
+    return -1;
+  }
+  /* Stacks grow down, so the guard goes at the bottom of each slot */
+  for (i = 0; i < n; i++) {
+    if (mprotect((char *)st + i * slot, page, PROT_NONE) != 0) {
+      munmap(st, n * slot);
+      free(f);
+      return -1;
+    }
+  }
+  free(s->fibers);
+  if (s->stacks != NULL)
+    munmap(s->stacks, s->cap * s->slot);
+  s->fibers = f;
+  s->stacks = (char *)st;
+  s->slot = slot;
+  s->cap = n;
+  return 0;
+}
+
+static __thread host_fibers *running;
+
+static void fiber_main(void) {
+  host_fibers *s = running;
+  fiber *f = &s->fibers[s->cur];
+
+  s->item(s->args, f->lid, s->g);
+  f->done = 1;
+  /* Returning resumes uc_link, which is the scheduler */
+}
+
+void host_fibers_barrier(const host_group *g) {
+  host_fibers *s = (host_fibers *)g->priv;
+
+  swapcontext(&s->fibers[s->cur].uc, &s->main);
+}
+
+int host_fibers_run(const host_group *g, host_item_fn item, void **args) {
+  host_fibers *s = (host_fibers *)g->priv;
+  host_fibers *prev;
+  size_t n, i, left;
+  fiber *f;
+
+  n = g->ldim[0] * g->ldim[1] * g->ldim[2];
+  if (reserve(s, n) != 0)
+    return GA_MEMORY_ERROR;
+
+  s->g = g;
+  s->item = item;
+  s->args = args;
+
+  for (i = 0; i < n; i++) {
+    f = &s->fibers[i];
+    f->lid[0] = i % g->ldim[0];
+    f->lid[1] = (i / g->ldim[0]) % g->ldim[1];
+    f->lid[2] = i / (g->ldim[0] * g->ldim[1]);
+    f->done = 0;
+    getcontext(&f->uc);
+    f->uc.uc_stack.ss_sp = s->stacks + (i + 1) * s->slot - FIBER_STACK;
+    f->uc.uc_stack.ss_size = FIBER_STACK;
+    f->uc.uc_link = &s->main;
+    makecontext(&f->uc, fiber_main, 0);
+  }
+
+  prev = running;
+  running = s;
+  left = n;
+  while (left != 0) {
+    for (i = 0; i < n; i++) {
+      f = &s->fibers[i];
+      if (f->done)
+        continue;
+      s->cur = i;
+      swapcontext(&s->main, &f->uc);
+      if (f->done)
+        left--;
+    }
+  }
+  running = prev;
+  return GA_NO_ERROR;
+}
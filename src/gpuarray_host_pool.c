@@ -0,0 +1,301 @@
+#include "private_host.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Work-stealing scheduler for host_pool_run().
+ *
+ * Every participant (the workers and the calling thread) owns a slot
+ * holding a contiguous range of indices.  The range [0, n) is first
+ * split evenly among the slots.  Owners take chunks from the front of
+ * their range and a participant that runs dry steals the back half of
+ * the range of another one.  This keeps everybody busy when the cost
+ * of the indices is uneven without paying for a shared counter on
+ * each chunk.
+ *
+ * Once a participant finds nothing left to steal it is done for the
+ * job; whatever remains is already being worked on by someone else.
+ */
+
+/* Chunks per participant we aim for in the initial split */
+#define CHUNKS_PER_SLOT 8
+
+#define SLOT_ALIGN 64
+
+typedef struct _slot {
+  pthread_mutex_t lock;
+  size_t lo;
+  size_t hi;
+  host_pool *p;
+  unsigned int seed;
+  /* Stats for the current job, only touched by the owner */
+  size_t chunks;
+  size_t steals;
+  double finish;
+} slot;
+
+#define SLOT_SIZE ((sizeof(slot) + SLOT_ALIGN - 1) & ~(size_t)(SLOT_ALIGN - 1))
+
+struct _host_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  pthread_mutex_t run;
+  pthread_t *threads;
+  char *slots;
+  unsigned int nslots;
+  unsigned int nthreads;
+  unsigned int busy;
+  unsigned long gen;
+  int quit;
+  /* The job currently being executed */
+  host_range_fn fn;
+  void *arg;
+  size_t grain;
+  /* Totals over all jobs, protected by `run` */
+  host_pool_stats stats;
+};
+
+#define SLOT(p, i) ((slot *)((p)->slots + (size_t)(i) * SLOT_SIZE))
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int steal(host_pool *p, slot *s) {
+  unsigned int size = p->nthreads + 1;
+  unsigned int i, start;
+  size_t lo, hi;
+  slot *v;
+
+  /* xorshift to spread the thieves over the victims */
+  s->seed ^= s->seed << 13;
+  s->seed ^= s->seed >> 17;
+  s->seed ^= s->seed << 5;
+  start = s->seed % size;
+
+  for (i = 0; i < size; i++) {
+    v = SLOT(p, (start + i) % size);
+    if (v == s)
+      continue;
+    pthread_mutex_lock(&v->lock);
+    if (v->lo < v->hi) {
+      hi = v->hi;
+      lo = hi - (hi - v->lo + 1) / 2;
+      v->hi = lo;
+      pthread_mutex_unlock(&v->lock);
+      pthread_mutex_lock(&s->lock);
+      s->lo = lo;
+      s->hi = hi;
+      pthread_mutex_unlock(&s->lock);
+      s->steals++;
+      return 1;
+    }
+    pthread_mutex_unlock(&v->lock);
+  }
+  return 0;
+}
+
+static void participate(host_pool *p, slot *s) {
+  size_t lo, hi;
+
+  for (;;) {
+    pthread_mutex_lock(&s->lock);
+    lo = s->lo;
+    if (lo < s->hi) {
+      hi = lo + p->grain;
+      if (hi > s->hi || hi < lo)
+        hi = s->hi;
+      s->lo = hi;
+      pthread_mutex_unlock(&s->lock);
+      p->fn(p->arg, lo, hi);
+      s->chunks++;
+      continue;
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (!steal(p, s))
+      break;
+  }
+  s->finish = now();
+}
+
+static void *worker(void *arg) {
+  slot *s = (slot *)arg;
+  host_pool *p = s->p;
+  unsigned long seen = 0;
+
+  pthread_mutex_lock(&p->lock);
+  for (;;) {
+    while (p->gen == seen && !p->quit)
+      pthread_cond_wait(&p->work, &p->lock);
+    if (p->quit)
+      break;
+    seen = p->gen;
+    pthread_mutex_unlock(&p->lock);
+
+    participate(p, s);
+
+    pthread_mutex_lock(&p->lock);
+    p->busy--;
+    if (p->busy == 0)
+      pthread_cond_signal(&p->done);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+host_pool *host_pool_new(unsigned int nthreads) {
+  host_pool *res;
+  unsigned int i;
+  void *slots;
+
+  if (nthreads == 0)
+    nthreads = 1;
+
+  res = calloc(1, sizeof(*res));
+  if (res == NULL)
+    return NULL;
+
+  /* Keep each slot on its own cache line */
+  if (posix_memalign(&slots, SLOT_ALIGN, nthreads * SLOT_SIZE) != 0) {
+    free(res);
+    return NULL;
+  }
+  memset(slots, 0, nthreads * SLOT_SIZE);
+  res->slots = (char *)slots;
+  res->nslots = nthreads;
+
+  /* The calling thread counts as one of the workers and uses slot 0 */
+  res->nthreads = nthreads - 1;
+  if (res->nthreads != 0) {
+    res->threads = calloc(res->nthreads, sizeof(pthread_t));
+    if (res->threads == NULL) {
+      free(res->slots);
+      free(res);
+      return NULL;
+    }
+  }
+
+  pthread_mutex_init(&res->lock, NULL);
+  pthread_mutex_init(&res->run, NULL);
+  pthread_cond_init(&res->work, NULL);
+  pthread_cond_init(&res->done, NULL);
+
+  for (i = 0; i < nthreads; i++) {
+    pthread_mutex_init(&SLOT(res, i)->lock, NULL);
+    SLOT(res, i)->p = res;
+    SLOT(res, i)->seed = 2463534242U + i * 2654435761U;
+  }
+
+  for (i = 0; i < res->nthreads; i++) {
+    if (pthread_create(&res->threads[i], NULL, worker,
+                       SLOT(res, i + 1)) != 0) {
+      res->nthreads = i;
+      host_pool_free(res);
+      return NULL;
+    }
+  }
+  return res;
+}
+
+void host_pool_free(host_pool *p) {
+  unsigned int i;
+
+  pthread_mutex_lock(&p->lock);
+  p->quit = 1;
+  pthread_cond_broadcast(&p->work);
+  pthread_mutex_unlock(&p->lock);
+
+  for (i = 0; i < p->nthreads; i++)
+    pthread_join(p->threads[i], NULL);
+
+  for (i = 0; i < p->nslots; i++)
+    pthread_mutex_destroy(&SLOT(p, i)->lock);
+  pthread_cond_destroy(&p->done);
+  pthread_cond_destroy(&p->work);
+  pthread_mutex_destroy(&p->run);
+  pthread_mutex_destroy(&p->lock);
+  free(p->threads);
+  free(p->slots);
+  free(p);
+}
+
+unsigned int host_pool_size(host_pool *p) {
+  return p->nthreads + 1;
+}
+
+void host_pool_get_stats(host_pool *p, host_pool_stats *st) {
+  pthread_mutex_lock(&p->run);
+  *st = p->stats;
+  pthread_mutex_unlock(&p->run);
+}
+
+void host_pool_run(host_pool *p, size_t n, host_range_fn fn, void *arg) {
+  unsigned int size = host_pool_size(p);
+  unsigned int i;
+  size_t base, extra, lo;
+  double end;
+  slot *s;
+
+  if (n == 0)
+    return;
+
+  /* Not worth waking up the workers */
+  if (p->nthreads == 0 || n == 1) {
+    fn(arg, 0, n);
+    pthread_mutex_lock(&p->run);
+    p->stats.runs++;
+    p->stats.chunks++;
+    p->stats.items += n;
+    pthread_mutex_unlock(&p->run);
+    return;
+  }
+
+  pthread_mutex_lock(&p->run);
+  pthread_mutex_lock(&p->lock);
+  p->fn = fn;
+  p->arg = arg;
+  p->grain = n / (size * CHUNKS_PER_SLOT);
+  if (p->grain == 0)
+    p->grain = 1;
+
+  base = n / size;
+  extra = n % size;
+  lo = 0;
+  for (i = 0; i < size; i++) {
+    s = SLOT(p, i);
+    s->lo = lo;
+    lo += base + (i < extra ? 1 : 0);
+    s->hi = lo;
+    s->chunks = 0;
+    s->steals = 0;
+  }
+
+  p->busy = p->nthreads;
+  p->gen++;
+  pthread_cond_broadcast(&p->work);
+  pthread_mutex_unlock(&p->lock);
+
+  participate(p, SLOT(p, 0));
+
+  pthread_mutex_lock(&p->lock);
+  while (p->busy != 0)
+    pthread_cond_wait(&p->done, &p->lock);
+  pthread_mutex_unlock(&p->lock);
+
+  end = now();
+  p->stats.runs++;
+  p->stats.items += n;
+  for (i = 0; i < size; i++) {
+    s = SLOT(p, i);
+    p->stats.chunks += s->chunks;
+    p->stats.steals += s->steals;
+    p->stats.idle += end - s->finish;
+  }
+  pthread_mutex_unlock(&p->run);
+}
@@ -1,8 +1,15 @@
+#include "private.h"
 #include "gpuarray/kernel.h"
 #include "gpuarray/error.h"
 #include "gpuarray/types.h"
 
 #include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
 int GpuKernel_init(GpuKernel *k, const gpuarray_buffer_ops *ops, void *ctx,
                    unsigned int count, const char **strs, const size_t *lens,
@@ -18,9 +25,120 @@ int GpuKernel_init(GpuKernel *k, const gpuarray_buffer_ops *ops, void *ctx,
                               flags, &res, err_str);
   if (res != GA_NO_ERROR)
     GpuKernel_clear(k);
+  else
+    manifest_record(k, ctx, count, strs, lens, name, argcount, types, flags);
+  return res;
+}
+
+static void kernel_defines(strb *sb, unsigned int ndefs,
+                           const char **defines) {
+  const char *eq;
+  unsigned int i;
+
+  for (i = 0; i < ndefs; i++) {
+    eq = strchr(defines[i], '=');
+    strb_appends(sb, "#define ");
+    if (eq == NULL) {
+      strb_appends(sb, defines[i]);
+    } else {
+      strb_appendn(sb, defines[i], eq - defines[i]);
+      strb_appendc(sb, ' ');
+      strb_appends(sb, eq + 1);
+    }
+    strb_appendc(sb, '\n');
+  }
+}
+
+char *GpuKernel_defines(unsigned int ndefs, const char **defines) {
+  strb sb = STRB_STATIC_INIT;
+
+  kernel_defines(&sb, ndefs, defines);
+  strb_append0(&sb);
+  if (strb_error(&sb)) {
+    strb_clear(&sb);
+    return NULL;
+  }
+  return sb.s;
+}
+
+int GpuKernel_init_opts(GpuKernel *k, const gpuarray_buffer_ops *ops,
+                        void *ctx, unsigned int count, const char **strs,
+                        const size_t *lens, const char *name,
+                        unsigned int argcount, const int *types, int flags,
+                        unsigned int ndefs, const char **defines,
+                        char **err_str) {
+  strb sb = STRB_STATIC_INIT;
+  const char **s;
+  size_t *l;
+  unsigned int i;
+  int res;
+
+  kernel_defines(&sb, ndefs, defines);
+  if (strb_error(&sb)) {
+    strb_clear(&sb);
+    return GA_MEMORY_ERROR;
+  }
+  if (sb.l == 0)
+    return GpuKernel_init(k, ops, ctx, count, strs, lens, name, argcount,
+                          types, flags, err_str);
+
+  s = calloc(count + 1, sizeof(*s));
+  l = calloc(count + 1, sizeof(*l));
+  if (s == NULL || l == NULL) {
+    free(s);
+    free(l);
+    strb_clear(&sb);
+    return GA_MEMORY_ERROR;
+  }
+  s[0] = sb.s;
+  l[0] = sb.l;
+  for (i = 0; i < count; i++) {
+    s[i + 1] = strs[i];
+    l[i + 1] = lens == NULL ? 0 : lens[i];
+  }
+  res = GpuKernel_init(k, ops, ctx, count + 1, s, l, name, argcount, types,
+                       flags, err_str);
+  free(s);
+  free(l);
+  strb_clear(&sb);
   return res;
 }
 
+int GpuKernel_init_module(GpuKernel *ks, const gpuarray_buffer_ops *ops,
+                          void *ctx, unsigned int count, const char **strs,
+                          const size_t *lens, unsigned int n,
+                          const char **names, const unsigned int *argcounts,
+                          const int **types, int flags, char **err_str) {
+  gpukernel **res;
+  unsigned int i;
+  int err = GA_NO_ERROR;
+
+  res = calloc(n, sizeof(*res));
+  if (res == NULL)
+    return GA_MEMORY_ERROR;
+  for (i = 0; i < n; i++) {
+    ks[i].k = NULL;
+    ks[i].ops = ops;
+    ks[i].args = calloc(argcounts[i], sizeof(void *));
+    if (ks[i].args == NULL)
+      err = GA_MEMORY_ERROR;
+  }
+  if (err == GA_NO_ERROR)
+    err = ops->kernel_alloc_module(ctx, count, strs, lens, n, names,
+                                   argcounts, types, flags, res, err_str);
+  for (i = 0; i < n; i++) {
+    if (err == GA_NO_ERROR) {
+      ks[i].k = res[i];
+      manifest_record(&ks[i], ctx, count, strs, lens, names[i], argcounts[i],
+                      types[i], flags);
+    } else {
+      GpuKernel_clear(&ks[i]);
+    }
+  }
+  free(res);
+  return err;
+}
+
 void GpuKernel_clear(GpuKernel *k) {
   if (k->k)
     k->ops->kernel_release(k->k);
@@ -90,3 +208,295 @@ const char *GpuKernel_error(const GpuKernel *k, int err) {
   }
   return Gpu_error(k->ops, ctx, err);
 }
+
+/*
+ * Background compilation for GpuKernel_init_async().
+ *
+ * Futures wait in a FIFO queue for one of the compile threads, which
+ * only call the kernel_compile operation of the backend.  Threads are
+ * started when there is more work queued than idle threads, up to the
+ * limit, and stay around afterwards.  The state and results of the
+ * futures are protected by the queue lock.
+ */
+
+enum {
+  FUTURE_QUEUED,
+  FUTURE_RUNNING,
+  FUTURE_DONE
+};
+
+struct _GpuKernelFuture {
+  GpuKernelFuture *next; /* in the queue */
+  const gpuarray_buffer_ops *ops;
+  void *ctx;
+  char **strs;
+  size_t *lens;
+  char *name;
+  int *types;
+  unsigned int count;
+  unsigned int argcount;
+  int flags;
+  int state;
+  int err;
+  void *bin;
+  size_t bin_sz;
+  char *err_str;
+};
+
+static void future_compile(GpuKernelFuture *f) {
+  f->err = f->ops->kernel_compile(f->ctx, f->count, (const char **)f->strs,
+                                  f->lens, f->name, f->argcount, f->types,
+                                  f->flags, &f->bin, &f->bin_sz, &f->err_str);
+}
+
+#ifndef _WIN32
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_done = PTHREAD_COND_INITIALIZER;
+static GpuKernelFuture *queue_head;
+static GpuKernelFuture *queue_tail;
+static unsigned int queued;
+static unsigned int nthreads;
+static unsigned int nidle;
+static unsigned int maxthreads;
+
+static unsigned int compile_threads(void) {
+  const char *s = getenv("GPUARRAY_COMPILE_THREADS");
+  char *end;
+  long n = 0;
+
+  if (s != NULL) {
+    n = strtol(s, &end, 10);
+    if (end == s || *end != '\0')
+      n = 0;
+  }
+  if (n < 1)
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1)
+    n = 1;
+  return (unsigned int)n;
+}
+
+static void *compile_thread(void *arg) {
+  GpuKernelFuture *f;
+
+  (void)arg;
+  pthread_mutex_lock(&queue_lock);
+  for (;;) {
+    while (queue_head == NULL) {
+      nidle++;
+      pthread_cond_wait(&queue_work, &queue_lock);
+      nidle--;
+    }
+    f = queue_head;
+    queue_head = f->next;
+    if (queue_head == NULL)
+      queue_tail = NULL;
+    queued--;
+    f->state = FUTURE_RUNNING;
+    pthread_mutex_unlock(&queue_lock);
+
+    future_compile(f);
+
+    pthread_mutex_lock(&queue_lock);
+    f->state = FUTURE_DONE;
+    pthread_cond_broadcast(&queue_done);
+  }
+  return NULL;
+}
+
+static void future_submit(GpuKernelFuture *f) {
+  pthread_t t;
+
+  pthread_mutex_lock(&queue_lock);
+  if (maxthreads == 0)
+    maxthreads = compile_threads();
+  if (queued + 1 > nidle && nthreads < maxthreads &&
+      pthread_create(&t, NULL, compile_thread, NULL) == 0) {
+    pthread_detach(t);
+    nthreads++;
+  }
+  if (nthreads == 0) {
+    /* We could not start any thread, do it ourselves */
+    pthread_mutex_unlock(&queue_lock);
+    future_compile(f);
+    f->state = FUTURE_DONE;
+    return;
+  }
+  f->state = FUTURE_QUEUED;
+  f->next = NULL;
+  if (queue_tail != NULL)
+    queue_tail->next = f;
+  else
+    queue_head = f;
+  queue_tail = f;
+  queued++;
+  pthread_cond_signal(&queue_work);
+  pthread_mutex_unlock(&queue_lock);
+}
+
+static void future_join(GpuKernelFuture *f) {
+  pthread_mutex_lock(&queue_lock);
+  while (f->state != FUTURE_DONE)
+    pthread_cond_wait(&queue_done, &queue_lock);
+  pthread_mutex_unlock(&queue_lock);
+}
+
+int GpuKernelFuture_ready(GpuKernelFuture *f) {
+  int res;
+
+  pthread_mutex_lock(&queue_lock);
+  res = f->state == FUTURE_DONE;
+  pthread_mutex_unlock(&queue_lock);
+  return res;
+}
+
+/* Take `f` out of the queue if it is still there */
+static void future_cancel(GpuKernelFuture *f) {
+  GpuKernelFuture **p, *prev = NULL;
+
+  pthread_mutex_lock(&queue_lock);
+  if (f->state == FUTURE_QUEUED) {
+    for (p = &queue_head; *p != f; p = &(*p)->next)
+      prev = *p;
+    *p = f->next;
+    if (queue_tail == f)
+      queue_tail = prev;
+    queued--;
+    f->state = FUTURE_DONE;
+  }
+  pthread_mutex_unlock(&queue_lock);
+}
+
+#else /* _WIN32 */
+
+static void future_submit(GpuKernelFuture *f) {
+  future_compile(f);
+  f->state = FUTURE_DONE;
+}
+
+static void future_join(GpuKernelFuture *f) {
+  (void)f;
+}
+
+int GpuKernelFuture_ready(GpuKernelFuture *f) {
+  (void)f;
+  return 1;
+}
+
+static void future_cancel(GpuKernelFuture *f) {
+  (void)f;
+}
+
+#endif
+
+static void future_free(GpuKernelFuture *f) {
+  unsigned int i;
+
+  if (f->strs != NULL) {
+    for (i = 0; i < f->count; i++)
+      free(f->strs[i]);
+  }
+  free(f->strs);
+  free(f->lens);
+  free(f->name);
+  free(f->types);
+  free(f->bin);
+  free(f->err_str);
+  free(f);
+}
+
+GpuKernelFuture *GpuKernel_init_async(const gpuarray_buffer_ops *ops,
+                                      void *ctx, unsigned int count,
+                                      const char **strs, const size_t *lens,
+                                      const char *name, unsigned int argcount,
+                                      const int *types, int flags, int *ret) {
+  GpuKernelFuture *res;
+  unsigned int i;
+  size_t l;
+
+  res = calloc(1, sizeof(*res));
+  if (res == NULL) goto fail;
+  res->ops = ops;
+  res->ctx = ctx;
+  res->count = count;
+  res->argcount = argcount;
+  res->flags = flags;
+  res->strs = calloc(count, sizeof(char *));
+  res->lens = calloc(count, sizeof(size_t));
+  res->name = strdup(name);
+  res->types = memdup(types, argcount * sizeof(int));
+  if (res->strs == NULL || res->lens == NULL || res->name == NULL ||
+      (argcount != 0 && res->types == NULL))
+    goto fail;
+  for (i = 0; i < count; i++) {
+    l = (lens == NULL || lens[i] == 0) ? strlen(strs[i]) : lens[i];
+    res->strs[i] = malloc(l + 1);
+    if (res->strs[i] == NULL) goto fail;
+    memcpy(res->strs[i], strs[i], l);
+    res->strs[i][l] = '\0';
+    res->lens[i] = l;
+  }
+
+  if (flags & GA_USE_BINARY) {
+    /* Nothing to compile, GpuKernelFuture_wait() will load the blob */
+    res->state = FUTURE_DONE;
+    res->err = GA_NO_ERROR;
+  } else {
+    future_submit(res);
+  }
+  return res;
+
+ fail:
+  if (res != NULL)
+    future_free(res);
+  if (ret != NULL)
+    *ret = GA_MEMORY_ERROR;
+  return NULL;
+}
+
+int GpuKernelFuture_error(GpuKernelFuture *f, char **err_str) {
+  future_join(f);
+  if (err_str != NULL) {
+    *err_str = NULL;
+    if (f->err_str != NULL)
+      *err_str = strdup(f->err_str);
+  }
+  return f->err;
+}
+
+int GpuKernelFuture_wait(GpuKernelFuture *f, GpuKernel *k, char **err_str) {
+  int err;
+
+  err = GpuKernelFuture_error(f, err_str);
+  if (err != GA_NO_ERROR)
+    return err;
+  if (f->flags & GA_USE_BINARY)
+    return GpuKernel_init(k, f->ops, f->ctx, f->count,
+                          (const char **)f->strs, f->lens, f->name,
+                          f->argcount, f->types, f->flags, err_str);
+  /* Load under the source so that GpuKernel_init() with it finds it */
+  k->args = calloc(f->argcount, sizeof(void *));
+  if (k->args == NULL)
+    return GA_MEMORY_ERROR;
+  k->ops = f->ops;
+  k->k = f->ops->kernel_load(f->ctx, f->count, (const char **)f->strs,
+                             f->lens, f->name, f->argcount, f->types,
+                             f->flags, f->bin, f->bin_sz, &err, err_str);
+  if (k->k == NULL) {
+    GpuKernel_clear(k);
+    return err;
+  }
+  manifest_record(k, f->ctx, f->count, (const char **)f->strs, f->lens,
+                  f->name, f->argcount, f->types, f->flags);
+  return GA_NO_ERROR;
+}
+
+void GpuKernelFuture_free(GpuKernelFuture *f) {
+  if (f == NULL)
+    return;
+  future_cancel(f);
+  future_join(f);
+  future_free(f);
+}
@@ -0,0 +1,319 @@
+#include "private.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+typedef CRITICAL_SECTION table_lock;
+#define lock_init(l) InitializeCriticalSection(l)
+#define lock_destroy(l) DeleteCriticalSection(l)
+#define lock(l) EnterCriticalSection(l)
+#define unlock(l) LeaveCriticalSection(l)
+#else
+#include <pthread.h>
+typedef pthread_mutex_t table_lock;
+#define lock_init(l) pthread_mutex_init(l, NULL)
+#define lock_destroy(l) pthread_mutex_destroy(l)
+#define lock(l) pthread_mutex_lock(l)
+#define unlock(l) pthread_mutex_unlock(l)
+#endif
+
+/*
+ * Hash table of the kernels of a context that are still in use.
+ *
+ * Keys are the strings built by kernel_table_key(), compared in full
+ * on lookup.  The reference counts of the kernels in the table are
+ * only changed under the lock (through kernel_table_get() and
+ * kernel_table_unref()) so that a lookup never revives a kernel that
+ * is being freed.
+ */
+
+#define TABLE_MINSIZE 64
+
+struct _kernel_entry {
+  kernel_entry *next;
+  kernel_table *t;
+  uint64_t hash;
+  size_t len;
+  char *key;
+  gpukernel *k;
+};
+
+struct _kernel_table {
+  table_lock lock;
+  kernel_entry **buckets;
+  size_t nbuckets;
+  size_t size;
+  size_t hits;
+  size_t misses;
+};
+
+kernel_table *kernel_table_new(void) {
+  kernel_table *res;
+
+  res = malloc(sizeof(*res));
+  if (res == NULL)
+    return NULL;
+  res->buckets = calloc(TABLE_MINSIZE, sizeof(*res->buckets));
+  if (res->buckets == NULL) {
+    free(res);
+    return NULL;
+  }
+  res->nbuckets = TABLE_MINSIZE;
+  res->size = 0;
+  res->hits = 0;
+  res->misses = 0;
+  lock_init(&res->lock);
+  return res;
+}
+
+void kernel_table_free(kernel_table *t) {
+  kernel_entry *e, *next;
+  size_t i;
+
+  /* Kernels hold a reference to their context so this should be empty */
+  for (i = 0; i < t->nbuckets; i++) {
+    for (e = t->buckets[i]; e != NULL; e = next) {
+      next = e->next;
+      free(e->key);
+      free(e);
+    }
+  }
+  lock_destroy(&t->lock);
+  free(t->buckets);
+  free(t);
+}
+
+int kernel_table_key(strb *key, unsigned int count, const char **strings,
+                     const size_t *lengths, const char *fname,
+                     unsigned int argcount, const int *types, int flags) {
+  unsigned int i;
+
+  strb_appends(key, fname);
+  strb_append0(key);
+  strb_appendf(key, "%x %u", flags, argcount);
+  strb_append0(key);
+  strb_appendn(key, (const char *)types, argcount * sizeof(int));
+  for (i = 0; i < count; i++) {
+    if (lengths == NULL || lengths[i] == 0)
+      strb_appends(key, strings[i]);
+    else
+      strb_appendn(key, strings[i], lengths[i]);
+  }
+  return strb_error(key) ? -1 : 0;
+}
+
+gpukernel *kernel_table_get(kernel_table *t, strb *key,
+                            void (*retain)(gpukernel *)) {
+  uint64_t h = hash_bytes(key->s, key->l);
+  kernel_entry *e;
+  gpukernel *res = NULL;
+
+  lock(&t->lock);
+  for (e = t->buckets[h & (t->nbuckets - 1)]; e != NULL; e = e->next) {
+    if (e->hash == h && e->len == key->l &&
+        memcmp(e->key, key->s, key->l) == 0) {
+      retain(e->k);
+      res = e->k;
+      break;
+    }
+  }
+  if (res != NULL)
+    t->hits++;
+  else
+    t->misses++;
+  unlock(&t->lock);
+  return res;
+}
+
+static void grow(kernel_table *t) {
+  kernel_entry **buckets;
+  kernel_entry *e, *next;
+  size_t n = t->nbuckets * 2;
+  size_t i;
+
+  buckets = calloc(n, sizeof(*buckets));
+  /* Longer chains are fine if we can't get the memory */
+  if (buckets == NULL)
+    return;
+  for (i = 0; i < t->nbuckets; i++) {
+    for (e = t->buckets[i]; e != NULL; e = next) {
+      next = e->next;
+      e->next = buckets[e->hash & (n - 1)];
+      buckets[e->hash & (n - 1)] = e;
+    }
+  }
+  free(t->buckets);
+  t->buckets = buckets;
+  t->nbuckets = n;
+}
+
+kernel_entry *kernel_table_add(kernel_table *t, strb *key, gpukernel *k) {
+  kernel_entry *res;
+  size_t b;
+
+  res = malloc(sizeof(*res));
+  if (res == NULL)
+    return NULL;
+  res->key = memdup(key->s, key->l);
+  if (res->key == NULL) {
+    free(res);
+    return NULL;
+  }
+  res->t = t;
+  res->hash = hash_bytes(key->s, key->l);
+  res->len = key->l;
+  res->k = k;
+
+  lock(&t->lock);
+  if (t->size >= t->nbuckets)
+    grow(t);
+  b = res->hash & (t->nbuckets - 1);
+  res->next = t->buckets[b];
+  t->buckets[b] = res;
+  t->size++;
+  unlock(&t->lock);
+  return res;
+}
+
+unsigned int kernel_table_unref(kernel_entry *e, unsigned int *refcnt) {
+  kernel_table *t;
+  kernel_entry **p;
+  unsigned int res;
+
+  if (e == NULL)
+    return --(*refcnt);
+
+  t = e->t;
+  lock(&t->lock);
+  res = --(*refcnt);
+  if (res == 0) {
+    for (p = &t->buckets[e->hash & (t->nbuckets - 1)]; *p != e;
+         p = &(*p)->next);
+    *p = e->next;
+    t->size--;
+  }
+  unlock(&t->lock);
+  if (res == 0) {
+    free(e->key);
+    free(e);
+  }
+  return res;
+}
+
+void kernel_table_stats(kernel_table *t, size_t *hits, size_t *misses) {
+  lock(&t->lock);
+  if (hits != NULL)
+    *hits = t->hits;
+  if (misses != NULL)
+    *misses = t->misses;
+  unlock(&t->lock);
+}
+
+/*
+ * Kernels kept by a context under caller-chosen keys.
+ *
+ * This is a small LRU that owns one reference to each of its kernels,
+ * given back through the release function when a kernel is evicted or
+ * the store is freed.  Like the rest of the context it is not
+ * thread-safe.
+ */
+
+#define STORE_SIZE 64
+
+typedef struct _store_entry {
+  uint64_t hash;
+  size_t len;
+  char *key;
+  gpukernel *k;
+  size_t last; /* value of use at the last access */
+} store_entry;
+
+struct _kernel_store {
+  void (*release)(gpukernel *);
+  store_entry entries[STORE_SIZE];
+  size_t n;
+  size_t use;
+};
+
+kernel_store *kernel_store_new(void (*release)(gpukernel *)) {
+  kernel_store *res;
+
+  res = malloc(sizeof(*res));
+  if (res == NULL)
+    return NULL;
+  res->release = release;
+  res->n = 0;
+  res->use = 0;
+  return res;
+}
+
+void kernel_store_free(kernel_store *s) {
+  size_t i;
+
+  for (i = 0; i < s->n; i++) {
+    s->release(s->entries[i].k);
+    free(s->entries[i].key);
+  }
+  free(s);
+}
+
+static store_entry *store_find(kernel_store *s, uint64_t h,
+                               const char *key, size_t len) {
+  size_t i;
+
+  for (i = 0; i < s->n; i++) {
+    if (s->entries[i].hash == h && s->entries[i].len == len &&
+        memcmp(s->entries[i].key, key, len) == 0)
+      return &s->entries[i];
+  }
+  return NULL;
+}
+
+gpukernel *kernel_store_get(kernel_store *s, const char *key, size_t len) {
+  store_entry *e = store_find(s, hash_bytes(key, len), key, len);
+
+  if (e == NULL)
+    return NULL;
+  e->last = ++s->use;
+  return e->k;
+}
+
+int kernel_store_put(kernel_store *s, const char *key, size_t len,
+                     gpukernel *k) {
+  uint64_t h = hash_bytes(key, len);
+  store_entry *e;
+  char *kcopy;
+  size_t i;
+
+  e = store_find(s, h, key, len);
+  if (e != NULL) {
+    s->release(e->k);
+    e->k = k;
+    e->last = ++s->use;
+    return 0;
+  }
+
+  kcopy = memdup(key, len);
+  if (kcopy == NULL)
+    return -1;
+  if (s->n < STORE_SIZE) {
+    e = &s->entries[s->n++];
+  } else {
+    /* Evict the least recently used */
+    e = &s->entries[0];
+    for (i = 1; i < s->n; i++) {
+      if (s->entries[i].last < e->last)
+        e = &s->entries[i];
+    }
+    s->release(e->k);
+    free(e->key);
+  }
+  e->hash = h;
+  e->len = len;
+  e->key = kcopy;
+  e->k = k;
+  e->last = ++s->use;
+  return 0;
+}
@@ -0,0 +1,465 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "private.h"
+#include "gpuarray/kernel.h"
+#include "gpuarray/error.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+static SRWLOCK rec_lock = SRWLOCK_INIT;
+#define lock() AcquireSRWLockExclusive(&rec_lock)
+#define unlock() ReleaseSRWLockExclusive(&rec_lock)
+#else
+#include <pthread.h>
+static pthread_mutex_t rec_lock = PTHREAD_MUTEX_INITIALIZER;
+#define lock() pthread_mutex_lock(&rec_lock)
+#define unlock() pthread_mutex_unlock(&rec_lock)
+#endif
+
+/*
+ * Lists of kernels to build when a context is created.
+ *
+ * An entry holds everything needed to call kernel_alloc() for a
+ * kernel and optionally a binary for it along with the bin_id of the
+ * contexts it works on.  Entries are unique on the parameters of
+ * kernel_alloc(), which are hashed like the keys of the kernel table.
+ *
+ * The file format is a header followed by the entries, in native byte
+ * order since binaries are not portable anyway:
+ *
+ *   "GAMANIF1", uint64 number of entries
+ *   for each entry:
+ *     uint32 flags, uint32 argcount, uint32 name length,
+ *     uint32 bin_id length, uint64 source length, uint64 binary length,
+ *     name, types (argcount int32), source, bin_id, binary
+ *
+ * The kernels built by GpuKernelManifest_replay() are kept in the
+ * manifest, which keeps them in the kernel table of their context.
+ */
+
+#define MANIFEST_MAGIC "GAMANIF1"
+
+typedef struct _manifest_hdr {
+  char magic[8];
+  uint64_t n;
+} manifest_hdr;
+
+typedef struct _entry_hdr {
+  uint32_t flags;
+  uint32_t argcount;
+  uint32_t name_len;
+  uint32_t bin_id_len;
+  uint64_t src_len;
+  uint64_t bin_len;
+} entry_hdr;
+
+typedef struct _manifest_entry {
+  uint64_t hash;
+  char *name;
+  int *types;
+  char *src;
+  size_t src_len;
+  char *bin_id;
+  void *bin;
+  size_t bin_len;
+  unsigned int argcount;
+  int flags;
+} manifest_entry;
+
+struct _GpuKernelManifest {
+  manifest_entry *entries;
+  size_t n;
+  size_t alloc;
+  GpuKernel *kernels;
+  size_t nkernels;
+  size_t kalloc;
+};
+
+static GpuKernelManifest *recorder;
+
+GpuKernelManifest *GpuKernelManifest_new(void) {
+  return calloc(1, sizeof(GpuKernelManifest));
+}
+
+static void entry_clear(manifest_entry *e) {
+  free(e->name);
+  free(e->types);
+  free(e->src);
+  free(e->bin_id);
+  free(e->bin);
+}
+
+void GpuKernelManifest_free(GpuKernelManifest *m) {
+  size_t i;
+
+  if (m == NULL)
+    return;
+  lock();
+  if (recorder == m)
+    recorder = NULL;
+  unlock();
+  for (i = 0; i < m->n; i++)
+    entry_clear(&m->entries[i]);
+  for (i = 0; i < m->nkernels; i++)
+    GpuKernel_clear(&m->kernels[i]);
+  free(m->entries);
+  free(m->kernels);
+  free(m);
+}
+
+size_t GpuKernelManifest_size(const GpuKernelManifest *m) {
+  return m->n;
+}
+
+static manifest_entry *find(GpuKernelManifest *m, uint64_t h,
+                            const char *name, unsigned int argcount,
+                            const int *types, int flags, const char *src,
+                            size_t src_len) {
+  manifest_entry *e;
+  size_t i;
+
+  for (i = 0; i < m->n; i++) {
+    e = &m->entries[i];
+    if (e->hash == h && e->flags == flags && e->argcount == argcount &&
+        e->src_len == src_len && strcmp(e->name, name) == 0 &&
+        memcmp(e->types, types, argcount * sizeof(int)) == 0 &&
+        memcmp(e->src, src, src_len) == 0)
+      return e;
+  }
+  return NULL;
+}
+
+static int set_bin(manifest_entry *e, const char *bin_id, const void *bin,
+                   size_t bin_len) {
+  char *id;
+  void *b;
+
+  id = strdup(bin_id);
+  b = memdup(bin, bin_len);
+  if (id == NULL || b == NULL) {
+    free(id);
+    free(b);
+    return GA_MEMORY_ERROR;
+  }
+  free(e->bin_id);
+  free(e->bin);
+  e->bin_id = id;
+  e->bin = b;
+  e->bin_len = bin_len;
+  return GA_NO_ERROR;
+}
+
+/* Takes over `src` */
+static int add_entry(GpuKernelManifest *m, const char *name,
+                     unsigned int argcount, const int *types, int flags,
+                     char *src, size_t src_len, const char *bin_id,
+                     const void *bin, size_t bin_len) {
+  manifest_entry *e, *tmp;
+  uint64_t h;
+
+  h = hash_bytes(src, src_len) ^ hash_bytes(name, strlen(name));
+  e = find(m, h, name, argcount, types, flags, src, src_len);
+  if (e != NULL) {
+    free(src);
+    if (bin != NULL)
+      return set_bin(e, bin_id, bin, bin_len);
+    return GA_NO_ERROR;
+  }
+
+  if (m->n == m->alloc) {
+    tmp = realloc(m->entries, (m->alloc ? m->alloc * 2 : 16) * sizeof(*tmp));
+    if (tmp == NULL) {
+      free(src);
+      return GA_MEMORY_ERROR;
+    }
+    m->entries = tmp;
+    m->alloc = m->alloc ? m->alloc * 2 : 16;
+  }
+  e = &m->entries[m->n];
+  memset(e, 0, sizeof(*e));
+  e->hash = h;
+  e->src = src;
+  e->src_len = src_len;
+  e->argcount = argcount;
+  e->flags = flags;
+  e->name = strdup(name);
+  e->types = malloc(argcount * sizeof(int) + 1);
+  if (e->name == NULL || e->types == NULL ||
+      (bin != NULL && set_bin(e, bin_id, bin, bin_len) != GA_NO_ERROR)) {
+    entry_clear(e);
+    return GA_MEMORY_ERROR;
+  }
+  memcpy(e->types, types, argcount * sizeof(int));
+  m->n++;
+  return GA_NO_ERROR;
+}
+
+/* Concatenate the source strings like the backends do */
+static char *join(unsigned int count, const char **strs, const size_t *lens,
+                  size_t *len) {
+  strb sb = STRB_STATIC_INIT;
+  unsigned int i;
+
+  for (i = 0; i < count; i++) {
+    if (lens == NULL || lens[i] == 0)
+      strb_appends(&sb, strs[i]);
+    else
+      strb_appendn(&sb, strs[i], lens[i]);
+  }
+  /* Always return an allocated string, even for empty sources */
+  strb_append0(&sb);
+  if (strb_error(&sb)) {
+    strb_clear(&sb);
+    return NULL;
+  }
+  *len = sb.l - 1;
+  return sb.s;
+}
+
+int GpuKernelManifest_add(GpuKernelManifest *m, unsigned int count,
+                          const char **strs, const size_t *lens,
+                          const char *name, unsigned int argcount,
+                          const int *types, int flags, const char *bin_id,
+                          const void *bin, size_t bin_sz) {
+  char *src;
+  size_t src_len;
+
+  if (flags & GA_USE_BINARY)
+    return GA_VALUE_ERROR;
+  if (bin != NULL && bin_id == NULL)
+    return GA_VALUE_ERROR;
+  src = join(count, strs, lens, &src_len);
+  if (src == NULL)
+    return GA_MEMORY_ERROR;
+  return add_entry(m, name, argcount, types, flags, src, src_len, bin_id,
+                   bin, bin_sz);
+}
+
+void GpuKernelManifest_record(GpuKernelManifest *m) {
+  lock();
+  recorder = m;
+  unlock();
+}
+
+void manifest_record(const GpuKernel *k, void *ctx, unsigned int count,
+                     const char **strs, const size_t *lens, const char *name,
+                     unsigned int argcount, const int *types, int flags) {
+  const char *bin_id = NULL;
+  void *bin = NULL;
+  size_t bin_sz = 0;
+
+  if (flags & GA_USE_BINARY)
+    return;
+  lock();
+  if (recorder != NULL) {
+    /* The binary is only a bonus, record the kernel without it if
+       the backend can't give it to us */
+    if (k->ops->property(ctx, NULL, NULL, GA_CTX_PROP_BIN_ID,
+                         &bin_id) != GA_NO_ERROR ||
+        k->ops->kernel_binary(k->k, &bin_sz, &bin) != GA_NO_ERROR) {
+      bin = NULL;
+      bin_id = NULL;
+    }
+    /* Errors are ignored, recording must not break the caller */
+    GpuKernelManifest_add(recorder, count, strs, lens, name, argcount,
+                          types, flags, bin_id, bin, bin_sz);
+    free(bin);
+  }
+  unlock();
+}
+
+static int keep(GpuKernelManifest *m, GpuKernel **k) {
+  GpuKernel *tmp;
+
+  if (m->nkernels == m->kalloc) {
+    tmp = realloc(m->kernels,
+                  (m->kalloc ? m->kalloc * 2 : 16) * sizeof(*tmp));
+    if (tmp == NULL)
+      return GA_MEMORY_ERROR;
+    m->kernels = tmp;
+    m->kalloc = m->kalloc ? m->kalloc * 2 : 16;
+  }
+  *k = &m->kernels[m->nkernels];
+  return GA_NO_ERROR;
+}
+
+int GpuKernelManifest_replay(GpuKernelManifest *m,
+                             const gpuarray_buffer_ops *ops, void *ctx,
+                             size_t *nbin, char **err_str) {
+  const char *bin_id;
+  manifest_entry *e;
+  GpuKernel *k;
+  size_t i;
+  int err;
+
+  if (nbin != NULL)
+    *nbin = 0;
+  err = ops->property(ctx, NULL, NULL, GA_CTX_PROP_BIN_ID, &bin_id);
+  if (err != GA_NO_ERROR)
+    return err;
+
+  for (i = 0; i < m->n; i++) {
+    e = &m->entries[i];
+    err = keep(m, &k);
+    if (err != GA_NO_ERROR)
+      return err;
+    k->ops = ops;
+    k->args = calloc(e->argcount, sizeof(void *));
+    if (k->args == NULL)
+      return GA_MEMORY_ERROR;
+    k->k = NULL;
+    if (e->bin != NULL && strcmp(e->bin_id, bin_id) == 0) {
+      k->k = ops->kernel_load(ctx, 1, (const char **)&e->src, &e->src_len,
+                              e->name, e->argcount, e->types, e->flags,
+                              e->bin, e->bin_len, &err, NULL);
+      if (k->k != NULL && nbin != NULL)
+        (*nbin)++;
+    }
+    /* A stale binary is not an error, compile it instead */
+    if (k->k == NULL)
+      k->k = ops->kernel_alloc(ctx, 1, (const char **)&e->src, &e->src_len,
+                               e->name, e->argcount, e->types, e->flags, &err,
+                               err_str);
+    if (k->k == NULL) {
+      GpuKernel_clear(k);
+      return err;
+    }
+    m->nkernels++;
+  }
+  return GA_NO_ERROR;
+}
+
+int GpuKernelManifest_save(const GpuKernelManifest *m, const char *path) {
+  manifest_hdr hdr;
+  entry_hdr ehdr;
+  manifest_entry *e;
+  int32_t t;
+  unsigned int j;
+  size_t i;
+  FILE *f;
+  int ok;
+
+  f = fopen(path, "wb");
+  if (f == NULL)
+    return GA_SYS_ERROR;
+  memcpy(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic));
+  hdr.n = m->n;
+  ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+  for (i = 0; i < m->n && ok; i++) {
+    e = &m->entries[i];
+    ehdr.flags = (uint32_t)e->flags;
+    ehdr.argcount = e->argcount;
+    ehdr.name_len = (uint32_t)strlen(e->name);
+    ehdr.bin_id_len = e->bin != NULL ? (uint32_t)strlen(e->bin_id) : 0;
+    ehdr.src_len = e->src_len;
+    ehdr.bin_len = e->bin != NULL ? e->bin_len : 0;
+    ok = fwrite(&ehdr, sizeof(ehdr), 1, f) == 1 &&
+      fwrite(e->name, 1, ehdr.name_len, f) == ehdr.name_len;
+    for (j = 0; j < e->argcount && ok; j++) {
+      t = e->types[j];
+      ok = fwrite(&t, sizeof(t), 1, f) == 1;
+    }
+    ok = ok && fwrite(e->src, 1, e->src_len, f) == e->src_len &&
+      fwrite(e->bin_id, 1, ehdr.bin_id_len, f) == ehdr.bin_id_len &&
+      fwrite(e->bin, 1, ehdr.bin_len, f) == ehdr.bin_len;
+  }
+  if (fclose(f) != 0)
+    ok = 0;
+  if (!ok) {
+    remove(path);
+    return GA_SYS_ERROR;
+  }
+  return GA_NO_ERROR;
+}
+
+/* Read `len` bytes into a new buffer with a NUL after them */
+static char *read_str(FILE *f, size_t len) {
+  char *res;
+
+  res = malloc(len + 1);
+  if (res == NULL)
+    return NULL;
+  if (fread(res, 1, len, f) != len) {
+    free(res);
+    return NULL;
+  }
+  res[len] = '\0';
+  return res;
+}
+
+GpuKernelManifest *GpuKernelManifest_load(const char *path, int *ret) {
+  GpuKernelManifest *res = NULL;
+  manifest_hdr hdr;
+  entry_hdr ehdr;
+  char *name = NULL, *src = NULL, *bin_id = NULL, *bin = NULL;
+  int *types = NULL;
+  int32_t t;
+  uint64_t i;
+  unsigned int j;
+  FILE *f;
+  int err = GA_VALUE_ERROR;
+
+  f = fopen(path, "rb");
+  if (f == NULL) {
+    if (ret != NULL)
+      *ret = GA_SYS_ERROR;
+    return NULL;
+  }
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+      memcmp(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic)) != 0)
+    goto fail;
+  res = GpuKernelManifest_new();
+  if (res == NULL) {
+    err = GA_MEMORY_ERROR;
+    goto fail;
+  }
+  for (i = 0; i < hdr.n; i++) {
+    if (fread(&ehdr, sizeof(ehdr), 1, f) != 1)
+      goto fail;
+    name = read_str(f, ehdr.name_len);
+    types = malloc(ehdr.argcount * sizeof(int) + 1);
+    if (name == NULL || types == NULL)
+      goto fail;
+    for (j = 0; j < ehdr.argcount; j++) {
+      if (fread(&t, sizeof(t), 1, f) != 1)
+        goto fail;
+      types[j] = t;
+    }
+    src = read_str(f, ehdr.src_len);
+    bin_id = read_str(f, ehdr.bin_id_len);
+    bin = read_str(f, ehdr.bin_len);
+    if (src == NULL || bin_id == NULL || bin == NULL)
+      goto fail;
+    err = add_entry(res, name, ehdr.argcount, types, (int)ehdr.flags, src,
+                    ehdr.src_len, bin_id, ehdr.bin_len != 0 ? bin : NULL,
+                    ehdr.bin_len);
+    src = NULL;
+    if (err != GA_NO_ERROR)
+      goto fail;
+    err = GA_VALUE_ERROR;
+    free(name);
+    free(types);
+    free(bin_id);
+    free(bin);
+    name = bin_id = bin = NULL;
+    types = NULL;
+  }
+  fclose(f);
+  return res;
+
+ fail:
+  free(name);
+  free(types);
+  free(src);
+  free(bin_id);
+  free(bin);
+  fclose(f);
+  GpuKernelManifest_free(res);
+  if (ret != NULL)
+    *ret = err;
+  return NULL;
+}
@@ -0,0 +1,39 @@
+#include "private.h"
+#include "gpuarray/stream.h"
+#include "gpuarray/error.h"
+
+int GpuStream_init(GpuStream *s, const gpuarray_buffer_ops *ops, void *ctx) {
+  int res = GA_NO_ERROR;
+
+  s->ops = ops;
+  s->ctx = ctx;
+  s->s = ops->stream_new(ctx, &res);
+  return res;
+}
+
+void GpuStream_default(GpuStream *s, const gpuarray_buffer_ops *ops,
+                       void *ctx) {
+  s->ops = ops;
+  s->ctx = ctx;
+  s->s = NULL;
+}
+
+void GpuStream_clear(GpuStream *s) {
+  if (s->s != NULL)
+    s->ops->stream_free(s->s);
+  s->s = NULL;
+}
+
+int GpuStream_use(const GpuStream *s) {
+  return s->ops->stream_use(s->ctx, s->s);
+}
+
+int GpuStream_sync(const GpuStream *s) {
+  return s->ops->stream_sync(s->ctx, s->s);
+}
+
+int GpuStream_wait(const GpuStream *s, const GpuStream *other) {
+  if (s->ctx != other->ctx)
+    return GA_VALUE_ERROR;
+  return s->ops->stream_wait(s->ctx, s->s, other->s);
+}
@@ -72,6 +72,15 @@ void gpuarray_elem_perdim(strb *sb, unsigned int nd,
   if (nd > 0) {
     strb_appendf(sb, "int %si = i;", id);
 
+    if (dims == NULL) {
+      for (i = nd-1; i > 0; i--) {
+        strb_appendf(sb, "%s += (%si %% %s_d%u) * %s_s%u;%si = %si / %s_d%u;",
+                     id, id, id, i, id, i, id, id, id, i);
+      }
+      strb_appendf(sb, "%s += %si * %s_s0;", id, id, id);
+      return;
+    }
+
     for (i = nd-1; i > 0; i--) {
       strb_appendf(sb, "%s %c= ((%si %% %" SPREFIX "u) * "
                    "%" SPREFIX "d);%si = %si / %" SPREFIX "u;", id,
@@ -11,6 +11,7 @@
 #include "private_config.h"
 
 #include "gpuarray/array.h"
+#include "gpuarray/kernel.h"
 #include "gpuarray/types.h"
 #include "util/strb.h"
 
@@ -28,6 +29,139 @@ static inline void *memdup(const void *p, size_t s) {
   return res;
 }
 
+/* FNV-1a hash of `len` bytes */
+static inline uint64_t hash_bytes(const void *p, size_t len) {
+  const unsigned char *s = (const unsigned char *)p;
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h ^= s[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+/*
+ * Size classes for the buffer caches of the backends.
+ *
+ * Sizes are rounded up to one of four steps per power of two (so at
+ * most 25% is wasted) with a minimum of ALLOC_MINSIZE.  Buffers in
+ * the same class are interchangeable.
+ *
+ * Returns the class index and stores its size in `csz` or returns -1
+ * if `sz` is too big to be cached.
+ */
+#define ALLOC_MINSIZE 256
+#define ALLOC_NCLASSES (1 + 4 * (sizeof(size_t) * 8 - 8))
+
+static inline int alloc_class(size_t sz, size_t *csz) {
+  unsigned int b = 0;
+  size_t r, step;
+
+  if (sz <= ALLOC_MINSIZE) {
+    *csz = ALLOC_MINSIZE;
+    return 0;
+  }
+  if (sz > (SIZE_MAX >> 1))
+    return -1;
+  for (r = sz - 1; r > 1; r >>= 1)
+    b++;
+  step = (size_t)1 << (b - 2);
+  *csz = (sz + step - 1) & ~(step - 1);
+  return 1 + (b - 8) * 4 + (int)(*csz / step) - 5;
+}
+
+/*
+ * Allocations up to ARENA_MAXSIZE are carved out of blocks of
+ * ARENA_BLOCKSIZE bytes, one block at a time for each size class.
+ */
+#define ARENA_MAXSIZE 4096
+#define ARENA_NCLASSES 17 /* alloc_class(ARENA_MAXSIZE) + 1 */
+#define ARENA_BLOCKSIZE (256 * 1024)
+
+/*
+ * Reads and writes of at least STAGING_MINSIZE bytes go through
+ * STAGING_NBUFS page-locked buffers of STAGING_BUFSIZE bytes, kept by
+ * the context from one transfer to the next.  The copy between the
+ * user memory and one of them overlaps with the DMA of the other.
+ */
+#define STAGING_MINSIZE (64 * 1024)
+#define STAGING_BUFSIZE (1024 * 1024)
+#define STAGING_NBUFS 2
+
+/*
+ * On-disk cache of kernel binaries (see gpuarray_disk_cache.c).
+ *
+ * disk_cache_key() appends the key of a kernel to `key`: the bin_id
+ * of the context, the compile flags and the final source.  It returns
+ * -1 on failure.  disk_cache_get() returns a malloc()ed copy of the
+ * binary or NULL if there is none.  Errors while writing an entry are
+ * ignored, the cache is only an optimization.
+ */
+GPUARRAY_LOCAL int disk_cache_key(strb *key, const char *bin_id, int flags,
+                                  unsigned int count, const char **strings,
+                                  const size_t *lengths);
+GPUARRAY_LOCAL void *disk_cache_get(strb *key, size_t *len);
+GPUARRAY_LOCAL void disk_cache_put(strb *key, const void *bin, size_t len);
+
+/*
+ * Table of the live kernels of a context (see gpuarray_kernel_table.c).
+ *
+ * kernel_alloc looks up the key made by kernel_table_key() and hands
+ * out a new reference to the kernel it finds instead of building it
+ * again.  The table doesn't keep the kernels alive: backends drop
+ * their references with kernel_table_unref(), which removes the entry
+ * along with the last one.  It returns the remaining count.
+ * kernel_table_stats() accepts NULL for the counts it should skip.
+ */
+typedef struct _kernel_table kernel_table;
+typedef struct _kernel_entry kernel_entry;
+
+GPUARRAY_LOCAL kernel_table *kernel_table_new(void);
+GPUARRAY_LOCAL void kernel_table_free(kernel_table *t);
+GPUARRAY_LOCAL int kernel_table_key(strb *key, unsigned int count,
+                                    const char **strings,
+                                    const size_t *lengths, const char *fname,
+                                    unsigned int argcount, const int *types,
+                                    int flags);
+GPUARRAY_LOCAL gpukernel *kernel_table_get(kernel_table *t, strb *key,
+                                           void (*retain)(gpukernel *));
+GPUARRAY_LOCAL kernel_entry *kernel_table_add(kernel_table *t, strb *key,
+                                              gpukernel *k);
+GPUARRAY_LOCAL unsigned int kernel_table_unref(kernel_entry *e,
+                                               unsigned int *refcnt);
+GPUARRAY_LOCAL void kernel_table_stats(kernel_table *t, size_t *hits,
+                                       size_t *misses);
+
+/*
+ * Kernels kept by a context for kernel_lookup and kernel_keep (see
+ * gpuarray_kernel_table.c).
+ *
+ * kernel_store_get() returns a borrowed pointer.  kernel_store_put()
+ * takes over a reference to `k`, replacing the kernel under the same
+ * key if there is one, and returns -1 if it couldn't.  The store
+ * gives its references back through `release`.
+ */
+typedef struct _kernel_store kernel_store;
+
+GPUARRAY_LOCAL kernel_store *kernel_store_new(void (*release)(gpukernel *));
+GPUARRAY_LOCAL void kernel_store_free(kernel_store *s);
+GPUARRAY_LOCAL gpukernel *kernel_store_get(kernel_store *s, const char *key,
+                                           size_t len);
+GPUARRAY_LOCAL int kernel_store_put(kernel_store *s, const char *key,
+                                    size_t len, gpukernel *k);
+
+/*
+ * Adds a kernel that was just initialized to the manifest being
+ * recorded, if there is one (see gpuarray_manifest.c).
+ */
+GPUARRAY_LOCAL void manifest_record(const GpuKernel *k, void *ctx,
+                                    unsigned int count, const char **strs,
+                                    const size_t *lens, const char *name,
+                                    unsigned int argcount, const int *types,
+                                    int flags);
+
 GPUARRAY_LOCAL int GpuArray_is_c_contiguous(const GpuArray *a);
 GPUARRAY_LOCAL int GpuArray_is_f_contiguous(const GpuArray *a);
 GPUARRAY_LOCAL int GpuArray_is_aligned(const GpuArray *a);
@@ -38,6 +172,9 @@ GPUARRAY_LOCAL extern const gpuarray_type vector_types[];
 /*
  * This function generates the kernel code to perform indexing on var id
  * from planar index 'i' using the dimensions and strides provided.
+ *
+ * If dims is NULL, the dimensions and strides are taken from variables
+ * named <id>_d<n> and <id>_s<n> in the kernel instead.
  */
 GPUARRAY_LOCAL void gpuarray_elem_perdim(strb *sb, unsigned int nd,
                                          const size_t *dims,
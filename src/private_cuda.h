@@ -38,7 +38,12 @@
 #define CLEAR(o)
 #endif
 
-/* Keep in sync with the copy in gpuarray/extension.h */
+/*
+ * Keep in sync with the copy in gpuarray/extension.h
+ *
+ * For buffers, the memory is owned by someone else, which is `base`
+ * if set.
+ */
 #define DONTFREE 0x10000000
 
 typedef struct _cuda_context {
@@ -47,10 +52,30 @@ typedef struct _cuda_context {
 #endif
   CUcontext ctx;
   CUresult err;
-  CUstream s;
+  CUstream s;  /* stream in use */
+  CUstream s0; /* default stream */
+  unsigned int nstreams; /* streams from cuda_stream_new() */
   void *blas_handle;
   gpudata *errbuf;
-  cache *extcopy_cache;
+  cache *extcopy_cache;   /* layouts */
+  cache *extcopy_generic; /* generic kernels */
+  kernel_table *kernels;
+  kernel_store *kept;
+  /* Allocation cache, one list per size class */
+  gpudata *freebufs[ALLOC_NCLASSES];
+  size_t cached;
+  size_t inuse;
+  size_t peak;    /* highest value of inuse since the last reset */
+  size_t nbufs;   /* buffers in use */
+  size_t nallocs; /* allocations requested from the system or driver */
+  /* Block being carved up for each small size class */
+  gpudata *arena[ARENA_NCLASSES];
+  size_t arena_off[ARENA_NCLASSES];
+  /* Released buffers whose memory the GPU may still be using */
+  gpudata *pending;
+  /* Page-locked buffers for reads and writes, allocated on first use */
+  void *staging[STAGING_NBUFS];
+  CUevent staging_ev[STAGING_NBUFS];
   char bin_id[12];
   unsigned int refcnt;
   int flags;
@@ -71,11 +96,15 @@ GPUARRAY_LOCAL void cuda_exit(cuda_context *ctx);
 
 struct _gpudata {
   CUdeviceptr ptr;
+  void *host; /* host mapping for GA_BUFFER_HOST */
   CUevent ev;
   size_t sz;
   cuda_context *ctx;
   int flags;
   unsigned int refcnt;
+  gpudata *base; /* buffer or arena block this one is part of */
+  size_t off;    /* offset of ptr in base */
+  gpudata *next; /* link in the allocation cache */
 #ifdef DEBUG
   char tag[8];
 #endif
@@ -92,11 +121,25 @@ GPUARRAY_LOCAL int cuda_record(gpudata *, int);
 #define CUDA_WAIT_WRITE 0x20000
 #define CUDA_WAIT_MASK  0xf0000
 
+struct _gpustream {
+  cuda_context *ctx;
+  CUstream s;
+};
+
+struct _gpuevent {
+  cuda_context *ctx;
+  CUevent ev;
+  int flags;
+  int recorded;
+};
+
 struct _gpukernel {
 #ifdef DEBUG
   char tag[8];
 #endif
   cuda_context *ctx;
+  kernel_entry *entry; /* in ctx->kernels */
+  gpukernel *mod; /* owner of m and bin if not this one */
   CUmodule m;
   CUfunction k;
   void **args;
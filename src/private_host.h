@@ -0,0 +1,195 @@
+#ifndef _PRIVATE_HOST_H
+#define _PRIVATE_HOST_H
+
+#include <pthread.h>
+
+#include "private.h"
+
+#include "gpuarray/buffer.h"
+
+#ifdef DEBUG
+#include <assert.h>
+
+#define CTX_TAG "host ctx"
+#define BUF_TAG "host buf"
+#define KER_TAG "hostkern"
+
+#define TAG_CTX(c) memcpy((c)->tag, CTX_TAG, 8)
+#define TAG_BUF(b) memcpy((b)->tag, BUF_TAG, 8)
+#define TAG_KER(k) memcpy((k)->tag, KER_TAG, 8)
+#define ASSERT_CTX(c) assert(memcmp((c)->tag, CTX_TAG, 8) == 0)
+#define ASSERT_BUF(b) assert(memcmp((b)->tag, BUF_TAG, 8) == 0)
+#define ASSERT_KER(k) assert(memcmp((k)->tag, KER_TAG, 8) == 0)
+#define CLEAR(o) memset((o)->tag, 0, 8);
+
+#else
+#define TAG_CTX(c)
+#define TAG_BUF(b)
+#define TAG_KER(k)
+#define ASSERT_CTX(c)
+#define ASSERT_BUF(b)
+#define ASSERT_KER(k)
+#define CLEAR(o)
+#endif
+
+/*
+ * Thread pool used to spread work over the cores of the machine.
+ *
+ * host_pool_run() calls `fn` on disjoint sub-ranges covering [0, n)
+ * and returns once all of them are done.  The calling thread takes
+ * part in the work.  Concurrent calls on the same pool are serialized.
+ *
+ * The sub-ranges are balanced between the threads by work stealing
+ * (see gpuarray_host_pool.c).  host_pool_get_stats() returns the
+ * totals since the creation of the pool.
+ */
+typedef struct _host_pool host_pool;
+
+typedef void (*host_range_fn)(void *arg, size_t start, size_t end);
+
+typedef struct _host_pool_stats {
+  size_t runs;   /* calls to host_pool_run() */
+  size_t items;  /* indices processed */
+  size_t chunks; /* calls to the range functions */
+  size_t steals; /* ranges taken from another thread */
+  double idle;   /* seconds spent by threads waiting for the others */
+} host_pool_stats;
+
+GPUARRAY_LOCAL host_pool *host_pool_new(unsigned int nthreads);
+GPUARRAY_LOCAL void host_pool_free(host_pool *p);
+GPUARRAY_LOCAL unsigned int host_pool_size(host_pool *p);
+GPUARRAY_LOCAL void host_pool_run(host_pool *p, size_t n, host_range_fn fn,
+                                  void *arg);
+GPUARRAY_LOCAL void host_pool_get_stats(host_pool *p, host_pool_stats *st);
+
+typedef struct _host_ctx {
+#ifdef DEBUG
+  char tag[8];
+#endif
+  host_pool *pool;
+  gpudata *errbuf;
+  /* Allocation cache, one list per size class */
+  gpudata *freebufs[ALLOC_NCLASSES];
+  size_t cached;
+  size_t inuse;
+  size_t peak;    /* highest value of inuse since the last reset */
+  size_t nbufs;   /* buffers in use */
+  size_t nallocs; /* allocations requested from the system or driver */
+  /* Block being carved up for each small size class */
+  gpudata *arena[ARENA_NCLASSES];
+  size_t arena_off[ARENA_NCLASSES];
+  kernel_table *kernels;
+  kernel_store *kept;
+  char err[256];
+  char bin_id[64];
+  unsigned int refcnt;
+  int flags;
+} host_ctx;
+
+struct _gpudata {
+  void *ptr;
+  size_t sz;
+  host_ctx *ctx;
+  int flags;
+  unsigned int refcnt;
+  gpudata *base; /* buffer or arena block this one is part of */
+  size_t off;    /* offset of ptr in base */
+  gpudata *next; /* link in the allocation cache */
+#ifdef DEBUG
+  char tag[8];
+#endif
+};
+
+/* Operations complete before returning so there is nothing to track */
+struct _gpustream {
+  host_ctx *ctx;
+};
+
+struct _gpuevent {
+  host_ctx *ctx;
+  double t; /* time of the last record, < 0 if never recorded */
+  int flags;
+};
+
+/*
+ * Description of the work-group being executed, passed to the kernel
+ * entry point along with the argument table.
+ *
+ * Kernels that synchronize their work-items hand them back to us
+ * through run_items() and call barrier() from each of them.
+ *
+ * Keep in sync with the copy in HOST_BASE (gpuarray_host_compile.c).
+ */
+typedef struct _host_group host_group;
+
+typedef void (*host_item_fn)(void **args, const size_t *lid,
+                             const host_group *g);
+
+struct _host_group {
+  size_t gid[3];
+  size_t gdim[3];
+  size_t ldim[3];
+  int (*run_items)(const host_group *g, host_item_fn item, void **args);
+  void (*barrier)(const host_group *g);
+  void *priv;
+};
+
+/* Returns the error from run_items(), GA_NO_ERROR otherwise */
+typedef int (*host_kfunc)(void **args, const host_group *g);
+
+/*
+ * Fiber scheduler for the work-items of a group (see
+ * gpuarray_host_fiber.c).  Set `priv` of the group to the per-thread
+ * state from host_fibers_get() and use the other two as `run_items`
+ * and `barrier`.
+ */
+typedef struct _host_fibers host_fibers;
+
+GPUARRAY_LOCAL host_fibers *host_fibers_get(void);
+GPUARRAY_LOCAL int host_fibers_run(const host_group *g, host_item_fn item,
+                                   void **args);
+GPUARRAY_LOCAL void host_fibers_barrier(const host_group *g);
+
+struct _gpukernel {
+#ifdef DEBUG
+  char tag[8];
+#endif
+  host_ctx *ctx;
+  kernel_entry *entry; /* in ctx->kernels */
+  gpukernel *mod; /* owner of handle and bin if not this one */
+  host_kfunc fn;
+  void *handle;
+  size_t bin_sz;
+  void *bin;
+  int *types;
+  unsigned int argcount;
+  unsigned int refcnt;
+};
+
+/*
+ * Kernel compilation.
+ *
+ * host_translate() produces the C source for a set of kernels from
+ * the same sources, which host_compile() turns into a shared object
+ * image and host_load() maps into the process.  host_symbol() finds
+ * the other kernels in a loaded image.
+ */
+GPUARRAY_LOCAL int host_translate(strb *sb, unsigned int count,
+                                  const char **strings, const size_t *lengths,
+                                  unsigned int n, const char **fnames,
+                                  const unsigned int *argcounts,
+                                  const int **types, int flags);
+GPUARRAY_LOCAL void *host_compile(const char *src, size_t len, int flags,
+                                  size_t *bin_len, char **log,
+                                  size_t *log_len, int *ret);
+GPUARRAY_LOCAL void *host_load(const void *bin, size_t bin_len,
+                               const char *fname, host_kfunc *fn, int *ret);
+GPUARRAY_LOCAL int host_symbol(void *handle, const char *fname,
+                               host_kfunc *fn);
+GPUARRAY_LOCAL void host_unload(void *handle);
+
+GPUARRAY_LOCAL host_ctx *host_make_ctx(int flags);
+GPUARRAY_LOCAL gpudata *host_make_buf(void *c, void *p, size_t sz);
+GPUARRAY_LOCAL void *host_get_ptr(gpudata *g);
+
+#endif
@@ -2,6 +2,7 @@
 #define _GPUARRAY_PRIVATE_OPENCL
 
 #include "private.h"
+#include "cache_decls.h"
 
 #ifdef __APPLE__
 #include <OpenCL/opencl.h>
@@ -39,13 +40,39 @@ typedef struct _cl_ctx {
   char tag[8];
 #endif
   cl_context ctx;
-  cl_command_queue q;
+  cl_command_queue q;  /* queue in use */
+  cl_command_queue q0; /* default queue */
   char *exts;
   void *blas_handle;
   gpudata *errbuf;
+  cache *extcopy_cache;   /* layouts */
+  cache *extcopy_generic; /* generic kernels */
+  /* Allocation cache, one list per size class */
+  gpudata *freebufs[ALLOC_NCLASSES];
+  size_t cached;
+  size_t inuse;
+  size_t peak;    /* highest value of inuse since the last reset */
+  size_t nbufs;   /* buffers in use */
+  size_t nallocs; /* allocations requested from the system or driver */
+  /* Block being carved up for each small size class */
+  cl_mem arena[ARENA_NCLASSES];
+  size_t arena_off[ARENA_NCLASSES];
+  size_t align; /* required alignment of sub-buffers, in bytes */
+  /*
+   * Page-locked buffers for reads and writes, allocated on first use
+   * and kept mapped.
+   */
+  cl_mem staging[STAGING_NBUFS];
+  void *staging_ptr[STAGING_NBUFS];
+  cl_event staging_ev[STAGING_NBUFS];
+  kernel_table *kernels;
+  kernel_store *kept;
   cl_int err;
   unsigned int refcnt;
+  int flags;
+  int has_fill; /* clEnqueueFillBuffer() is there (OpenCL 1.2) */
   char bin_id[64];
+  char cache_id[256]; /* bin_id and device name, for the disk cache */
 } cl_ctx;
 
 struct _gpudata {
@@ -53,11 +80,26 @@ struct _gpudata {
   cl_event ev;
   cl_ctx *ctx;
   unsigned int refcnt;
+  size_t size;   /* size asked for, used for the bounds */
+  size_t sz;     /* size of the allocation, 0 if we didn't make it */
+  int cls;       /* size class in the allocation cache or -1 */
+  gpudata *next; /* link in the allocation cache */
 #ifdef DEBUG
   char tag[8];
 #endif
 };
 
+struct _gpustream {
+  cl_ctx *ctx;
+  cl_command_queue q;
+};
+
+struct _gpuevent {
+  cl_ctx *ctx;
+  cl_event ev; /* NULL until recorded */
+  int flags;
+};
+
 struct _gpukernel {
 #ifdef DEBUG
   char tag[8];
@@ -67,6 +109,7 @@ struct _gpukernel {
   unsigned int argcount;
   int *types;
   cl_ctx *ctx;
+  kernel_entry *entry; /* in ctx->kernels */
   unsigned int refcnt;
 };
 
@@ -31,6 +31,12 @@ int get_env_dev(const gpuarray_buffer_ops **o) {
       return -1; 
     return (int)no;
   }
+  if (strncmp(dev, "host", 4) == 0) {
+    *o = gpuarray_get_ops("host");
+    if (dev[4] != '\0')
+      return -1;
+    return 0;
+  }
   if (strncmp(dev, "opencl", 6) == 0) {
     *o = gpuarray_get_ops("opencl");
     no = strtol(dev + 6, &end, 10);
@@ -297,11 +303,179 @@ START_TEST(test_take1_ok)
 }
 END_TEST
 
+START_TEST(test_take1_cached)
+{
+  GpuArray v;
+  GpuArray idx;
+  GpuArray res;
+  static const uint32_t data[6] = {0, 1, 2, 3, 4, 5};
+  static const ssize_t indexes[2] = {2, 0};
+  uint32_t buf[2];
+  size_t dims[1];
+  size_t misses, misses2;
+  unsigned int j;
+
+  dims[0] = 6;
+  ga_assert_ok(GpuArray_empty(&v, ops, ctx, GA_UINT, 1, dims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_write(&v, data, sizeof(data)));
+  dims[0] = 2;
+  ga_assert_ok(GpuArray_empty(&idx, ops, ctx, GA_SSIZE, 1, dims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_write(&idx, indexes, sizeof(indexes)));
+  ga_assert_ok(GpuArray_empty(&res, ops, ctx, GA_UINT, 1, dims, GA_C_ORDER));
+
+  ga_assert_ok(GpuArray_take1(&res, &v, &idx, 1));
+  ga_assert_ok(ops->property(ctx, NULL, NULL, GA_CTX_PROP_KERNEL_CACHE_MISSES,
+                             &misses));
+
+  /* Later calls reuse the kernel kept in the context */
+  for (j = 0; j < 3; j++) {
+    ga_assert_ok(GpuArray_take1(&res, &v, &idx, 1));
+    ga_assert_ok(GpuArray_read(buf, sizeof(buf), &res));
+    ck_assert(buf[0] == 2);
+    ck_assert(buf[1] == 0);
+  }
+  ga_assert_ok(ops->property(ctx, NULL, NULL, GA_CTX_PROP_KERNEL_CACHE_MISSES,
+                             &misses2));
+  ck_assert(misses2 == misses);
+
+  GpuArray_clear(&res);
+  GpuArray_clear(&idx);
+  GpuArray_clear(&v);
+}
+END_TEST
+
+static void check_views(unsigned int nd) {
+  GpuArray a, v, t;
+  size_t dims[GA_INLINE_ND + 2];
+  ssize_t starts[GA_INLINE_ND + 2];
+  ssize_t stops[GA_INLINE_ND + 2];
+  ssize_t steps[GA_INLINE_ND + 2];
+  unsigned int axes[GA_INLINE_ND + 2];
+  size_t rdims[2];
+  unsigned int i;
+
+  for (i = 0; i < nd; i++) {
+    dims[i] = (i == 0) ? 3 : 2;
+    starts[i] = 0;
+    stops[i] = dims[i];
+    steps[i] = 1;
+    axes[i] = nd - i - 1;
+  }
+  stops[0] = 2;
+
+  ga_assert_ok(GpuArray_empty(&a, ops, ctx, GA_FLOAT, nd, dims, GA_C_ORDER));
+
+  ga_assert_ok(GpuArray_view(&v, &a));
+  ck_assert_int_eq(v.nd, nd);
+  ck_assert(v.dimensions != a.dimensions);
+  ck_assert(v.strides != a.strides);
+  GpuArray_clear(&v);
+  ck_assert_int_eq(a.dimensions[0], 3);
+
+  ga_assert_ok(GpuArray_index(&v, &a, starts, stops, steps));
+  ck_assert_int_eq(v.dimensions[0], 2);
+  ck_assert_int_eq(a.dimensions[0], 3);
+
+  ga_assert_ok(GpuArray_transpose(&t, &v, axes));
+  ck_assert_int_eq(t.dimensions[nd - 1], 2);
+  ck_assert(t.strides[nd - 1] == v.strides[0]);
+  GpuArray_clear(&v);
+
+  /* Go through both the inline and the allocated storage */
+  rdims[0] = 3;
+  rdims[1] = 1 << (nd - 1);
+  ga_assert_ok(GpuArray_reshape_inplace(&a, 2, rdims, GA_C_ORDER));
+  ck_assert_int_eq(a.nd, 2);
+  ga_assert_ok(GpuArray_reshape_inplace(&a, nd, dims, GA_C_ORDER));
+  ck_assert_int_eq(a.nd, nd);
+  ck_assert_int_eq(a.dimensions[nd - 1], 2);
+
+  GpuArray_clear(&t);
+  GpuArray_clear(&a);
+}
+
+START_TEST(test_view_dims)
+{
+  check_views(3);
+  check_views(GA_INLINE_ND);
+  check_views(GA_INLINE_ND + 2);
+}
+END_TEST
+
+START_TEST(test_memset_view)
+{
+  GpuArray a, v;
+  static const uint32_t data[6] = {1, 1, 1, 1, 1, 1};
+  uint32_t buf[6];
+  size_t dims[1];
+  ssize_t start = 2, stop = 4, step = 1;
+  unsigned int i;
+
+  dims[0] = 6;
+  ga_assert_ok(GpuArray_empty(&a, ops, ctx, GA_UINT, 1, dims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_write(&a, data, sizeof(data)));
+  ga_assert_ok(GpuArray_index(&v, &a, &start, &stop, &step));
+
+  /* Only the view is set, not the rest of the buffer */
+  ga_assert_ok(GpuArray_memset(&v, 0));
+  ga_assert_ok(GpuArray_read(buf, sizeof(buf), &a));
+  for (i = 0; i < 6; i++)
+    ck_assert(buf[i] == ((i == 2 || i == 3) ? 0 : 1));
+
+  GpuArray_clear(&v);
+  GpuArray_clear(&a);
+}
+END_TEST
+
+START_TEST(test_fill)
+{
+  GpuArray a, v;
+  static const float one = 1.0f;
+  static const double data[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  static const double val = -2.5;
+  float fbuf[5];
+  double dbuf[8];
+  size_t dims[2];
+  ssize_t starts[2] = {0, 1}, stops[2] = {4, 2}, steps[2] = {1, 1};
+  unsigned int i;
+
+  dims[0] = 5;
+  ga_assert_ok(GpuArray_empty(&a, ops, ctx, GA_FLOAT, 1, dims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_fill(&a, &one));
+  ga_assert_ok(GpuArray_read(fbuf, sizeof(fbuf), &a));
+  for (i = 0; i < 5; i++)
+    ck_assert(fbuf[i] == 1.0f);
+  GpuArray_clear(&a);
+
+  /* A column is strided so this goes through the kernel */
+  dims[0] = 4;
+  dims[1] = 2;
+  ga_assert_ok(GpuArray_empty(&a, ops, ctx, GA_DOUBLE, 2, dims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_write(&a, data, sizeof(data)));
+  ga_assert_ok(GpuArray_index(&v, &a, starts, stops, steps));
+  ga_assert_ok(GpuArray_fill(&v, &val));
+  ga_assert_ok(GpuArray_read(dbuf, sizeof(dbuf), &a));
+  for (i = 0; i < 8; i++)
+    ck_assert(dbuf[i] == ((i % 2) ? -2.5 : 0.0));
+
+  GpuArray_clear(&v);
+  GpuArray_clear(&a);
+}
+END_TEST
+
 Suite *get_suite(void) {
   Suite *s = suite_create("array");
   TCase *tc = tcase_create("take1");
   tcase_add_checked_fixture(tc, setup, teardown);
   tcase_add_test(tc, test_take1_ok);
+  tcase_add_test(tc, test_take1_cached);
+  suite_add_tcase(s, tc);
+
+  tc = tcase_create("dims");
+  tcase_add_checked_fixture(tc, setup, teardown);
+  tcase_add_test(tc, test_view_dims);
+  tcase_add_test(tc, test_memset_view);
+  tcase_add_test(tc, test_fill);
   suite_add_tcase(s, tc);
   return s;
 }
@@ -1,7 +1,17 @@
 #include <check.h>
 
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <utime.h>
+
 #include "gpuarray/buffer.h"
 #include "gpuarray/error.h"
+#include "gpuarray/event.h"
+#include "gpuarray/kernel.h"
+#include "gpuarray/stream.h"
 #include "private.h"
 
 START_TEST(test_get_ops)
@@ -12,6 +22,8 @@ START_TEST(test_get_ops)
   if (ops != NULL) valid_ops++;
   ops = gpuarray_get_ops("opencl");
   if (ops != NULL) valid_ops++;
+  ops = gpuarray_get_ops("host");
+  if (ops != NULL) valid_ops++;
   ck_assert_msg(valid_ops > 0, "No backends are available");
 
   ops = gpuarray_get_ops("potato");
@@ -19,7 +31,7 @@ START_TEST(test_get_ops)
 }
 END_TEST
 
-static char *BACKENDS[] = {"opencl", "cuda"};
+static char *BACKENDS[] = {"opencl", "cuda", "host"};
 
 START_TEST(test_gpu_error)
 {
@@ -211,6 +223,143 @@ START_TEST(test_buffer_read_write)
 }
 END_TEST
 
+START_TEST(test_buffer_read_write_async)
+{
+  const int32_t data[] = {0, 1, 2, 3, 4, 5, 6, 7};
+  int32_t buf[nelems(data)];
+  gpudata *d;
+  gpuevent *ev, *ev2;
+  int err;
+  unsigned int i;
+
+  if (setup(_i)) {
+    d = ops->buffer_alloc(ctx, sizeof(data), NULL, 0, NULL);
+    ck_assert(d != NULL);
+
+    err = ops->buffer_write_async(d, 0, data, sizeof(data), &ev);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    /* The read is ordered after the write without waiting on ev */
+    memset(buf, 0, sizeof(buf));
+    err = ops->buffer_read_async(buf, d, 0, sizeof(data), &ev2);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+
+    err = ops->event_sync(ev2);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    ck_assert_int_eq(ops->event_query(ev2), 1);
+    ck_assert_int_eq(ops->event_query(ev), 1);
+    for (i = 0; i < nelems(data); i++)
+      ck_assert_int_eq(buf[i], data[i]);
+    ops->event_free(ev);
+    ops->event_free(ev2);
+
+    err = ops->buffer_read_async(buf, d, 4, sizeof(data), &ev);
+    ck_assert_int_eq(err, GA_VALUE_ERROR);
+
+    err = ops->buffer_read_async(buf, d, 0, 0, &ev);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = ops->event_sync(ev);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    ops->event_free(ev);
+
+    ops->buffer_release(d);
+  }
+  teardown();
+}
+END_TEST
+
+START_TEST(test_buffer_memset_range)
+{
+  unsigned char buf[64];
+  gpudata *d;
+  int err;
+  unsigned int i;
+
+  if (setup(_i)) {
+    d = ops->buffer_alloc(ctx, sizeof(buf), NULL, 0, NULL);
+    ck_assert(d != NULL);
+
+    err = ops->buffer_memset(d, 0, 0);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+
+    /* Aligned for wide stores, then odd offsets and sizes */
+    err = ops->buffer_memset_range(d, 16, 32, 0xa5);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = ops->buffer_memset_range(d, 4, 8, 0x01);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = ops->buffer_memset_range(d, 49, 3, 0x7f);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = ops->buffer_memset_range(d, 60, 0, 0xff);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+
+    err = ops->buffer_read(buf, d, 0, sizeof(buf));
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    for (i = 0; i < sizeof(buf); i++) {
+      if (i >= 16 && i < 48)
+        ck_assert_int_eq(buf[i], 0xa5);
+      else if (i >= 4 && i < 12)
+        ck_assert_int_eq(buf[i], 0x01);
+      else if (i >= 49 && i < 52)
+        ck_assert_int_eq(buf[i], 0x7f);
+      else
+        ck_assert_int_eq(buf[i], 0);
+    }
+
+    err = ops->buffer_memset_range(d, 60, 8, 0);
+    ck_assert_int_eq(err, GA_VALUE_ERROR);
+
+    ops->buffer_release(d);
+  }
+  teardown();
+}
+END_TEST
+
+START_TEST(test_buffer_fill)
+{
+  static const uint32_t pat[2] = {0x01020304, 0xa0b0c0d0};
+  static const uint16_t spat = 0x4142;
+  uint32_t buf[16];
+  uint16_t sbuf[8];
+  gpudata *d;
+  int err;
+  unsigned int i;
+
+  if (setup(_i)) {
+    d = ops->buffer_alloc(ctx, sizeof(buf), NULL, 0, NULL);
+    ck_assert(d != NULL);
+
+    err = ops->buffer_memset(d, 0, 0);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+
+    /* The backend may not support this one */
+    err = ops->buffer_fill(d, 8, 48, pat, sizeof(pat));
+    if (err != GA_UNSUPPORTED_ERROR) {
+      ck_assert_int_eq(err, GA_NO_ERROR);
+      err = ops->buffer_read(buf, d, 0, sizeof(buf));
+      ck_assert_int_eq(err, GA_NO_ERROR);
+      for (i = 0; i < 16; i++) {
+        if (i >= 2 && i < 14)
+          ck_assert(buf[i] == pat[i % 2]);
+        else
+          ck_assert(buf[i] == 0);
+      }
+    }
+
+    err = ops->buffer_fill(d, 0, sizeof(sbuf), &spat, sizeof(spat));
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = ops->buffer_read(sbuf, d, 0, sizeof(sbuf));
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    for (i = 0; i < 8; i++)
+      ck_assert(sbuf[i] == spat);
+
+    err = ops->buffer_fill(d, 0, 6, pat, sizeof(pat));
+    ck_assert_int_eq(err, GA_VALUE_ERROR);
+
+    ops->buffer_release(d);
+  }
+  teardown();
+}
+END_TEST
+
 START_TEST(test_buffer_move)
 {
   const int32_t data[] = {0, 1, 2, 3, 4, 5, 6, 7};
@@ -254,6 +403,1117 @@ START_TEST(test_buffer_move)
 }
 END_TEST
 
+START_TEST(test_stream)
+{
+  const int32_t data[] = {0, 1, 2, 3, 4, 5, 6, 7};
+  int32_t buf[nelems(data)];
+  GpuStream s1, s2, s0;
+  gpudata *d, *d2, *d3;
+  int err;
+  unsigned int i;
+
+  if (setup(_i)) {
+    d = ops->buffer_alloc(ctx, sizeof(data), NULL, 0, NULL);
+    ck_assert(d != NULL);
+    d2 = ops->buffer_alloc(ctx, sizeof(data), NULL, 0, NULL);
+    ck_assert(d2 != NULL);
+    d3 = ops->buffer_alloc(ctx, sizeof(data), NULL, 0, NULL);
+    ck_assert(d3 != NULL);
+
+    err = ops->buffer_write(d, 0, data, sizeof(data));
+    ck_assert_int_eq(err, GA_NO_ERROR);
+
+    err = GpuStream_init(&s1, ops, ctx);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = GpuStream_init(&s2, ops, ctx);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    GpuStream_default(&s0, ops, ctx);
+
+    /* d3 on s2 depends on d2 written on s1 */
+    err = GpuStream_use(&s1);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = ops->buffer_memset_range(d2, 0, sizeof(data), 0);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = ops->buffer_move(d2, 0, d, 0, sizeof(data));
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = GpuStream_use(&s2);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = ops->buffer_move(d3, 0, d2, 0, sizeof(data));
+    ck_assert_int_eq(err, GA_NO_ERROR);
+
+    err = GpuStream_wait(&s0, &s2);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = GpuStream_sync(&s2);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+
+    err = ops->buffer_read(buf, d3, 0, sizeof(data));
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    for (i = 0; i < nelems(data); i++)
+      ck_assert_int_eq(buf[i], data[i]);
+
+    /* Releasing the stream in use goes back to the default one */
+    GpuStream_clear(&s2);
+    ck_assert(s2.s == NULL);
+    err = ops->buffer_memset_range(d3, 0, sizeof(data), 0);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    GpuStream_clear(&s1);
+
+    err = GpuStream_sync(&s0);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = ops->buffer_read(buf, d3, 0, sizeof(data));
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    for (i = 0; i < nelems(data); i++)
+      ck_assert_int_eq(buf[i], 0);
+
+    ops->buffer_release(d);
+    ops->buffer_release(d2);
+    ops->buffer_release(d3);
+  }
+  teardown();
+}
+END_TEST
+
+START_TEST(test_event)
+{
+  GpuEvent start, end, plain;
+  GpuStream s1;
+  gpudata *d;
+  double ms;
+  int err;
+
+  if (setup(_i)) {
+    d = ops->buffer_alloc(ctx, 1 << 20, NULL, 0, NULL);
+    ck_assert(d != NULL);
+
+    err = GpuEvent_init(&start, ops, ctx, GA_EVENT_TIMING);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = GpuEvent_init(&end, ops, ctx, GA_EVENT_TIMING);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = GpuEvent_init(&plain, ops, ctx, 0);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+
+    /* Not recorded yet */
+    ck_assert_int_eq(GpuEvent_query(&start), 1);
+    err = GpuEvent_elapsed(&start, &end, &ms);
+    ck_assert_int_eq(err, GA_VALUE_ERROR);
+
+    err = GpuEvent_record(&start, NULL);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = ops->buffer_memset(d, 0, 1);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = GpuEvent_record(&end, NULL);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = GpuEvent_record(&plain, NULL);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+
+    /* Order a stream after the memset */
+    err = GpuStream_init(&s1, ops, ctx);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = GpuEvent_wait(&end, &s1);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = GpuEvent_record(&plain, &s1);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = GpuEvent_sync(&plain);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    ck_assert_int_eq(GpuEvent_query(&end), 1);
+
+    err = GpuEvent_elapsed(&start, &end, &ms);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    ck_assert(ms >= 0);
+    err = GpuEvent_elapsed(&start, &plain, &ms);
+    ck_assert_int_eq(err, GA_VALUE_ERROR);
+
+    GpuStream_clear(&s1);
+    GpuEvent_clear(&start);
+    GpuEvent_clear(&end);
+    GpuEvent_clear(&plain);
+    ops->buffer_release(d);
+  }
+  teardown();
+}
+END_TEST
+
+START_TEST(test_buffer_suballoc)
+{
+  const int32_t data[] = {0, 1, 2, 3, 4, 5, 6, 7};
+  int32_t buf[nelems(data)];
+  gpudata *d;
+  gpudata *d2;
+  gpudata *v;
+  int err;
+  unsigned int i;
+
+  if (setup(_i)) {
+    /* Small buffers may come from the same block */
+    d = ops->buffer_alloc(ctx, sizeof(data), NULL, 0, NULL);
+    ck_assert(d != NULL);
+    d2 = ops->buffer_alloc(ctx, sizeof(data), NULL, 0, NULL);
+    ck_assert(d2 != NULL);
+    ck_assert_int_eq(ops->buffer_share(d, d2, NULL), 0);
+
+    err = ops->buffer_write(d, 0, data, sizeof(data));
+    ck_assert(err == GA_NO_ERROR);
+    err = ops->buffer_memset(d2, 0, 0);
+    ck_assert(err == GA_NO_ERROR);
+    err = ops->buffer_read(buf, d, 0, sizeof(data));
+    ck_assert(err == GA_NO_ERROR);
+    for (i = 0; i < nelems(data); i++) {
+      ck_assert_int_eq(buf[i], data[i]);
+    }
+
+    /* Shared transfers of a part of a buffer are views */
+    v = ops->buffer_transfer(d, sizeof(data)/2, sizeof(data)/2, ctx, 1);
+    if (v != NULL) {
+      ck_assert_int_eq(ops->buffer_share(v, d, NULL), 1);
+      ck_assert_int_eq(ops->buffer_share(v, d2, NULL), 0);
+      err = ops->buffer_read(buf, v, 0, sizeof(data)/2);
+      ck_assert(err == GA_NO_ERROR);
+      for (i = 0; i < nelems(data)/2; i++) {
+        ck_assert_int_eq(buf[i], data[i + nelems(data)/2]);
+      }
+      ops->buffer_release(v);
+    }
+
+    ops->buffer_release(d);
+    ops->buffer_release(d2);
+  }
+  teardown();
+}
+END_TEST
+
+START_TEST(test_buffer_read_write_large)
+{
+  /* Not a multiple of the staging buffer size */
+  const size_t n = (STAGING_BUFSIZE * 5) / 2 + 3;
+  unsigned char *data;
+  unsigned char *buf;
+  gpudata *d;
+  int err;
+  size_t i;
+
+  if (setup(_i)) {
+    data = malloc(n);
+    ck_assert(data != NULL);
+    buf = malloc(n);
+    ck_assert(buf != NULL);
+    for (i = 0; i < n; i++)
+      data[i] = (unsigned char)(i * 7);
+
+    d = ops->buffer_alloc(ctx, n, NULL, 0, NULL);
+    ck_assert(d != NULL);
+
+    err = ops->buffer_write(d, 0, data, n);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    memset(buf, 0, n);
+    err = ops->buffer_read(buf, d, 0, n);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    ck_assert(memcmp(data, buf, n) == 0);
+
+    /* Unaligned in the middle of the buffer */
+    err = ops->buffer_write(d, 5, data, n - 5);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = ops->buffer_read(buf, d, 1, n - 1);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    ck_assert(memcmp(buf, data + 1, 4) == 0);
+    ck_assert(memcmp(buf + 4, data, n - 5) == 0);
+
+    ops->buffer_release(d);
+    free(data);
+    free(buf);
+  }
+  teardown();
+}
+END_TEST
+
+START_TEST(test_buffer_host)
+{
+  const int32_t data[] = {0, 1, 2, 3, 4, 5, 6, 7};
+  int32_t buf[nelems(data)];
+  int32_t *p;
+  gpudata *d;
+  int err;
+  unsigned int i;
+
+  if (setup(_i)) {
+    d = ops->buffer_alloc(ctx, sizeof(data), NULL, GA_BUFFER_HOST, &err);
+    if (d == NULL) {
+      ck_assert_int_eq(err, GA_DEVSUP_ERROR);
+    } else {
+      err = ops->buffer_write(d, 0, data, sizeof(data));
+      ck_assert_int_eq(err, GA_NO_ERROR);
+      err = ops->buffer_read(buf, d, 0, sizeof(data));
+      ck_assert_int_eq(err, GA_NO_ERROR);
+      for (i = 0; i < nelems(data); i++) {
+        ck_assert_int_eq(buf[i], data[i]);
+      }
+
+      err = ops->property(NULL, d, NULL, GA_BUFFER_PROP_HOSTPOINTER, &p);
+      if (err != GA_DEVSUP_ERROR) {
+        ck_assert_int_eq(err, GA_NO_ERROR);
+        for (i = 0; i < nelems(data); i++) {
+          ck_assert_int_eq(p[i], data[i]);
+        }
+        p[1] = 42;
+        err = ops->buffer_read(buf, d, 0, sizeof(data));
+        ck_assert_int_eq(err, GA_NO_ERROR);
+        ck_assert_int_eq(buf[1], 42);
+      }
+      ops->buffer_release(d);
+    }
+  }
+  teardown();
+}
+END_TEST
+
+START_TEST(test_buffer_host_kernel)
+{
+  /* Enough work for the kernel to still be running when we read */
+  static const char *src =
+    "KERNEL void k(GLOBAL_MEM ga_int *a) {\n"
+    "  const ga_size i = GID_0 * LDIM_0 + LID_0;\n"
+    "  ga_int v = 0;\n"
+    "  ga_int j;\n"
+    "  for (j = 0; j < 1000; j++)\n"
+    "    v += (ga_int)i;\n"
+    "  a[i] = v;\n"
+    "}\n";
+  static const int types[] = {GA_BUFFER};
+  int32_t buf[1 << 14];
+  GpuKernel k;
+  gpudata *d;
+  void *args[1];
+  size_t ls = 64, gs = nelems(buf) / 64;
+  int err;
+  unsigned int i;
+
+  if (setup(_i)) {
+    d = ops->buffer_alloc(ctx, sizeof(buf), NULL, GA_BUFFER_HOST, &err);
+    if (d == NULL) {
+      ck_assert_int_eq(err, GA_DEVSUP_ERROR);
+    } else {
+      err = GpuKernel_init(&k, ops, ctx, 1, &src, NULL, "k", 1, types,
+                           GA_USE_CLUDA, NULL);
+      ck_assert_int_eq(err, GA_NO_ERROR);
+      args[0] = d;
+      err = GpuKernel_call(&k, 1, &ls, &gs, 0, args);
+      ck_assert_int_eq(err, GA_NO_ERROR);
+      err = ops->buffer_read(buf, d, 0, sizeof(buf));
+      ck_assert_int_eq(err, GA_NO_ERROR);
+      for (i = 0; i < nelems(buf); i++)
+        ck_assert_int_eq(buf[i], (int32_t)(i * 1000));
+
+      /* And a write isn't overwritten by the kernel afterwards */
+      err = GpuKernel_call(&k, 1, &ls, &gs, 0, args);
+      ck_assert_int_eq(err, GA_NO_ERROR);
+      buf[0] = 42;
+      err = ops->buffer_write(d, 0, buf, sizeof(int32_t));
+      ck_assert_int_eq(err, GA_NO_ERROR);
+      err = ops->buffer_read(buf, d, 0, sizeof(int32_t));
+      ck_assert_int_eq(err, GA_NO_ERROR);
+      ck_assert_int_eq(buf[0], 42);
+
+      GpuKernel_clear(&k);
+      ops->buffer_release(d);
+    }
+  }
+  teardown();
+}
+END_TEST
+
+static size_t ctx_size_prop(int prop_id) {
+  size_t res;
+  int err;
+  err = ops->property(ctx, NULL, NULL, prop_id, &res);
+  ck_assert(err == GA_NO_ERROR);
+  return res;
+}
+
+START_TEST(test_buffer_cache)
+{
+  int32_t data[250];
+  int32_t buf[nelems(data)];
+  gpudata *d;
+  size_t inuse, cached, sz;
+  int err;
+  unsigned int i;
+
+  for (i = 0; i < nelems(data); i++)
+    data[i] = i;
+
+  if (setup(_i)) {
+    inuse = ctx_size_prop(GA_CTX_PROP_INUSE_BYTES);
+    cached = ctx_size_prop(GA_CTX_PROP_CACHED_BYTES);
+
+    d = ops->buffer_alloc(ctx, sizeof(data), NULL, 0, NULL);
+    ck_assert(d != NULL);
+    ck_assert(ctx_size_prop(GA_CTX_PROP_INUSE_BYTES) >= inuse + sizeof(data));
+    ops->buffer_release(d);
+    ck_assert(ctx_size_prop(GA_CTX_PROP_INUSE_BYTES) == inuse);
+    ck_assert(ctx_size_prop(GA_CTX_PROP_CACHED_BYTES) >= cached + sizeof(data));
+
+    /* A close size comes from the cache and gets initialized */
+    d = ops->buffer_alloc(ctx, sizeof(data) - sizeof(int32_t), data,
+                          GA_BUFFER_INIT, NULL);
+    ck_assert(d != NULL);
+    ck_assert(ctx_size_prop(GA_CTX_PROP_CACHED_BYTES) == cached);
+    err = ops->buffer_read(buf, d, 0, sizeof(data) - sizeof(int32_t));
+    ck_assert(err == GA_NO_ERROR);
+    for (i = 0; i < nelems(data) - 1; i++) {
+      ck_assert_int_eq(buf[i], data[i]);
+    }
+
+    /* It keeps the size that was asked for */
+    err = ops->property(NULL, d, NULL, GA_BUFFER_PROP_SIZE, &sz);
+    ck_assert(err == GA_NO_ERROR);
+    ck_assert(sz == sizeof(data) - sizeof(int32_t));
+    err = ops->buffer_read(buf, d, 0, sizeof(data));
+    ck_assert(err == GA_VALUE_ERROR);
+    ops->buffer_release(d);
+
+    err = ops->buffer_trim(ctx);
+    ck_assert(err == GA_NO_ERROR);
+    ck_assert(ctx_size_prop(GA_CTX_PROP_CACHED_BYTES) == 0);
+    ck_assert(ctx_size_prop(GA_CTX_PROP_INUSE_BYTES) == inuse);
+  }
+  teardown();
+}
+END_TEST
+
+START_TEST(test_buffer_accounting)
+{
+  gpudata *d;
+  gpudata *d2;
+  size_t nbufs, inuse, nallocs, peak;
+  int err;
+
+  if (setup(_i)) {
+    nbufs = ctx_size_prop(GA_CTX_PROP_NUM_BUFFERS);
+    inuse = ctx_size_prop(GA_CTX_PROP_INUSE_BYTES);
+    ck_assert(ctx_size_prop(GA_CTX_PROP_PEAK_BYTES) >= inuse);
+
+    err = ops->buffer_trim(ctx);
+    ck_assert(err == GA_NO_ERROR);
+    nallocs = ctx_size_prop(GA_CTX_PROP_NUM_ALLOCS);
+
+    /* Too big to come from a block, so this asks the driver */
+    d = ops->buffer_alloc(ctx, 1024 * 1024, NULL, 0, NULL);
+    ck_assert(d != NULL);
+    d2 = ops->buffer_alloc(ctx, 1000, NULL, 0, NULL);
+    ck_assert(d2 != NULL);
+    ck_assert(ctx_size_prop(GA_CTX_PROP_NUM_ALLOCS) > nallocs);
+    ck_assert(ctx_size_prop(GA_CTX_PROP_NUM_BUFFERS) == nbufs + 2);
+    peak = ctx_size_prop(GA_CTX_PROP_PEAK_BYTES);
+    ck_assert(peak >= inuse + 1024 * 1024 + 1000);
+    ck_assert(peak == ctx_size_prop(GA_CTX_PROP_INUSE_BYTES));
+
+    ops->buffer_release(d);
+    ck_assert(ctx_size_prop(GA_CTX_PROP_NUM_BUFFERS) == nbufs + 1);
+    ck_assert(ctx_size_prop(GA_CTX_PROP_PEAK_BYTES) == peak);
+
+    err = ops->buffer_reset_peak(ctx);
+    ck_assert(err == GA_NO_ERROR);
+    ck_assert(ctx_size_prop(GA_CTX_PROP_PEAK_BYTES) ==
+              ctx_size_prop(GA_CTX_PROP_INUSE_BYTES));
+
+    ops->buffer_release(d2);
+    ck_assert(ctx_size_prop(GA_CTX_PROP_NUM_BUFFERS) == nbufs);
+    ck_assert(ctx_size_prop(GA_CTX_PROP_INUSE_BYTES) == inuse);
+  }
+  teardown();
+}
+END_TEST
+
+static unsigned int count_files(const char *dir) {
+  unsigned int res = 0;
+  struct dirent *d;
+  DIR *dp;
+
+  dp = opendir(dir);
+  ck_assert(dp != NULL);
+  while ((d = readdir(dp)) != NULL)
+    if (d->d_name[0] != '.')
+      res++;
+  closedir(dp);
+  return res;
+}
+
+static void remove_files(const char *dir) {
+  char path[1024];
+  struct dirent *d;
+  DIR *dp;
+
+  dp = opendir(dir);
+  ck_assert(dp != NULL);
+  while ((d = readdir(dp)) != NULL) {
+    if (d->d_name[0] == '.')
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, d->d_name);
+    unlink(path);
+  }
+  closedir(dp);
+  rmdir(dir);
+}
+
+/* Path of the only file in `dir` */
+static void only_file(const char *dir, char *path, size_t sz) {
+  struct dirent *d;
+  DIR *dp;
+
+  ck_assert_int_eq(count_files(dir), 1);
+  dp = opendir(dir);
+  ck_assert(dp != NULL);
+  while ((d = readdir(dp)) != NULL)
+    if (d->d_name[0] != '.')
+      snprintf(path, sz, "%s/%s", dir, d->d_name);
+  closedir(dp);
+}
+
+START_TEST(test_kernel_disk_cache)
+{
+  static const char *src = "KERNEL void k(GLOBAL_MEM float *a) {\n"
+                           "  a[0] = 1.0f;\n"
+                           "}\n";
+  char dir[] = "/tmp/gpuarray_cache.XXXXXX";
+  char path[1024];
+  struct utimbuf old = {0, 0};
+  struct stat st;
+  ino_t ino;
+  int types[] = {GA_BUFFER};
+  gpukernel *k;
+  size_t misses;
+  int err;
+
+  if (setup(_i)) {
+    ck_assert(mkdtemp(dir) != NULL);
+    setenv("GPUARRAY_CACHE_DIR", dir, 1);
+
+    k = ops->kernel_alloc(ctx, 1, &src, NULL, "k", 1, types, GA_USE_CLUDA,
+                          &err, NULL);
+    ck_assert(k != NULL);
+    only_file(dir, path, sizeof(path));
+    /* Drop it from the context so that the next one is built again */
+    ops->kernel_release(k);
+
+    /*
+     * Hits refresh the modification time of the entry while a rebuild
+     * would replace the file.
+     */
+    ck_assert(stat(path, &st) == 0);
+    ino = st.st_ino;
+    ck_assert(utime(path, &old) == 0);
+    misses = ctx_size_prop(GA_CTX_PROP_KERNEL_CACHE_MISSES);
+    k = ops->kernel_alloc(ctx, 1, &src, NULL, "k", 1, types, GA_USE_CLUDA,
+                          &err, NULL);
+    ck_assert(k != NULL);
+    ck_assert(ctx_size_prop(GA_CTX_PROP_KERNEL_CACHE_MISSES) == misses + 1);
+    ck_assert_int_eq(count_files(dir), 1);
+    ck_assert(stat(path, &st) == 0);
+    ck_assert(st.st_ino == ino);
+    ck_assert(st.st_mtime != 0);
+
+    ops->kernel_release(k);
+    unsetenv("GPUARRAY_CACHE_DIR");
+    remove_files(dir);
+  }
+  teardown();
+}
+END_TEST
+
+START_TEST(test_kernel_table)
+{
+  static const char *src = "KERNEL void k(GLOBAL_MEM float *a) {\n"
+                           "  a[0] = 2.0f;\n"
+                           "}\n";
+  int types[] = {GA_BUFFER};
+  gpukernel *k;
+  gpukernel *k2;
+  gpukernel *k3;
+  size_t hits, misses;
+  int err;
+
+  if (setup(_i)) {
+    hits = ctx_size_prop(GA_CTX_PROP_KERNEL_CACHE_HITS);
+    misses = ctx_size_prop(GA_CTX_PROP_KERNEL_CACHE_MISSES);
+
+    k = ops->kernel_alloc(ctx, 1, &src, NULL, "k", 1, types, GA_USE_CLUDA,
+                          &err, NULL);
+    ck_assert(k != NULL);
+    ck_assert(ctx_size_prop(GA_CTX_PROP_KERNEL_CACHE_MISSES) == misses + 1);
+
+    k2 = ops->kernel_alloc(ctx, 1, &src, NULL, "k", 1, types, GA_USE_CLUDA,
+                           &err, NULL);
+    ck_assert(k2 == k);
+    ck_assert(ctx_size_prop(GA_CTX_PROP_KERNEL_CACHE_HITS) == hits + 1);
+
+    /* Different flags make a different kernel */
+    k3 = ops->kernel_alloc(ctx, 1, &src, NULL, "k", 1, types,
+                           GA_USE_CLUDA|GA_USE_SMALL, &err, NULL);
+    ck_assert(k3 != NULL);
+    ck_assert(k3 != k);
+    ck_assert(ctx_size_prop(GA_CTX_PROP_KERNEL_CACHE_MISSES) == misses + 2);
+
+    ops->kernel_release(k3);
+    ops->kernel_release(k2);
+    ops->kernel_release(k);
+
+    /* Kernels are only shared while they are alive */
+    k = ops->kernel_alloc(ctx, 1, &src, NULL, "k", 1, types, GA_USE_CLUDA,
+                          &err, NULL);
+    ck_assert(k != NULL);
+    ck_assert(ctx_size_prop(GA_CTX_PROP_KERNEL_CACHE_MISSES) == misses + 3);
+    ops->kernel_release(k);
+  }
+  teardown();
+}
+END_TEST
+
+START_TEST(test_kernel_keep)
+{
+  static const char *src = "KERNEL void k(GLOBAL_MEM float *a) {\n"
+                           "  a[0] = 2.0f;\n"
+                           "}\n";
+  int types[] = {GA_BUFFER};
+  gpukernel *k;
+  gpukernel *k2;
+  int err;
+
+  if (setup(_i)) {
+    ck_assert(ops->kernel_lookup(ctx, "test k", 6) == NULL);
+
+    k = ops->kernel_alloc(ctx, 1, &src, NULL, "k", 1, types, GA_USE_CLUDA,
+                          &err, NULL);
+    ck_assert(k != NULL);
+    err = ops->kernel_keep(k, "test k", 6);
+    ck_assert(err == GA_NO_ERROR);
+    ops->kernel_release(k);
+
+    /* The context kept it alive */
+    k2 = ops->kernel_lookup(ctx, "test k", 6);
+    ck_assert(k2 == k);
+    ck_assert(ops->kernel_lookup(ctx, "test k2", 7) == NULL);
+    ops->kernel_release(k2);
+
+    /* Replace it */
+    k = ops->kernel_alloc(ctx, 1, &src, NULL, "k", 1, types,
+                          GA_USE_CLUDA|GA_USE_SMALL, &err, NULL);
+    ck_assert(k != NULL);
+    err = ops->kernel_keep(k, "test k", 6);
+    ck_assert(err == GA_NO_ERROR);
+    k2 = ops->kernel_lookup(ctx, "test k", 6);
+    ck_assert(k2 == k);
+    ops->kernel_release(k2);
+    ops->kernel_release(k);
+  }
+  teardown();
+}
+END_TEST
+
+START_TEST(test_kernel_async)
+{
+  static const char *bad = "KERNEL void k(GLOBAL_MEM float *a) {\n"
+                           "  a[0] = ;\n"
+                           "}\n";
+  char srcs[4][128];
+  const char *src;
+  GpuKernelFuture *f[4];
+  GpuKernelFuture *fbad;
+  GpuKernel k;
+  gpudata *a;
+  void *args[1];
+  char *err_str;
+  size_t ls, gs;
+  float res;
+  int types[] = {GA_BUFFER};
+  unsigned int i;
+  int err;
+
+  if (setup(_i)) {
+    for (i = 0; i < 4; i++) {
+      snprintf(srcs[i], sizeof(srcs[i]),
+               "KERNEL void k(GLOBAL_MEM float *a) {\n"
+               "  a[0] = %u.0f;\n"
+               "}\n", i + 3);
+      src = srcs[i];
+      f[i] = GpuKernel_init_async(ops, ctx, 1, &src, NULL, "k", 1, types,
+                                  GA_USE_CLUDA, &err);
+      ck_assert(f[i] != NULL);
+    }
+    fbad = GpuKernel_init_async(ops, ctx, 1, &bad, NULL, "k", 1, types,
+                                GA_USE_CLUDA, &err);
+    ck_assert(fbad != NULL);
+
+    a = ops->buffer_alloc(ctx, sizeof(float), NULL, 0, NULL);
+    ck_assert(a != NULL);
+    args[0] = a;
+    for (i = 0; i < 4; i++) {
+      err = GpuKernelFuture_wait(f[i], &k, NULL);
+      ck_assert_int_eq(err, GA_NO_ERROR);
+      ck_assert(GpuKernelFuture_ready(f[i]));
+      ls = gs = 1;
+      err = GpuKernel_call(&k, 1, &ls, &gs, 0, args);
+      ck_assert_int_eq(err, GA_NO_ERROR);
+      err = ops->buffer_read(&res, a, 0, sizeof(res));
+      ck_assert_int_eq(err, GA_NO_ERROR);
+      ck_assert(res == (float)(i + 3));
+      GpuKernel_clear(&k);
+    }
+    ops->buffer_release(a);
+
+    err = GpuKernelFuture_error(fbad, &err_str);
+    ck_assert(err != GA_NO_ERROR);
+    ck_assert(err_str != NULL);
+    free(err_str);
+    ck_assert(GpuKernelFuture_wait(fbad, &k, NULL) == err);
+
+    for (i = 0; i < 4; i++)
+      GpuKernelFuture_free(f[i]);
+    GpuKernelFuture_free(fbad);
+
+    /* Dropping a future before it is done is fine */
+    src = srcs[0];
+    GpuKernelFuture_free(GpuKernel_init_async(ops, ctx, 1, &src, NULL, "k", 1,
+                                              types, GA_USE_CLUDA, &err));
+  }
+  teardown();
+}
+END_TEST
+
+START_TEST(test_kernel_module)
+{
+  static const char *src = "KERNEL void set(GLOBAL_MEM float *a, float v) {\n"
+                           "  a[0] = v;\n"
+                           "}\n"
+                           "KERNEL void twice(GLOBAL_MEM float *a) {\n"
+                           "  a[0] = a[0] * 2.0f;\n"
+                           "}\n";
+  static const int set_types[] = {GA_BUFFER, GA_FLOAT};
+  static const int twice_types[] = {GA_BUFFER};
+  const char *names[] = {"set", "twice"};
+  const unsigned int argcounts[] = {2, 1};
+  const int *types[] = {set_types, twice_types};
+  GpuKernel ks[2];
+  gpukernel *k;
+  gpudata *a;
+  void *args[2];
+  size_t ls, gs;
+  float v = 5.0f;
+  float res;
+  int err;
+
+  if (setup(_i)) {
+    err = GpuKernel_init_module(ks, ops, ctx, 1, &src, NULL, 2, names,
+                                argcounts, types, GA_USE_CLUDA, NULL);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    ck_assert(ks[0].k != ks[1].k);
+
+    a = ops->buffer_alloc(ctx, sizeof(float), NULL, 0, NULL);
+    ck_assert(a != NULL);
+    args[0] = a;
+    args[1] = &v;
+    ls = gs = 1;
+    err = GpuKernel_call(&ks[0], 1, &ls, &gs, 0, args);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = GpuKernel_call(&ks[1], 1, &ls, &gs, 0, args);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = ops->buffer_read(&res, a, 0, sizeof(res));
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    ck_assert(res == 10.0f);
+    ops->buffer_release(a);
+
+    /* Each kernel of the module is in the kernel table */
+    k = ops->kernel_alloc(ctx, 1, &src, NULL, "twice", 1, twice_types,
+                          GA_USE_CLUDA, &err, NULL);
+    ck_assert(k == ks[1].k);
+    ops->kernel_release(k);
+
+    GpuKernel_clear(&ks[0]);
+    /* The other kernel keeps the module alive */
+    a = ops->buffer_alloc(ctx, sizeof(float), &v, GA_BUFFER_INIT, NULL);
+    ck_assert(a != NULL);
+    args[0] = a;
+    err = GpuKernel_call(&ks[1], 1, &ls, &gs, 0, args);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = ops->buffer_read(&res, a, 0, sizeof(res));
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    ck_assert(res == 10.0f);
+    ops->buffer_release(a);
+    GpuKernel_clear(&ks[1]);
+
+    names[1] = "missing";
+    err = GpuKernel_init_module(ks, ops, ctx, 1, &src, NULL, 2, names,
+                                argcounts, types, GA_USE_CLUDA, NULL);
+    ck_assert(err != GA_NO_ERROR);
+  }
+  teardown();
+}
+END_TEST
+
+START_TEST(test_kernel_options)
+{
+  static const char *src = "KERNEL void k(GLOBAL_MEM float *a) {\n"
+                           "  a[0] = VAL * 3.0f;\n"
+                           "}\n";
+  static const int types[] = {GA_BUFFER};
+  const char *defs[] = {"VAL=2.0f"};
+  GpuKernel k, k2;
+  gpudata *a;
+  void *args[1];
+  size_t ls, gs;
+  size_t misses;
+  float res;
+  int err;
+
+  if (setup(_i)) {
+    misses = ctx_size_prop(GA_CTX_PROP_KERNEL_CACHE_MISSES);
+    err = GpuKernel_init_opts(&k, ops, ctx, 1, &src, NULL, "k", 1, types,
+                              GA_USE_CLUDA, 1, defs, NULL);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+
+    a = ops->buffer_alloc(ctx, sizeof(float), NULL, 0, NULL);
+    ck_assert(a != NULL);
+    args[0] = a;
+    ls = gs = 1;
+    err = GpuKernel_call(&k, 1, &ls, &gs, 0, args);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = ops->buffer_read(&res, a, 0, sizeof(res));
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    ck_assert(res == 6.0f);
+
+    /* Compiler options make a different kernel */
+    err = GpuKernel_init_opts(&k2, ops, ctx, 1, &src, NULL, "k", 1, types,
+                              GA_USE_CLUDA|GA_USE_FAST_MATH|GA_USE_MAD|
+                              GA_OPT_LEVEL(0), 1, defs, NULL);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    ck_assert(k2.k != k.k);
+    ck_assert(ctx_size_prop(GA_CTX_PROP_KERNEL_CACHE_MISSES) == misses + 2);
+    err = GpuKernel_call(&k2, 1, &ls, &gs, 0, args);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = ops->buffer_read(&res, a, 0, sizeof(res));
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    ck_assert(res == 6.0f);
+    GpuKernel_clear(&k2);
+
+    /* And so do the definitions */
+    defs[0] = "VAL=3.0f";
+    err = GpuKernel_init_opts(&k2, ops, ctx, 1, &src, NULL, "k", 1, types,
+                              GA_USE_CLUDA, 1, defs, NULL);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    ck_assert(k2.k != k.k);
+    err = GpuKernel_call(&k2, 1, &ls, &gs, 0, args);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = ops->buffer_read(&res, a, 0, sizeof(res));
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    ck_assert(res == 9.0f);
+    GpuKernel_clear(&k2);
+
+    ck_assert_int_eq(GA_GET_OPT_LEVEL(GA_USE_CLUDA), -1);
+    ck_assert_int_eq(GA_GET_OPT_LEVEL(GA_OPT_LEVEL(3)), 3);
+
+    ops->buffer_release(a);
+    GpuKernel_clear(&k);
+  }
+  teardown();
+}
+END_TEST
+
+START_TEST(test_kernel_local_barrier)
+{
+  /* Sum each work-group of 8x4 items through local memory */
+  static const char *src =
+    "KERNEL void red(GLOBAL_MEM const float *a, GLOBAL_MEM float *out) {\n"
+    "  LOCAL_MEM float buf[32];\n"
+    "  const ga_size l = LID_1 * LDIM_0 + LID_0;\n"
+    "  const ga_size g = GID_1 * GDIM_0 + GID_0;\n"
+    "  ga_size s;\n"
+    "  buf[l] = a[g * 32 + l];\n"
+    "  local_barrier();\n"
+    "  for (s = 16; s > 0; s /= 2) {\n"
+    "    if (l < s)\n"
+    "      buf[l] += buf[l + s];\n"
+    "    local_barrier();\n"
+    "  }\n"
+    "  if (l == 0)\n"
+    "    out[g] = buf[0];\n"
+    "}\n";
+  static const int types[] = {GA_BUFFER, GA_BUFFER};
+  float data[6 * 32];
+  float res[6];
+  float expect;
+  GpuKernel k;
+  gpudata *a, *out;
+  void *args[2];
+  size_t ls[2] = {8, 4};
+  size_t gs[2] = {3, 2};
+  unsigned int i, j;
+  int err;
+
+  if (setup(_i)) {
+    for (i = 0; i < nelems(data); i++)
+      data[i] = (float)(i % 7);
+    err = GpuKernel_init(&k, ops, ctx, 1, &src, NULL, "red", 2, types,
+                         GA_USE_CLUDA, NULL);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+
+    a = ops->buffer_alloc(ctx, sizeof(data), data, GA_BUFFER_INIT, NULL);
+    ck_assert(a != NULL);
+    out = ops->buffer_alloc(ctx, sizeof(res), NULL, 0, NULL);
+    ck_assert(out != NULL);
+    args[0] = a;
+    args[1] = out;
+    err = GpuKernel_call(&k, 2, ls, gs, 0, args);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = ops->buffer_read(res, out, 0, sizeof(res));
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    for (i = 0; i < nelems(res); i++) {
+      expect = 0.0f;
+      for (j = 0; j < 32; j++)
+        expect += data[i * 32 + j];
+      ck_assert(res[i] == expect);
+    }
+
+    ops->buffer_release(out);
+    ops->buffer_release(a);
+    GpuKernel_clear(&k);
+  }
+  teardown();
+}
+END_TEST
+
+START_TEST(test_kernel_manifest)
+{
+  static const char *src = "KERNEL void k(GLOBAL_MEM float *a) {\n"
+                           "  a[0] = 7.0f;\n"
+                           "}\n";
+  static const char *src2 = "KERNEL void k(GLOBAL_MEM float *a) {\n"
+                            "  a[0] = 8.0f;\n"
+                            "}\n";
+  char path[] = "/tmp/gpuarray_manifest.XXXXXX";
+  GpuKernelManifest *m;
+  GpuKernel k, k2;
+  gpudata *a;
+  void *args[1];
+  size_t ls, gs;
+  size_t misses, nbin;
+  float res;
+  int types[] = {GA_BUFFER};
+  int fd;
+  int err;
+
+  if (setup(_i)) {
+    fd = mkstemp(path);
+    ck_assert(fd != -1);
+    close(fd);
+
+    m = GpuKernelManifest_new();
+    ck_assert(m != NULL);
+    GpuKernelManifest_record(m);
+    err = GpuKernel_init(&k, ops, ctx, 1, &src, NULL, "k", 1, types,
+                         GA_USE_CLUDA, NULL);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = GpuKernel_init(&k2, ops, ctx, 1, &src, NULL, "k", 1, types,
+                         GA_USE_CLUDA, NULL);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    GpuKernelManifest_record(NULL);
+    ck_assert_int_eq(GpuKernelManifest_size(m), 1);
+    GpuKernel_clear(&k2);
+    GpuKernel_clear(&k);
+
+    /* A binary for another kind of device is not used */
+    err = GpuKernelManifest_add(m, 1, &src2, NULL, "k", 1, types,
+                                GA_USE_CLUDA, "elsewhere", "junk", 4);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    ck_assert_int_eq(GpuKernelManifest_save(m, path), GA_NO_ERROR);
+    GpuKernelManifest_free(m);
+
+    m = GpuKernelManifest_load(path, &err);
+    ck_assert(m != NULL);
+    ck_assert_int_eq(GpuKernelManifest_size(m), 2);
+    err = GpuKernelManifest_replay(m, ops, ctx, &nbin, NULL);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    ck_assert_int_eq(nbin, 1);
+
+    /* Both kernels are ready */
+    misses = ctx_size_prop(GA_CTX_PROP_KERNEL_CACHE_MISSES);
+    err = GpuKernel_init(&k, ops, ctx, 1, &src, NULL, "k", 1, types,
+                         GA_USE_CLUDA, NULL);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = GpuKernel_init(&k2, ops, ctx, 1, &src2, NULL, "k", 1, types,
+                         GA_USE_CLUDA, NULL);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    ck_assert(ctx_size_prop(GA_CTX_PROP_KERNEL_CACHE_MISSES) == misses);
+
+    a = ops->buffer_alloc(ctx, sizeof(float), NULL, 0, NULL);
+    ck_assert(a != NULL);
+    args[0] = a;
+    ls = gs = 1;
+    err = GpuKernel_call(&k, 1, &ls, &gs, 0, args);
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    err = ops->buffer_read(&res, a, 0, sizeof(res));
+    ck_assert_int_eq(err, GA_NO_ERROR);
+    ck_assert(res == 7.0f);
+    ops->buffer_release(a);
+
+    GpuKernel_clear(&k2);
+    GpuKernel_clear(&k);
+    GpuKernelManifest_free(m);
+
+    unlink(path);
+    ck_assert(GpuKernelManifest_load(path, &err) == NULL);
+    ck_assert_int_eq(err, GA_SYS_ERROR);
+  }
+  teardown();
+}
+END_TEST
+
+START_TEST(test_buffer_extcopy_cache)
+{
+  float data[16];
+  float res[16];
+  size_t dims[2] = {4, 4};
+  ssize_t istr[2] = {16, 4};
+  ssize_t ostr[2] = {4, 16};
+  gpudata *a;
+  gpudata *b;
+  size_t n;
+  unsigned int i, j;
+  int err;
+
+  for (i = 0; i < 16; i++)
+    data[i] = (float)i;
+
+  if (setup(_i)) {
+    a = ops->buffer_alloc(ctx, sizeof(data), data, GA_BUFFER_INIT, NULL);
+    ck_assert(a != NULL);
+    b = ops->buffer_alloc(ctx, sizeof(data), NULL, 0, NULL);
+    ck_assert(b != NULL);
+    n = ctx_size_prop(GA_CTX_PROP_EXTCOPY_CACHE_SIZE);
+
+    /* Transpose */
+    err = ops->buffer_extcopy(a, 0, b, 0, GA_FLOAT, GA_FLOAT, 2, dims, istr,
+                              2, dims, ostr);
+    ck_assert(err == GA_NO_ERROR);
+    ck_assert(ctx_size_prop(GA_CTX_PROP_EXTCOPY_CACHE_SIZE) <= n + 1);
+    n = ctx_size_prop(GA_CTX_PROP_EXTCOPY_CACHE_SIZE);
+
+    /* The second time reuses the kernel */
+    err = ops->buffer_extcopy(a, 0, b, 0, GA_FLOAT, GA_FLOAT, 2, dims, istr,
+                              2, dims, ostr);
+    ck_assert(err == GA_NO_ERROR);
+    ck_assert(ctx_size_prop(GA_CTX_PROP_EXTCOPY_CACHE_SIZE) == n);
+
+    err = ops->buffer_read(res, b, 0, sizeof(res));
+    ck_assert(err == GA_NO_ERROR);
+    for (i = 0; i < 4; i++)
+      for (j = 0; j < 4; j++)
+        ck_assert(res[j * 4 + i] == data[i * 4 + j]);
+
+    ops->buffer_release(b);
+    ops->buffer_release(a);
+  }
+  teardown();
+}
+END_TEST
+
+START_TEST(test_buffer_extcopy_offsets)
+{
+  float data[16];
+  float res[16];
+  size_t dims[1] = {4};
+  ssize_t istr[1] = {16};
+  ssize_t ostr[1] = {4};
+  gpudata *a;
+  gpudata *b;
+  size_t n;
+  unsigned int i, j;
+  int err;
+
+  for (i = 0; i < 16; i++)
+    data[i] = (float)i;
+
+  if (setup(_i)) {
+    a = ops->buffer_alloc(ctx, sizeof(data), data, GA_BUFFER_INIT, NULL);
+    ck_assert(a != NULL);
+    b = ops->buffer_alloc(ctx, sizeof(data), NULL, 0, NULL);
+    ck_assert(b != NULL);
+
+    /* Columns of a into rows of b */
+    err = ops->buffer_extcopy(a, 0, b, 0, GA_FLOAT, GA_FLOAT, 1, dims, istr,
+                              1, dims, ostr);
+    ck_assert(err == GA_NO_ERROR);
+    n = ctx_size_prop(GA_CTX_PROP_EXTCOPY_CACHE_SIZE);
+
+    /* The offsets are not part of the kernel */
+    for (i = 1; i < 4; i++) {
+      err = ops->buffer_extcopy(a, i * sizeof(float), b, i * 4 * sizeof(float),
+                                GA_FLOAT, GA_FLOAT, 1, dims, istr,
+                                1, dims, ostr);
+      ck_assert(err == GA_NO_ERROR);
+      ck_assert(ctx_size_prop(GA_CTX_PROP_EXTCOPY_CACHE_SIZE) == n);
+    }
+
+    err = ops->buffer_read(res, b, 0, sizeof(res));
+    ck_assert(err == GA_NO_ERROR);
+    for (i = 0; i < 4; i++)
+      for (j = 0; j < 4; j++)
+        ck_assert(res[i * 4 + j] == data[j * 4 + i]);
+
+    ops->buffer_release(b);
+    ops->buffer_release(a);
+  }
+  teardown();
+}
+END_TEST
+
+START_TEST(test_buffer_extcopy_shapes)
+{
+  float data[16];
+  float res[16];
+  size_t dims[2];
+  ssize_t istr[2];
+  ssize_t ostr[2];
+  gpudata *a;
+  gpudata *b;
+  unsigned int i, j, n, r;
+  int err;
+
+  for (i = 0; i < 16; i++)
+    data[i] = (float)i;
+
+  if (setup(_i)) {
+    a = ops->buffer_alloc(ctx, sizeof(data), data, GA_BUFFER_INIT, NULL);
+    ck_assert(a != NULL);
+    b = ops->buffer_alloc(ctx, sizeof(data), NULL, 0, NULL);
+    ck_assert(b != NULL);
+
+    /*
+     * Transpose the top-left n x n corner, each size enough times for
+     * the layout to get a specialized kernel.
+     */
+    for (n = 1; n <= 4; n++) {
+      dims[0] = dims[1] = n;
+      istr[0] = n * sizeof(float);
+      istr[1] = sizeof(float);
+      ostr[0] = sizeof(float);
+      ostr[1] = n * sizeof(float);
+      for (r = 0; r < 12; r++) {
+        err = ops->buffer_extcopy(a, 0, b, 0, GA_FLOAT, GA_FLOAT, 2, dims,
+                                  istr, 2, dims, ostr);
+        ck_assert(err == GA_NO_ERROR);
+        err = ops->buffer_read(res, b, 0, n * n * sizeof(float));
+        ck_assert(err == GA_NO_ERROR);
+        for (i = 0; i < n; i++)
+          for (j = 0; j < n; j++)
+            ck_assert(res[j * n + i] == data[i * n + j]);
+      }
+    }
+
+    ops->buffer_release(b);
+    ops->buffer_release(a);
+  }
+  teardown();
+}
+END_TEST
+
 Suite *get_suite(void) {
   Suite *s = suite_create("buffer");
   TCase *tc = tcase_create("All");
@@ -266,7 +1526,29 @@ Suite *get_suite(void) {
   tcase_add_loop_test(tc, test_buffer_retain_release, 0, nelems(BACKENDS));
   tcase_add_loop_test(tc, test_buffer_share, 0, nelems(BACKENDS));
   tcase_add_loop_test(tc, test_buffer_read_write, 0, nelems(BACKENDS));
+  tcase_add_loop_test(tc, test_buffer_read_write_async, 0, nelems(BACKENDS));
+  tcase_add_loop_test(tc, test_buffer_memset_range, 0, nelems(BACKENDS));
+  tcase_add_loop_test(tc, test_buffer_fill, 0, nelems(BACKENDS));
   tcase_add_loop_test(tc, test_buffer_move, 0, nelems(BACKENDS));
+  tcase_add_loop_test(tc, test_stream, 0, nelems(BACKENDS));
+  tcase_add_loop_test(tc, test_event, 0, nelems(BACKENDS));
+  tcase_add_loop_test(tc, test_buffer_cache, 0, nelems(BACKENDS));
+  tcase_add_loop_test(tc, test_buffer_suballoc, 0, nelems(BACKENDS));
+  tcase_add_loop_test(tc, test_buffer_read_write_large, 0, nelems(BACKENDS));
+  tcase_add_loop_test(tc, test_buffer_host, 0, nelems(BACKENDS));
+  tcase_add_loop_test(tc, test_buffer_host_kernel, 0, nelems(BACKENDS));
+  tcase_add_loop_test(tc, test_buffer_accounting, 0, nelems(BACKENDS));
+  tcase_add_loop_test(tc, test_kernel_disk_cache, 0, nelems(BACKENDS));
+  tcase_add_loop_test(tc, test_kernel_table, 0, nelems(BACKENDS));
+  tcase_add_loop_test(tc, test_kernel_keep, 0, nelems(BACKENDS));
+  tcase_add_loop_test(tc, test_kernel_async, 0, nelems(BACKENDS));
+  tcase_add_loop_test(tc, test_kernel_module, 0, nelems(BACKENDS));
+  tcase_add_loop_test(tc, test_kernel_manifest, 0, nelems(BACKENDS));
+  tcase_add_loop_test(tc, test_kernel_options, 0, nelems(BACKENDS));
+  tcase_add_loop_test(tc, test_kernel_local_barrier, 0, nelems(BACKENDS));
+  tcase_add_loop_test(tc, test_buffer_extcopy_cache, 0, nelems(BACKENDS));
+  tcase_add_loop_test(tc, test_buffer_extcopy_offsets, 0, nelems(BACKENDS));
+  tcase_add_loop_test(tc, test_buffer_extcopy_shapes, 0, nelems(BACKENDS));
   suite_add_tcase(s, tc);
   return s;
 }